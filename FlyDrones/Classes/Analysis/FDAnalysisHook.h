@@ -0,0 +1,78 @@
+//
+//  FDAnalysisHook.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+@protocol FDFrameAnalyzer <NSObject>
+
+// Called on the hook's serial analysis queue, one frame at a time. The frame is
+// only valid during the call; take an av_frame_ref to keep it.
+- (void)analyzeFrame:(const AVFrame *)frame;
+
+@end
+
+
+@interface FDAnalysisStatistics : NSObject
+
+@property (nonatomic, assign, readonly) unsigned long long submittedFrames;
+@property (nonatomic, assign, readonly) unsigned long long sampledFrames;
+@property (nonatomic, assign, readonly) unsigned long long analyzedFrames;
+// Sampled frames pushed out of a full queue before the analyzer got to them.
+@property (nonatomic, assign, readonly) unsigned long long droppedFrames;
+@property (nonatomic, assign, readonly) NSUInteger queuedFrames;
+@property (nonatomic, assign, readonly) NSTimeInterval averageAnalysisTime;
+// Submission to the end of the analysis, over the analyzed frames.
+@property (nonatomic, assign, readonly) NSTimeInterval averageLag;
+@property (nonatomic, assign, readonly) NSTimeInterval maximumLag;
+// Longest time a submitFrame: call took, to check decode is never held up.
+@property (nonatomic, assign, readonly) NSTimeInterval maximumSubmitTime;
+
+@end
+
+
+// Feeds a sample of the live frames to a pluggable analyzer, such as a CPU object
+// detector, without slowing the video. Sampled frames are referenced, not copied,
+// into a bounded queue drained on a serial background queue; when the analyzer
+// falls behind the oldest queued frames are dropped, so the analyzer always sees
+// the most recent video and submission never waits for it.
+@interface FDAnalysisHook : NSObject
+
+@property (nonatomic, strong, readonly) id<FDFrameAnalyzer> analyzer;
+@property (nonatomic, assign, readonly) NSUInteger queueCapacity;
+// Frames per second handed to the analyzer, 0 samples every frame. 5 by default.
+@property (nonatomic, assign) double sampleRate;
+
+- (instancetype)initWithAnalyzer:(id<FDFrameAnalyzer>)analyzer queueCapacity:(NSUInteger)queueCapacity;
+
+// Thread safe, returns YES when the frame was sampled and queued.
+- (BOOL)submitFrame:(const AVFrame *)frame;
+// Drops the queued frames, e.g. when the stream restarts.
+- (void)flush;
+
+- (FDAnalysisStatistics *)statistics;
+
+// Submits synthetic frames at frameRate to a dummy analyzer of the given cost and
+// logs the lag, drops and the longest submission.
++ (void)runBenchmarkWithWidth:(int)width
+                       height:(int)height
+                    frameRate:(double)frameRate
+                     duration:(NSTimeInterval)duration
+                 analysisCost:(NSTimeInterval)analysisCost;
+
+@end
+
+
+// Stands in for a detector in benchmarks: reads luma until cost has elapsed.
+@interface FDDummyFrameAnalyzer : NSObject <FDFrameAnalyzer>
+
+@property (nonatomic, assign) NSTimeInterval cost;
+@property (nonatomic, assign, readonly) uint64_t checksum;
+
+- (instancetype)initWithCost:(NSTimeInterval)cost;
+
+@end
@@ -0,0 +1,360 @@
+//
+//  FDAnalysisHook.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDAnalysisHook.h"
+#include <pthread.h>
+
+
+static double const FDAnalysisHookDefaultSampleRate = 5.0;
+// Rows the dummy analyzer reads between two looks at the clock.
+static int const FDDummyFrameAnalyzerRowBatch = 16;
+
+
+#pragma mark - FDAnalysisStatistics
+
+@interface FDAnalysisStatistics ()
+
+@property (nonatomic, assign, readwrite) unsigned long long submittedFrames;
+@property (nonatomic, assign, readwrite) unsigned long long sampledFrames;
+@property (nonatomic, assign, readwrite) unsigned long long analyzedFrames;
+@property (nonatomic, assign, readwrite) unsigned long long droppedFrames;
+@property (nonatomic, assign, readwrite) NSUInteger queuedFrames;
+@property (nonatomic, assign, readwrite) NSTimeInterval averageAnalysisTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval averageLag;
+@property (nonatomic, assign, readwrite) NSTimeInterval maximumLag;
+@property (nonatomic, assign, readwrite) NSTimeInterval maximumSubmitTime;
+
+@end
+
+@implementation FDAnalysisStatistics
+
+@end
+
+
+#pragma mark - Private interface methods
+
+@interface FDAnalysisHook ()
+{
+    dispatch_queue_t _analysisQueue;
+    pthread_mutex_t _lock;
+
+    // Guarded by _lock, a ring of queued frame references.
+    AVFrame **_frames;
+    CFTimeInterval *_submitTimes;
+    NSUInteger _head;
+    NSUInteger _count;
+    BOOL _drainScheduled;
+    CFTimeInterval _nextSampleTime;
+
+    unsigned long long _submittedFrames;
+    unsigned long long _sampledFrames;
+    unsigned long long _analyzedFrames;
+    unsigned long long _droppedFrames;
+    CFTimeInterval _totalAnalysisTime;
+    CFTimeInterval _totalLag;
+    CFTimeInterval _maximumLag;
+    CFTimeInterval _maximumSubmitTime;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, strong, readwrite) id<FDFrameAnalyzer> analyzer;
+@property (nonatomic, assign, readwrite) NSUInteger queueCapacity;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDAnalysisHook
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithAnalyzer:(id<FDFrameAnalyzer>)analyzer queueCapacity:(NSUInteger)queueCapacity
+{
+    self = [super init];
+    if (self)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        _analysisQueue = dispatch_queue_create("com.flydrones.analysis", DISPATCH_QUEUE_SERIAL);
+        // Analysis is best effort, decode and display keep the higher priorities.
+        dispatch_set_target_queue(_analysisQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0));
+        _analyzer = analyzer;
+        _queueCapacity = MAX(queueCapacity, (NSUInteger)1);
+        _sampleRate = FDAnalysisHookDefaultSampleRate;
+        _frames = calloc(_queueCapacity, sizeof(AVFrame *));
+        _submitTimes = calloc(_queueCapacity, sizeof(CFTimeInterval));
+        if (analyzer == nil || _frames == NULL || _submitTimes == NULL)
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // Every pending drain holds a reference to us, so nothing runs on the queue any more.
+    for (NSUInteger i = 0; i < _count; i++)
+    {
+        av_frame_free(&_frames[(_head + i) % _queueCapacity]);
+    }
+    free(_frames);
+    free(_submitTimes);
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Properties
+
+- (void)setSampleRate:(double)sampleRate
+{
+    pthread_mutex_lock(&_lock);
+    _sampleRate = MAX(sampleRate, 0.0);
+    _nextSampleTime = 0;
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark - Instance methods
+
+- (BOOL)submitFrame:(const AVFrame *)frame
+{
+    CFTimeInterval start = CACurrentMediaTime();
+    pthread_mutex_lock(&_lock);
+    _submittedFrames++;
+    BOOL sampled = _sampleRate <= 0 || start >= _nextSampleTime;
+    if (sampled && _sampleRate > 0)
+    {
+        // Keeps the cadence of the sample clock, unless submissions stalled for longer than a period.
+        CFTimeInterval interval = 1.0 / _sampleRate;
+        _nextSampleTime = start - _nextSampleTime > interval ? start + interval : _nextSampleTime + interval;
+    }
+    pthread_mutex_unlock(&_lock);
+    if (!sampled)
+    {
+        return NO;
+    }
+
+    // A new reference to the decoder's buffers, no pixels are copied.
+    AVFrame *reference = av_frame_clone(frame);
+    if (reference == NULL)
+    {
+        return NO;
+    }
+
+    AVFrame *evicted = NULL;
+    pthread_mutex_lock(&_lock);
+    if (_count == _queueCapacity)
+    {
+        // The analyzer fell behind: the oldest frame is the least useful one.
+        evicted = _frames[_head];
+        _frames[_head] = NULL;
+        _head = (_head + 1) % _queueCapacity;
+        _count--;
+        _droppedFrames++;
+    }
+    NSUInteger slot = (_head + _count) % _queueCapacity;
+    _frames[slot] = reference;
+    _submitTimes[slot] = start;
+    _count++;
+    _sampledFrames++;
+    BOOL wake = !_drainScheduled;
+    _drainScheduled = YES;
+    pthread_mutex_unlock(&_lock);
+
+    if (wake)
+    {
+        dispatch_async(_analysisQueue, ^{
+            [self drain];
+        });
+    }
+    av_frame_free(&evicted);
+
+    CFTimeInterval submitTime = CACurrentMediaTime() - start;
+    pthread_mutex_lock(&_lock);
+    _maximumSubmitTime = MAX(_maximumSubmitTime, submitTime);
+    pthread_mutex_unlock(&_lock);
+    return YES;
+}
+
+- (void)flush
+{
+    pthread_mutex_lock(&_lock);
+    for (NSUInteger i = 0; i < _count; i++)
+    {
+        av_frame_free(&_frames[(_head + i) % _queueCapacity]);
+    }
+    _droppedFrames += _count;
+    _head = 0;
+    _count = 0;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (FDAnalysisStatistics *)statistics
+{
+    FDAnalysisStatistics *statistics = [[FDAnalysisStatistics alloc] init];
+    pthread_mutex_lock(&_lock);
+    statistics.submittedFrames = _submittedFrames;
+    statistics.sampledFrames = _sampledFrames;
+    statistics.analyzedFrames = _analyzedFrames;
+    statistics.droppedFrames = _droppedFrames;
+    statistics.queuedFrames = _count;
+    statistics.averageAnalysisTime = _analyzedFrames > 0 ? _totalAnalysisTime / _analyzedFrames : 0.0;
+    statistics.averageLag = _analyzedFrames > 0 ? _totalLag / _analyzedFrames : 0.0;
+    statistics.maximumLag = _maximumLag;
+    statistics.maximumSubmitTime = _maximumSubmitTime;
+    pthread_mutex_unlock(&_lock);
+    return statistics;
+}
+
+#pragma mark - Private methods
+
+// Runs on _analysisQueue until the ring is empty.
+- (void)drain
+{
+    while (YES)
+    {
+        pthread_mutex_lock(&_lock);
+        if (_count == 0)
+        {
+            _drainScheduled = NO;
+            pthread_mutex_unlock(&_lock);
+            return;
+        }
+        AVFrame *frame = _frames[_head];
+        CFTimeInterval submitTime = _submitTimes[_head];
+        _frames[_head] = NULL;
+        _head = (_head + 1) % _queueCapacity;
+        _count--;
+        pthread_mutex_unlock(&_lock);
+
+        CFTimeInterval start = CACurrentMediaTime();
+        @autoreleasepool
+        {
+            [self.analyzer analyzeFrame:frame];
+        }
+        CFTimeInterval end = CACurrentMediaTime();
+        av_frame_free(&frame);
+
+        pthread_mutex_lock(&_lock);
+        _analyzedFrames++;
+        _totalAnalysisTime += end - start;
+        _totalLag += end - submitTime;
+        _maximumLag = MAX(_maximumLag, end - submitTime);
+        pthread_mutex_unlock(&_lock);
+    }
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithWidth:(int)width
+                       height:(int)height
+                    frameRate:(double)frameRate
+                     duration:(NSTimeInterval)duration
+                 analysisCost:(NSTimeInterval)analysisCost
+{
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL)
+    {
+        return;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        av_frame_free(&frame);
+        return;
+    }
+    for (int y = 0; y < height; y++)
+    {
+        memset(frame->data[0] + (size_t)y * frame->linesize[0], y & 0xFF, width);
+    }
+
+    FDDummyFrameAnalyzer *analyzer = [[FDDummyFrameAnalyzer alloc] initWithCost:analysisCost];
+    FDAnalysisHook *hook = [[FDAnalysisHook alloc] initWithAnalyzer:analyzer queueCapacity:2];
+    if (hook == nil)
+    {
+        av_frame_free(&frame);
+        return;
+    }
+    // Every frame is offered, so a slow analyzer shows up as drops rather than being hidden by sampling.
+    hook.sampleRate = 0;
+
+    // Paced like a decoder delivering frames; the submissions must not drift when the analyzer is slow.
+    NSUInteger frameCount = (NSUInteger)(MAX(frameRate, 1.0) * duration);
+    CFTimeInterval start = CACurrentMediaTime();
+    for (NSUInteger i = 0; i < frameCount; i++)
+    {
+        CFTimeInterval due = start + i / MAX(frameRate, 1.0);
+        CFTimeInterval now = CACurrentMediaTime();
+        if (due > now)
+        {
+            usleep((useconds_t)((due - now) * 1e6));
+        }
+        frame->pts = (int64_t)i;
+        [hook submitFrame:frame];
+    }
+    CFTimeInterval submitDuration = CACurrentMediaTime() - start;
+    // The drain in flight, if any, is ahead of this block and empties the ring before returning.
+    dispatch_sync(hook->_analysisQueue, ^{});
+
+    FDAnalysisStatistics *statistics = [hook statistics];
+    NSLog(@"Analysis hook at %dx%d, %.0f fps for %.1f s (took %.1f s), %.1f ms analyzer: %llu of %llu analyzed, %llu dropped, "
+          @"lag avg %.1f ms max %.1f ms, submit max %.3f ms",
+          width, height, frameRate, duration, submitDuration, statistics.averageAnalysisTime * 1000.0,
+          statistics.analyzedFrames, statistics.sampledFrames, statistics.droppedFrames,
+          statistics.averageLag * 1000.0, statistics.maximumLag * 1000.0, statistics.maximumSubmitTime * 1000.0);
+    av_frame_free(&frame);
+}
+
+#pragma mark -
+
+@end
+
+
+#pragma mark - FDDummyFrameAnalyzer
+
+@interface FDDummyFrameAnalyzer ()
+
+@property (nonatomic, assign, readwrite) uint64_t checksum;
+
+@end
+
+@implementation FDDummyFrameAnalyzer
+
+- (instancetype)initWithCost:(NSTimeInterval)cost
+{
+    self = [super init];
+    if (self)
+    {
+        _cost = cost;
+    }
+    return self;
+}
+
+- (void)analyzeFrame:(const AVFrame *)frame
+{
+    CFTimeInterval start = CACurrentMediaTime();
+    uint64_t checksum = self.checksum;
+    int y = 0;
+    do
+    {
+        // Real reads of the shared buffers, the way a detector would touch them.
+        for (int row = 0; row < FDDummyFrameAnalyzerRowBatch; row++, y = (y + 1) % MAX(frame->height, 1))
+        {
+            const uint8_t *pixels = frame->data[0] + (size_t)y * frame->linesize[0];
+            for (int x = 0; x < frame->width; x++)
+            {
+                checksum += pixels[x];
+            }
+        }
+    }
+    while (CACurrentMediaTime() - start < self.cost);
+    self.checksum = checksum;
+}
+
+@end
@@ -0,0 +1,61 @@
+//
+//  FDExposureMeter.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+#define FDExposureHistogramBins 256
+
+typedef NS_OPTIONS(NSUInteger, FDExposureWarning)
+{
+    FDExposureWarningNone = 0,
+    FDExposureWarningUnderexposed = 1 << 0,
+    FDExposureWarningOverexposed = 1 << 1
+};
+
+typedef struct FDExposureStatistics
+{
+    int64_t pts;
+    uint32_t histogram[FDExposureHistogramBins];
+    uint32_t sampleCount;
+    // Samples at or below the underexposure level and at or above the overexposure level.
+    uint32_t underexposedCount;
+    uint32_t overexposedCount;
+    double mean;
+    double variance;
+    FDExposureWarning warnings;
+} FDExposureStatistics;
+
+// Adds the 8-bit plane sampled every step pixels in both directions (1, 2 or 4) to histogram.
+void FDExposureAccumulateHistogram(const uint8_t *plane, int stride, int width, int height, int step, uint32_t *histogram);
+
+
+// Luma histogram and exposure statistics of decoded frames for the live histogram,
+// zebra and exposure warnings. The decoder thread measures, the UI reads the most
+// recent result at display rate through a lock-free triple buffer.
+@interface FDExposureMeter : NSObject
+
+// Sampling grid step, 1, 2 or 4. 2 by default, which reads a quarter of the luma.
+@property (nonatomic, assign) int subsampling;
+// 16 and 235 by default (video range); use 0 and 255 for full range sources.
+@property (nonatomic, assign) uint8_t underexposureLevel;
+@property (nonatomic, assign) uint8_t overexposureLevel;
+// Fraction of clipped samples that raises a warning, 0.02 by default.
+@property (nonatomic, assign) double warningFraction;
+@property (nonatomic, assign, readonly) NSTimeInterval averageMeasurementTime;
+
+// Measures the first plane of an 8-bit planar frame and publishes the result. statistics may be NULL.
+// One measuring thread at a time.
+- (void)measureFrame:(const AVFrame *)frame statistics:(FDExposureStatistics *)statistics;
+// Copies the most recently published statistics, NO if nothing was published yet.
+// Never blocks the measuring thread; one reading thread at a time (the main thread).
+- (BOOL)copyLatestStatistics:(FDExposureStatistics *)statistics;
+
+// Logs the measurement time per frame for each subsampling step.
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount;
+
+@end
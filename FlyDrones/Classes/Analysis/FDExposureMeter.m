@@ -0,0 +1,273 @@
+//
+//  FDExposureMeter.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDExposureMeter.h"
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static int const FDExposureDefaultSubsampling = 2;
+static uint8_t const FDExposureDefaultUnderexposureLevel = 16;
+static uint8_t const FDExposureDefaultOverexposureLevel = 235;
+static double const FDExposureDefaultWarningFraction = 0.02;
+// Set in the exchanged slot index when it holds statistics the reader has not taken yet.
+static int const FDExposureSlotFresh = 1 << 2;
+
+// Consecutive samples go to different copies so repeated values do not serialize on one counter.
+#define FDExposureSubHistograms 4
+
+
+#pragma mark - Private functions
+
+static inline int FDExposureExchange(volatile int *slot, int value)
+{
+    // Full barrier, the statistics written before are visible to whoever takes the slot.
+    int previous;
+    do
+    {
+        previous = *slot;
+    }
+    while (!__sync_bool_compare_and_swap(slot, previous, value));
+    return previous;
+}
+
+static inline void FDExposureCountSamples(const uint8_t *samples, int count, uint32_t (*histograms)[FDExposureHistogramBins])
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        histograms[0][samples[i]]++;
+        histograms[1][samples[i + 1]]++;
+        histograms[2][samples[i + 2]]++;
+        histograms[3][samples[i + 3]]++;
+    }
+    for (; i < count; i++)
+    {
+        histograms[0][samples[i]]++;
+    }
+}
+
+
+#pragma mark - Public functions
+
+void FDExposureAccumulateHistogram(const uint8_t *plane, int stride, int width, int height, int step, uint32_t *histogram)
+{
+    uint32_t histograms[FDExposureSubHistograms][FDExposureHistogramBins];
+    memset(histograms, 0, sizeof(histograms));
+    step = step >= 4 ? 4 : (step >= 2 ? 2 : 1);
+
+    for (int y = 0; y < height; y += step)
+    {
+        const uint8_t *row = plane + (size_t)y * stride;
+        int x = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+        // De-interleaving loads pick every step-th pixel of 16 * step bytes.
+        uint8_t samples[16];
+        for (; x + 16 * step <= width; x += 16 * step)
+        {
+            uint8x16_t values;
+            if (step == 1)
+            {
+                values = vld1q_u8(row + x);
+            }
+            else if (step == 2)
+            {
+                values = vld2q_u8(row + x).val[0];
+            }
+            else
+            {
+                values = vld4q_u8(row + x).val[0];
+            }
+            vst1q_u8(samples, values);
+            FDExposureCountSamples(samples, 16, histograms);
+        }
+#endif
+        if (step == 1)
+        {
+            FDExposureCountSamples(row + x, width - x, histograms);
+        }
+        else
+        {
+            for (; x < width; x += step)
+            {
+                histograms[0][row[x]]++;
+            }
+        }
+    }
+
+    int bin = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; bin < FDExposureHistogramBins; bin += 4)
+    {
+        uint32x4_t sum = vaddq_u32(vaddq_u32(vld1q_u32(histograms[0] + bin), vld1q_u32(histograms[1] + bin)),
+                                   vaddq_u32(vld1q_u32(histograms[2] + bin), vld1q_u32(histograms[3] + bin)));
+        vst1q_u32(histogram + bin, vaddq_u32(vld1q_u32(histogram + bin), sum));
+    }
+#endif
+    for (; bin < FDExposureHistogramBins; bin++)
+    {
+        histogram[bin] += histograms[0][bin] + histograms[1][bin] + histograms[2][bin] + histograms[3][bin];
+    }
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDExposureMeter ()
+{
+    // Triple buffer: the writer owns one slot, the reader another, the third is exchanged.
+    FDExposureStatistics _slots[3];
+    int _writeSlot;
+    int _readSlot;
+    volatile int _exchangeSlot;
+    BOOL _hasRead;
+    NSUInteger _measurementCount;
+    CFTimeInterval _totalMeasurementTime;
+}
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDExposureMeter
+
+#pragma mark - Lifecycle
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _subsampling = FDExposureDefaultSubsampling;
+        _underexposureLevel = FDExposureDefaultUnderexposureLevel;
+        _overexposureLevel = FDExposureDefaultOverexposureLevel;
+        _warningFraction = FDExposureDefaultWarningFraction;
+        _writeSlot = 0;
+        _exchangeSlot = 1;
+        _readSlot = 2;
+    }
+    return self;
+}
+
+#pragma mark - Properties
+
+- (NSTimeInterval)averageMeasurementTime
+{
+    return _measurementCount > 0 ? _totalMeasurementTime / _measurementCount : 0.0;
+}
+
+#pragma mark - Instance methods
+
+- (void)measureFrame:(const AVFrame *)frame statistics:(FDExposureStatistics *)statistics
+{
+    CFTimeInterval start = CACurrentMediaTime();
+    FDExposureStatistics *result = &_slots[_writeSlot];
+    memset(result, 0, sizeof(FDExposureStatistics));
+    result->pts = av_frame_get_best_effort_timestamp(frame);
+    FDExposureAccumulateHistogram(frame->data[0], frame->linesize[0], frame->width, frame->height, self.subsampling, result->histogram);
+
+    // Everything else follows from the 256 bins.
+    uint64_t sum = 0;
+    uint64_t squares = 0;
+    for (int bin = 0; bin < FDExposureHistogramBins; bin++)
+    {
+        uint32_t count = result->histogram[bin];
+        result->sampleCount += count;
+        sum += (uint64_t)bin * count;
+        squares += (uint64_t)bin * bin * count;
+        if (bin <= self.underexposureLevel)
+        {
+            result->underexposedCount += count;
+        }
+        if (bin >= self.overexposureLevel)
+        {
+            result->overexposedCount += count;
+        }
+    }
+    if (result->sampleCount > 0)
+    {
+        result->mean = (double)sum / result->sampleCount;
+        result->variance = (double)squares / result->sampleCount - result->mean * result->mean;
+        double limit = self.warningFraction * result->sampleCount;
+        result->warnings |= result->underexposedCount > limit ? FDExposureWarningUnderexposed : FDExposureWarningNone;
+        result->warnings |= result->overexposedCount > limit ? FDExposureWarningOverexposed : FDExposureWarningNone;
+    }
+    if (statistics != NULL)
+    {
+        memcpy(statistics, result, sizeof(FDExposureStatistics));
+    }
+
+    _writeSlot = FDExposureExchange(&_exchangeSlot, _writeSlot | FDExposureSlotFresh) & ~FDExposureSlotFresh;
+    _totalMeasurementTime += CACurrentMediaTime() - start;
+    _measurementCount++;
+}
+
+- (BOOL)copyLatestStatistics:(FDExposureStatistics *)statistics
+{
+    if ((_exchangeSlot & FDExposureSlotFresh) != 0)
+    {
+        _readSlot = FDExposureExchange(&_exchangeSlot, _readSlot) & ~FDExposureSlotFresh;
+        _hasRead = YES;
+    }
+    if (!_hasRead)
+    {
+        return NO;
+    }
+    memcpy(statistics, &_slots[_readSlot], sizeof(FDExposureStatistics));
+    return YES;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount
+{
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL)
+    {
+        return;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        av_frame_free(&frame);
+        return;
+    }
+    // Mostly flat sky with a bright band, the case that hurts a single histogram the most.
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            frame->data[0][(size_t)y * frame->linesize[0] + x] = y < height / 3 ? 250 : (uint8_t)(96 + ((x ^ y) & 15));
+        }
+    }
+
+    int steps[3] = {1, 2, 4};
+    for (int i = 0; i < 3; i++)
+    {
+        FDExposureMeter *meter = [[FDExposureMeter alloc] init];
+        meter.subsampling = steps[i];
+        FDExposureStatistics statistics;
+        for (NSUInteger j = 0; j < frameCount; j++)
+        {
+            [meter measureFrame:frame statistics:NULL];
+        }
+        [meter copyLatestStatistics:&statistics];
+        NSLog(@"Exposure at %dx%d step %d: %.3f ms/frame, mean %.1f, variance %.1f, %.1f%% overexposed",
+              width, height, steps[i], meter.averageMeasurementTime * 1000.0, statistics.mean, statistics.variance,
+              100.0 * statistics.overexposedCount / MAX(statistics.sampleCount, 1U));
+    }
+
+    av_frame_free(&frame);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,50 @@
+//
+//  FDFrameQualityAnalyzer.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+typedef struct FDFrameQuality
+{
+    int64_t pts;
+    // Variance of the Laplacian of the analysis luma, higher is sharper.
+    double sharpness;
+    // Mean absolute difference per pixel against the previous frame, 8x8 block SAD.
+    double meanAbsoluteDifference;
+    // 0...1, the change of the difference relative to the previous frame, like the select filter's scene score.
+    double sceneScore;
+    BOOL blurred;
+    BOOL sceneCut;
+} FDFrameQuality;
+
+typedef void (^FDFrameQualityHandler)(const FDFrameQuality *quality);
+
+
+// Cheap per-frame metrics for picking highlight stills and hinting scene cuts to
+// the encoder. Luma is box-downscaled to analysisWidth first, so the cost barely
+// depends on the source resolution.
+@interface FDFrameQualityAnalyzer : NSObject
+
+// Rounded to a multiple of 8, 480 by default. Changing it resets the analyzer.
+@property (nonatomic, assign) int analysisWidth;
+// Frames with a sharpness below this are blurred, 100 by default.
+@property (nonatomic, assign) double blurThreshold;
+// Frames with a scene score above this are cuts, 0.4 by default.
+@property (nonatomic, assign) double sceneThreshold;
+// Called on the caller's thread after every analyzed frame.
+@property (nonatomic, copy) FDFrameQualityHandler handler;
+@property (nonatomic, assign, readonly) NSTimeInterval averageAnalysisTime;
+
+// Any planar 8-bit format, only the first plane is used. Not thread safe.
+- (void)analyzeFrame:(const AVFrame *)frame quality:(FDFrameQuality *)quality;
+// Forgets the previous frame, e.g. after a seek.
+- (void)reset;
+
+// Logs the analysis rate on synthetic frames of the given size.
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount;
+
+@end
@@ -0,0 +1,277 @@
+//
+//  FDFrameQualityAnalyzer.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFrameQualityAnalyzer.h"
+#import "FDBoxFilter.h"
+#include "libavutil/pixelutils.h"
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static int const FDFrameQualityDefaultAnalysisWidth = 480;
+static double const FDFrameQualityDefaultBlurThreshold = 100.0;
+static double const FDFrameQualityDefaultSceneThreshold = 0.4;
+// SAD blocks are 1 << FDFrameQualityBlockBits pixels on each side.
+static int const FDFrameQualityBlockBits = 3;
+
+
+#pragma mark - Private functions
+
+// Variance of 4 * c - (left + right + up + down) over the interior pixels.
+static double FDFrameQualityLaplacianVariance(const uint8_t *plane, int stride, int width, int height)
+{
+    int64_t sum = 0;
+    int64_t squares = 0;
+    for (int y = 1; y < height - 1; y++)
+    {
+        const uint8_t *row = plane + (size_t)y * stride;
+        int x = 1;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+        int32x4_t rowSum = vdupq_n_s32(0);
+        int32x4_t rowSquares = vdupq_n_s32(0);
+        for (; x + 8 <= width - 1; x += 8)
+        {
+            uint8x8_t center = vld1_u8(row + x);
+            uint16x8_t neighbours = vaddq_u16(vaddl_u8(vld1_u8(row + x - 1), vld1_u8(row + x + 1)),
+                                              vaddl_u8(vld1_u8(row + x - stride), vld1_u8(row + x + stride)));
+            int16x8_t laplacian = vsubq_s16(vreinterpretq_s16_u16(vshll_n_u8(center, 2)), vreinterpretq_s16_u16(neighbours));
+            rowSum = vpadalq_s16(rowSum, laplacian);
+            rowSquares = vmlal_s16(rowSquares, vget_low_s16(laplacian), vget_low_s16(laplacian));
+            rowSquares = vmlal_s16(rowSquares, vget_high_s16(laplacian), vget_high_s16(laplacian));
+        }
+        // Each lane adds two squares of at most 1020^2 per 8 pixels, which stays below
+        // 2^31 for rows up to ~8000 pixels; the lanes are widened before they are added.
+        int32x2_t pairSum = vadd_s32(vget_low_s32(rowSum), vget_high_s32(rowSum));
+        int64x2_t pairSquares = vpaddlq_s32(rowSquares);
+        sum += vget_lane_s32(pairSum, 0) + vget_lane_s32(pairSum, 1);
+        squares += vgetq_lane_s64(pairSquares, 0) + vgetq_lane_s64(pairSquares, 1);
+#endif
+        for (; x < width - 1; x++)
+        {
+            int laplacian = 4 * row[x] - row[x - 1] - row[x + 1] - row[x - stride] - row[x + stride];
+            sum += laplacian;
+            squares += laplacian * laplacian;
+        }
+    }
+
+    int64_t count = (int64_t)(width - 2) * (height - 2);
+    if (count <= 0)
+    {
+        return 0.0;
+    }
+    double mean = (double)sum / count;
+    return (double)squares / count - mean * mean;
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDFrameQualityAnalyzer ()
+{
+    av_pixelutils_sad_fn _sad;
+    uint8_t *_planes[2];
+    int _current;
+    int _planeWidth;
+    int _planeHeight;
+    int _planeStride;
+    int _sourceWidth;
+    int _sourceHeight;
+    BOOL _hasPrevious;
+    double _previousDifference;
+    NSUInteger _analysisCount;
+    CFTimeInterval _totalAnalysisTime;
+}
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDFrameQualityAnalyzer
+
+#pragma mark - Lifecycle
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _analysisWidth = FDFrameQualityDefaultAnalysisWidth;
+        _blurThreshold = FDFrameQualityDefaultBlurThreshold;
+        _sceneThreshold = FDFrameQualityDefaultSceneThreshold;
+        // Planes are allocated with av_malloc and a stride multiple of the block size, both sources are aligned.
+        _sad = av_pixelutils_get_sad_fn(FDFrameQualityBlockBits, FDFrameQualityBlockBits, 2, NULL);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    av_freep(&_planes[0]);
+    av_freep(&_planes[1]);
+}
+
+#pragma mark - Properties
+
+- (void)setAnalysisWidth:(int)analysisWidth
+{
+    _analysisWidth = analysisWidth;
+    _sourceWidth = 0;
+    _sourceHeight = 0;
+    [self reset];
+}
+
+- (NSTimeInterval)averageAnalysisTime
+{
+    return _analysisCount > 0 ? _totalAnalysisTime / _analysisCount : 0.0;
+}
+
+#pragma mark - Instance methods
+
+- (void)analyzeFrame:(const AVFrame *)frame quality:(FDFrameQuality *)quality
+{
+    CFTimeInterval start = CACurrentMediaTime();
+    memset(quality, 0, sizeof(FDFrameQuality));
+    quality->pts = av_frame_get_best_effort_timestamp(frame);
+    if (![self preparePlanesForWidth:frame->width height:frame->height])
+    {
+        return;
+    }
+
+    uint8_t *plane = _planes[_current];
+    FDBoxFilterDownscalePlane(frame->data[0], frame->linesize[0], frame->width, frame->height,
+                              plane, _planeStride, _planeWidth, _planeHeight);
+    quality->sharpness = FDFrameQualityLaplacianVariance(plane, _planeStride, _planeWidth, _planeHeight);
+    quality->blurred = quality->sharpness < self.blurThreshold;
+
+    if (_hasPrevious && _sad != NULL)
+    {
+        const uint8_t *previous = _planes[_current ^ 1];
+        int blockSize = 1 << FDFrameQualityBlockBits;
+        int64_t total = 0;
+        for (int y = 0; y < _planeHeight; y += blockSize)
+        {
+            size_t offset = (size_t)y * _planeStride;
+            for (int x = 0; x < _planeWidth; x += blockSize)
+            {
+                total += _sad(plane + offset + x, _planeStride, previous + offset + x, _planeStride);
+            }
+        }
+        double difference = (double)total / ((int64_t)_planeWidth * _planeHeight);
+        // Same definition as the select filter: a cut is a large difference that is also a jump from the last one.
+        quality->meanAbsoluteDifference = difference;
+        quality->sceneScore = MIN(MAX(MIN(difference, fabs(difference - _previousDifference)) / 100.0, 0.0), 1.0);
+        quality->sceneCut = quality->sceneScore > self.sceneThreshold;
+        _previousDifference = difference;
+    }
+    _hasPrevious = YES;
+    _current ^= 1;
+
+    _totalAnalysisTime += CACurrentMediaTime() - start;
+    _analysisCount++;
+    if (self.handler != nil)
+    {
+        self.handler(quality);
+    }
+}
+
+- (void)reset
+{
+    _hasPrevious = NO;
+    _previousDifference = 0.0;
+}
+
+#pragma mark - Private methods
+
+- (BOOL)preparePlanesForWidth:(int)width height:(int)height
+{
+    if (width == _sourceWidth && height == _sourceHeight)
+    {
+        return _planes[0] != NULL;
+    }
+
+    int blockSize = 1 << FDFrameQualityBlockBits;
+    int planeWidth = MIN(self.analysisWidth, width) & ~(blockSize - 1);
+    int planeHeight = (int)((int64_t)planeWidth * height / MAX(width, 1)) & ~(blockSize - 1);
+    av_freep(&_planes[0]);
+    av_freep(&_planes[1]);
+    _sourceWidth = width;
+    _sourceHeight = height;
+    [self reset];
+    if (planeWidth < blockSize || planeHeight < blockSize)
+    {
+        return NO;
+    }
+
+    _planeWidth = planeWidth;
+    _planeHeight = planeHeight;
+    _planeStride = FFALIGN(planeWidth, 16);
+    _planes[0] = av_malloc((size_t)_planeStride * planeHeight);
+    _planes[1] = av_malloc((size_t)_planeStride * planeHeight);
+    if (_planes[0] == NULL || _planes[1] == NULL)
+    {
+        av_freep(&_planes[0]);
+        av_freep(&_planes[1]);
+        return NO;
+    }
+    return YES;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount
+{
+    AVFrame *frames[2] = {av_frame_alloc(), av_frame_alloc()};
+    for (int i = 0; i < 2; i++)
+    {
+        if (frames[i] == NULL)
+        {
+            av_frame_free(&frames[0]);
+            av_frame_free(&frames[1]);
+            return;
+        }
+        frames[i]->format = AV_PIX_FMT_YUV420P;
+        frames[i]->width = width;
+        frames[i]->height = height;
+        if (av_frame_get_buffer(frames[i], 32) < 0)
+        {
+            av_frame_free(&frames[0]);
+            av_frame_free(&frames[1]);
+            return;
+        }
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                frames[i]->data[0][(size_t)y * frames[i]->linesize[0] + x] = (uint8_t)((x + 3 * i) * (y + 5 * i) >> 4);
+            }
+        }
+    }
+
+    FDFrameQualityAnalyzer *analyzer = [[FDFrameQualityAnalyzer alloc] init];
+    __block NSUInteger cuts = 0;
+    analyzer.handler = ^(const FDFrameQuality *quality) {
+        cuts += quality->sceneCut ? 1 : 0;
+    };
+    FDFrameQuality quality;
+    CFTimeInterval start = CACurrentMediaTime();
+    for (NSUInteger i = 0; i < frameCount; i++)
+    {
+        [analyzer analyzeFrame:frames[i & 1] quality:&quality];
+    }
+    CFTimeInterval elapsed = CACurrentMediaTime() - start;
+    NSLog(@"Frame quality at %dx%d: %.0f fps (%.3f ms/frame), sharpness %.1f, %lu scene cuts",
+          width, height, frameCount / MAX(elapsed, 1e-9), analyzer.averageAnalysisTime * 1000.0, quality.sharpness, (unsigned long)cuts);
+
+    av_frame_free(&frames[0]);
+    av_frame_free(&frames[1]);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,51 @@
+//
+//  FDMotionDetector.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+// Bounding box in source frame pixels; area counts foreground pixels of the analysis plane.
+typedef struct FDMotionRegion
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    uint32_t area;
+} FDMotionRegion;
+
+typedef void (^FDMotionDetectionHandler)(int64_t pts, const FDMotionRegion *regions, NSUInteger count);
+
+
+// Moving object detection for hover mode, when the camera itself is static. Luma is
+// downscaled, compared with a running-average background, thresholded into a
+// packed bitmap and grouped into regions by run-based connected-component
+// labeling (8-connectivity) with union-find.
+@interface FDMotionDetector : NSObject
+
+// Rounded down to a multiple of 16, 320 by default. Changing it resets the background.
+@property (nonatomic, assign) int analysisWidth;
+// Absolute luma difference from the background that counts as motion, 25 by default.
+@property (nonatomic, assign) uint8_t threshold;
+// The background moves 1 / 2^learningShift of the way to each frame, 5 by default (1...8).
+@property (nonatomic, assign) int learningShift;
+// Regions with fewer foreground analysis pixels are noise, 12 by default.
+@property (nonatomic, assign) NSUInteger minimumArea;
+// Called on the caller's thread after every frame with regions, largest first.
+@property (nonatomic, copy) FDMotionDetectionHandler handler;
+@property (nonatomic, assign, readonly) NSTimeInterval averageDetectionTime;
+
+// Writes up to maximumCount regions, largest first, and returns how many. The first
+// frame after a reset only initializes the background. Not thread safe.
+- (NSUInteger)detectMotionInFrame:(const AVFrame *)frame regions:(FDMotionRegion *)regions maximumCount:(NSUInteger)maximumCount;
+// Forgets the background, e.g. after the drone moved.
+- (void)reset;
+
+// Logs the detection time on synthetic frames with a few moving blocks.
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount;
+
+@end
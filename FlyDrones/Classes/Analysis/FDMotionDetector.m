@@ -0,0 +1,485 @@
+//
+//  FDMotionDetector.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDMotionDetector.h"
+#import "FDBoxFilter.h"
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static int const FDMotionDetectorDefaultAnalysisWidth = 320;
+static uint8_t const FDMotionDetectorDefaultThreshold = 25;
+static int const FDMotionDetectorDefaultLearningShift = 5;
+static NSUInteger const FDMotionDetectorDefaultMinimumArea = 12;
+
+// Largest regions kept per frame before sorting, smaller ones are dropped.
+#define FDMotionDetectorMaximumRegions 256
+
+// Horizontal run of foreground pixels, end is exclusive.
+typedef struct FDMotionRun
+{
+    uint16_t start;
+    uint16_t end;
+    uint16_t row;
+} FDMotionRun;
+
+typedef struct FDMotionBox
+{
+    int minimumX;
+    int minimumY;
+    int maximumX;
+    int maximumY;
+    uint32_t area;
+} FDMotionBox;
+
+
+#pragma mark - Private functions
+
+// Marks the pixels differing from the background by more than threshold in a packed
+// row bitmap (bit x of word x / 64), then moves the background towards the frame.
+// The background is 8.8 fixed point.
+static void FDMotionDetectorProcessRow(const uint8_t *row, uint16_t *background, uint64_t *bits, int width, uint8_t threshold, int shift)
+{
+    int x = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    static const uint8_t bitWeights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t weights = vld1q_u8(bitWeights);
+    uint8x16_t limit = vdupq_n_u8(threshold);
+    int16x8_t rightShift = vdupq_n_s16((int16_t)-shift);
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t pixels = vld1q_u8(row + x);
+        uint16x8_t low = vld1q_u16(background + x);
+        uint16x8_t high = vld1q_u16(background + x + 8);
+        uint8x16_t model = vcombine_u8(vshrn_n_u16(low, 8), vshrn_n_u16(high, 8));
+        uint8x16_t foreground = vcgtq_u8(vabdq_u8(pixels, model), limit);
+
+        // Movemask: weight each lane by its bit and add pairwise down to two bytes.
+        uint8x16_t masked = vandq_u8(foreground, weights);
+        uint8x8_t packed = vpadd_u8(vget_low_u8(masked), vget_high_u8(masked));
+        packed = vpadd_u8(packed, packed);
+        packed = vpadd_u8(packed, packed);
+        uint64_t mask = vget_lane_u8(packed, 0) | ((uint64_t)vget_lane_u8(packed, 1) << 8);
+        bits[x >> 6] |= mask << (x & 63);
+
+        low = vaddq_u16(vsubq_u16(low, vshlq_u16(low, rightShift)), vshlq_u16(vshll_n_u8(vget_low_u8(pixels), 8), rightShift));
+        high = vaddq_u16(vsubq_u16(high, vshlq_u16(high, rightShift)), vshlq_u16(vshll_n_u8(vget_high_u8(pixels), 8), rightShift));
+        vst1q_u16(background + x, low);
+        vst1q_u16(background + x + 8, high);
+    }
+#endif
+    for (; x < width; x++)
+    {
+        int model = background[x] >> 8;
+        int difference = row[x] > model ? row[x] - model : model - row[x];
+        if (difference > threshold)
+        {
+            bits[x >> 6] |= 1ULL << (x & 63);
+        }
+        background[x] = (uint16_t)(background[x] - (background[x] >> shift) + (((uint32_t)row[x] << 8) >> shift));
+    }
+}
+
+// Position of the first bit equal to value at or after from, words * 64 when there is none.
+static inline int FDMotionDetectorNextBit(const uint64_t *bits, int words, int from, BOOL value)
+{
+    int index = from >> 6;
+    if (index >= words)
+    {
+        return words * 64;
+    }
+    uint64_t word = (value ? bits[index] : ~bits[index]) & (~0ULL << (from & 63));
+    while (word == 0)
+    {
+        if (++index >= words)
+        {
+            return words * 64;
+        }
+        word = value ? bits[index] : ~bits[index];
+    }
+    return index * 64 + __builtin_ctzll(word);
+}
+
+static inline uint32_t FDMotionDetectorFind(uint32_t *parents, uint32_t index)
+{
+    while (parents[index] != index)
+    {
+        // Path halving.
+        parents[index] = parents[parents[index]];
+        index = parents[index];
+    }
+    return index;
+}
+
+static inline void FDMotionDetectorUnion(uint32_t *parents, uint32_t first, uint32_t second)
+{
+    first = FDMotionDetectorFind(parents, first);
+    second = FDMotionDetectorFind(parents, second);
+    if (first < second)
+    {
+        parents[second] = first;
+    }
+    else if (second < first)
+    {
+        parents[first] = second;
+    }
+}
+
+// Min-heap on area over the regions kept so far; the root is the first to go.
+static void FDMotionDetectorKeepRegion(FDMotionRegion *heap, NSUInteger *count, NSUInteger capacity, const FDMotionRegion *region)
+{
+    NSUInteger index;
+    if (*count < capacity)
+    {
+        index = (*count)++;
+        while (index > 0 && heap[(index - 1) / 2].area > region->area)
+        {
+            heap[index] = heap[(index - 1) / 2];
+            index = (index - 1) / 2;
+        }
+        heap[index] = *region;
+        return;
+    }
+    if (region->area <= heap[0].area)
+    {
+        return;
+    }
+
+    index = 0;
+    for (;;)
+    {
+        NSUInteger smallest = 2 * index + 1;
+        if (smallest >= *count)
+        {
+            break;
+        }
+        if (smallest + 1 < *count && heap[smallest + 1].area < heap[smallest].area)
+        {
+            smallest++;
+        }
+        if (heap[smallest].area >= region->area)
+        {
+            break;
+        }
+        heap[index] = heap[smallest];
+        index = smallest;
+    }
+    heap[index] = *region;
+}
+
+static int FDMotionDetectorCompareRegions(const void *first, const void *second)
+{
+    uint32_t firstArea = ((const FDMotionRegion *)first)->area;
+    uint32_t secondArea = ((const FDMotionRegion *)second)->area;
+    return firstArea > secondArea ? -1 : (firstArea < secondArea ? 1 : 0);
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDMotionDetector ()
+{
+    uint8_t *_plane;
+    uint16_t *_background;
+    uint64_t *_bits;
+    FDMotionRun *_runs;
+    uint32_t *_parents;
+    FDMotionBox *_boxes;
+    FDMotionRegion _found[FDMotionDetectorMaximumRegions];
+    int _planeWidth;
+    int _planeHeight;
+    int _words;
+    int _sourceWidth;
+    int _sourceHeight;
+    BOOL _hasBackground;
+    NSUInteger _detectionCount;
+    CFTimeInterval _totalDetectionTime;
+}
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDMotionDetector
+
+#pragma mark - Lifecycle
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _analysisWidth = FDMotionDetectorDefaultAnalysisWidth;
+        _threshold = FDMotionDetectorDefaultThreshold;
+        _learningShift = FDMotionDetectorDefaultLearningShift;
+        _minimumArea = FDMotionDetectorDefaultMinimumArea;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self freeBuffers];
+}
+
+#pragma mark - Properties
+
+- (void)setAnalysisWidth:(int)analysisWidth
+{
+    _analysisWidth = analysisWidth;
+    _sourceWidth = 0;
+    _sourceHeight = 0;
+    [self reset];
+}
+
+- (void)setLearningShift:(int)learningShift
+{
+    _learningShift = MIN(MAX(learningShift, 1), 8);
+}
+
+- (NSTimeInterval)averageDetectionTime
+{
+    return _detectionCount > 0 ? _totalDetectionTime / _detectionCount : 0.0;
+}
+
+#pragma mark - Instance methods
+
+- (NSUInteger)detectMotionInFrame:(const AVFrame *)frame regions:(FDMotionRegion *)regions maximumCount:(NSUInteger)maximumCount
+{
+    CFTimeInterval start = CACurrentMediaTime();
+    if (![self prepareBuffersForWidth:frame->width height:frame->height])
+    {
+        return 0;
+    }
+
+    FDBoxFilterDownscalePlane(frame->data[0], frame->linesize[0], frame->width, frame->height,
+                              _plane, _planeWidth, _planeWidth, _planeHeight);
+    if (!_hasBackground)
+    {
+        for (size_t i = 0; i < (size_t)_planeWidth * _planeHeight; i++)
+        {
+            _background[i] = (uint16_t)(_plane[i] << 8);
+        }
+        _hasBackground = YES;
+        _totalDetectionTime += CACurrentMediaTime() - start;
+        _detectionCount++;
+        return 0;
+    }
+
+    memset(_bits, 0, sizeof(uint64_t) * _words * _planeHeight);
+    for (int y = 0; y < _planeHeight; y++)
+    {
+        FDMotionDetectorProcessRow(_plane + (size_t)y * _planeWidth, _background + (size_t)y * _planeWidth,
+                                   _bits + (size_t)y * _words, _planeWidth, self.threshold, self.learningShift);
+    }
+
+    NSUInteger foundCount = [self labelRegionsWithScaleX:(double)frame->width / _planeWidth scaleY:(double)frame->height / _planeHeight];
+    qsort(_found, foundCount, sizeof(FDMotionRegion), FDMotionDetectorCompareRegions);
+    NSUInteger count = MIN(foundCount, maximumCount);
+    memcpy(regions, _found, count * sizeof(FDMotionRegion));
+
+    _totalDetectionTime += CACurrentMediaTime() - start;
+    _detectionCount++;
+    if (self.handler != nil)
+    {
+        self.handler(av_frame_get_best_effort_timestamp(frame), _found, foundCount);
+    }
+    return count;
+}
+
+- (void)reset
+{
+    _hasBackground = NO;
+}
+
+#pragma mark - Private methods
+
+- (NSUInteger)labelRegionsWithScaleX:(double)scaleX scaleY:(double)scaleY
+{
+    // Runs row by row; each run is joined with the runs of the previous row it touches, diagonals included.
+    uint32_t runCount = 0;
+    uint32_t previousStart = 0;
+    uint32_t previousEnd = 0;
+    for (int y = 0; y < _planeHeight; y++)
+    {
+        const uint64_t *bits = _bits + (size_t)y * _words;
+        uint32_t rowStart = runCount;
+        uint32_t candidate = previousStart;
+        int x = 0;
+        while (YES)
+        {
+            x = FDMotionDetectorNextBit(bits, _words, x, YES);
+            if (x >= _planeWidth)
+            {
+                break;
+            }
+            int end = MIN(FDMotionDetectorNextBit(bits, _words, x, NO), _planeWidth);
+            FDMotionRun run = {(uint16_t)x, (uint16_t)end, (uint16_t)y};
+            _runs[runCount] = run;
+            _parents[runCount] = runCount;
+
+            while (candidate < previousEnd && _runs[candidate].end < x)
+            {
+                candidate++;
+            }
+            for (uint32_t k = candidate; k < previousEnd && _runs[k].start <= end; k++)
+            {
+                FDMotionDetectorUnion(_parents, runCount, k);
+            }
+            runCount++;
+            x = end;
+        }
+        previousStart = rowStart;
+        previousEnd = runCount;
+    }
+
+    // Every root gets a box; runs are visited in order, so a root comes before its members are merged in.
+    for (uint32_t i = 0; i < runCount; i++)
+    {
+        uint32_t root = FDMotionDetectorFind(_parents, i);
+        const FDMotionRun *run = &_runs[i];
+        FDMotionBox *box = &_boxes[root];
+        if (root == i)
+        {
+            FDMotionBox initial = {run->start, run->row, run->end - 1, run->row, 0};
+            *box = initial;
+        }
+        box->minimumX = MIN(box->minimumX, run->start);
+        box->maximumX = MAX(box->maximumX, run->end - 1);
+        box->minimumY = MIN(box->minimumY, run->row);
+        box->maximumY = MAX(box->maximumY, run->row);
+        box->area += run->end - run->start;
+    }
+
+    NSUInteger foundCount = 0;
+    for (uint32_t i = 0; i < runCount; i++)
+    {
+        if (_parents[i] != i || _boxes[i].area < self.minimumArea)
+        {
+            continue;
+        }
+        const FDMotionBox *box = &_boxes[i];
+        FDMotionRegion region;
+        region.x = (int)floor(box->minimumX * scaleX);
+        region.y = (int)floor(box->minimumY * scaleY);
+        region.width = (int)ceil((box->maximumX + 1) * scaleX) - region.x;
+        region.height = (int)ceil((box->maximumY + 1) * scaleY) - region.y;
+        region.area = box->area;
+        FDMotionDetectorKeepRegion(_found, &foundCount, FDMotionDetectorMaximumRegions, &region);
+    }
+    return foundCount;
+}
+
+- (BOOL)prepareBuffersForWidth:(int)width height:(int)height
+{
+    if (width == _sourceWidth && height == _sourceHeight)
+    {
+        return _plane != NULL;
+    }
+
+    [self freeBuffers];
+    _sourceWidth = width;
+    _sourceHeight = height;
+    _hasBackground = NO;
+    int planeWidth = MIN(self.analysisWidth, width) & ~15;
+    int planeHeight = (int)((int64_t)planeWidth * height / MAX(width, 1));
+    if (planeWidth < 16 || planeHeight < 2 || planeWidth > UINT16_MAX || planeHeight > UINT16_MAX)
+    {
+        return NO;
+    }
+
+    _planeWidth = planeWidth;
+    _planeHeight = planeHeight;
+    _words = (planeWidth + 63) / 64;
+    size_t pixels = (size_t)planeWidth * planeHeight;
+    // At most one run per two pixels of a row, plus one for odd widths.
+    size_t maximumRuns = (size_t)(planeWidth / 2 + 1) * planeHeight;
+    _plane = malloc(pixels);
+    _background = malloc(pixels * sizeof(uint16_t));
+    _bits = malloc((size_t)_words * planeHeight * sizeof(uint64_t));
+    _runs = malloc(maximumRuns * sizeof(FDMotionRun));
+    _parents = malloc(maximumRuns * sizeof(uint32_t));
+    _boxes = malloc(maximumRuns * sizeof(FDMotionBox));
+    if (_plane == NULL || _background == NULL || _bits == NULL || _runs == NULL || _parents == NULL || _boxes == NULL)
+    {
+        [self freeBuffers];
+        return NO;
+    }
+    return YES;
+}
+
+- (void)freeBuffers
+{
+    free(_plane);
+    free(_background);
+    free(_bits);
+    free(_runs);
+    free(_parents);
+    free(_boxes);
+    _plane = NULL;
+    _background = NULL;
+    _bits = NULL;
+    _runs = NULL;
+    _parents = NULL;
+    _boxes = NULL;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount
+{
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL)
+    {
+        return;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        av_frame_free(&frame);
+        return;
+    }
+
+    FDMotionDetector *detector = [[FDMotionDetector alloc] init];
+    FDMotionRegion regions[16];
+    NSUInteger regionTotal = 0;
+    int blockSize = MAX(height / 12, 8);
+    for (NSUInteger i = 0; i < frameCount; i++)
+    {
+        // Textured static ground with three bright blocks crossing it at different speeds.
+        for (int y = 0; y < height; y++)
+        {
+            uint8_t *row = frame->data[0] + (size_t)y * frame->linesize[0];
+            for (int x = 0; x < width; x++)
+            {
+                row[x] = (uint8_t)(60 + ((x * 3 + y * 5) & 31));
+            }
+        }
+        for (int block = 0; block < 3; block++)
+        {
+            int left = (int)((i * (block + 2) * 4 + block * width / 3) % MAX(width - blockSize, 1));
+            int top = (block + 1) * height / 4 - blockSize / 2;
+            for (int y = top; y < top + blockSize; y++)
+            {
+                memset(frame->data[0] + (size_t)y * frame->linesize[0] + left, 220, blockSize);
+            }
+        }
+        regionTotal += [detector detectMotionInFrame:frame regions:regions maximumCount:16];
+    }
+
+    NSLog(@"Motion detection at %dx%d: %.3f ms/frame, %.1f regions/frame",
+          width, height, detector.averageDetectionTime * 1000.0, (double)regionTotal / MAX(frameCount, (NSUInteger)1));
+    av_frame_free(&frame);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,61 @@
+//
+//  FDMotionEstimator.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+typedef NS_ENUM(NSUInteger, FDMotionModel)
+{
+    FDMotionModelAffine,
+    FDMotionModelHomography
+};
+
+// Global camera motion between a frame and its reference.
+typedef struct FDCameraMotion
+{
+    int64_t pts;
+    BOOL valid;
+    // Maps reference frame pixels to frame pixels, row-major, matrix[8] == 1.
+    double matrix[9];
+    // Derived from the matrix at the frame center: pixels, radians and a zoom factor.
+    double translationX;
+    double translationY;
+    double rotation;
+    double scale;
+    uint32_t vectorCount;
+    uint32_t inlierCount;
+} FDCameraMotion;
+
+typedef void (^FDCameraMotionHandler)(const FDCameraMotion *motion);
+
+
+// Global motion from the motion vectors the H.264 decoder already computed,
+// exported as AV_FRAME_DATA_MOTION_VECTORS side data. A RANSAC fit scores its
+// hypotheses four vectors at a time with NEON, then refines on the inliers.
+// Frames without vectors (intra frames) yield invalid motion. B-frame vectors
+// refer to their past reference, which is not always the previous frame.
+@interface FDMotionEstimator : NSObject
+
+@property (nonatomic, assign) FDMotionModel model;
+// Reprojection error in pixels below which a vector is an inlier, 1.5 by default.
+@property (nonatomic, assign) double inlierThreshold;
+// 256 by default; fewer are run once the inlier ratio is known.
+@property (nonatomic, assign) NSUInteger maximumIterations;
+// Called on the caller's thread after every estimate, including invalid ones.
+@property (nonatomic, copy) FDCameraMotionHandler handler;
+@property (nonatomic, assign, readonly) NSTimeInterval averageEstimationTime;
+
+// Adds "flags2=+export_mvs" for FDFFmpegOpenDecoderWithOptions.
++ (void)addDecoderOptions:(AVDictionary **)options;
+
+// Not thread safe, use one estimator per decoder.
+- (BOOL)estimateMotionForFrame:(const AVFrame *)frame motion:(FDCameraMotion *)motion;
+
+// Decodes the file with and without vector export and logs what export and estimation add per frame.
++ (void)logCostForFileAtPath:(NSString *)path;
+
+@end
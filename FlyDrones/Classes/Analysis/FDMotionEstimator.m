@@ -0,0 +1,571 @@
+//
+//  FDMotionEstimator.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDMotionEstimator.h"
+#include "libavutil/motion_vector.h"
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static double const FDMotionEstimatorDefaultInlierThreshold = 1.5;
+static NSUInteger const FDMotionEstimatorDefaultMaximumIterations = 256;
+static NSUInteger const FDMotionEstimatorMinimumIterations = 16;
+// Vectors beyond this are subsampled uniformly, scoring cost grows linearly with them.
+static size_t const FDMotionEstimatorMaximumVectors = 4096;
+static double const FDMotionEstimatorConfidence = 0.99;
+
+// Correspondences in normalized coordinates, centered on the frame and scaled by half its larger side.
+typedef struct FDMotionPoints
+{
+    float *sourceX;
+    float *sourceY;
+    float *destinationX;
+    float *destinationY;
+    uint32_t *indices;
+    size_t count;
+    size_t capacity;
+} FDMotionPoints;
+
+
+#pragma mark - Private functions
+
+static inline uint32_t FDMotionRandom(uint32_t *state)
+{
+    // xorshift32, deterministic per frame.
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Gaussian elimination with partial pivoting. matrix is size x size, the solution replaces vector.
+static BOOL FDMotionSolve(double *matrix, double *vector, int size)
+{
+    for (int column = 0; column < size; column++)
+    {
+        int pivot = column;
+        for (int row = column + 1; row < size; row++)
+        {
+            if (fabs(matrix[row * size + column]) > fabs(matrix[pivot * size + column]))
+            {
+                pivot = row;
+            }
+        }
+        if (fabs(matrix[pivot * size + column]) < 1e-12)
+        {
+            return NO;
+        }
+        if (pivot != column)
+        {
+            for (int i = 0; i < size; i++)
+            {
+                double swap = matrix[column * size + i];
+                matrix[column * size + i] = matrix[pivot * size + i];
+                matrix[pivot * size + i] = swap;
+            }
+            double swap = vector[column];
+            vector[column] = vector[pivot];
+            vector[pivot] = swap;
+        }
+        for (int row = column + 1; row < size; row++)
+        {
+            double factor = matrix[row * size + column] / matrix[column * size + column];
+            for (int i = column; i < size; i++)
+            {
+                matrix[row * size + i] -= factor * matrix[column * size + i];
+            }
+            vector[row] -= factor * vector[column];
+        }
+    }
+    for (int row = size - 1; row >= 0; row--)
+    {
+        double sum = vector[row];
+        for (int i = row + 1; i < size; i++)
+        {
+            sum -= matrix[row * size + i] * vector[i];
+        }
+        vector[row] = sum / matrix[row * size + row];
+    }
+    return YES;
+}
+
+// Least squares affine fit, exact for three points.
+static BOOL FDMotionFitAffine(const FDMotionPoints *points, const uint32_t *indices, size_t count, double *model)
+{
+    double normal[9] = {0};
+    double rightX[3] = {0};
+    double rightY[3] = {0};
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t index = indices[i];
+        double row[3] = {points->sourceX[index], points->sourceY[index], 1.0};
+        for (int j = 0; j < 3; j++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                normal[j * 3 + k] += row[j] * row[k];
+            }
+            rightX[j] += row[j] * points->destinationX[index];
+            rightY[j] += row[j] * points->destinationY[index];
+        }
+    }
+    double copy[9];
+    memcpy(copy, normal, sizeof(normal));
+    if (!FDMotionSolve(normal, rightX, 3) || !FDMotionSolve(copy, rightY, 3))
+    {
+        return NO;
+    }
+    double result[9] = {rightX[0], rightX[1], rightX[2], rightY[0], rightY[1], rightY[2], 0.0, 0.0, 1.0};
+    memcpy(model, result, sizeof(result));
+    return YES;
+}
+
+// Linearized DLT with h33 = 1 through the normal equations, exact for four points.
+static BOOL FDMotionFitHomography(const FDMotionPoints *points, const uint32_t *indices, size_t count, double *model)
+{
+    double normal[64] = {0};
+    double right[8] = {0};
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t index = indices[i];
+        double x = points->sourceX[index];
+        double y = points->sourceY[index];
+        double u = points->destinationX[index];
+        double v = points->destinationY[index];
+        double rows[2][8] =
+        {
+            {x, y, 1.0, 0.0, 0.0, 0.0, -x * u, -y * u},
+            {0.0, 0.0, 0.0, x, y, 1.0, -x * v, -y * v}
+        };
+        double values[2] = {u, v};
+        for (int r = 0; r < 2; r++)
+        {
+            for (int j = 0; j < 8; j++)
+            {
+                for (int k = 0; k < 8; k++)
+                {
+                    normal[j * 8 + k] += rows[r][j] * rows[r][k];
+                }
+                right[j] += rows[r][j] * values[r];
+            }
+        }
+    }
+    if (!FDMotionSolve(normal, right, 8))
+    {
+        return NO;
+    }
+    memcpy(model, right, sizeof(right));
+    model[8] = 1.0;
+    return YES;
+}
+
+// Counts vectors whose reprojection error is below threshold. The homography test
+// is multiplied through by w, so there is no division.
+static size_t FDMotionCountInliers(const FDMotionPoints *points, const double *model, float threshold)
+{
+    float m[8];
+    for (int i = 0; i < 8; i++)
+    {
+        m[i] = (float)model[i];
+    }
+    float thresholdSquared = threshold * threshold;
+    size_t inliers = 0;
+    size_t i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    float32x4_t m0 = vdupq_n_f32(m[0]);
+    float32x4_t m1 = vdupq_n_f32(m[1]);
+    float32x4_t m2 = vdupq_n_f32(m[2]);
+    float32x4_t m3 = vdupq_n_f32(m[3]);
+    float32x4_t m4 = vdupq_n_f32(m[4]);
+    float32x4_t m5 = vdupq_n_f32(m[5]);
+    float32x4_t m6 = vdupq_n_f32(m[6]);
+    float32x4_t m7 = vdupq_n_f32(m[7]);
+    float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+    float32x4_t limit = vdupq_n_f32(thresholdSquared);
+    uint32x4_t counts = vdupq_n_u32(0);
+    for (; i + 4 <= points->count; i += 4)
+    {
+        float32x4_t x = vld1q_f32(points->sourceX + i);
+        float32x4_t y = vld1q_f32(points->sourceY + i);
+        float32x4_t w = vmlaq_f32(vmlaq_f32(one, m6, x), m7, y);
+        float32x4_t dx = vmlsq_f32(vmlaq_f32(vmlaq_f32(m2, m0, x), m1, y), vld1q_f32(points->destinationX + i), w);
+        float32x4_t dy = vmlsq_f32(vmlaq_f32(vmlaq_f32(m5, m3, x), m4, y), vld1q_f32(points->destinationY + i), w);
+        float32x4_t error = vmlaq_f32(vmulq_f32(dx, dx), dy, dy);
+        uint32x4_t inlier = vandq_u32(vcltq_f32(error, vmulq_f32(limit, vmulq_f32(w, w))), vcgtq_f32(w, zero));
+        counts = vsubq_u32(counts, inlier);
+    }
+    uint32x2_t pair = vadd_u32(vget_low_u32(counts), vget_high_u32(counts));
+    inliers = vget_lane_u32(pair, 0) + vget_lane_u32(pair, 1);
+#endif
+    for (; i < points->count; i++)
+    {
+        float x = points->sourceX[i];
+        float y = points->sourceY[i];
+        float w = m[6] * x + m[7] * y + 1.0f;
+        float dx = m[0] * x + m[1] * y + m[2] - points->destinationX[i] * w;
+        float dy = m[3] * x + m[4] * y + m[5] - points->destinationY[i] * w;
+        inliers += w > 0.0f && dx * dx + dy * dy < thresholdSquared * w * w;
+    }
+    return inliers;
+}
+
+static size_t FDMotionCollectInliers(FDMotionPoints *points, const double *model, float threshold)
+{
+    size_t count = 0;
+    float thresholdSquared = threshold * threshold;
+    for (size_t i = 0; i < points->count; i++)
+    {
+        double x = points->sourceX[i];
+        double y = points->sourceY[i];
+        double w = model[6] * x + model[7] * y + 1.0;
+        double dx = model[0] * x + model[1] * y + model[2] - points->destinationX[i] * w;
+        double dy = model[3] * x + model[4] * y + model[5] - points->destinationY[i] * w;
+        if (w > 0.0 && dx * dx + dy * dy < thresholdSquared * w * w)
+        {
+            points->indices[count++] = (uint32_t)i;
+        }
+    }
+    return count;
+}
+
+static void FDMotionMultiply(const double *a, const double *b, double *result)
+{
+    for (int row = 0; row < 3; row++)
+    {
+        for (int column = 0; column < 3; column++)
+        {
+            result[row * 3 + column] = a[row * 3] * b[column] + a[row * 3 + 1] * b[3 + column] + a[row * 3 + 2] * b[6 + column];
+        }
+    }
+}
+
+static BOOL FDMotionPointsReserve(FDMotionPoints *points, size_t capacity)
+{
+    if (capacity <= points->capacity)
+    {
+        return YES;
+    }
+    float **arrays[] = {&points->sourceX, &points->sourceY, &points->destinationX, &points->destinationY};
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++)
+    {
+        float *array = realloc(*arrays[i], capacity * sizeof(float));
+        if (array == NULL)
+        {
+            return NO;
+        }
+        *arrays[i] = array;
+    }
+    uint32_t *indices = realloc(points->indices, capacity * sizeof(uint32_t));
+    if (indices == NULL)
+    {
+        return NO;
+    }
+    points->indices = indices;
+    points->capacity = capacity;
+    return YES;
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDMotionEstimator ()
+{
+    FDMotionPoints _points;
+    NSUInteger _estimateCount;
+    CFTimeInterval _totalEstimationTime;
+}
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDMotionEstimator
+
+#pragma mark - Lifecycle
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _model = FDMotionModelAffine;
+        _inlierThreshold = FDMotionEstimatorDefaultInlierThreshold;
+        _maximumIterations = FDMotionEstimatorDefaultMaximumIterations;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(_points.sourceX);
+    free(_points.sourceY);
+    free(_points.destinationX);
+    free(_points.destinationY);
+    free(_points.indices);
+}
+
+#pragma mark - Properties
+
+- (NSTimeInterval)averageEstimationTime
+{
+    return _estimateCount > 0 ? _totalEstimationTime / _estimateCount : 0.0;
+}
+
+#pragma mark - Instance methods
+
++ (void)addDecoderOptions:(AVDictionary **)options
+{
+    av_dict_set(options, "flags2", "+export_mvs", 0);
+}
+
+- (BOOL)estimateMotionForFrame:(const AVFrame *)frame motion:(FDCameraMotion *)motion
+{
+    CFTimeInterval start = CACurrentMediaTime();
+    memset(motion, 0, sizeof(FDCameraMotion));
+    motion->pts = av_frame_get_best_effort_timestamp(frame);
+    motion->matrix[0] = motion->matrix[4] = motion->matrix[8] = 1.0;
+    motion->scale = 1.0;
+
+    double centerX = frame->width / 2.0;
+    double centerY = frame->height / 2.0;
+    double normalization = MAX(MAX(centerX, centerY), 1.0);
+    BOOL homography = self.model == FDMotionModelHomography;
+    size_t sampleSize = homography ? 4 : 3;
+
+    AVFrameSideData *sideData = av_frame_get_side_data((AVFrame *)frame, AV_FRAME_DATA_MOTION_VECTORS);
+    size_t vectorCount = sideData != NULL ? sideData->size / sizeof(AVMotionVector) : 0;
+    size_t stride = MAX((vectorCount + FDMotionEstimatorMaximumVectors - 1) / FDMotionEstimatorMaximumVectors, (size_t)1);
+    _points.count = 0;
+    if (vectorCount > 0 && FDMotionPointsReserve(&_points, vectorCount / stride + 1))
+    {
+        const AVMotionVector *vectors = (const AVMotionVector *)sideData->data;
+        for (size_t i = 0; i < vectorCount; i += stride)
+        {
+            const AVMotionVector *vector = &vectors[i];
+            // Only vectors into the past reference describe motion since an earlier frame.
+            if (vector->source >= 0 || vector->dst_x < 0 || vector->dst_y < 0 || vector->dst_x >= frame->width || vector->dst_y >= frame->height)
+            {
+                continue;
+            }
+            size_t index = _points.count++;
+            _points.sourceX[index] = (float)((vector->src_x - centerX) / normalization);
+            _points.sourceY[index] = (float)((vector->src_y - centerY) / normalization);
+            _points.destinationX[index] = (float)((vector->dst_x - centerX) / normalization);
+            _points.destinationY[index] = (float)((vector->dst_y - centerY) / normalization);
+        }
+    }
+    motion->vectorCount = (uint32_t)_points.count;
+
+    double best[9];
+    size_t bestInliers = 0;
+    float threshold = (float)(self.inlierThreshold / normalization);
+    if (_points.count >= 2 * sampleSize)
+    {
+        uint32_t state = (uint32_t)(motion->pts ^ 0x9E3779B9U) | 1U;
+        NSUInteger iterations = MAX(self.maximumIterations, sampleSize);
+        for (NSUInteger iteration = 0; iteration < iterations; iteration++)
+        {
+            uint32_t sample[4];
+            for (size_t i = 0; i < sampleSize; i++)
+            {
+                BOOL duplicate;
+                do
+                {
+                    sample[i] = FDMotionRandom(&state) % (uint32_t)_points.count;
+                    duplicate = NO;
+                    for (size_t j = 0; j < i; j++)
+                    {
+                        duplicate = duplicate || sample[j] == sample[i];
+                    }
+                }
+                while (duplicate);
+            }
+
+            double hypothesis[9];
+            BOOL fitted = homography ? FDMotionFitHomography(&_points, sample, sampleSize, hypothesis) :
+                                       FDMotionFitAffine(&_points, sample, sampleSize, hypothesis);
+            if (!fitted)
+            {
+                continue;
+            }
+            size_t inliers = FDMotionCountInliers(&_points, hypothesis, threshold);
+            if (inliers > bestInliers)
+            {
+                bestInliers = inliers;
+                memcpy(best, hypothesis, sizeof(best));
+                // Enough iterations to draw one all-inlier sample with the target confidence.
+                double ratio = (double)inliers / _points.count;
+                double miss = 1.0 - pow(ratio, (double)sampleSize);
+                NSUInteger needed = miss > 0.0 ? (NSUInteger)ceil(log(1.0 - FDMotionEstimatorConfidence) / log(miss)) : 0;
+                iterations = MIN(MAX(needed, FDMotionEstimatorMinimumIterations), MAX(self.maximumIterations, sampleSize));
+            }
+        }
+    }
+
+    if (bestInliers >= 2 * sampleSize)
+    {
+        // Two rounds of refitting on the inliers of the previous model.
+        for (int round = 0; round < 2; round++)
+        {
+            size_t inliers = FDMotionCollectInliers(&_points, best, threshold);
+            double refined[9];
+            BOOL fitted = inliers >= sampleSize &&
+                          (homography ? FDMotionFitHomography(&_points, _points.indices, inliers, refined) :
+                                        FDMotionFitAffine(&_points, _points.indices, inliers, refined));
+            if (!fitted)
+            {
+                break;
+            }
+            memcpy(best, refined, sizeof(best));
+            bestInliers = inliers;
+        }
+
+        // Back to pixels: T^-1 * H * T with T mapping pixels to normalized coordinates.
+        double toNormalized[9] = {1.0 / normalization, 0.0, -centerX / normalization, 0.0, 1.0 / normalization, -centerY / normalization, 0.0, 0.0, 1.0};
+        double toPixels[9] = {normalization, 0.0, centerX, 0.0, normalization, centerY, 0.0, 0.0, 1.0};
+        double temporary[9];
+        FDMotionMultiply(best, toNormalized, temporary);
+        FDMotionMultiply(toPixels, temporary, motion->matrix);
+        for (int i = 0; i < 9; i++)
+        {
+            motion->matrix[i] /= motion->matrix[8];
+        }
+
+        // Jacobian at the frame center.
+        const double *m = motion->matrix;
+        double w = m[6] * centerX + m[7] * centerY + 1.0;
+        double mappedX = (m[0] * centerX + m[1] * centerY + m[2]) / w;
+        double mappedY = (m[3] * centerX + m[4] * centerY + m[5]) / w;
+        double j00 = (m[0] - mappedX * m[6]) / w;
+        double j01 = (m[1] - mappedX * m[7]) / w;
+        double j10 = (m[3] - mappedY * m[6]) / w;
+        double j11 = (m[4] - mappedY * m[7]) / w;
+        motion->translationX = mappedX - centerX;
+        motion->translationY = mappedY - centerY;
+        motion->rotation = atan2(j10 - j01, j00 + j11);
+        motion->scale = sqrt(fabs(j00 * j11 - j01 * j10));
+        motion->inlierCount = (uint32_t)bestInliers;
+        motion->valid = YES;
+    }
+
+    _totalEstimationTime += CACurrentMediaTime() - start;
+    _estimateCount++;
+    if (self.handler != nil)
+    {
+        self.handler(motion);
+    }
+    return motion->valid;
+}
+
+#pragma mark - Benchmark
+
++ (void)logCostForFileAtPath:(NSString *)path
+{
+    FDFFmpegInitialize();
+    CFTimeInterval decodeTimes[2] = {0, 0};
+    NSUInteger frameCounts[2] = {0, 0};
+    NSUInteger validCount = 0;
+    double inlierRatio = 0;
+    FDMotionEstimator *estimator = [[FDMotionEstimator alloc] init];
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        AVFormatContext *format = NULL;
+        AVCodecContext *decoder = NULL;
+        AVDictionary *options = NULL;
+        AVFrame *frame = av_frame_alloc();
+        int result = frame != NULL ? avformat_open_input(&format, path.fileSystemRepresentation, NULL, NULL) : AVERROR(ENOMEM);
+        if (result >= 0)
+        {
+            result = avformat_find_stream_info(format, NULL);
+        }
+        int streamIndex = result >= 0 ? av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0) : result;
+        if (streamIndex >= 0)
+        {
+            if (pass == 1)
+            {
+                [self addDecoderOptions:&options];
+            }
+            decoder = FDFFmpegOpenDecoderWithOptions(format->streams[streamIndex], 1, &options, &result);
+        }
+        av_dict_free(&options);
+        if (streamIndex < 0 || decoder == NULL)
+        {
+            NSLog(@"Unable to open %@: %@", path, FDFFmpegError(streamIndex < 0 ? streamIndex : result, @"Unable to open recording"));
+            av_frame_free(&frame);
+            avformat_close_input(&format);
+            return;
+        }
+
+        AVPacket packet;
+        av_init_packet(&packet);
+        BOOL draining = NO;
+        while (YES)
+        {
+            if (!draining && av_read_frame(format, &packet) < 0)
+            {
+                draining = YES;
+            }
+            if (draining)
+            {
+                av_init_packet(&packet);
+                packet.data = NULL;
+                packet.size = 0;
+            }
+            else if (packet.stream_index != streamIndex)
+            {
+                av_free_packet(&packet);
+                continue;
+            }
+
+            int gotFrame = 0;
+            CFTimeInterval start = CACurrentMediaTime();
+            int decoded = avcodec_decode_video2(decoder, frame, &gotFrame, &packet);
+            decodeTimes[pass] += CACurrentMediaTime() - start;
+            if (!draining)
+            {
+                av_free_packet(&packet);
+            }
+            if (gotFrame)
+            {
+                frameCounts[pass]++;
+                if (pass == 1)
+                {
+                    FDCameraMotion motion;
+                    if ([estimator estimateMotionForFrame:frame motion:&motion])
+                    {
+                        validCount++;
+                        inlierRatio += (double)motion.inlierCount / motion.vectorCount;
+                    }
+                }
+                av_frame_unref(frame);
+            }
+            if (draining && (decoded < 0 || !gotFrame))
+            {
+                break;
+            }
+        }
+
+        avcodec_free_context(&decoder);
+        av_frame_free(&frame);
+        avformat_close_input(&format);
+    }
+
+    NSLog(@"Motion vectors for %@: decode %.2f ms/frame, with export %.2f ms/frame, estimation %.3f ms/frame, %lu of %lu frames estimated, %.0f%% inliers",
+          path.lastPathComponent, decodeTimes[0] * 1000.0 / MAX(frameCounts[0], (NSUInteger)1),
+          decodeTimes[1] * 1000.0 / MAX(frameCounts[1], (NSUInteger)1), estimator.averageEstimationTime * 1000.0,
+          (unsigned long)validCount, (unsigned long)frameCounts[1], 100.0 * inlierRatio / MAX(validCount, (NSUInteger)1));
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,55 @@
+//
+//  FDElevationCache.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stdint.h>
+
+
+// Tiles span 1/16 degree with 256 intervals per side (about 27 m of latitude),
+// stored as 257 x 257 int16 meters with shared edges.
+#define FDElevationTilesPerDegree 16
+#define FDElevationTileIntervals 256
+#define FDElevationTileSamples (FDElevationTileIntervals + 1)
+// Voids in the source data.
+#define FDElevationVoid INT16_MIN
+
+
+// Offline terrain elevation. Every tile is its own fixed-size file, memory mapped
+// on first use and kept in a small LRU of hot tiles, so lookups never touch the
+// network and rarely the file system. Batch lookups split into a scalar pass that
+// resolves tiles and cells and a vectorized bilinear pass. Missing tiles are looked
+// for again every few seconds, so imported tiles show up without a new cache.
+// Thread safe.
+@interface FDElevationCache : NSObject
+
+@property (nonatomic, copy, readonly) NSString *directory;
+// Mapped tiles kept around, 64 by default.
+@property (nonatomic, assign, readonly) NSUInteger capacity;
+@property (nonatomic, assign, readonly) unsigned long long tileLoadCount;
+
+- (instancetype)initWithDirectory:(NSString *)directory capacity:(NSUInteger)capacity;
+
+// Meters above mean sea level, NAN without a tile or next to a void.
+- (float)elevationAtLatitude:(double)latitude longitude:(double)longitude;
+- (void)getElevations:(float *)elevations
+          atLatitudes:(const double *)latitudes
+           longitudes:(const double *)longitudes
+                count:(NSUInteger)count;
+
+// Splits an SRTM .hgt file (1201 or 3601 samples per side, named after its south
+// west corner, e.g. N48E002.hgt) into tiles. Existing tiles are replaced.
++ (BOOL)importHGTFileAtPath:(NSString *)path toDirectory:(NSString *)directory error:(NSError **)error;
++ (BOOL)writeTileWithLatitudeIndex:(int)latitudeIndex
+                    longitudeIndex:(int)longitudeIndex
+                           samples:(const int16_t *)samples
+                       toDirectory:(NSString *)directory
+                             error:(NSError **)error;
+
+// Writes synthetic tiles to a temporary directory and logs single core lookup rates
+// for a flight path and for scattered points.
++ (void)runBenchmarkWithLookupCount:(NSUInteger)lookupCount;
+
+@end
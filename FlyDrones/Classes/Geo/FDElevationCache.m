@@ -0,0 +1,487 @@
+//
+//  FDElevationCache.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDElevationCache.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static uint32_t const FDElevationTileMagic = 0x4D454446; // 'FDEM'
+static uint32_t const FDElevationTileVersion = 1;
+static NSUInteger const FDElevationCacheDefaultCapacity = 64;
+// A missing tile is looked for again after this long, tiles may be imported meanwhile.
+static CFTimeInterval const FDElevationMissingTileRetryInterval = 5.0;
+// Points resolved per pass, sized for the stack.
+#define FDElevationBatchSize 256
+#define FDElevationSamplesPerDegree (FDElevationTilesPerDegree * FDElevationTileIntervals)
+
+typedef struct FDElevationTileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t latitudeIndex;
+    int32_t longitudeIndex;
+} FDElevationTileHeader;
+
+typedef struct FDElevationTile
+{
+    uint32_t key;
+    uint64_t lastUse;
+    // NULL when there is no tile file, which is cached too until missingUntil.
+    const int16_t *samples;
+    CFTimeInterval missingUntil;
+    void *mapping;
+    size_t mappingSize;
+    BOOL valid;
+} FDElevationTile;
+
+
+#pragma mark - Private functions
+
+static inline uint32_t FDElevationTileKey(int latitudeIndex, int longitudeIndex)
+{
+    return ((uint32_t)latitudeIndex << 16) | (uint32_t)longitudeIndex;
+}
+
+static NSString *FDElevationTilePath(NSString *directory, int latitudeIndex, int longitudeIndex)
+{
+    return [directory stringByAppendingPathComponent:[NSString stringWithFormat:@"%04d_%04d.dem", latitudeIndex, longitudeIndex]];
+}
+
+static inline float FDElevationSampleValue(int16_t sample)
+{
+    return sample == FDElevationVoid ? NAN : (float)sample;
+}
+
+// Bilinear blend of the four cell corners; voids propagate as NAN.
+static void FDElevationInterpolate(const float *southWest,
+                                   const float *southEast,
+                                   const float *northWest,
+                                   const float *northEast,
+                                   const float *fractionX,
+                                   const float *fractionY,
+                                   float *elevations,
+                                   int count)
+{
+    int i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t x = vld1q_f32(fractionX + i);
+        float32x4_t y = vld1q_f32(fractionY + i);
+        float32x4_t a = vld1q_f32(southWest + i);
+        float32x4_t b = vld1q_f32(southEast + i);
+        float32x4_t c = vld1q_f32(northWest + i);
+        float32x4_t d = vld1q_f32(northEast + i);
+        float32x4_t south = vmlaq_f32(a, vsubq_f32(b, a), x);
+        float32x4_t north = vmlaq_f32(c, vsubq_f32(d, c), x);
+        vst1q_f32(elevations + i, vmlaq_f32(south, vsubq_f32(north, south), y));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float south = southWest[i] + (southEast[i] - southWest[i]) * fractionX[i];
+        float north = northWest[i] + (northEast[i] - northWest[i]) * fractionX[i];
+        elevations[i] = south + (north - south) * fractionY[i];
+    }
+}
+
+static inline int16_t FDElevationReadBigEndian(const uint8_t *bytes, int index)
+{
+    return (int16_t)((bytes[2 * index] << 8) | bytes[2 * index + 1]);
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDElevationCache ()
+{
+    pthread_mutex_t _lock;
+    FDElevationTile *_tiles;
+    uint64_t _useClock;
+    // The last tile resolved, most batches stay within one.
+    uint32_t _lastKey;
+    const int16_t *_lastSamples;
+    BOOL _lastValid;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, copy, readwrite) NSString *directory;
+@property (nonatomic, assign, readwrite) NSUInteger capacity;
+@property (nonatomic, assign, readwrite) unsigned long long tileLoadCount;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDElevationCache
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithDirectory:(NSString *)directory capacity:(NSUInteger)capacity
+{
+    self = [super init];
+    if (self)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        _directory = [directory copy];
+        _capacity = capacity > 0 ? capacity : FDElevationCacheDefaultCapacity;
+        _tiles = calloc(_capacity, sizeof(FDElevationTile));
+        if (_tiles == NULL)
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger i = 0; _tiles != NULL && i < _capacity; i++)
+    {
+        if (_tiles[i].mapping != NULL)
+        {
+            munmap(_tiles[i].mapping, _tiles[i].mappingSize);
+        }
+    }
+    free(_tiles);
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Instance methods
+
+- (float)elevationAtLatitude:(double)latitude longitude:(double)longitude
+{
+    float elevation;
+    [self getElevations:&elevation atLatitudes:&latitude longitudes:&longitude count:1];
+    return elevation;
+}
+
+- (void)getElevations:(float *)elevations
+          atLatitudes:(const double *)latitudes
+           longitudes:(const double *)longitudes
+                count:(NSUInteger)count
+{
+    float southWest[FDElevationBatchSize];
+    float southEast[FDElevationBatchSize];
+    float northWest[FDElevationBatchSize];
+    float northEast[FDElevationBatchSize];
+    float fractionX[FDElevationBatchSize];
+    float fractionY[FDElevationBatchSize];
+
+    pthread_mutex_lock(&_lock);
+    // A missing tile goes back through the LRU, which knows when to look for it again.
+    _lastValid = _lastValid && _lastSamples != NULL;
+    for (NSUInteger start = 0; start < count; start += FDElevationBatchSize)
+    {
+        int batchCount = (int)MIN(count - start, (NSUInteger)FDElevationBatchSize);
+        for (int i = 0; i < batchCount; i++)
+        {
+            // Global sample grid coordinates; the tile and the cell fall out of the integer part.
+            double x = (longitudes[start + i] + 180.0) * FDElevationSamplesPerDegree;
+            double y = (latitudes[start + i] + 90.0) * FDElevationSamplesPerDegree;
+            const int16_t *samples = NULL;
+            int64_t column = (int64_t)floor(x);
+            int64_t row = (int64_t)floor(y);
+            if (column >= 0 && column < 360 * FDElevationSamplesPerDegree && row >= 0 && row < 180 * FDElevationSamplesPerDegree)
+            {
+                uint32_t key = FDElevationTileKey((int)(row / FDElevationTileIntervals), (int)(column / FDElevationTileIntervals));
+                if (!_lastValid || key != _lastKey)
+                {
+                    _lastSamples = [self samplesForKey:key];
+                    _lastKey = key;
+                    _lastValid = YES;
+                }
+                samples = _lastSamples;
+            }
+
+            if (samples == NULL)
+            {
+                southWest[i] = southEast[i] = northWest[i] = northEast[i] = NAN;
+                fractionX[i] = fractionY[i] = 0.0f;
+                continue;
+            }
+            const int16_t *corner = samples + (row % FDElevationTileIntervals) * FDElevationTileSamples + column % FDElevationTileIntervals;
+            southWest[i] = FDElevationSampleValue(corner[0]);
+            southEast[i] = FDElevationSampleValue(corner[1]);
+            northWest[i] = FDElevationSampleValue(corner[FDElevationTileSamples]);
+            northEast[i] = FDElevationSampleValue(corner[FDElevationTileSamples + 1]);
+            fractionX[i] = (float)(x - column);
+            fractionY[i] = (float)(y - row);
+        }
+        FDElevationInterpolate(southWest, southEast, northWest, northEast, fractionX, fractionY, elevations + start, batchCount);
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark - Private methods
+
+// LRU lookup, mapping the tile file on a miss. Called with _lock held.
+- (const int16_t *)samplesForKey:(uint32_t)key
+{
+    CFTimeInterval now = CACurrentMediaTime();
+    FDElevationTile *victim = &_tiles[0];
+    for (NSUInteger i = 0; i < _capacity; i++)
+    {
+        FDElevationTile *tile = &_tiles[i];
+        if (tile->valid && tile->key == key)
+        {
+            if (tile->samples != NULL || now < tile->missingUntil)
+            {
+                tile->lastUse = ++_useClock;
+                return tile->samples;
+            }
+            victim = tile;
+            break;
+        }
+        if (!tile->valid || (victim->valid && tile->lastUse < victim->lastUse))
+        {
+            victim = tile;
+        }
+    }
+
+    if (victim->mapping != NULL)
+    {
+        munmap(victim->mapping, victim->mappingSize);
+    }
+    memset(victim, 0, sizeof(FDElevationTile));
+    victim->key = key;
+    victim->lastUse = ++_useClock;
+    victim->missingUntil = now + FDElevationMissingTileRetryInterval;
+    victim->valid = YES;
+    self.tileLoadCount++;
+
+    int latitudeIndex = (int)(key >> 16);
+    int longitudeIndex = (int)(key & 0xFFFF);
+    NSString *path = FDElevationTilePath(self.directory, latitudeIndex, longitudeIndex);
+    size_t size = sizeof(FDElevationTileHeader) + FDElevationTileSamples * FDElevationTileSamples * sizeof(int16_t);
+    int descriptor = open(path.fileSystemRepresentation, O_RDONLY);
+    struct stat status;
+    if (descriptor < 0)
+    {
+        return NULL;
+    }
+    if (fstat(descriptor, &status) != 0 || status.st_size != (off_t)size)
+    {
+        close(descriptor);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    const FDElevationTileHeader *header = mapping;
+    if (header->magic != FDElevationTileMagic || header->version != FDElevationTileVersion ||
+        header->latitudeIndex != latitudeIndex || header->longitudeIndex != longitudeIndex)
+    {
+        NSLog(@"Ignoring mismatched elevation tile %@", path);
+        munmap(mapping, size);
+        return NULL;
+    }
+    victim->mapping = mapping;
+    victim->mappingSize = size;
+    victim->samples = (const int16_t *)(header + 1);
+    return victim->samples;
+}
+
+#pragma mark - Import
+
++ (BOOL)writeTileWithLatitudeIndex:(int)latitudeIndex
+                    longitudeIndex:(int)longitudeIndex
+                           samples:(const int16_t *)samples
+                       toDirectory:(NSString *)directory
+                             error:(NSError **)error
+{
+    FDElevationTileHeader header = {FDElevationTileMagic, FDElevationTileVersion, latitudeIndex, longitudeIndex};
+    NSMutableData *data = [NSMutableData dataWithBytes:&header length:sizeof(header)];
+    [data appendBytes:samples length:FDElevationTileSamples * FDElevationTileSamples * sizeof(int16_t)];
+    if (![[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:error])
+    {
+        return NO;
+    }
+    return [data writeToFile:FDElevationTilePath(directory, latitudeIndex, longitudeIndex) options:NSDataWritingAtomic error:error];
+}
+
++ (BOOL)importHGTFileAtPath:(NSString *)path toDirectory:(NSString *)directory error:(NSError **)error
+{
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:error];
+    if (data == nil)
+    {
+        return NO;
+    }
+
+    NSString *name = path.lastPathComponent.uppercaseString;
+    int latitude = 0;
+    int longitude = 0;
+    char latitudeHemisphere = 0;
+    char longitudeHemisphere = 0;
+    int size = data.length == 1201 * 1201 * 2 ? 1201 : (data.length == 3601 * 3601 * 2 ? 3601 : 0);
+    if (size == 0 || sscanf(name.UTF8String, "%c%2d%c%3d", &latitudeHemisphere, &latitude, &longitudeHemisphere, &longitude) != 4 ||
+        (latitudeHemisphere != 'N' && latitudeHemisphere != 'S') || (longitudeHemisphere != 'E' && longitudeHemisphere != 'W'))
+    {
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:@{NSFilePathErrorKey : path}];
+        }
+        return NO;
+    }
+    latitude = latitudeHemisphere == 'S' ? -latitude : latitude;
+    longitude = longitudeHemisphere == 'W' ? -longitude : longitude;
+
+    const uint8_t *bytes = data.bytes;
+    int16_t *samples = malloc(FDElevationTileSamples * FDElevationTileSamples * sizeof(int16_t));
+    if (samples == NULL)
+    {
+        return NO;
+    }
+
+    BOOL success = YES;
+    for (int tileRow = 0; tileRow < FDElevationTilesPerDegree && success; tileRow++)
+    {
+        for (int tileColumn = 0; tileColumn < FDElevationTilesPerDegree && success; tileColumn++)
+        {
+            for (int row = 0; row < FDElevationTileSamples; row++)
+            {
+                // .hgt rows run north to south.
+                double y = (1.0 - (tileRow * FDElevationTileIntervals + row) / (double)FDElevationSamplesPerDegree) * (size - 1);
+                int y0 = MIN((int)y, size - 2);
+                float fy = (float)(y - y0);
+                for (int column = 0; column < FDElevationTileSamples; column++)
+                {
+                    double x = (tileColumn * FDElevationTileIntervals + column) / (double)FDElevationSamplesPerDegree * (size - 1);
+                    int x0 = MIN((int)x, size - 2);
+                    float fx = (float)(x - x0);
+                    int16_t corners[4] =
+                    {
+                        FDElevationReadBigEndian(bytes, y0 * size + x0),
+                        FDElevationReadBigEndian(bytes, y0 * size + x0 + 1),
+                        FDElevationReadBigEndian(bytes, (y0 + 1) * size + x0),
+                        FDElevationReadBigEndian(bytes, (y0 + 1) * size + x0 + 1)
+                    };
+                    int16_t value;
+                    if (corners[0] == FDElevationVoid || corners[1] == FDElevationVoid ||
+                        corners[2] == FDElevationVoid || corners[3] == FDElevationVoid)
+                    {
+                        value = corners[(fy >= 0.5f ? 2 : 0) + (fx >= 0.5f ? 1 : 0)];
+                    }
+                    else
+                    {
+                        float top = corners[0] + (corners[1] - corners[0]) * fx;
+                        float bottom = corners[2] + (corners[3] - corners[2]) * fx;
+                        value = (int16_t)lrintf(top + (bottom - top) * fy);
+                    }
+                    samples[row * FDElevationTileSamples + column] = value;
+                }
+            }
+            success = [self writeTileWithLatitudeIndex:(latitude + 90) * FDElevationTilesPerDegree + tileRow
+                                        longitudeIndex:(longitude + 180) * FDElevationTilesPerDegree + tileColumn
+                                               samples:samples
+                                           toDirectory:directory
+                                                 error:error];
+        }
+    }
+    free(samples);
+    return success;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithLookupCount:(NSUInteger)lookupCount
+{
+    static NSUInteger const batchSize = 256;
+    NSString *directory = [NSTemporaryDirectory() stringByAppendingPathComponent:@"FDElevationBenchmark"];
+    int16_t *samples = malloc(FDElevationTileSamples * FDElevationTileSamples * sizeof(int16_t));
+    double *latitudes = malloc(lookupCount * sizeof(double));
+    double *longitudes = malloc(lookupCount * sizeof(double));
+    float *elevations = malloc(lookupCount * sizeof(float));
+    if (samples == NULL || latitudes == NULL || longitudes == NULL || elevations == NULL)
+    {
+        free(samples);
+        free(latitudes);
+        free(longitudes);
+        free(elevations);
+        return;
+    }
+
+    // A 4 x 4 block of rolling synthetic terrain.
+    int baseLatitudeIndex = (48 + 90) * FDElevationTilesPerDegree;
+    int baseLongitudeIndex = (2 + 180) * FDElevationTilesPerDegree;
+    for (int tile = 0; tile < 16; tile++)
+    {
+        int latitudeIndex = baseLatitudeIndex + tile / 4;
+        int longitudeIndex = baseLongitudeIndex + tile % 4;
+        for (int row = 0; row < FDElevationTileSamples; row++)
+        {
+            for (int column = 0; column < FDElevationTileSamples; column++)
+            {
+                double y = latitudeIndex * FDElevationTileIntervals + row;
+                double x = longitudeIndex * FDElevationTileIntervals + column;
+                samples[row * FDElevationTileSamples + column] = (int16_t)(300.0 + 120.0 * sin(x * 0.01) * cos(y * 0.013));
+            }
+        }
+        [self writeTileWithLatitudeIndex:latitudeIndex longitudeIndex:longitudeIndex samples:samples toDirectory:directory error:NULL];
+    }
+
+    double south = baseLatitudeIndex / (double)FDElevationTilesPerDegree - 90.0;
+    double west = baseLongitudeIndex / (double)FDElevationTilesPerDegree - 180.0;
+    double span = 4.0 / FDElevationTilesPerDegree;
+    for (NSUInteger pass = 0; pass < 2; pass++)
+    {
+        srandom(39);
+        double latitude = south + span / 2;
+        double longitude = west + span / 2;
+        for (NSUInteger i = 0; i < lookupCount; i++)
+        {
+            if (pass == 0)
+            {
+                // About 15 m/s sampled at 50 Hz.
+                latitude = MIN(MAX(latitude + (random() % 1000 - 500) * 1e-8, south), south + span);
+                longitude = MIN(MAX(longitude + (random() % 1000 - 500) * 1e-8, west), west + span);
+                latitudes[i] = latitude;
+                longitudes[i] = longitude;
+            }
+            else
+            {
+                latitudes[i] = south + span * (random() / (double)RAND_MAX);
+                longitudes[i] = west + span * (random() / (double)RAND_MAX);
+            }
+        }
+
+        FDElevationCache *cache = [[FDElevationCache alloc] initWithDirectory:directory capacity:FDElevationCacheDefaultCapacity];
+        CFTimeInterval start = CACurrentMediaTime();
+        for (NSUInteger i = 0; i < lookupCount; i += batchSize)
+        {
+            NSUInteger count = MIN(batchSize, lookupCount - i);
+            [cache getElevations:elevations + i atLatitudes:latitudes + i longitudes:longitudes + i count:count];
+        }
+        CFTimeInterval elapsed = CACurrentMediaTime() - start;
+        NSLog(@"Elevation lookups (%@): %.2f M/s in batches of %lu, %llu tile loads",
+              pass == 0 ? @"flight path" : @"scattered", lookupCount / MAX(elapsed, 1e-9) / 1e6,
+              (unsigned long)batchSize, cache.tileLoadCount);
+    }
+
+    [[NSFileManager defaultManager] removeItemAtPath:directory error:NULL];
+    free(samples);
+    free(latitudes);
+    free(longitudes);
+    free(elevations);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,73 @@
+//
+//  FDGeoIndex.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stdint.h>
+
+
+typedef NS_OPTIONS(uint16_t, FDGeoIndexEntryFlags)
+{
+    FDGeoIndexEntryFlagKeyframe = 1 << 0
+};
+
+// One geotagged frame. Positions are 1e-7 degrees, altitude mm above mean sea
+// level, angles 1e-4 radians and streamTime microseconds from the start of the recording.
+typedef struct FDGeoIndexEntry
+{
+    uint64_t hilbert;
+    uint64_t recordingIdentifier;
+    int64_t streamTime;
+    int32_t latitude;
+    int32_t longitude;
+    int32_t altitude;
+    uint32_t frameIndex;
+    int16_t roll;
+    int16_t pitch;
+    int16_t yaw;
+    uint16_t flags;
+} FDGeoIndexEntry;
+
+typedef void (^FDGeoIndexBlock)(const FDGeoIndexEntry *entry, double distance, BOOL *stop);
+
+// Position on the world wide Hilbert curve of order 32, the sort key of every index.
+uint64_t FDGeoIndexHilbertValue(int32_t latitude, int32_t longitude);
+
+// Equirectangular distance in meters, accurate to well under a meter at query radii.
+double FDGeoIndexDistance(int32_t latitude1, int32_t longitude1, int32_t latitude2, int32_t longitude2);
+
+int FDGeoIndexCompareEntries(const void *a, const void *b);
+
+
+// Static packed R-tree: entries sorted along a fixed world wide Hilbert curve,
+// grouped 16 per leaf node, with every upper level holding the bounding boxes of
+// 16 nodes below. Because every index sorts on the same curve, indexes merge in
+// linear time, which is how the per-recording runs and the global index are built.
+// Files are memory mapped, so opening costs no parsing.
+@interface FDGeoIndex : NSObject
+
+@property (nonatomic, assign, readonly) NSUInteger entryCount;
+@property (nonatomic, assign, readonly) const FDGeoIndexEntry *entries;
+
+// Sorts a copy of the entries.
++ (instancetype)indexWithEntries:(const FDGeoIndexEntry *)entries count:(NSUInteger)count;
+// entries must already be in Hilbert order, see FDGeoIndexCompareEntries.
++ (instancetype)indexWithSortedEntries:(const FDGeoIndexEntry *)entries count:(NSUInteger)count;
++ (instancetype)indexByMergingIndexes:(NSArray *)indexes;
++ (instancetype)indexWithContentsOfFile:(NSString *)path error:(NSError **)error;
+
+- (BOOL)writeToFile:(NSString *)path error:(NSError **)error;
+
+// Entries in no particular order.
+- (void)enumerateEntriesWithinDistance:(double)distance
+                            ofLatitude:(int32_t)latitude
+                             longitude:(int32_t)longitude
+                            usingBlock:(FDGeoIndexBlock)block;
+- (NSUInteger)countOfEntriesWithinDistance:(double)distance ofLatitude:(int32_t)latitude longitude:(int32_t)longitude;
+
+// Builds an index of simulated flights and logs the build and 50 m query times.
++ (void)runBenchmarkWithEntryCount:(NSUInteger)entryCount;
+
+@end
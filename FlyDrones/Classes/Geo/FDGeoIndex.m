@@ -0,0 +1,490 @@
+//
+//  FDGeoIndex.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDGeoIndex.h"
+
+
+static uint32_t const FDGeoIndexMagic = 0x49474446; // 'FDGI'
+static uint32_t const FDGeoIndexVersion = 1;
+static NSUInteger const FDGeoIndexNodeSize = 16;
+#define FDGeoIndexMaximumLevels 16
+static double const FDGeoIndexEarthRadius = 6371008.8;
+
+typedef struct FDGeoIndexBox
+{
+    int32_t minimumLatitude;
+    int32_t minimumLongitude;
+    int32_t maximumLatitude;
+    int32_t maximumLongitude;
+} FDGeoIndexBox;
+
+// Level 0 are the entries, level n holds one box per FDGeoIndexNodeSize items of level n - 1.
+typedef struct FDGeoIndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t entryCount;
+    uint32_t levelCount;
+    uint32_t reserved;
+    uint64_t levelCounts[FDGeoIndexMaximumLevels];
+} FDGeoIndexHeader;
+
+typedef struct FDGeoIndexCursor
+{
+    const FDGeoIndexEntry *position;
+    const FDGeoIndexEntry *end;
+} FDGeoIndexCursor;
+
+
+#pragma mark - Private functions
+
+static inline BOOL FDGeoIndexBoxIntersects(const FDGeoIndexBox *box, const FDGeoIndexBox *query)
+{
+    return box->minimumLatitude <= query->maximumLatitude && box->maximumLatitude >= query->minimumLatitude &&
+           box->minimumLongitude <= query->maximumLongitude && box->maximumLongitude >= query->minimumLongitude;
+}
+
+static inline BOOL FDGeoIndexCursorLess(const FDGeoIndexCursor *a, const FDGeoIndexCursor *b)
+{
+    return FDGeoIndexCompareEntries(a->position, b->position) < 0;
+}
+
+static void FDGeoIndexSiftDown(FDGeoIndexCursor *heap, size_t count, size_t index)
+{
+    for (;;)
+    {
+        size_t smallest = index;
+        size_t left = 2 * index + 1;
+        size_t right = left + 1;
+        if (left < count && FDGeoIndexCursorLess(&heap[left], &heap[smallest]))
+        {
+            smallest = left;
+        }
+        if (right < count && FDGeoIndexCursorLess(&heap[right], &heap[smallest]))
+        {
+            smallest = right;
+        }
+        if (smallest == index)
+        {
+            return;
+        }
+        FDGeoIndexCursor swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+static size_t FDGeoIndexLayout(FDGeoIndexHeader *header, uint64_t entryCount)
+{
+    memset(header, 0, sizeof(FDGeoIndexHeader));
+    header->magic = FDGeoIndexMagic;
+    header->version = FDGeoIndexVersion;
+    header->entryCount = entryCount;
+    header->levelCounts[0] = entryCount;
+    header->levelCount = 1;
+    size_t boxCount = 0;
+    while (header->levelCounts[header->levelCount - 1] > 1 || (header->levelCount == 1 && entryCount > 0))
+    {
+        uint64_t count = (header->levelCounts[header->levelCount - 1] + FDGeoIndexNodeSize - 1) / FDGeoIndexNodeSize;
+        header->levelCounts[header->levelCount++] = count;
+        boxCount += count;
+    }
+    return boxCount;
+}
+
+static void FDGeoIndexBuildBoxes(const FDGeoIndexHeader *header, const FDGeoIndexEntry *entries, FDGeoIndexBox *boxes)
+{
+    FDGeoIndexBox *level = boxes;
+    for (uint64_t i = 0; i < header->levelCounts[1]; i++)
+    {
+        FDGeoIndexBox box = {INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN};
+        uint64_t end = MIN((i + 1) * FDGeoIndexNodeSize, header->entryCount);
+        for (uint64_t j = i * FDGeoIndexNodeSize; j < end; j++)
+        {
+            box.minimumLatitude = MIN(box.minimumLatitude, entries[j].latitude);
+            box.minimumLongitude = MIN(box.minimumLongitude, entries[j].longitude);
+            box.maximumLatitude = MAX(box.maximumLatitude, entries[j].latitude);
+            box.maximumLongitude = MAX(box.maximumLongitude, entries[j].longitude);
+        }
+        level[i] = box;
+    }
+
+    for (uint32_t levelIndex = 2; levelIndex < header->levelCount; levelIndex++)
+    {
+        const FDGeoIndexBox *children = level;
+        uint64_t childCount = header->levelCounts[levelIndex - 1];
+        level += childCount;
+        for (uint64_t i = 0; i < header->levelCounts[levelIndex]; i++)
+        {
+            FDGeoIndexBox box = {INT32_MAX, INT32_MAX, INT32_MIN, INT32_MIN};
+            uint64_t end = MIN((i + 1) * FDGeoIndexNodeSize, childCount);
+            for (uint64_t j = i * FDGeoIndexNodeSize; j < end; j++)
+            {
+                box.minimumLatitude = MIN(box.minimumLatitude, children[j].minimumLatitude);
+                box.minimumLongitude = MIN(box.minimumLongitude, children[j].minimumLongitude);
+                box.maximumLatitude = MAX(box.maximumLatitude, children[j].maximumLatitude);
+                box.maximumLongitude = MAX(box.maximumLongitude, children[j].maximumLongitude);
+            }
+            level[i] = box;
+        }
+    }
+}
+
+
+#pragma mark - Public functions
+
+uint64_t FDGeoIndexHilbertValue(int32_t latitude, int32_t longitude)
+{
+    uint32_t x = (uint32_t)MIN(MAX((longitude + 1800000000.0) * (4294967295.0 / 3600000000.0), 0.0), 4294967295.0);
+    uint32_t y = (uint32_t)MIN(MAX((latitude + 900000000.0) * (4294967295.0 / 1800000000.0), 0.0), 4294967295.0);
+    uint64_t value = 0;
+    for (uint32_t s = 1U << 31; s > 0; s >>= 1)
+    {
+        uint32_t rx = (x & s) != 0;
+        uint32_t ry = (y & s) != 0;
+        value += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = ~x;
+                y = ~y;
+            }
+            uint32_t swap = x;
+            x = y;
+            y = swap;
+        }
+    }
+    return value;
+}
+
+double FDGeoIndexDistance(int32_t latitude1, int32_t longitude1, int32_t latitude2, int32_t longitude2)
+{
+    double scale = M_PI / 180.0 * 1e-7;
+    double meanLatitude = (latitude1 + (double)latitude2) * 0.5 * scale;
+    double x = (longitude2 - (double)longitude1) * scale * cos(meanLatitude);
+    double y = (latitude2 - (double)latitude1) * scale;
+    return sqrt(x * x + y * y) * FDGeoIndexEarthRadius;
+}
+
+int FDGeoIndexCompareEntries(const void *a, const void *b)
+{
+    const FDGeoIndexEntry *left = a;
+    const FDGeoIndexEntry *right = b;
+    if (left->hilbert != right->hilbert)
+    {
+        return left->hilbert < right->hilbert ? -1 : 1;
+    }
+    if (left->recordingIdentifier != right->recordingIdentifier)
+    {
+        return left->recordingIdentifier < right->recordingIdentifier ? -1 : 1;
+    }
+    return left->streamTime < right->streamTime ? -1 : (left->streamTime > right->streamTime ? 1 : 0);
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDGeoIndex ()
+{
+    NSData *_storage;
+    FDGeoIndexHeader _header;
+    const FDGeoIndexBox *_boxes;
+}
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDGeoIndex
+
+#pragma mark - Lifecycle
+
++ (instancetype)indexWithEntries:(const FDGeoIndexEntry *)entries count:(NSUInteger)count
+{
+    return [self indexWithEntryCount:count fill:^(FDGeoIndexEntry *output) {
+        memcpy(output, entries, count * sizeof(FDGeoIndexEntry));
+        qsort(output, count, sizeof(FDGeoIndexEntry), FDGeoIndexCompareEntries);
+    }];
+}
+
++ (instancetype)indexWithSortedEntries:(const FDGeoIndexEntry *)entries count:(NSUInteger)count
+{
+    return [self indexWithEntryCount:count fill:^(FDGeoIndexEntry *output) {
+        memcpy(output, entries, count * sizeof(FDGeoIndexEntry));
+    }];
+}
+
++ (instancetype)indexByMergingIndexes:(NSArray *)indexes
+{
+    NSUInteger count = 0;
+    for (FDGeoIndex *index in indexes)
+    {
+        count += index.entryCount;
+    }
+
+    return [self indexWithEntryCount:count fill:^(FDGeoIndexEntry *output) {
+        // k-way merge with a binary heap of cursors, the inputs are already sorted.
+        FDGeoIndexCursor *heap = malloc(MAX(indexes.count, (NSUInteger)1) * sizeof(FDGeoIndexCursor));
+        size_t heapCount = 0;
+        for (FDGeoIndex *index in indexes)
+        {
+            if (index.entryCount > 0)
+            {
+                heap[heapCount].position = index.entries;
+                heap[heapCount].end = index.entries + index.entryCount;
+                heapCount++;
+            }
+        }
+        for (size_t i = heapCount / 2; i-- > 0;)
+        {
+            FDGeoIndexSiftDown(heap, heapCount, i);
+        }
+
+        FDGeoIndexEntry *position = output;
+        while (heapCount > 0)
+        {
+            *position++ = *heap[0].position++;
+            if (heap[0].position == heap[0].end)
+            {
+                heap[0] = heap[--heapCount];
+            }
+            FDGeoIndexSiftDown(heap, heapCount, 0);
+        }
+        free(heap);
+    }];
+}
+
++ (instancetype)indexWithContentsOfFile:(NSString *)path error:(NSError **)error
+{
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:error];
+    if (data == nil)
+    {
+        return nil;
+    }
+
+    FDGeoIndexHeader header;
+    BOOL valid = data.length >= sizeof(header);
+    if (valid)
+    {
+        memcpy(&header, data.bytes, sizeof(header));
+        FDGeoIndexHeader expected;
+        size_t boxCount = FDGeoIndexLayout(&expected, header.entryCount);
+        valid = header.magic == FDGeoIndexMagic && header.version == FDGeoIndexVersion &&
+                header.levelCount == expected.levelCount &&
+                memcmp(header.levelCounts, expected.levelCounts, sizeof(header.levelCounts)) == 0 &&
+                data.length == sizeof(header) + header.entryCount * sizeof(FDGeoIndexEntry) + boxCount * sizeof(FDGeoIndexBox);
+    }
+    if (!valid)
+    {
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:@{NSFilePathErrorKey : path}];
+        }
+        return nil;
+    }
+    return [[self alloc] initWithStorage:data];
+}
+
++ (instancetype)indexWithEntryCount:(NSUInteger)count fill:(void (^)(FDGeoIndexEntry *entries))fill
+{
+    FDGeoIndexHeader header;
+    size_t boxCount = FDGeoIndexLayout(&header, count);
+    NSMutableData *data = [NSMutableData dataWithLength:sizeof(header) + count * sizeof(FDGeoIndexEntry) + boxCount * sizeof(FDGeoIndexBox)];
+    if (data == nil)
+    {
+        return nil;
+    }
+
+    uint8_t *bytes = data.mutableBytes;
+    FDGeoIndexEntry *entries = (FDGeoIndexEntry *)(bytes + sizeof(header));
+    memcpy(bytes, &header, sizeof(header));
+    if (count > 0)
+    {
+        fill(entries);
+        FDGeoIndexBuildBoxes(&header, entries, (FDGeoIndexBox *)(entries + count));
+    }
+    return [[self alloc] initWithStorage:data];
+}
+
+- (instancetype)initWithStorage:(NSData *)storage
+{
+    self = [super init];
+    if (self)
+    {
+        _storage = storage;
+        memcpy(&_header, storage.bytes, sizeof(_header));
+        _entries = (const FDGeoIndexEntry *)((const uint8_t *)storage.bytes + sizeof(_header));
+        _boxes = (const FDGeoIndexBox *)(_entries + _header.entryCount);
+        _entryCount = (NSUInteger)_header.entryCount;
+    }
+    return self;
+}
+
+#pragma mark - Instance methods
+
+- (BOOL)writeToFile:(NSString *)path error:(NSError **)error
+{
+    return [_storage writeToFile:path options:NSDataWritingAtomic error:error];
+}
+
+- (void)enumerateEntriesWithinDistance:(double)distance
+                            ofLatitude:(int32_t)latitude
+                             longitude:(int32_t)longitude
+                            usingBlock:(FDGeoIndexBlock)block
+{
+    if (_header.entryCount == 0)
+    {
+        return;
+    }
+
+    // Degrees (1e-7) spanned by distance, widened in longitude towards the poles.
+    double latitudeSpan = distance / (FDGeoIndexEarthRadius * M_PI / 180.0) * 1e7;
+    double longitudeSpan = latitudeSpan / MAX(cos(latitude * 1e-7 * M_PI / 180.0), 1e-6);
+    FDGeoIndexBox query;
+    query.minimumLatitude = (int32_t)MAX(latitude - latitudeSpan - 1, (double)INT32_MIN);
+    query.maximumLatitude = (int32_t)MIN(latitude + latitudeSpan + 1, (double)INT32_MAX);
+    query.minimumLongitude = (int32_t)MAX(longitude - longitudeSpan - 1, (double)INT32_MIN);
+    query.maximumLongitude = (int32_t)MIN(longitude + longitudeSpan + 1, (double)INT32_MAX);
+
+    uint64_t levelOffsets[FDGeoIndexMaximumLevels];
+    uint64_t offset = 0;
+    for (uint32_t level = 1; level < _header.levelCount; level++)
+    {
+        levelOffsets[level] = offset;
+        offset += _header.levelCounts[level];
+    }
+
+    // Depth first; each level pushes at most one node's children.
+    struct
+    {
+        uint32_t level;
+        uint64_t index;
+    } stack[FDGeoIndexMaximumLevels * FDGeoIndexNodeSize];
+    size_t stackCount = 0;
+    stack[stackCount].level = _header.levelCount - 1;
+    stack[stackCount].index = 0;
+    stackCount++;
+
+    BOOL stop = NO;
+    while (stackCount > 0 && !stop)
+    {
+        stackCount--;
+        uint32_t level = stack[stackCount].level;
+        uint64_t index = stack[stackCount].index;
+        if (!FDGeoIndexBoxIntersects(&_boxes[levelOffsets[level] + index], &query))
+        {
+            continue;
+        }
+
+        uint64_t start = index * FDGeoIndexNodeSize;
+        uint64_t end = MIN(start + FDGeoIndexNodeSize, _header.levelCounts[level - 1]);
+        if (level > 1)
+        {
+            for (uint64_t child = end; child-- > start;)
+            {
+                stack[stackCount].level = level - 1;
+                stack[stackCount].index = child;
+                stackCount++;
+            }
+            continue;
+        }
+
+        for (uint64_t i = start; i < end && !stop; i++)
+        {
+            const FDGeoIndexEntry *entry = &_entries[i];
+            if (entry->latitude < query.minimumLatitude || entry->latitude > query.maximumLatitude ||
+                entry->longitude < query.minimumLongitude || entry->longitude > query.maximumLongitude)
+            {
+                continue;
+            }
+            double entryDistance = FDGeoIndexDistance(latitude, longitude, entry->latitude, entry->longitude);
+            if (entryDistance <= distance)
+            {
+                block(entry, entryDistance, &stop);
+            }
+        }
+    }
+}
+
+- (NSUInteger)countOfEntriesWithinDistance:(double)distance ofLatitude:(int32_t)latitude longitude:(int32_t)longitude
+{
+    __block NSUInteger count = 0;
+    [self enumerateEntriesWithinDistance:distance ofLatitude:latitude longitude:longitude usingBlock:^(const FDGeoIndexEntry *entry, double entryDistance, BOOL *stop) {
+        count++;
+    }];
+    return count;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithEntryCount:(NSUInteger)entryCount
+{
+    static NSUInteger const framesPerFlight = 18000;
+    static NSUInteger const queryCount = 10000;
+
+    // Flights as random walks of 30 fps frames at about 10 m/s within 20 km of a home point.
+    FDGeoIndexEntry *entries = malloc(MAX(entryCount, (NSUInteger)1) * sizeof(FDGeoIndexEntry));
+    if (entries == NULL)
+    {
+        return;
+    }
+    srandom(38);
+    int32_t homeLatitude = 487000000;
+    int32_t homeLongitude = 22000000;
+    double latitude = 0;
+    double longitude = 0;
+    double heading = 0;
+    for (NSUInteger i = 0; i < entryCount; i++)
+    {
+        if (i % framesPerFlight == 0)
+        {
+            latitude = homeLatitude + (random() % 3600000) - 1800000;
+            longitude = homeLongitude + (random() % 5400000) - 2700000;
+            heading = random() % 628 / 100.0;
+        }
+        heading += (random() % 200 - 100) / 5000.0;
+        latitude += cos(heading) * 30.0;
+        longitude += sin(heading) * 45.0;
+
+        FDGeoIndexEntry *entry = &entries[i];
+        memset(entry, 0, sizeof(FDGeoIndexEntry));
+        entry->recordingIdentifier = i / framesPerFlight;
+        entry->frameIndex = (uint32_t)(i % framesPerFlight);
+        entry->streamTime = entry->frameIndex * 1000000LL / 30;
+        entry->latitude = (int32_t)latitude;
+        entry->longitude = (int32_t)longitude;
+        entry->hilbert = FDGeoIndexHilbertValue(entry->latitude, entry->longitude);
+    }
+
+    CFTimeInterval start = CACurrentMediaTime();
+    FDGeoIndex *index = [FDGeoIndex indexWithEntries:entries count:entryCount];
+    CFTimeInterval buildTime = CACurrentMediaTime() - start;
+
+    unsigned long long found = 0;
+    start = CACurrentMediaTime();
+    for (NSUInteger i = 0; i < queryCount && entryCount > 0; i++)
+    {
+        // Half the queries land on a flown frame, half anywhere in the area.
+        const FDGeoIndexEntry *target = &entries[random() % entryCount];
+        int32_t queryLatitude = i % 2 == 0 ? target->latitude : homeLatitude + (int32_t)(random() % 3600000) - 1800000;
+        int32_t queryLongitude = i % 2 == 0 ? target->longitude : homeLongitude + (int32_t)(random() % 5400000) - 2700000;
+        found += [index countOfEntriesWithinDistance:50.0 ofLatitude:queryLatitude longitude:queryLongitude];
+    }
+    CFTimeInterval queryTime = CACurrentMediaTime() - start;
+
+    NSLog(@"Geo index of %lu frames: built in %.0f ms, %.1f MB, 50 m queries %.1f us average, %.1f frames per query",
+          (unsigned long)entryCount, buildTime * 1000.0, index->_storage.length / 1048576.0,
+          queryTime * 1e6 / queryCount, found / (double)queryCount);
+    free(entries);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,51 @@
+//
+//  FDGeofence.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+
+typedef struct FDGeofenceVertex
+{
+    double latitude;
+    double longitude;
+} FDGeofenceVertex;
+
+typedef struct FDGeofenceResult
+{
+    // Inside at least one polygon.
+    BOOL inside;
+    // The containing polygon, otherwise the one with the nearest boundary; NSNotFound when none is in range.
+    NSInteger polygonIndex;
+    // Meters to the nearest boundary within the search distance, INFINITY beyond it.
+    float distance;
+} FDGeofenceResult;
+
+
+// Static set of no-fly polygons. Vertices are projected once to local meters
+// around the center of the set, edges are stored as padded structure-of-arrays
+// and tested four at a time with NEON, and a uniform grid of polygon bounding
+// boxes limits each query to the polygons near it. Thread safe.
+@interface FDGeofence : NSObject
+
+@property (nonatomic, assign, readonly) NSUInteger polygonCount;
+@property (nonatomic, assign, readonly) NSUInteger edgeCount;
+
+// polygons holds one NSData of FDGeofenceVertex per polygon, open or closed rings.
+- (instancetype)initWithPolygons:(NSArray *)polygons;
+
+- (FDGeofenceResult)evaluateLatitude:(double)latitude
+                           longitude:(double)longitude
+                     maximumDistance:(float)maximumDistance;
+
+// A polygon the straight leg crosses or lies in, nearest to the start cell first; NSNotFound when clear.
+- (NSInteger)indexOfPolygonIntersectingPathFromLatitude:(double)fromLatitude
+                                              longitude:(double)fromLongitude
+                                             toLatitude:(double)toLatitude
+                                              longitude:(double)toLongitude;
+
+// Random polygons over a 100 km square; logs position and path leg costs.
++ (void)runBenchmarkWithPolygonCount:(NSUInteger)polygonCount;
+
+@end
@@ -0,0 +1,686 @@
+//
+//  FDGeofence.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDGeofence.h"
+#include <pthread.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static double const FDGeofenceEarthRadius = 6371008.8;
+static NSUInteger const FDGeofenceMaximumGridSide = 1024;
+
+// Edges a -> b with e = b - a. Every polygon starts on a multiple of four and is
+// padded with zero length edges at its first vertex, whose inverseLengthSquared is 0.
+typedef struct FDGeofenceEdges
+{
+    float *ax;
+    float *ay;
+    float *bx;
+    float *by;
+    float *ex;
+    float *ey;
+    float *inverseLengthSquared;
+} FDGeofenceEdges;
+
+typedef struct FDGeofencePolygon
+{
+    float minimumX;
+    float minimumY;
+    float maximumX;
+    float maximumY;
+    uint32_t edgeStart;
+    uint32_t edgeCount;
+} FDGeofencePolygon;
+
+
+#pragma mark - Private functions
+
+// Crossing number parity of a ray towards +x.
+static BOOL FDGeofenceContains(const FDGeofenceEdges *edges, uint32_t start, uint32_t count, float px, float py)
+{
+    uint32_t crossings = 0;
+    uint32_t i = start;
+    uint32_t end = start + count;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    float32x4_t x = vdupq_n_f32(px);
+    float32x4_t y = vdupq_n_f32(py);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+    uint32x4_t counts = vdupq_n_u32(0);
+    for (; i + 4 <= end; i += 4)
+    {
+        float32x4_t ay = vld1q_f32(edges->ay + i);
+        uint32x4_t aboveA = vcgtq_f32(ay, y);
+        uint32x4_t aboveB = vcgtq_f32(vld1q_f32(edges->by + i), y);
+        float32x4_t cross = vsubq_f32(vmulq_f32(vld1q_f32(edges->ex + i), vsubq_f32(y, ay)),
+                                      vmulq_f32(vsubq_f32(x, vld1q_f32(edges->ax + i)), vld1q_f32(edges->ey + i)));
+        // The edge straddles the ray and crosses it right of the point.
+        uint32x4_t hit = vandq_u32(veorq_u32(aboveA, aboveB), vmvnq_u32(veorq_u32(vcgtq_f32(cross, zero), aboveB)));
+        counts = vsubq_u32(counts, hit);
+    }
+    uint32x2_t pair = vadd_u32(vget_low_u32(counts), vget_high_u32(counts));
+    crossings = vget_lane_u32(pair, 0) + vget_lane_u32(pair, 1);
+#endif
+    for (; i < end; i++)
+    {
+        BOOL aboveA = edges->ay[i] > py;
+        BOOL aboveB = edges->by[i] > py;
+        float cross = edges->ex[i] * (py - edges->ay[i]) - (px - edges->ax[i]) * edges->ey[i];
+        crossings += aboveA != aboveB && (cross > 0.0f) == aboveB;
+    }
+    return (crossings & 1) != 0;
+}
+
+static float FDGeofenceDistanceSquared(const FDGeofenceEdges *edges, uint32_t start, uint32_t count, float px, float py)
+{
+    float best = INFINITY;
+    uint32_t i = start;
+    uint32_t end = start + count;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    float32x4_t x = vdupq_n_f32(px);
+    float32x4_t y = vdupq_n_f32(py);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+    float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t minimum = vdupq_n_f32(INFINITY);
+    for (; i + 4 <= end; i += 4)
+    {
+        float32x4_t ex = vld1q_f32(edges->ex + i);
+        float32x4_t ey = vld1q_f32(edges->ey + i);
+        float32x4_t dx = vsubq_f32(x, vld1q_f32(edges->ax + i));
+        float32x4_t dy = vsubq_f32(y, vld1q_f32(edges->ay + i));
+        float32x4_t t = vmulq_f32(vmlaq_f32(vmulq_f32(dx, ex), dy, ey), vld1q_f32(edges->inverseLengthSquared + i));
+        t = vminq_f32(vmaxq_f32(t, zero), one);
+        float32x4_t rx = vmlsq_f32(dx, t, ex);
+        float32x4_t ry = vmlsq_f32(dy, t, ey);
+        minimum = vminq_f32(minimum, vmlaq_f32(vmulq_f32(rx, rx), ry, ry));
+    }
+    float32x2_t pair = vpmin_f32(vget_low_f32(minimum), vget_high_f32(minimum));
+    best = vget_lane_f32(vpmin_f32(pair, pair), 0);
+#endif
+    for (; i < end; i++)
+    {
+        float dx = px - edges->ax[i];
+        float dy = py - edges->ay[i];
+        float t = (dx * edges->ex[i] + dy * edges->ey[i]) * edges->inverseLengthSquared[i];
+        t = MIN(MAX(t, 0.0f), 1.0f);
+        float rx = dx - t * edges->ex[i];
+        float ry = dy - t * edges->ey[i];
+        best = MIN(best, rx * rx + ry * ry);
+    }
+    return best;
+}
+
+// Orientation tests of the leg p -> q against every edge; touching counts as crossing.
+static BOOL FDGeofenceIntersects(const FDGeofenceEdges *edges, uint32_t start, uint32_t count,
+                                 float px, float py, float qx, float qy)
+{
+    float sx = qx - px;
+    float sy = qy - py;
+    uint32_t i = start;
+    uint32_t end = start + count;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    float32x4_t vpx = vdupq_n_f32(px);
+    float32x4_t vpy = vdupq_n_f32(py);
+    float32x4_t vqx = vdupq_n_f32(qx);
+    float32x4_t vqy = vdupq_n_f32(qy);
+    float32x4_t vsx = vdupq_n_f32(sx);
+    float32x4_t vsy = vdupq_n_f32(sy);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+    uint32x4_t any = vdupq_n_u32(0);
+    for (; i + 4 <= end; i += 4)
+    {
+        float32x4_t ax = vld1q_f32(edges->ax + i);
+        float32x4_t ay = vld1q_f32(edges->ay + i);
+        float32x4_t ex = vld1q_f32(edges->ex + i);
+        float32x4_t ey = vld1q_f32(edges->ey + i);
+        float32x4_t o1 = vmlsq_f32(vmulq_f32(ex, vsubq_f32(vpy, ay)), ey, vsubq_f32(vpx, ax));
+        float32x4_t o2 = vmlsq_f32(vmulq_f32(ex, vsubq_f32(vqy, ay)), ey, vsubq_f32(vqx, ax));
+        float32x4_t o3 = vmlsq_f32(vmulq_f32(vsx, vsubq_f32(ay, vpy)), vsy, vsubq_f32(ax, vpx));
+        float32x4_t o4 = vmlsq_f32(vmulq_f32(vsx, vsubq_f32(vld1q_f32(edges->by + i), vpy)), vsy, vsubq_f32(vld1q_f32(edges->bx + i), vpx));
+        uint32x4_t hit = vandq_u32(vcleq_f32(vmulq_f32(o1, o2), zero), vcleq_f32(vmulq_f32(o3, o4), zero));
+        any = vorrq_u32(any, vandq_u32(hit, vcgtq_f32(vld1q_f32(edges->inverseLengthSquared + i), zero)));
+    }
+    uint32x2_t pair = vorr_u32(vget_low_u32(any), vget_high_u32(any));
+    if ((vget_lane_u32(pair, 0) | vget_lane_u32(pair, 1)) != 0)
+    {
+        return YES;
+    }
+#endif
+    for (; i < end; i++)
+    {
+        if (edges->inverseLengthSquared[i] <= 0.0f)
+        {
+            continue;
+        }
+        float o1 = edges->ex[i] * (py - edges->ay[i]) - edges->ey[i] * (px - edges->ax[i]);
+        float o2 = edges->ex[i] * (qy - edges->ay[i]) - edges->ey[i] * (qx - edges->ax[i]);
+        float o3 = sx * (edges->ay[i] - py) - sy * (edges->ax[i] - px);
+        float o4 = sx * (edges->by[i] - py) - sy * (edges->bx[i] - px);
+        if (o1 * o2 <= 0.0f && o3 * o4 <= 0.0f)
+        {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+static inline float FDGeofenceBoxDistanceSquared(const FDGeofencePolygon *polygon, float x, float y)
+{
+    float dx = MAX(MAX(polygon->minimumX - x, x - polygon->maximumX), 0.0f);
+    float dy = MAX(MAX(polygon->minimumY - y, y - polygon->maximumY), 0.0f);
+    return dx * dx + dy * dy;
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDGeofence ()
+{
+    pthread_mutex_t _lock;
+    FDGeofenceEdges _edges;
+    FDGeofencePolygon *_polygons;
+
+    double _originLatitude;
+    double _originLongitude;
+    double _metersPerDegreeLatitude;
+    double _metersPerDegreeLongitude;
+
+    // Cells list every polygon whose bounding box overlaps them, in CSR form.
+    float _gridMinimumX;
+    float _gridMinimumY;
+    float _cellSize;
+    int _gridWidth;
+    int _gridHeight;
+    uint32_t *_cellStarts;
+    uint32_t *_cellPolygons;
+
+    // Query stamps so a polygon listed in several cells is tested once, guarded by _lock.
+    uint32_t *_stamps;
+    uint32_t _generation;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) NSUInteger polygonCount;
+@property (nonatomic, assign, readwrite) NSUInteger edgeCount;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDGeofence
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithPolygons:(NSArray *)polygons
+{
+    self = [super init];
+    if (self)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        if (![self projectPolygons:polygons] || ![self buildGrid])
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(_edges.ax);
+    free(_edges.ay);
+    free(_edges.bx);
+    free(_edges.by);
+    free(_edges.ex);
+    free(_edges.ey);
+    free(_edges.inverseLengthSquared);
+    free(_polygons);
+    free(_cellStarts);
+    free(_cellPolygons);
+    free(_stamps);
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Instance methods
+
+- (FDGeofenceResult)evaluateLatitude:(double)latitude
+                           longitude:(double)longitude
+                     maximumDistance:(float)maximumDistance
+{
+    FDGeofenceResult result = {NO, NSNotFound, INFINITY};
+    if (self.polygonCount == 0)
+    {
+        return result;
+    }
+
+    float x = (float)((longitude - _originLongitude) * _metersPerDegreeLongitude);
+    float y = (float)((latitude - _originLatitude) * _metersPerDegreeLatitude);
+    float range = MAX(maximumDistance, 0.0f);
+    int minimumColumn = MAX((int)floorf((x - range - _gridMinimumX) / _cellSize), 0);
+    int maximumColumn = MIN((int)floorf((x + range - _gridMinimumX) / _cellSize), _gridWidth - 1);
+    int minimumRow = MAX((int)floorf((y - range - _gridMinimumY) / _cellSize), 0);
+    int maximumRow = MIN((int)floorf((y + range - _gridMinimumY) / _cellSize), _gridHeight - 1);
+    float bestSquared = range * range;
+
+    pthread_mutex_lock(&_lock);
+    uint32_t generation = [self nextGeneration];
+    for (int row = minimumRow; row <= maximumRow; row++)
+    {
+        for (int column = minimumColumn; column <= maximumColumn; column++)
+        {
+            uint32_t cell = (uint32_t)(row * _gridWidth + column);
+            for (uint32_t i = _cellStarts[cell]; i < _cellStarts[cell + 1]; i++)
+            {
+                uint32_t index = _cellPolygons[i];
+                if (_stamps[index] == generation)
+                {
+                    continue;
+                }
+                _stamps[index] = generation;
+
+                const FDGeofencePolygon *polygon = &_polygons[index];
+                float boxDistanceSquared = FDGeofenceBoxDistanceSquared(polygon, x, y);
+                // Once inside, only other containing polygons matter.
+                if (result.inside ? boxDistanceSquared > 0.0f : boxDistanceSquared > bestSquared)
+                {
+                    continue;
+                }
+                BOOL inside = boxDistanceSquared == 0.0f && FDGeofenceContains(&_edges, polygon->edgeStart, polygon->edgeCount, x, y);
+                if (result.inside && !inside)
+                {
+                    continue;
+                }
+                float distanceSquared = FDGeofenceDistanceSquared(&_edges, polygon->edgeStart, polygon->edgeCount, x, y);
+                if (inside != result.inside || distanceSquared <= bestSquared)
+                {
+                    result.inside = inside;
+                    result.polygonIndex = index;
+                    result.distance = sqrtf(distanceSquared);
+                    bestSquared = distanceSquared;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (!result.inside && result.distance > range)
+    {
+        result.polygonIndex = NSNotFound;
+        result.distance = INFINITY;
+    }
+    return result;
+}
+
+- (NSInteger)indexOfPolygonIntersectingPathFromLatitude:(double)fromLatitude
+                                              longitude:(double)fromLongitude
+                                             toLatitude:(double)toLatitude
+                                              longitude:(double)toLongitude
+{
+    if (self.polygonCount == 0)
+    {
+        return NSNotFound;
+    }
+
+    float px = (float)((fromLongitude - _originLongitude) * _metersPerDegreeLongitude);
+    float py = (float)((fromLatitude - _originLatitude) * _metersPerDegreeLatitude);
+    float qx = (float)((toLongitude - _originLongitude) * _metersPerDegreeLongitude);
+    float qy = (float)((toLatitude - _originLatitude) * _metersPerDegreeLatitude);
+    float minimumX = MIN(px, qx);
+    float maximumX = MAX(px, qx);
+    float minimumY = MIN(py, qy);
+    float maximumY = MAX(py, qy);
+
+    // Walk the cells the leg passes through (Amanatides-Woo).
+    float sx = qx - px;
+    float sy = qy - py;
+    int column = (int)floorf((px - _gridMinimumX) / _cellSize);
+    int row = (int)floorf((py - _gridMinimumY) / _cellSize);
+    int endColumn = (int)floorf((qx - _gridMinimumX) / _cellSize);
+    int endRow = (int)floorf((qy - _gridMinimumY) / _cellSize);
+    int stepColumn = sx > 0 ? 1 : -1;
+    int stepRow = sy > 0 ? 1 : -1;
+    float nextX = _gridMinimumX + (column + (stepColumn > 0 ? 1 : 0)) * _cellSize;
+    float nextY = _gridMinimumY + (row + (stepRow > 0 ? 1 : 0)) * _cellSize;
+    float tMaximumX = sx != 0.0f ? (nextX - px) / sx : INFINITY;
+    float tMaximumY = sy != 0.0f ? (nextY - py) / sy : INFINITY;
+    float tDeltaX = sx != 0.0f ? _cellSize / fabsf(sx) : INFINITY;
+    float tDeltaY = sy != 0.0f ? _cellSize / fabsf(sy) : INFINITY;
+    int steps = abs(endColumn - column) + abs(endRow - row);
+
+    NSInteger found = NSNotFound;
+    pthread_mutex_lock(&_lock);
+    uint32_t generation = [self nextGeneration];
+    for (int step = 0; step <= steps && found == NSNotFound; step++)
+    {
+        if (column >= 0 && column < _gridWidth && row >= 0 && row < _gridHeight)
+        {
+            uint32_t cell = (uint32_t)(row * _gridWidth + column);
+            for (uint32_t i = _cellStarts[cell]; i < _cellStarts[cell + 1]; i++)
+            {
+                uint32_t index = _cellPolygons[i];
+                if (_stamps[index] == generation)
+                {
+                    continue;
+                }
+                _stamps[index] = generation;
+
+                const FDGeofencePolygon *polygon = &_polygons[index];
+                if (polygon->maximumX < minimumX || polygon->minimumX > maximumX ||
+                    polygon->maximumY < minimumY || polygon->minimumY > maximumY)
+                {
+                    continue;
+                }
+                // A leg entirely inside crosses no edge.
+                if (FDGeofenceIntersects(&_edges, polygon->edgeStart, polygon->edgeCount, px, py, qx, qy) ||
+                    (FDGeofenceBoxDistanceSquared(polygon, px, py) == 0.0f &&
+                     FDGeofenceContains(&_edges, polygon->edgeStart, polygon->edgeCount, px, py)))
+                {
+                    found = index;
+                    break;
+                }
+            }
+        }
+
+        if (tMaximumX < tMaximumY)
+        {
+            column += stepColumn;
+            tMaximumX += tDeltaX;
+        }
+        else
+        {
+            row += stepRow;
+            tMaximumY += tDeltaY;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+    return found;
+}
+
+#pragma mark - Private methods
+
+// Called with _lock held.
+- (uint32_t)nextGeneration
+{
+    if (++_generation == 0)
+    {
+        memset(_stamps, 0, self.polygonCount * sizeof(uint32_t));
+        _generation = 1;
+    }
+    return _generation;
+}
+
+- (BOOL)projectPolygons:(NSArray *)polygons
+{
+    double minimumLatitude = INFINITY;
+    double maximumLatitude = -INFINITY;
+    double minimumLongitude = INFINITY;
+    double maximumLongitude = -INFINITY;
+    NSUInteger edgeCapacity = 0;
+    for (NSData *data in polygons)
+    {
+        const FDGeofenceVertex *vertices = data.bytes;
+        NSUInteger count = data.length / sizeof(FDGeofenceVertex);
+        for (NSUInteger i = 0; i < count; i++)
+        {
+            minimumLatitude = MIN(minimumLatitude, vertices[i].latitude);
+            maximumLatitude = MAX(maximumLatitude, vertices[i].latitude);
+            minimumLongitude = MIN(minimumLongitude, vertices[i].longitude);
+            maximumLongitude = MAX(maximumLongitude, vertices[i].longitude);
+        }
+        // Every polygon is padded to whole groups of four edges, an empty one still gets a group.
+        edgeCapacity += MAX((count + 3) & ~(NSUInteger)3, (NSUInteger)4);
+    }
+
+    _originLatitude = isfinite(minimumLatitude) ? (minimumLatitude + maximumLatitude) / 2 : 0.0;
+    _originLongitude = isfinite(minimumLongitude) ? (minimumLongitude + maximumLongitude) / 2 : 0.0;
+    _metersPerDegreeLatitude = FDGeofenceEarthRadius * M_PI / 180.0;
+    _metersPerDegreeLongitude = _metersPerDegreeLatitude * cos(_originLatitude * M_PI / 180.0);
+
+    size_t size = MAX(edgeCapacity, (NSUInteger)1) * sizeof(float);
+    float **arrays[] = {&_edges.ax, &_edges.ay, &_edges.bx, &_edges.by, &_edges.ex, &_edges.ey, &_edges.inverseLengthSquared};
+    BOOL allocated = YES;
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++)
+    {
+        *arrays[i] = malloc(size);
+        allocated = allocated && *arrays[i] != NULL;
+    }
+    _polygons = malloc(MAX(polygons.count, (NSUInteger)1) * sizeof(FDGeofencePolygon));
+    _stamps = calloc(MAX(polygons.count, (NSUInteger)1), sizeof(uint32_t));
+    if (!allocated || _polygons == NULL || _stamps == NULL)
+    {
+        return NO;
+    }
+
+    uint32_t edge = 0;
+    NSUInteger polygonCount = 0;
+    for (NSData *data in polygons)
+    {
+        const FDGeofenceVertex *vertices = data.bytes;
+        NSUInteger count = data.length / sizeof(FDGeofenceVertex);
+        // Closed rings repeat the first vertex.
+        if (count > 1 && vertices[0].latitude == vertices[count - 1].latitude && vertices[0].longitude == vertices[count - 1].longitude)
+        {
+            count--;
+        }
+
+        FDGeofencePolygon *polygon = &_polygons[polygonCount++];
+        polygon->edgeStart = edge;
+        polygon->minimumX = polygon->minimumY = INFINITY;
+        polygon->maximumX = polygon->maximumY = -INFINITY;
+        for (NSUInteger i = 0; i < count; i++)
+        {
+            const FDGeofenceVertex *a = &vertices[i];
+            const FDGeofenceVertex *b = &vertices[(i + 1) % count];
+            _edges.ax[edge] = (float)((a->longitude - _originLongitude) * _metersPerDegreeLongitude);
+            _edges.ay[edge] = (float)((a->latitude - _originLatitude) * _metersPerDegreeLatitude);
+            _edges.bx[edge] = (float)((b->longitude - _originLongitude) * _metersPerDegreeLongitude);
+            _edges.by[edge] = (float)((b->latitude - _originLatitude) * _metersPerDegreeLatitude);
+            _edges.ex[edge] = _edges.bx[edge] - _edges.ax[edge];
+            _edges.ey[edge] = _edges.by[edge] - _edges.ay[edge];
+            float lengthSquared = _edges.ex[edge] * _edges.ex[edge] + _edges.ey[edge] * _edges.ey[edge];
+            _edges.inverseLengthSquared[edge] = lengthSquared > 0.0f ? 1.0f / lengthSquared : 0.0f;
+            polygon->minimumX = MIN(polygon->minimumX, _edges.ax[edge]);
+            polygon->minimumY = MIN(polygon->minimumY, _edges.ay[edge]);
+            polygon->maximumX = MAX(polygon->maximumX, _edges.ax[edge]);
+            polygon->maximumY = MAX(polygon->maximumY, _edges.ay[edge]);
+            edge++;
+        }
+        while ((edge - polygon->edgeStart) % 4 != 0 || (count == 0 && edge == polygon->edgeStart))
+        {
+            float x = count > 0 ? _edges.ax[polygon->edgeStart] : 0.0f;
+            float y = count > 0 ? _edges.ay[polygon->edgeStart] : 0.0f;
+            _edges.ax[edge] = _edges.bx[edge] = x;
+            _edges.ay[edge] = _edges.by[edge] = y;
+            _edges.ex[edge] = _edges.ey[edge] = 0.0f;
+            _edges.inverseLengthSquared[edge] = 0.0f;
+            edge++;
+        }
+        polygon->edgeCount = edge - polygon->edgeStart;
+        if (count == 0)
+        {
+            // Degenerate input keeps its index but is never listed in the grid.
+            polygon->minimumX = polygon->minimumY = INFINITY;
+            polygon->maximumX = polygon->maximumY = -INFINITY;
+        }
+    }
+    self.polygonCount = polygonCount;
+    self.edgeCount = edge;
+    return YES;
+}
+
+- (BOOL)buildGrid
+{
+    float minimumX = INFINITY;
+    float minimumY = INFINITY;
+    float maximumX = -INFINITY;
+    float maximumY = -INFINITY;
+    for (NSUInteger i = 0; i < self.polygonCount; i++)
+    {
+        minimumX = MIN(minimumX, _polygons[i].minimumX);
+        minimumY = MIN(minimumY, _polygons[i].minimumY);
+        maximumX = MAX(maximumX, _polygons[i].maximumX);
+        maximumY = MAX(maximumY, _polygons[i].maximumY);
+    }
+    if (!isfinite(minimumX))
+    {
+        minimumX = minimumY = maximumX = maximumY = 0.0f;
+    }
+
+    // About one polygon per cell, within a bounded grid.
+    float width = MAX(maximumX - minimumX, 1.0f);
+    float height = MAX(maximumY - minimumY, 1.0f);
+    _cellSize = MAX(sqrtf(width * height / MAX(self.polygonCount, (NSUInteger)1)), MAX(width, height) / FDGeofenceMaximumGridSide);
+    _gridMinimumX = minimumX;
+    _gridMinimumY = minimumY;
+    _gridWidth = MIN((int)(width / _cellSize), (int)FDGeofenceMaximumGridSide) + 1;
+    _gridHeight = MIN((int)(height / _cellSize), (int)FDGeofenceMaximumGridSide) + 1;
+
+    uint32_t cellCount = (uint32_t)(_gridWidth * _gridHeight);
+    _cellStarts = calloc(cellCount + 1, sizeof(uint32_t));
+    if (_cellStarts == NULL)
+    {
+        return NO;
+    }
+
+    // Count, prefix sum, then fill, so each cell's polygons are contiguous.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (uint32_t index = 0; index < self.polygonCount; index++)
+        {
+            const FDGeofencePolygon *polygon = &_polygons[index];
+            if (!isfinite(polygon->minimumX))
+            {
+                continue;
+            }
+            int minimumColumn = MAX((int)floorf((polygon->minimumX - _gridMinimumX) / _cellSize), 0);
+            int maximumColumn = MIN((int)floorf((polygon->maximumX - _gridMinimumX) / _cellSize), _gridWidth - 1);
+            int minimumRow = MAX((int)floorf((polygon->minimumY - _gridMinimumY) / _cellSize), 0);
+            int maximumRow = MIN((int)floorf((polygon->maximumY - _gridMinimumY) / _cellSize), _gridHeight - 1);
+            for (int row = minimumRow; row <= maximumRow; row++)
+            {
+                for (int column = minimumColumn; column <= maximumColumn; column++)
+                {
+                    uint32_t cell = (uint32_t)(row * _gridWidth + column);
+                    if (pass == 0)
+                    {
+                        _cellStarts[cell + 1]++;
+                    }
+                    else
+                    {
+                        _cellPolygons[_cellStarts[cell]++] = index;
+                    }
+                }
+            }
+        }
+
+        if (pass == 0)
+        {
+            for (uint32_t cell = 0; cell < cellCount; cell++)
+            {
+                _cellStarts[cell + 1] += _cellStarts[cell];
+            }
+            _cellPolygons = malloc(MAX(_cellStarts[cellCount], 1U) * sizeof(uint32_t));
+            if (_cellPolygons == NULL)
+            {
+                return NO;
+            }
+        }
+        else
+        {
+            // The fill advanced every start to the next cell's start.
+            memmove(_cellStarts + 1, _cellStarts, cellCount * sizeof(uint32_t));
+            _cellStarts[0] = 0;
+        }
+    }
+    return YES;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithPolygonCount:(NSUInteger)polygonCount
+{
+    static NSUInteger const positionCount = 200000;
+    static NSUInteger const legCount = 50000;
+    static float const searchDistance = 500.0f;
+
+    srandom(40);
+    double centerLatitude = 48.7;
+    double centerLongitude = 2.2;
+    double latitudeSpan = 100000.0 / (FDGeofenceEarthRadius * M_PI / 180.0);
+    double longitudeSpan = latitudeSpan / cos(centerLatitude * M_PI / 180.0);
+
+    NSMutableArray *polygons = [NSMutableArray arrayWithCapacity:polygonCount];
+    for (NSUInteger i = 0; i < polygonCount; i++)
+    {
+        // Star shaped polygons of 6 to 32 vertices and 50 to 400 m radius.
+        int count = 6 + (int)(random() % 27);
+        double radius = 50.0 + random() % 350;
+        double latitude = centerLatitude + latitudeSpan * (random() / (double)RAND_MAX - 0.5);
+        double longitude = centerLongitude + longitudeSpan * (random() / (double)RAND_MAX - 0.5);
+        NSMutableData *data = [NSMutableData dataWithLength:count * sizeof(FDGeofenceVertex)];
+        FDGeofenceVertex *vertices = data.mutableBytes;
+        for (int j = 0; j < count; j++)
+        {
+            double angle = 2.0 * M_PI * j / count;
+            double distance = radius * (0.5 + 0.5 * random() / (double)RAND_MAX);
+            vertices[j].latitude = latitude + distance * sin(angle) / 111195.0;
+            vertices[j].longitude = longitude + distance * cos(angle) / (111195.0 * cos(latitude * M_PI / 180.0));
+        }
+        [polygons addObject:data];
+    }
+
+    CFTimeInterval start = CACurrentMediaTime();
+    FDGeofence *geofence = [[FDGeofence alloc] initWithPolygons:polygons];
+    CFTimeInterval buildTime = CACurrentMediaTime() - start;
+
+    // A 15 m/s flight sampled at 50 Hz, wrapping at the edges of the area.
+    double latitude = centerLatitude;
+    double longitude = centerLongitude;
+    double heading = 0;
+    NSUInteger insideCount = 0;
+    start = CACurrentMediaTime();
+    for (NSUInteger i = 0; i < positionCount; i++)
+    {
+        heading += (random() % 200 - 100) / 2000.0;
+        latitude += 0.3 * sin(heading) / 111195.0;
+        longitude += 0.3 * cos(heading) / 73000.0;
+        if (fabs(latitude - centerLatitude) > latitudeSpan / 2 || fabs(longitude - centerLongitude) > longitudeSpan / 2)
+        {
+            latitude = centerLatitude;
+            longitude = centerLongitude;
+        }
+        insideCount += [geofence evaluateLatitude:latitude longitude:longitude maximumDistance:searchDistance].inside ? 1 : 0;
+    }
+    CFTimeInterval positionTime = (CACurrentMediaTime() - start) / positionCount;
+
+    NSUInteger blockedCount = 0;
+    start = CACurrentMediaTime();
+    for (NSUInteger i = 0; i < legCount; i++)
+    {
+        double fromLatitude = centerLatitude + latitudeSpan * (random() / (double)RAND_MAX - 0.5);
+        double fromLongitude = centerLongitude + longitudeSpan * (random() / (double)RAND_MAX - 0.5);
+        double length = 50.0 + random() % 1950;
+        double angle = random() % 628 / 100.0;
+        double toLatitude = fromLatitude + length * sin(angle) / 111195.0;
+        double toLongitude = fromLongitude + length * cos(angle) / 73000.0;
+        blockedCount += [geofence indexOfPolygonIntersectingPathFromLatitude:fromLatitude longitude:fromLongitude
+                                                                  toLatitude:toLatitude longitude:toLongitude] != NSNotFound ? 1 : 0;
+    }
+    CFTimeInterval legTime = (CACurrentMediaTime() - start) / legCount;
+
+    NSLog(@"Geofence of %lu polygons (%lu edges): built in %.1f ms, position %.2f us (%.4f%% of a core at 50 Hz, %lu inside), path leg %.2f us (%lu blocked)",
+          (unsigned long)geofence.polygonCount, (unsigned long)geofence.edgeCount, buildTime * 1000.0,
+          positionTime * 1e6, positionTime * 50 * 100, (unsigned long)insideCount,
+          legTime * 1e6, (unsigned long)blockedCount);
+}
+
+#pragma mark -
+
+@end
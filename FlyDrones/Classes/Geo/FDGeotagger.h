@@ -0,0 +1,55 @@
+//
+//  FDGeotagger.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDGeoIndex.h"
+#import "FDMAVLinkParser.h"
+
+
+// Tags the frames of one recording with position and attitude interpolated from
+// GLOBAL_POSITION_INT and ATTITUDE, and builds the recording's geo index while it
+// records: tags are sorted into small runs as they arrive and runs are merged as
+// they pile up, so finishing is a single linear merge. Thread safe.
+@interface FDGeotagger : NSObject
+
+@property (nonatomic, assign, readonly) uint64_t recordingIdentifier;
+// Tags only keyframes, which keeps months of footage in a small global index.
+@property (nonatomic, assign) BOOL keyframesOnly;
+// Frames further than this from the nearest telemetry sample stay untagged, 1 s by default.
+@property (nonatomic, assign) NSTimeInterval maximumTelemetryGap;
+@property (nonatomic, assign, readonly) NSUInteger taggedFrameCount;
+
+- (instancetype)initWithRecordingIdentifier:(uint64_t)recordingIdentifier;
+
+// Feed from FDTelemetryStore's messageObserver for the duration of the recording;
+// the parser keeps a single handler per message, which belongs to the store.
+- (void)appendMessage:(const FDMAVLinkMessage *)message;
+
+// bootTime is the frame time on the autopilot clock in milliseconds, as mapped by
+// FDTelemetrySynchronizer. Returns NO for frames that could not be tagged.
+- (BOOL)tagFrameAtStreamTime:(NSTimeInterval)streamTime bootTime:(int64_t)bootTime keyframe:(BOOL)keyframe;
+
+// Index of everything tagged so far; tagging may continue afterwards.
+- (FDGeoIndex *)index;
+
+@end
+
+
+// Per-recording geo indexes in a directory plus the global index merged from
+// them. Adding a recording merges its index into the global one in linear time.
+// Thread safe.
+@interface FDGeoLibrary : NSObject
+
+@property (nonatomic, copy, readonly) NSString *directory;
+@property (nonatomic, strong, readonly) FDGeoIndex *globalIndex;
+
+- (instancetype)initWithDirectory:(NSString *)directory error:(NSError **)error;
+
+- (BOOL)addIndex:(FDGeoIndex *)index forRecordingWithIdentifier:(uint64_t)recordingIdentifier error:(NSError **)error;
+// Rebuilds the global index from the remaining recordings.
+- (BOOL)removeRecordingWithIdentifier:(uint64_t)recordingIdentifier error:(NSError **)error;
+
+@end
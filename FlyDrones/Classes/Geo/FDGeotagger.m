@@ -0,0 +1,430 @@
+//
+//  FDGeotagger.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDGeotagger.h"
+#include <pthread.h>
+
+
+// Telemetry samples kept for interpolation, several seconds at usual stream rates.
+#define FDGeotaggerSampleCapacity 64
+static NSUInteger const FDGeotaggerRunLength = 1024;
+// Sealed runs merged into one once this many pile up.
+static NSUInteger const FDGeotaggerMaximumRuns = 16;
+static NSTimeInterval const FDGeotaggerDefaultMaximumTelemetryGap = 1.0;
+// time_boot_ms jumping back this far means the autopilot rebooted.
+static int64_t const FDGeotaggerRebootThreshold = 1000;
+
+static NSString * const FDGeoLibraryGlobalIndexName = @"global.geoidx";
+static NSString * const FDGeoLibraryRecordingPrefix = @"recording-";
+static NSString * const FDGeoLibraryExtension = @"geoidx";
+
+typedef struct FDGeotaggerSample
+{
+    int64_t time;
+    double values[3];
+} FDGeotaggerSample;
+
+typedef struct FDGeotaggerHistory
+{
+    FDGeotaggerSample samples[FDGeotaggerSampleCapacity];
+    NSUInteger next;
+    NSUInteger count;
+} FDGeotaggerHistory;
+
+
+#pragma mark - Private functions
+
+static void FDGeotaggerHistoryAppend(FDGeotaggerHistory *history, int64_t time, double a, double b, double c)
+{
+    if (history->count > 0)
+    {
+        const FDGeotaggerSample *newest = &history->samples[(history->next + FDGeotaggerSampleCapacity - 1) % FDGeotaggerSampleCapacity];
+        if (time + FDGeotaggerRebootThreshold < newest->time)
+        {
+            // New boot clock: the old samples can no longer bracket any frame.
+            history->next = 0;
+            history->count = 0;
+        }
+        else if (time < newest->time)
+        {
+            // Reordered or stale datagram.
+            return;
+        }
+    }
+    FDGeotaggerSample *sample = &history->samples[history->next];
+    sample->time = time;
+    sample->values[0] = a;
+    sample->values[1] = b;
+    sample->values[2] = c;
+    history->next = (history->next + 1) % FDGeotaggerSampleCapacity;
+    history->count = MIN(history->count + 1, (NSUInteger)FDGeotaggerSampleCapacity);
+}
+
+// Linear interpolation between the samples around time. angular marks values that
+// wrap at 2 pi. Holds the nearest sample within maximumGap past either end.
+static BOOL FDGeotaggerHistoryInterpolate(const FDGeotaggerHistory *history,
+                                          int64_t time,
+                                          int64_t maximumGap,
+                                          BOOL angular,
+                                          double *values)
+{
+    // Frames trail telemetry, so search from the newest sample backwards.
+    for (NSUInteger age = 0; age < history->count; age++)
+    {
+        NSUInteger index = (history->next + FDGeotaggerSampleCapacity - 1 - age) % FDGeotaggerSampleCapacity;
+        const FDGeotaggerSample *before = &history->samples[index];
+        if (before->time > time)
+        {
+            if (age + 1 == history->count && before->time - time <= maximumGap)
+            {
+                memcpy(values, before->values, sizeof(before->values));
+                return YES;
+            }
+            continue;
+        }
+
+        if (age == 0)
+        {
+            if (time - before->time > maximumGap)
+            {
+                return NO;
+            }
+            memcpy(values, before->values, sizeof(before->values));
+            return YES;
+        }
+
+        const FDGeotaggerSample *after = &history->samples[(index + 1) % FDGeotaggerSampleCapacity];
+        if (time - before->time > maximumGap && after->time - time > maximumGap)
+        {
+            return NO;
+        }
+        double fraction = after->time > before->time ? (double)(time - before->time) / (after->time - before->time) : 0.0;
+        for (int i = 0; i < 3; i++)
+        {
+            double delta = after->values[i] - before->values[i];
+            if (angular)
+            {
+                delta = remainder(delta, 2.0 * M_PI);
+            }
+            values[i] = before->values[i] + delta * fraction;
+        }
+        return YES;
+    }
+    return NO;
+}
+
+static inline int16_t FDGeotaggerPackAngle(double angle)
+{
+    return (int16_t)lrint(remainder(angle, 2.0 * M_PI) * 10000.0);
+}
+
+
+
+#pragma mark - Private interface methods
+
+@interface FDGeotagger ()
+{
+    pthread_mutex_t _lock;
+    FDGeotaggerHistory _positions;
+    FDGeotaggerHistory _attitudes;
+    uint32_t _frameIndex;
+
+    FDGeoIndexEntry _run[FDGeotaggerRunLength];
+    NSUInteger _runCount;
+    NSMutableArray *_sealedRuns;
+    BOOL _merging;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) uint64_t recordingIdentifier;
+@property (nonatomic, assign, readwrite) NSUInteger taggedFrameCount;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDGeotagger
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithRecordingIdentifier:(uint64_t)recordingIdentifier
+{
+    self = [super init];
+    if (self)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        _recordingIdentifier = recordingIdentifier;
+        _maximumTelemetryGap = FDGeotaggerDefaultMaximumTelemetryGap;
+        _sealedRuns = [NSMutableArray array];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Instance methods
+
+- (void)appendMessage:(const FDMAVLinkMessage *)message
+{
+    pthread_mutex_lock(&_lock);
+    switch (message->messageID)
+    {
+        case FDMAVLinkMessageIDGlobalPositionInt:
+        {
+            FDGeotaggerHistoryAppend(&_positions, FDMAVLinkReadUInt32(message, 0),
+                                     FDMAVLinkReadInt32(message, 4), FDMAVLinkReadInt32(message, 8), FDMAVLinkReadInt32(message, 12));
+            break;
+        }
+        case FDMAVLinkMessageIDAttitude:
+        {
+            FDGeotaggerHistoryAppend(&_attitudes, FDMAVLinkReadUInt32(message, 0),
+                                     FDMAVLinkReadFloat(message, 4), FDMAVLinkReadFloat(message, 8), FDMAVLinkReadFloat(message, 12));
+            break;
+        }
+        default:
+            break;
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (BOOL)tagFrameAtStreamTime:(NSTimeInterval)streamTime bootTime:(int64_t)bootTime keyframe:(BOOL)keyframe
+{
+    pthread_mutex_lock(&_lock);
+    uint32_t frameIndex = _frameIndex++;
+    if (self.keyframesOnly && !keyframe)
+    {
+        pthread_mutex_unlock(&_lock);
+        return NO;
+    }
+
+    int64_t maximumGap = (int64_t)(self.maximumTelemetryGap * 1000.0);
+    double position[3];
+    double attitude[3];
+    if (!FDGeotaggerHistoryInterpolate(&_positions, bootTime, maximumGap, NO, position))
+    {
+        pthread_mutex_unlock(&_lock);
+        return NO;
+    }
+    if (!FDGeotaggerHistoryInterpolate(&_attitudes, bootTime, maximumGap, YES, attitude))
+    {
+        memset(attitude, 0, sizeof(attitude));
+    }
+
+    FDGeoIndexEntry *entry = &_run[_runCount++];
+    entry->recordingIdentifier = _recordingIdentifier;
+    entry->streamTime = (int64_t)llround(streamTime * 1e6);
+    entry->latitude = (int32_t)lround(position[0]);
+    entry->longitude = (int32_t)lround(position[1]);
+    entry->altitude = (int32_t)lround(position[2]);
+    entry->frameIndex = frameIndex;
+    entry->roll = FDGeotaggerPackAngle(attitude[0]);
+    entry->pitch = FDGeotaggerPackAngle(attitude[1]);
+    entry->yaw = FDGeotaggerPackAngle(attitude[2]);
+    entry->flags = keyframe ? FDGeoIndexEntryFlagKeyframe : 0;
+    entry->hilbert = FDGeoIndexHilbertValue(entry->latitude, entry->longitude);
+    _taggedFrameCount++;
+
+    if (_runCount == FDGeotaggerRunLength)
+    {
+        [self sealRun];
+    }
+    NSArray *runs = nil;
+    if (!_merging && _sealedRuns.count >= FDGeotaggerMaximumRuns)
+    {
+        runs = [_sealedRuns copy];
+        _merging = YES;
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (runs != nil)
+    {
+        [self mergeRuns:runs];
+    }
+    return YES;
+}
+
+- (FDGeoIndex *)index
+{
+    pthread_mutex_lock(&_lock);
+    [self sealRun];
+    NSArray *runs = [_sealedRuns copy];
+    pthread_mutex_unlock(&_lock);
+    return runs.count == 1 ? runs.firstObject : [FDGeoIndex indexByMergingIndexes:runs];
+}
+
+#pragma mark - Private methods
+
+// Called with _lock held.
+- (void)sealRun
+{
+    if (_runCount == 0)
+    {
+        return;
+    }
+    [_sealedRuns addObject:[FDGeoIndex indexWithEntries:_run count:_runCount]];
+    _runCount = 0;
+}
+
+// Merges outside _lock so telemetry keeps flowing; runs sealed meanwhile are
+// appended after the merged prefix and left for the next merge.
+- (void)mergeRuns:(NSArray *)runs
+{
+    FDGeoIndex *merged = [FDGeoIndex indexByMergingIndexes:runs];
+    pthread_mutex_lock(&_lock);
+    [_sealedRuns replaceObjectsInRange:NSMakeRange(0, runs.count) withObjectsFromArray:@[merged]];
+    _merging = NO;
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark -
+
+@end
+
+
+#pragma mark - FDGeoLibrary
+
+@interface FDGeoLibrary ()
+{
+    pthread_mutex_t _lock;
+}
+
+@property (nonatomic, copy, readwrite) NSString *directory;
+@property (nonatomic, strong, readwrite) FDGeoIndex *globalIndex;
+
+@end
+
+@implementation FDGeoLibrary
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithDirectory:(NSString *)directory error:(NSError **)error
+{
+    self = [super init];
+    if (self)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        _directory = [directory copy];
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:error])
+        {
+            return nil;
+        }
+
+        _globalIndex = [FDGeoIndex indexWithContentsOfFile:[self globalIndexPath] error:NULL];
+        if (_globalIndex == nil && ![self rebuildGlobalIndex:error])
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Instance methods
+
+- (FDGeoIndex *)globalIndex
+{
+    pthread_mutex_lock(&_lock);
+    FDGeoIndex *index = _globalIndex;
+    pthread_mutex_unlock(&_lock);
+    return index;
+}
+
+- (BOOL)addIndex:(FDGeoIndex *)index forRecordingWithIdentifier:(uint64_t)recordingIdentifier error:(NSError **)error
+{
+    pthread_mutex_lock(&_lock);
+    NSString *path = [self pathForRecordingWithIdentifier:recordingIdentifier];
+    BOOL replacing = [[NSFileManager defaultManager] fileExistsAtPath:path];
+    BOOL success = [index writeToFile:path error:error];
+    if (success && replacing)
+    {
+        success = [self rebuildGlobalIndex:error];
+    }
+    else if (success)
+    {
+        FDGeoIndex *merged = [FDGeoIndex indexByMergingIndexes:@[_globalIndex, index]];
+        success = [merged writeToFile:[self globalIndexPath] error:error];
+        if (success)
+        {
+            _globalIndex = merged;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+    return success;
+}
+
+- (BOOL)removeRecordingWithIdentifier:(uint64_t)recordingIdentifier error:(NSError **)error
+{
+    pthread_mutex_lock(&_lock);
+    NSString *path = [self pathForRecordingWithIdentifier:recordingIdentifier];
+    BOOL success = YES;
+    if ([[NSFileManager defaultManager] fileExistsAtPath:path])
+    {
+        success = [[NSFileManager defaultManager] removeItemAtPath:path error:error] && [self rebuildGlobalIndex:error];
+    }
+    pthread_mutex_unlock(&_lock);
+    return success;
+}
+
+#pragma mark - Private methods
+
+- (NSString *)globalIndexPath
+{
+    return [self.directory stringByAppendingPathComponent:FDGeoLibraryGlobalIndexName];
+}
+
+- (NSString *)pathForRecordingWithIdentifier:(uint64_t)recordingIdentifier
+{
+    NSString *name = [NSString stringWithFormat:@"%@%llu.%@", FDGeoLibraryRecordingPrefix, recordingIdentifier, FDGeoLibraryExtension];
+    return [self.directory stringByAppendingPathComponent:name];
+}
+
+- (BOOL)rebuildGlobalIndex:(NSError **)error
+{
+    NSArray *names = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:self.directory error:error];
+    if (names == nil)
+    {
+        return NO;
+    }
+
+    NSMutableArray *indexes = [NSMutableArray array];
+    for (NSString *name in names)
+    {
+        if (![name hasPrefix:FDGeoLibraryRecordingPrefix] || ![name.pathExtension isEqualToString:FDGeoLibraryExtension])
+        {
+            continue;
+        }
+        NSError *loadError = nil;
+        FDGeoIndex *index = [FDGeoIndex indexWithContentsOfFile:[self.directory stringByAppendingPathComponent:name] error:&loadError];
+        if (index == nil)
+        {
+            NSLog(@"Skipping geo index %@: %@", name, loadError);
+            continue;
+        }
+        [indexes addObject:index];
+    }
+
+    FDGeoIndex *merged = [FDGeoIndex indexByMergingIndexes:indexes];
+    if (![merged writeToFile:[self globalIndexPath] error:error])
+    {
+        return NO;
+    }
+    _globalIndex = merged;
+    return YES;
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,72 @@
+//
+//  FDReplaySimulator.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+
+// One virtual drone. Either path may be nil to replay only the other stream.
+@interface FDReplayDrone : NSObject
+
+// H.264 recording, sent as Annex B access units split into datagrams.
+@property (nonatomic, copy) NSString *videoPath;
+// MAVLink .tlog, sent one frame per datagram as a drone would.
+@property (nonatomic, copy) NSString *telemetryPath;
+// "127.0.0.1" by default.
+@property (nonatomic, copy) NSString *host;
+@property (nonatomic, assign) uint16_t videoPort;
+@property (nonatomic, assign) uint16_t telemetryPort;
+// Telemetry starts this much after the first video frame, negative values delay the video.
+@property (nonatomic, assign) NSTimeInterval telemetryOffset;
+
+// count drones replaying the same recordings to consecutive port pairs.
++ (NSArray *)dronesWithVideoPath:(NSString *)videoPath
+                   telemetryPath:(NSString *)telemetryPath
+                           count:(NSUInteger)count
+                       videoPort:(uint16_t)videoPort
+                   telemetryPort:(uint16_t)telemetryPort;
+
+@end
+
+
+@interface FDReplayStatistics : NSObject
+
+@property (nonatomic, assign, readonly) unsigned long long videoDatagrams;
+@property (nonatomic, assign, readonly) unsigned long long videoBytes;
+@property (nonatomic, assign, readonly) unsigned long long telemetryDatagrams;
+@property (nonatomic, assign, readonly) unsigned long long telemetryBytes;
+@property (nonatomic, assign, readonly) unsigned long long sendErrors;
+// How far behind the recorded schedule sends went out, a measure of timing fidelity.
+@property (nonatomic, assign, readonly) NSTimeInterval averageLateness;
+@property (nonatomic, assign, readonly) NSTimeInterval maximumLateness;
+@property (nonatomic, assign, readonly) NSTimeInterval elapsedTime;
+
+@end
+
+
+// Re-emits recorded video and telemetry over UDP following the recorded
+// timestamps, so the ingest path can be profiled without flying. Every stream
+// of every drone runs on its own queue against a shared start time, which keeps
+// runs repeatable: the same recordings always produce the same datagrams in the
+// same order at the same offsets.
+@interface FDReplaySimulator : NSObject
+
+@property (nonatomic, copy, readonly) NSArray *drones;
+// Playback rate, 1.0 replays in real time and 0 sends as fast as possible.
+@property (nonatomic, assign) double speed;
+// 1400 bytes by default.
+@property (nonatomic, assign) NSUInteger maximumDatagramSize;
+@property (atomic, assign, readonly, getter=isCancelled) BOOL cancelled;
+
+- (instancetype)initWithDrones:(NSArray *)drones;
+
+// Opens every recording and socket up front, so configuration errors surface here.
+- (BOOL)startWithError:(NSError **)error;
+- (void)cancel;
+// Blocks until every stream has been replayed or cancelled.
+- (void)waitUntilFinished;
+
+- (FDReplayStatistics *)statistics;
+
+@end
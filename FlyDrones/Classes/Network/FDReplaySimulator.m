@@ -0,0 +1,587 @@
+//
+//  FDReplaySimulator.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDReplaySimulator.h"
+#import "FDFFmpegUtils.h"
+#import "FDH264Utils.h"
+#import "FDTelemetryLog.h"
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+
+static NSUInteger const FDReplaySimulatorDefaultDatagramSize = 1400;
+// Every stream starts this long after start so the queues begin together.
+static NSTimeInterval const FDReplaySimulatorStartDelay = 0.1;
+// Upper bound of one sleep, keeps cancellation responsive.
+static NSTimeInterval const FDReplaySimulatorMaximumSleep = 0.05;
+static NSUInteger const FDReplaySimulatorSendRetries = 100;
+
+typedef struct FDReplayCounters
+{
+    unsigned long long datagrams;
+    unsigned long long bytes;
+    unsigned long long errors;
+    unsigned long long sends;
+    NSTimeInterval totalLateness;
+    NSTimeInterval maximumLateness;
+} FDReplayCounters;
+
+
+#pragma mark - Private functions
+
+static int FDReplayOpenSocket(NSString *host, uint16_t port, NSError **error)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+
+    struct addrinfo *addresses = NULL;
+    int result = getaddrinfo(host.UTF8String, service, &hints, &addresses);
+    if (result != 0)
+    {
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain
+                                         code:EADDRNOTAVAIL
+                                     userInfo:@{NSLocalizedDescriptionKey : [NSString stringWithFormat:@"Unable to resolve %@: %s", host, gai_strerror(result)]}];
+        }
+        return -1;
+    }
+
+    int descriptor = -1;
+    int code = 0;
+    for (struct addrinfo *address = addresses; address != NULL && descriptor < 0; address = address->ai_next)
+    {
+        descriptor = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (descriptor >= 0 && connect(descriptor, address->ai_addr, address->ai_addrlen) != 0)
+        {
+            code = errno;
+            close(descriptor);
+            descriptor = -1;
+        }
+        else if (descriptor < 0)
+        {
+            code = errno;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (descriptor < 0)
+    {
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain
+                                         code:code
+                                     userInfo:@{NSLocalizedDescriptionKey : [NSString stringWithFormat:@"Unable to connect to %@:%u", host, port]}];
+        }
+        return -1;
+    }
+
+    // A keyframe goes out as one burst of datagrams.
+    int bufferSize = 1 << 20;
+    setsockopt(descriptor, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    return descriptor;
+}
+
+
+#pragma mark - FDReplayDrone
+
+@implementation FDReplayDrone
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _host = @"127.0.0.1";
+    }
+    return self;
+}
+
++ (NSArray *)dronesWithVideoPath:(NSString *)videoPath
+                   telemetryPath:(NSString *)telemetryPath
+                           count:(NSUInteger)count
+                       videoPort:(uint16_t)videoPort
+                   telemetryPort:(uint16_t)telemetryPort
+{
+    NSMutableArray *drones = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        FDReplayDrone *drone = [[FDReplayDrone alloc] init];
+        drone.videoPath = videoPath;
+        drone.telemetryPath = telemetryPath;
+        drone.videoPort = (uint16_t)(videoPort + i);
+        drone.telemetryPort = (uint16_t)(telemetryPort + i);
+        [drones addObject:drone];
+    }
+    return drones;
+}
+
+@end
+
+
+#pragma mark - FDReplayStatistics
+
+@interface FDReplayStatistics ()
+
+@property (nonatomic, assign, readwrite) unsigned long long videoDatagrams;
+@property (nonatomic, assign, readwrite) unsigned long long videoBytes;
+@property (nonatomic, assign, readwrite) unsigned long long telemetryDatagrams;
+@property (nonatomic, assign, readwrite) unsigned long long telemetryBytes;
+@property (nonatomic, assign, readwrite) unsigned long long sendErrors;
+@property (nonatomic, assign, readwrite) NSTimeInterval averageLateness;
+@property (nonatomic, assign, readwrite) NSTimeInterval maximumLateness;
+@property (nonatomic, assign, readwrite) NSTimeInterval elapsedTime;
+
+@end
+
+@implementation FDReplayStatistics
+
+@end
+
+
+#pragma mark - Private interface methods
+
+@interface FDReplaySimulator ()
+{
+    pthread_mutex_t _lock;
+    dispatch_group_t _group;
+    NSArray *_streams;
+    CFTimeInterval _startTime;
+    CFTimeInterval _finishTime;
+
+    // Guarded by _lock.
+    FDReplayCounters _videoCounters;
+    FDReplayCounters _telemetryCounters;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, copy, readwrite) NSArray *drones;
+@property (atomic, assign, readwrite, getter=isCancelled) BOOL cancelled;
+
+- (void)recordDatagrams:(NSUInteger)datagrams
+                  bytes:(NSUInteger)bytes
+                 errors:(NSUInteger)errors
+               lateness:(NSTimeInterval)lateness
+                  video:(BOOL)video;
+
+@end
+
+
+#pragma mark - FDReplayStream
+
+// One recording replayed to one socket.
+@interface FDReplayStream : NSObject
+{
+    int _socket;
+    NSTimeInterval _offset;
+    NSUInteger _datagramSize;
+
+    AVFormatContext *_format;
+    int _streamIndex;
+    AVBitStreamFilterContext *_filter;
+
+    FDTelemetryLog *_log;
+
+    // Set for the duration of replayWithSimulator:.
+    __weak FDReplaySimulator *_simulator;
+    CFTimeInterval _startTime;
+    double _speed;
+}
+
+@end
+
+@implementation FDReplayStream
+
+- (instancetype)initWithVideoPath:(NSString *)path
+                             host:(NSString *)host
+                             port:(uint16_t)port
+                           offset:(NSTimeInterval)offset
+                            error:(NSError **)error
+{
+    self = [super init];
+    if (self)
+    {
+        _offset = offset;
+        _socket = -1;
+        int result = avformat_open_input(&_format, path.fileSystemRepresentation, NULL, NULL);
+        if (result >= 0)
+        {
+            result = avformat_find_stream_info(_format, NULL);
+        }
+        if (result >= 0)
+        {
+            result = av_find_best_stream(_format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        }
+        if (result < 0)
+        {
+            if (error != NULL)
+            {
+                *error = FDFFmpegError(result, [NSString stringWithFormat:@"Unable to open %@", path.lastPathComponent]);
+            }
+            return nil;
+        }
+        _streamIndex = result;
+
+        // Containers store length prefixed NALs, the wire carries start codes.
+        AVCodecContext *codec = _format->streams[_streamIndex]->codec;
+        if (FDH264NALLengthSize(codec->extradata, codec->extradata_size) > 0)
+        {
+            _filter = av_bitstream_filter_init("h264_mp4toannexb");
+            if (_filter == NULL)
+            {
+                if (error != NULL)
+                {
+                    *error = FDFFmpegError(AVERROR_BSF_NOT_FOUND, @"Unable to convert to Annex B");
+                }
+                return nil;
+            }
+        }
+
+        _socket = FDReplayOpenSocket(host, port, error);
+        if (_socket < 0)
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (instancetype)initWithTelemetryPath:(NSString *)path
+                                 host:(NSString *)host
+                                 port:(uint16_t)port
+                               offset:(NSTimeInterval)offset
+                                error:(NSError **)error
+{
+    self = [super init];
+    if (self)
+    {
+        _offset = offset;
+        _socket = -1;
+        _log = [FDTelemetryLog logWithContentsOfFile:path indexDirectory:[FDTelemetryLog defaultIndexDirectory] error:error];
+        if (_log == nil)
+        {
+            return nil;
+        }
+        _socket = FDReplayOpenSocket(host, port, error);
+        if (_socket < 0)
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_filter != NULL)
+    {
+        av_bitstream_filter_close(_filter);
+    }
+    avformat_close_input(&_format);
+    if (_socket >= 0)
+    {
+        close(_socket);
+    }
+}
+
+- (void)replayWithSimulator:(FDReplaySimulator *)simulator startTime:(CFTimeInterval)startTime
+{
+    _simulator = simulator;
+    _startTime = startTime;
+    _speed = simulator.speed;
+    _datagramSize = simulator.maximumDatagramSize;
+    if (_log != nil)
+    {
+        [self replayTelemetry];
+    }
+    else
+    {
+        [self replayVideo];
+    }
+    _simulator = nil;
+}
+
+- (void)replayVideo
+{
+    AVStream *stream = _format->streams[_streamIndex];
+    AVRational frameRate = av_guess_frame_rate(_format, stream, NULL);
+    // Raw elementary streams may come without timestamps.
+    int64_t frameDuration = frameRate.num > 0 ? MAX(av_rescale_q(1, av_inv_q(frameRate), stream->time_base), 1LL) : 1;
+    int64_t firstTimestamp = AV_NOPTS_VALUE;
+    int64_t lastTimestamp = 0;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    while (!_simulator.cancelled && av_read_frame(_format, &packet) >= 0)
+    {
+        if (packet.stream_index != _streamIndex)
+        {
+            av_free_packet(&packet);
+            continue;
+        }
+
+        // Send in decode order, which is the order a live encoder emits.
+        int64_t timestamp = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+        if (timestamp == AV_NOPTS_VALUE)
+        {
+            timestamp = firstTimestamp == AV_NOPTS_VALUE ? 0 : lastTimestamp + frameDuration;
+        }
+        if (firstTimestamp == AV_NOPTS_VALUE)
+        {
+            firstTimestamp = timestamp;
+        }
+        lastTimestamp = timestamp;
+
+        uint8_t *data = packet.data;
+        int size = packet.size;
+        int result = 0;
+        if (_filter != NULL)
+        {
+            result = av_bitstream_filter_filter(_filter, stream->codec, NULL, &data, &size,
+                                                packet.data, packet.size, packet.flags & AV_PKT_FLAG_KEY);
+        }
+
+        NSTimeInterval lateness = [self waitForTime:(timestamp - firstTimestamp) * av_q2d(stream->time_base) + _offset];
+        NSUInteger datagrams = 0;
+        NSUInteger errors = 0;
+        if (result >= 0)
+        {
+            for (int position = 0; position < size; position += (int)_datagramSize)
+            {
+                int length = MIN(size - position, (int)_datagramSize);
+                BOOL sent = [self sendBytes:data + position length:length];
+                datagrams += sent ? 1 : 0;
+                errors += sent ? 0 : 1;
+            }
+        }
+        else
+        {
+            errors++;
+        }
+        [_simulator recordDatagrams:datagrams bytes:result >= 0 ? size : 0 errors:errors lateness:lateness video:YES];
+
+        if (result > 0)
+        {
+            av_free(data);
+        }
+        av_free_packet(&packet);
+    }
+}
+
+- (void)replayTelemetry
+{
+    int64_t origin = _log.startTime;
+    [_log enumerateRecordsFromTime:origin toTime:_log.endTime usingBlock:^(int64_t time, const uint8_t *frame, size_t length, BOOL *stop) {
+        FDReplaySimulator *simulator = _simulator;
+        if (simulator.cancelled)
+        {
+            *stop = YES;
+            return;
+        }
+        NSTimeInterval lateness = [self waitForTime:(time - origin) / 1e6 + _offset];
+        BOOL sent = [self sendBytes:frame length:length];
+        [simulator recordDatagrams:sent ? 1 : 0 bytes:sent ? length : 0 errors:sent ? 0 : 1 lateness:lateness video:NO];
+    }];
+}
+
+// Sleeps until time (seconds of recording) is due and returns how late it is.
+- (NSTimeInterval)waitForTime:(NSTimeInterval)time
+{
+    if (_speed <= 0)
+    {
+        return 0;
+    }
+    CFTimeInterval due = _startTime + time / _speed;
+    for (;;)
+    {
+        CFTimeInterval now = CACurrentMediaTime();
+        if (now >= due || _simulator.cancelled)
+        {
+            return MAX(now - due, 0.0);
+        }
+        usleep((useconds_t)(MIN(due - now, FDReplaySimulatorMaximumSleep) * 1e6));
+    }
+}
+
+- (BOOL)sendBytes:(const void *)bytes length:(size_t)length
+{
+    // The socket buffer fills when replaying faster than the receiver drains.
+    for (NSUInteger attempt = 0; attempt < FDReplaySimulatorSendRetries; attempt++)
+    {
+        if (send(_socket, bytes, length, 0) >= 0)
+        {
+            return YES;
+        }
+        if (errno != EINTR && errno != ENOBUFS && errno != EAGAIN)
+        {
+            return NO;
+        }
+        if (errno != EINTR)
+        {
+            usleep(100);
+        }
+    }
+    return NO;
+}
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDReplaySimulator
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithDrones:(NSArray *)drones
+{
+    self = [super init];
+    if (self)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        _drones = [drones copy];
+        _speed = 1.0;
+        _maximumDatagramSize = FDReplaySimulatorDefaultDatagramSize;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Instance methods
+
+- (BOOL)startWithError:(NSError **)error
+{
+    if (_group != nil)
+    {
+        return NO;
+    }
+
+    FDFFmpegInitialize();
+    NSMutableArray *streams = [NSMutableArray array];
+    for (FDReplayDrone *drone in self.drones)
+    {
+        FDReplayStream *stream;
+        if (drone.videoPath != nil)
+        {
+            stream = [[FDReplayStream alloc] initWithVideoPath:drone.videoPath
+                                                          host:drone.host
+                                                          port:drone.videoPort
+                                                        offset:MAX(-drone.telemetryOffset, 0.0)
+                                                         error:error];
+            if (stream == nil)
+            {
+                return NO;
+            }
+            [streams addObject:stream];
+        }
+        if (drone.telemetryPath != nil)
+        {
+            stream = [[FDReplayStream alloc] initWithTelemetryPath:drone.telemetryPath
+                                                              host:drone.host
+                                                              port:drone.telemetryPort
+                                                            offset:MAX(drone.telemetryOffset, 0.0)
+                                                             error:error];
+            if (stream == nil)
+            {
+                return NO;
+            }
+            [streams addObject:stream];
+        }
+    }
+
+    _maximumDatagramSize = MAX(_maximumDatagramSize, (NSUInteger)64);
+    _streams = streams;
+    _group = dispatch_group_create();
+    _startTime = CACurrentMediaTime() + FDReplaySimulatorStartDelay;
+    CFTimeInterval startTime = _startTime;
+    for (FDReplayStream *stream in streams)
+    {
+        // A queue per stream, each one spends most of its time sleeping until the next send.
+        dispatch_queue_t queue = dispatch_queue_create("com.flydrones.replay", DISPATCH_QUEUE_SERIAL);
+        dispatch_group_async(_group, queue, ^{
+            [stream replayWithSimulator:self startTime:startTime];
+        });
+    }
+    dispatch_group_notify(_group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        pthread_mutex_lock(&_lock);
+        _finishTime = CACurrentMediaTime();
+        pthread_mutex_unlock(&_lock);
+        FDReplayStatistics *statistics = [self statistics];
+        NSLog(@"Replay of %lu streams finished in %.2f s: %llu video datagrams (%.1f Mbit/s), %llu telemetry datagrams, %llu errors, lateness %.2f ms average, %.2f ms maximum",
+              (unsigned long)_streams.count, statistics.elapsedTime, statistics.videoDatagrams,
+              statistics.videoBytes * 8 / 1e6 / MAX(statistics.elapsedTime, 1e-3), statistics.telemetryDatagrams,
+              statistics.sendErrors, statistics.averageLateness * 1000.0, statistics.maximumLateness * 1000.0);
+    });
+    return YES;
+}
+
+- (void)cancel
+{
+    self.cancelled = YES;
+}
+
+- (void)waitUntilFinished
+{
+    if (_group != nil)
+    {
+        dispatch_group_wait(_group, DISPATCH_TIME_FOREVER);
+    }
+}
+
+- (FDReplayStatistics *)statistics
+{
+    FDReplayStatistics *statistics = [[FDReplayStatistics alloc] init];
+    pthread_mutex_lock(&_lock);
+    statistics.videoDatagrams = _videoCounters.datagrams;
+    statistics.videoBytes = _videoCounters.bytes;
+    statistics.telemetryDatagrams = _telemetryCounters.datagrams;
+    statistics.telemetryBytes = _telemetryCounters.bytes;
+    statistics.sendErrors = _videoCounters.errors + _telemetryCounters.errors;
+    unsigned long long sends = _videoCounters.sends + _telemetryCounters.sends;
+    statistics.averageLateness = (_videoCounters.totalLateness + _telemetryCounters.totalLateness) / MAX(sends, 1ULL);
+    statistics.maximumLateness = MAX(_videoCounters.maximumLateness, _telemetryCounters.maximumLateness);
+    if (_startTime > 0)
+    {
+        CFTimeInterval end = _finishTime > 0 ? _finishTime : CACurrentMediaTime();
+        statistics.elapsedTime = MAX(end - _startTime, 0.0);
+    }
+    pthread_mutex_unlock(&_lock);
+    return statistics;
+}
+
+#pragma mark - Private methods
+
+- (void)recordDatagrams:(NSUInteger)datagrams
+                  bytes:(NSUInteger)bytes
+                 errors:(NSUInteger)errors
+               lateness:(NSTimeInterval)lateness
+                  video:(BOOL)video
+{
+    pthread_mutex_lock(&_lock);
+    FDReplayCounters *counters = video ? &_videoCounters : &_telemetryCounters;
+    counters->datagrams += datagrams;
+    counters->bytes += bytes;
+    counters->errors += errors;
+    counters->sends++;
+    counters->totalLateness += lateness;
+    counters->maximumLateness = MAX(counters->maximumLateness, lateness);
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,64 @@
+//
+//  FDTransmitScheduler.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+
+typedef NS_ENUM(NSUInteger, FDTrafficClass)
+{
+    FDTrafficClassControl,
+    FDTrafficClassTelemetry,
+    FDTrafficClassVideo,
+    FDTrafficClassBulk,
+    FDTrafficClassCount
+};
+
+
+@interface FDTrafficClassStatistics : NSObject
+
+@property (nonatomic, assign, readonly) unsigned long long sentPackets;
+@property (nonatomic, assign, readonly) unsigned long long sentBytes;
+@property (nonatomic, assign, readonly) unsigned long long droppedPackets;
+// Enqueue to send() over the recent packets, in seconds.
+@property (nonatomic, assign, readonly) NSTimeInterval medianLatency;
+@property (nonatomic, assign, readonly) NSTimeInterval p99Latency;
+@property (nonatomic, assign, readonly) NSTimeInterval maximumLatency;
+
+@end
+
+
+// Egress scheduler for one connected UDP socket. Control and telemetry are served
+// by strict priority, video and bulk share the rest by deficit round robin
+// weights, and everything is paced by a token bucket so the queues, not the
+// socket buffer, absorb bursts. Each wakeup sends a batch of datagrams.
+// Enqueueing is thread safe and never blocks on the socket.
+@interface FDTransmitScheduler : NSObject
+
+@property (nonatomic, assign, readonly) int socket;
+// Link budget in bytes per second and the burst the bucket may accumulate.
+@property (nonatomic, assign) double rate;
+@property (nonatomic, assign) NSUInteger burst;
+// Largest datagram accepted by enqueue, 1472 bytes by default.
+@property (nonatomic, assign, readonly) NSUInteger maximumPacketSize;
+// With NO every class shares a single FIFO, as a baseline for measurements.
+@property (nonatomic, assign, getter=isPrioritizationEnabled) BOOL prioritizationEnabled;
+
+- (instancetype)initWithSocket:(int)socket rate:(double)rate burst:(NSUInteger)burst;
+
+// Relative share of the link for video and bulk once the strict classes are served.
+- (void)setWeight:(NSUInteger)weight forTrafficClass:(FDTrafficClass)trafficClass;
+// Packets queued beyond capacity drop the oldest video packet, or are rejected for other classes.
+- (void)setQueueCapacity:(NSUInteger)capacity forTrafficClass:(FDTrafficClass)trafficClass;
+
+// Copies the datagram. Returns NO when it was rejected.
+- (BOOL)enqueueBytes:(const void *)bytes length:(NSUInteger)length trafficClass:(FDTrafficClass)trafficClass;
+
+- (FDTrafficClassStatistics *)statisticsForTrafficClass:(FDTrafficClass)trafficClass;
+
+// Saturates a paced loopback link with video while sending 100 Hz control
+// messages, once prioritized and once as a FIFO, and logs the end-to-end control latency.
++ (void)runLoopbackBenchmarkWithDuration:(NSTimeInterval)duration rate:(double)rate;
+
+@end
@@ -0,0 +1,616 @@
+//
+//  FDTransmitScheduler.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDTransmitScheduler.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+
+static NSUInteger const FDTransmitSchedulerDefaultMaximumPacketSize = 1472;
+// Datagrams sent per wakeup of the sender queue.
+static NSUInteger const FDTransmitSchedulerBatchSize = 32;
+// Recent send latencies kept per class for the percentiles.
+static NSUInteger const FDTransmitSchedulerLatencyWindow = 4096;
+
+typedef struct FDTransmitQueue
+{
+    uint8_t *slots;
+    uint32_t *lengths;
+    CFTimeInterval *enqueueTimes;
+    NSUInteger capacity;
+    NSUInteger head;
+    NSUInteger count;
+    NSUInteger weight;
+    NSInteger deficit;
+
+    unsigned long long sentPackets;
+    unsigned long long sentBytes;
+    unsigned long long droppedPackets;
+    float *latencies;
+    NSUInteger latencyCount;
+    NSUInteger latencyNext;
+    NSTimeInterval maximumLatency;
+} FDTransmitQueue;
+
+
+#pragma mark - FDTrafficClassStatistics
+
+@interface FDTrafficClassStatistics ()
+
+@property (nonatomic, assign, readwrite) unsigned long long sentPackets;
+@property (nonatomic, assign, readwrite) unsigned long long sentBytes;
+@property (nonatomic, assign, readwrite) unsigned long long droppedPackets;
+@property (nonatomic, assign, readwrite) NSTimeInterval medianLatency;
+@property (nonatomic, assign, readwrite) NSTimeInterval p99Latency;
+@property (nonatomic, assign, readwrite) NSTimeInterval maximumLatency;
+
+@end
+
+@implementation FDTrafficClassStatistics
+
+@end
+
+
+#pragma mark - Private functions
+
+static int FDCompareFloat(const void *a, const void *b)
+{
+    float left = *(const float *)a;
+    float right = *(const float *)b;
+    return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+static int FDCompareDouble(const void *a, const void *b)
+{
+    double left = *(const double *)a;
+    double right = *(const double *)b;
+    return left < right ? -1 : (left > right ? 1 : 0);
+}
+
+static BOOL FDTransmitQueueAllocate(FDTransmitQueue *queue, NSUInteger capacity, NSUInteger slotSize)
+{
+    free(queue->slots);
+    free(queue->lengths);
+    free(queue->enqueueTimes);
+    queue->slots = malloc(capacity * slotSize);
+    queue->lengths = malloc(capacity * sizeof(uint32_t));
+    queue->enqueueTimes = malloc(capacity * sizeof(CFTimeInterval));
+    queue->droppedPackets += queue->count;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->count = 0;
+    queue->deficit = 0;
+    return queue->slots != NULL && queue->lengths != NULL && queue->enqueueTimes != NULL;
+}
+
+static void FDTransmitQueueFree(FDTransmitQueue *queue)
+{
+    free(queue->slots);
+    free(queue->lengths);
+    free(queue->enqueueTimes);
+    free(queue->latencies);
+    memset(queue, 0, sizeof(FDTransmitQueue));
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDTransmitScheduler ()
+{
+    dispatch_queue_t _senderQueue;
+    pthread_mutex_t _lock;
+
+    // Guarded by _lock.
+    FDTransmitQueue _queues[FDTrafficClassCount];
+    double _tokens;
+    CFTimeInterval _refillTime;
+    FDTrafficClass _roundRobinClass;
+    BOOL _roundRobinNeedsQuantum;
+    BOOL _drainScheduled;
+    BOOL _waitingForTokens;
+    // Invalidates a pending token timer when an earlier wakeup was forced.
+    uint64_t _timerGeneration;
+
+    // Only touched on _senderQueue.
+    uint8_t *_batch;
+    uint32_t _batchLengths[FDTransmitSchedulerBatchSize];
+    CFTimeInterval _batchEnqueueTimes[FDTransmitSchedulerBatchSize];
+    FDTrafficClass _batchClasses[FDTransmitSchedulerBatchSize];
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) int socket;
+@property (nonatomic, assign, readwrite) NSUInteger maximumPacketSize;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDTransmitScheduler
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithSocket:(int)socket rate:(double)rate burst:(NSUInteger)burst
+{
+    self = [super init];
+    if (self)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        _senderQueue = dispatch_queue_create("com.flydrones.transmit-scheduler", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_senderQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0));
+        _socket = socket;
+        _rate = MAX(rate, 1.0);
+        _maximumPacketSize = FDTransmitSchedulerDefaultMaximumPacketSize;
+        _burst = MAX(burst, _maximumPacketSize);
+        _tokens = _burst;
+        _refillTime = CACurrentMediaTime();
+        _prioritizationEnabled = YES;
+        _roundRobinClass = FDTrafficClassVideo;
+        _roundRobinNeedsQuantum = YES;
+
+        static NSUInteger const capacities[FDTrafficClassCount] = {64, 128, 256, 256};
+        static NSUInteger const weights[FDTrafficClassCount] = {1, 1, 8, 1};
+        BOOL allocated = (_batch = malloc(FDTransmitSchedulerBatchSize * _maximumPacketSize)) != NULL;
+        for (NSUInteger i = 0; i < FDTrafficClassCount; i++)
+        {
+            _queues[i].weight = weights[i];
+            _queues[i].latencies = malloc(FDTransmitSchedulerLatencyWindow * sizeof(float));
+            allocated = FDTransmitQueueAllocate(&_queues[i], capacities[i], _maximumPacketSize) &&
+                        _queues[i].latencies != NULL && allocated;
+        }
+        if (!allocated)
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger i = 0; i < FDTrafficClassCount; i++)
+    {
+        FDTransmitQueueFree(&_queues[i]);
+    }
+    free(_batch);
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Instance methods
+
+- (void)setRate:(double)rate
+{
+    pthread_mutex_lock(&_lock);
+    _rate = MAX(rate, 1.0);
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)setBurst:(NSUInteger)burst
+{
+    pthread_mutex_lock(&_lock);
+    _burst = MAX(burst, _maximumPacketSize);
+    _tokens = MIN(_tokens, (double)_burst);
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)setPrioritizationEnabled:(BOOL)prioritizationEnabled
+{
+    pthread_mutex_lock(&_lock);
+    _prioritizationEnabled = prioritizationEnabled;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)setWeight:(NSUInteger)weight forTrafficClass:(FDTrafficClass)trafficClass
+{
+    if (trafficClass >= FDTrafficClassCount)
+    {
+        return;
+    }
+    pthread_mutex_lock(&_lock);
+    _queues[trafficClass].weight = MAX(weight, (NSUInteger)1);
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)setQueueCapacity:(NSUInteger)capacity forTrafficClass:(FDTrafficClass)trafficClass
+{
+    if (trafficClass >= FDTrafficClassCount)
+    {
+        return;
+    }
+    pthread_mutex_lock(&_lock);
+    // Queued packets are dropped rather than moved, capacity is meant to be set up front.
+    if (!FDTransmitQueueAllocate(&_queues[trafficClass], MAX(capacity, (NSUInteger)1), _maximumPacketSize))
+    {
+        FDTransmitQueueAllocate(&_queues[trafficClass], 1, _maximumPacketSize);
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (BOOL)enqueueBytes:(const void *)bytes length:(NSUInteger)length trafficClass:(FDTrafficClass)trafficClass
+{
+    if (length == 0 || length > _maximumPacketSize || trafficClass >= FDTrafficClassCount)
+    {
+        return NO;
+    }
+
+    pthread_mutex_lock(&_lock);
+    FDTrafficClass queueClass = _prioritizationEnabled ? trafficClass : FDTrafficClassVideo;
+    FDTransmitQueue *queue = &_queues[queueClass];
+    if (queue->count == queue->capacity)
+    {
+        if (queueClass != FDTrafficClassVideo)
+        {
+            queue->droppedPackets++;
+            pthread_mutex_unlock(&_lock);
+            return NO;
+        }
+        // Stale video is worthless, make room by dropping the oldest packet.
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        queue->droppedPackets++;
+    }
+
+    NSUInteger slot = (queue->head + queue->count) % queue->capacity;
+    memcpy(queue->slots + slot * _maximumPacketSize, bytes, length);
+    queue->lengths[slot] = (uint32_t)length;
+    queue->enqueueTimes[slot] = CACurrentMediaTime();
+    queue->count++;
+
+    // A control packet may overdraw the bucket, so do not let it wait for a timer armed for video.
+    BOOL wake = !_drainScheduled || (_waitingForTokens && queueClass == FDTrafficClassControl);
+    if (wake)
+    {
+        _drainScheduled = YES;
+        _waitingForTokens = NO;
+        _timerGeneration++;
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (wake)
+    {
+        dispatch_async(_senderQueue, ^{
+            [self drain];
+        });
+    }
+    return YES;
+}
+
+- (FDTrafficClassStatistics *)statisticsForTrafficClass:(FDTrafficClass)trafficClass
+{
+    if (trafficClass >= FDTrafficClassCount)
+    {
+        return nil;
+    }
+
+    FDTrafficClassStatistics *statistics = [[FDTrafficClassStatistics alloc] init];
+    float *latencies = malloc(FDTransmitSchedulerLatencyWindow * sizeof(float));
+    pthread_mutex_lock(&_lock);
+    FDTransmitQueue *queue = &_queues[trafficClass];
+    statistics.sentPackets = queue->sentPackets;
+    statistics.sentBytes = queue->sentBytes;
+    statistics.droppedPackets = queue->droppedPackets;
+    statistics.maximumLatency = queue->maximumLatency;
+    NSUInteger count = latencies != NULL ? queue->latencyCount : 0;
+    if (count > 0)
+    {
+        memcpy(latencies, queue->latencies, count * sizeof(float));
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (count > 0)
+    {
+        qsort(latencies, count, sizeof(float), FDCompareFloat);
+        statistics.medianLatency = latencies[count / 2];
+        statistics.p99Latency = latencies[MIN(count * 99 / 100, count - 1)];
+    }
+    free(latencies);
+    return statistics;
+}
+
+#pragma mark - Private methods
+
+// Picks the class of the next packet, called with _lock held.
+- (BOOL)nextTrafficClass:(FDTrafficClass *)trafficClass
+{
+    if (!_prioritizationEnabled)
+    {
+        *trafficClass = FDTrafficClassVideo;
+        return _queues[FDTrafficClassVideo].count > 0 || [self nextStrictTrafficClass:trafficClass];
+    }
+    if ([self nextStrictTrafficClass:trafficClass])
+    {
+        return YES;
+    }
+
+    // Deficit round robin over video and bulk. The quantum is one maximum sized
+    // packet per unit of weight, so every visit of a backlogged class sends.
+    for (NSUInteger visit = 0; visit < 2 * (FDTrafficClassCount - FDTrafficClassVideo); visit++)
+    {
+        FDTransmitQueue *queue = &_queues[_roundRobinClass];
+        if (queue->count == 0)
+        {
+            queue->deficit = 0;
+        }
+        else
+        {
+            if (_roundRobinNeedsQuantum)
+            {
+                queue->deficit += (NSInteger)(queue->weight * _maximumPacketSize);
+                _roundRobinNeedsQuantum = NO;
+            }
+            if (queue->deficit >= (NSInteger)queue->lengths[queue->head])
+            {
+                *trafficClass = _roundRobinClass;
+                return YES;
+            }
+        }
+        _roundRobinClass = _roundRobinClass + 1 < FDTrafficClassCount ? _roundRobinClass + 1 : FDTrafficClassVideo;
+        _roundRobinNeedsQuantum = YES;
+    }
+    return NO;
+}
+
+- (BOOL)nextStrictTrafficClass:(FDTrafficClass *)trafficClass
+{
+    for (FDTrafficClass candidate = FDTrafficClassControl; candidate < FDTrafficClassVideo; candidate++)
+    {
+        if (_queues[candidate].count > 0)
+        {
+            *trafficClass = candidate;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+- (void)drainForTimerGeneration:(uint64_t)generation
+{
+    pthread_mutex_lock(&_lock);
+    BOOL current = generation == _timerGeneration;
+    pthread_mutex_unlock(&_lock);
+    if (current)
+    {
+        [self drain];
+    }
+}
+
+- (void)drain
+{
+    for (;;)
+    {
+        NSUInteger batchCount = 0;
+        NSTimeInterval wait = 0;
+
+        pthread_mutex_lock(&_lock);
+        CFTimeInterval now = CACurrentMediaTime();
+        _tokens = MIN(_tokens + (now - _refillTime) * _rate, (double)_burst);
+        _refillTime = now;
+
+        FDTrafficClass trafficClass;
+        while (batchCount < FDTransmitSchedulerBatchSize && [self nextTrafficClass:&trafficClass])
+        {
+            FDTransmitQueue *queue = &_queues[trafficClass];
+            uint32_t length = queue->lengths[queue->head];
+            // Control may run the bucket into debt by up to one burst, everything else
+            // waits for the tokens and thereby repays it.
+            double floor = trafficClass == FDTrafficClassControl ? -(double)_burst : 0.0;
+            if (_tokens - length < floor)
+            {
+                wait = (length + floor - _tokens) / _rate;
+                break;
+            }
+
+            _tokens -= length;
+            if (trafficClass >= FDTrafficClassVideo && _prioritizationEnabled)
+            {
+                queue->deficit -= length;
+            }
+            memcpy(_batch + batchCount * _maximumPacketSize, queue->slots + queue->head * _maximumPacketSize, length);
+            _batchLengths[batchCount] = length;
+            _batchEnqueueTimes[batchCount] = queue->enqueueTimes[queue->head];
+            _batchClasses[batchCount] = trafficClass;
+            batchCount++;
+            queue->head = (queue->head + 1) % queue->capacity;
+            queue->count--;
+        }
+
+        if (batchCount == 0)
+        {
+            _waitingForTokens = wait > 0;
+            _drainScheduled = _waitingForTokens;
+            uint64_t generation = ++_timerGeneration;
+            pthread_mutex_unlock(&_lock);
+            if (wait > 0)
+            {
+                dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(wait * NSEC_PER_SEC)), _senderQueue, ^{
+                    [self drainForTimerGeneration:generation];
+                });
+            }
+            return;
+        }
+        pthread_mutex_unlock(&_lock);
+
+        // Darwin has no sendmmsg, the batch still amortizes the wakeup and the lock.
+        BOOL sent[FDTransmitSchedulerBatchSize];
+        for (NSUInteger i = 0; i < batchCount; i++)
+        {
+            ssize_t result;
+            do
+            {
+                result = send(_socket, _batch + i * _maximumPacketSize, _batchLengths[i], 0);
+            }
+            while (result < 0 && errno == EINTR);
+            sent[i] = result >= 0;
+        }
+
+        CFTimeInterval sendTime = CACurrentMediaTime();
+        pthread_mutex_lock(&_lock);
+        for (NSUInteger i = 0; i < batchCount; i++)
+        {
+            FDTransmitQueue *queue = &_queues[_batchClasses[i]];
+            if (!sent[i])
+            {
+                queue->droppedPackets++;
+                continue;
+            }
+            NSTimeInterval latency = sendTime - _batchEnqueueTimes[i];
+            queue->sentPackets++;
+            queue->sentBytes += _batchLengths[i];
+            queue->maximumLatency = MAX(queue->maximumLatency, latency);
+            queue->latencies[queue->latencyNext] = (float)latency;
+            queue->latencyNext = (queue->latencyNext + 1) % FDTransmitSchedulerLatencyWindow;
+            queue->latencyCount = MIN(queue->latencyCount + 1, FDTransmitSchedulerLatencyWindow);
+        }
+        pthread_mutex_unlock(&_lock);
+    }
+}
+
+#pragma mark - Benchmark
+
++ (void)runLoopbackBenchmarkWithDuration:(NSTimeInterval)duration rate:(double)rate
+{
+    for (NSUInteger pass = 0; pass < 2; pass++)
+    {
+        [self runLoopbackPassWithDuration:duration rate:rate prioritized:pass == 0];
+    }
+}
+
++ (void)runLoopbackPassWithDuration:(NSTimeInterval)duration rate:(double)rate prioritized:(BOOL)prioritized
+{
+    static NSUInteger const controlSize = 64;
+    static NSUInteger const videoSize = 1200;
+    static NSTimeInterval const controlInterval = 0.01;
+
+    int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_len = sizeof(address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int bufferSize = 4 << 20;
+    struct timeval timeout = {0, 100000};
+    if (receiver < 0 || sender < 0 ||
+        setsockopt(receiver, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize)) < 0 ||
+        setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        bind(receiver, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        getsockname(receiver, (struct sockaddr *)&address, &addressLength) < 0 ||
+        connect(sender, (struct sockaddr *)&address, addressLength) < 0)
+    {
+        NSLog(@"Transmit scheduler benchmark: unable to set up loopback sockets (%s)", strerror(errno));
+        if (receiver >= 0)
+        {
+            close(receiver);
+        }
+        if (sender >= 0)
+        {
+            close(sender);
+        }
+        return;
+    }
+
+    FDTransmitScheduler *scheduler = [[FDTransmitScheduler alloc] initWithSocket:sender
+                                                                            rate:rate
+                                                                           burst:16 * FDTransmitSchedulerDefaultMaximumPacketSize];
+    scheduler.prioritizationEnabled = prioritized;
+
+    NSUInteger latencyCapacity = (NSUInteger)(duration / controlInterval) + 16;
+    double *latencies = malloc(latencyCapacity * sizeof(double));
+    __block NSUInteger latencyCount = 0;
+    __block unsigned long long videoBytes = 0;
+    __block volatile BOOL receiving = YES;
+    __block volatile BOOL producing = YES;
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_queue_t background = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+    dispatch_group_async(group, background, ^{
+        uint8_t packet[FDTransmitSchedulerDefaultMaximumPacketSize];
+        while (receiving)
+        {
+            ssize_t length = recv(receiver, packet, sizeof(packet), 0);
+            if (length < (ssize_t)(sizeof(double) + 1))
+            {
+                continue;
+            }
+            CFTimeInterval enqueueTime;
+            memcpy(&enqueueTime, packet + 1, sizeof(double));
+            if (packet[0] == FDTrafficClassControl && latencyCount < latencyCapacity)
+            {
+                latencies[latencyCount++] = CACurrentMediaTime() - enqueueTime;
+            }
+            else if (packet[0] == FDTrafficClassVideo)
+            {
+                videoBytes += length;
+            }
+        }
+    });
+
+    // Offers half as much video again as the link carries, in 1 ms bursts like an encoder would.
+    dispatch_group_async(group, background, ^{
+        uint8_t packet[videoSize];
+        memset(packet, 0, sizeof(packet));
+        packet[0] = FDTrafficClassVideo;
+        double backlog = 0;
+        while (producing)
+        {
+            for (backlog += rate * 1.5 * 0.001; backlog >= videoSize; backlog -= videoSize)
+            {
+                CFTimeInterval now = CACurrentMediaTime();
+                memcpy(packet + 1, &now, sizeof(double));
+                [scheduler enqueueBytes:packet length:videoSize trafficClass:FDTrafficClassVideo];
+            }
+            usleep(1000);
+        }
+    });
+
+    uint8_t control[controlSize];
+    memset(control, 0, sizeof(control));
+    control[0] = FDTrafficClassControl;
+    NSUInteger controlCount = 0;
+    CFTimeInterval end = CACurrentMediaTime() + duration;
+    while (CACurrentMediaTime() < end)
+    {
+        CFTimeInterval now = CACurrentMediaTime();
+        memcpy(control + 1, &now, sizeof(double));
+        controlCount += [scheduler enqueueBytes:control length:controlSize trafficClass:FDTrafficClassControl] ? 1 : 0;
+        usleep((useconds_t)(controlInterval * 1e6));
+    }
+    producing = NO;
+    // Let the queues drain before the receiver stops counting.
+    usleep(500000);
+    receiving = NO;
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+
+    if (latencyCount > 0)
+    {
+        qsort(latencies, latencyCount, sizeof(double), FDCompareDouble);
+        NSLog(@"Transmit scheduler (%@): control p50 %.2f ms, p99 %.2f ms, max %.2f ms, %lu of %lu delivered; video %.0f kbit/s of %.0f kbit/s link",
+              prioritized ? @"prioritized" : @"FIFO",
+              latencies[latencyCount / 2] * 1000.0,
+              latencies[MIN(latencyCount * 99 / 100, latencyCount - 1)] * 1000.0,
+              latencies[latencyCount - 1] * 1000.0,
+              (unsigned long)latencyCount, (unsigned long)controlCount,
+              videoBytes * 8 / 1000.0 / duration, rate * 8 / 1000.0);
+    }
+    else
+    {
+        NSLog(@"Transmit scheduler (%@): no control packet delivered", prioritized ? @"prioritized" : @"FIFO");
+    }
+
+    free(latencies);
+    close(receiver);
+    close(sender);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,66 @@
+//
+//  FDRecordingStore.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDSegmentCatalog.h"
+
+
+// Immutable snapshot of one catalog record.
+@interface FDRecordingSegment : NSObject
+
+@property (nonatomic, assign, readonly) uint64_t identifier;
+@property (nonatomic, strong, readonly) NSDate *startDate;
+@property (nonatomic, assign, readonly) NSTimeInterval duration;
+@property (nonatomic, assign, readonly) unsigned long long size;
+@property (nonatomic, assign, readonly) NSUInteger frameCount;
+@property (nonatomic, assign, readonly, getter=isFinished) BOOL finished;
+@property (nonatomic, assign, readonly, getter=isProtected) BOOL protectedFromEviction;
+@property (nonatomic, copy, readonly) NSString *path;
+// SHA-256 of the segment file computed while recording, nil for segments without a digest.
+@property (nonatomic, copy, readonly) NSData *sha256;
+@property (nonatomic, assign, readonly) uint32_t crc;
+
+@end
+
+
+// Owns the segment directory and its catalog, and keeps the total size under the
+// quota by evicting the oldest unprotected finished segments. Eviction candidates
+// live in an intrusive list in catalog order, so no directory is ever scanned.
+// All methods are thread safe.
+@interface FDRecordingStore : NSObject
+
+@property (nonatomic, copy, readonly) NSString *directory;
+@property (nonatomic, assign) unsigned long long quota;
+// Free space the store leaves on the volume regardless of the quota.
+@property (nonatomic, assign) unsigned long long minimumFreeSpace;
+@property (nonatomic, assign, readonly) unsigned long long usedBytes;
+
+- (instancetype)initWithDirectory:(NSString *)directory quota:(unsigned long long)quota error:(NSError **)error;
+
+- (NSArray *)segments;
+- (FDRecordingSegment *)segmentWithIdentifier:(uint64_t)identifier;
+- (NSString *)pathForSegmentWithIdentifier:(uint64_t)identifier;
+
+// Evicts as needed to make room for expectedSize and appends an unfinished record.
+// Returns 0 when the record could not be appended.
+- (uint64_t)beginSegmentWithStartDate:(NSDate *)startDate expectedSize:(unsigned long long)expectedSize;
+- (void)finishSegmentWithIdentifier:(uint64_t)identifier
+                           duration:(NSTimeInterval)duration
+                               size:(unsigned long long)size
+                         frameCount:(NSUInteger)frameCount
+                             digest:(const FDSegmentDigest *)digest;
+
+- (void)setProtected:(BOOL)isProtected forSegmentWithIdentifier:(uint64_t)identifier;
+- (void)removeSegmentWithIdentifier:(uint64_t)identifier;
+
+// Rehashes only the segment file and compares it with the digest recorded while
+// writing. Fails with NSFileReadCorruptFileError on mismatch. Blocks, call off the main queue.
+- (BOOL)verifySegmentWithIdentifier:(uint64_t)identifier error:(NSError **)error;
+
+// Returns the number of evicted segments.
+- (NSUInteger)evictToFitAdditionalBytes:(unsigned long long)additionalBytes;
+
+@end
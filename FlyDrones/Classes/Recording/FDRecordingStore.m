@@ -0,0 +1,525 @@
+//
+//  FDRecordingStore.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDRecordingStore.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static NSString * const FDRecordingStoreCatalogName = @"catalog.fdsc";
+static NSString * const FDRecordingStoreSegmentExtension = @"h264";
+static size_t const FDRecordingStoreVerificationChunkSize = 1024 * 1024;
+// Compaction on open only pays off once evicted records dominate the catalog.
+static NSUInteger const FDRecordingStoreCompactionThreshold = 1024;
+
+// Links of the eviction list, indexed like the catalog records.
+typedef struct FDRecordingStoreLink
+{
+    NSUInteger previous;
+    NSUInteger next;
+} FDRecordingStoreLink;
+
+
+#pragma mark - FDRecordingSegment
+
+@interface FDRecordingSegment ()
+
+@property (nonatomic, assign, readwrite) uint64_t identifier;
+@property (nonatomic, strong, readwrite) NSDate *startDate;
+@property (nonatomic, assign, readwrite) NSTimeInterval duration;
+@property (nonatomic, assign, readwrite) unsigned long long size;
+@property (nonatomic, assign, readwrite) NSUInteger frameCount;
+@property (nonatomic, assign, readwrite, getter=isFinished) BOOL finished;
+@property (nonatomic, assign, readwrite, getter=isProtected) BOOL protectedFromEviction;
+@property (nonatomic, copy, readwrite) NSString *path;
+@property (nonatomic, copy, readwrite) NSData *sha256;
+@property (nonatomic, assign, readwrite) uint32_t crc;
+
+@end
+
+@implementation FDRecordingSegment
+
+@end
+
+
+#pragma mark - Private interface methods
+
+@interface FDRecordingStore ()
+{
+    dispatch_queue_t _queue;
+    FDSegmentCatalog *_catalog;
+    NSMutableData *_links;
+    NSUInteger _head;
+    NSUInteger _tail;
+    unsigned long long _usedBytes;
+    uint64_t _nextIdentifier;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, copy, readwrite) NSString *directory;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDRecordingStore
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithDirectory:(NSString *)directory quota:(unsigned long long)quota error:(NSError **)error
+{
+    self = [super init];
+    if (self)
+    {
+        _directory = [directory copy];
+        _quota = quota;
+        _queue = dispatch_queue_create("com.flydrones.recording-store", DISPATCH_QUEUE_SERIAL);
+        _links = [NSMutableData data];
+        _head = NSNotFound;
+        _tail = NSNotFound;
+        _nextIdentifier = 1;
+
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:error])
+        {
+            return nil;
+        }
+
+        NSString *catalogPath = [directory stringByAppendingPathComponent:FDRecordingStoreCatalogName];
+        _catalog = [FDSegmentCatalog catalogWithPath:catalogPath error:error];
+        if (_catalog == nil)
+        {
+            return nil;
+        }
+        [self loadCatalog];
+    }
+    return self;
+}
+
+#pragma mark - Instance methods
+
+- (unsigned long long)usedBytes
+{
+    __block unsigned long long usedBytes = 0;
+    dispatch_sync(_queue, ^{
+        usedBytes = _usedBytes;
+    });
+    return usedBytes;
+}
+
+- (NSArray *)segments
+{
+    NSMutableArray *segments = [NSMutableArray array];
+    dispatch_sync(_queue, ^{
+        for (NSUInteger index = 0; index < _catalog.recordCount; index++)
+        {
+            const FDSegmentRecord *record = [_catalog recordAtIndex:index];
+            if (!(record->flags & FDSegmentFlagEvicted))
+            {
+                [segments addObject:[self segmentWithRecord:record]];
+            }
+        }
+    });
+    return segments;
+}
+
+- (FDRecordingSegment *)segmentWithIdentifier:(uint64_t)identifier
+{
+    __block FDRecordingSegment *segment = nil;
+    dispatch_sync(_queue, ^{
+        NSUInteger index = [_catalog indexOfRecordWithIdentifier:identifier];
+        const FDSegmentRecord *record = [_catalog recordAtIndex:index];
+        if (record != NULL && !(record->flags & FDSegmentFlagEvicted))
+        {
+            segment = [self segmentWithRecord:record];
+        }
+    });
+    return segment;
+}
+
+- (NSString *)pathForSegmentWithIdentifier:(uint64_t)identifier
+{
+    NSString *name = [[NSString stringWithFormat:@"%016llx", identifier] stringByAppendingPathExtension:FDRecordingStoreSegmentExtension];
+    return [self.directory stringByAppendingPathComponent:name];
+}
+
+- (uint64_t)beginSegmentWithStartDate:(NSDate *)startDate expectedSize:(unsigned long long)expectedSize
+{
+    __block uint64_t identifier = 0;
+    dispatch_sync(_queue, ^{
+        [self evictLockedToFitAdditionalBytes:expectedSize];
+
+        FDSegmentRecord record;
+        memset(&record, 0, sizeof(record));
+        record.identifier = _nextIdentifier;
+        record.startTime = (int64_t)([startDate timeIntervalSince1970] * USEC_PER_SEC);
+
+        NSUInteger index = [_catalog appendRecord:&record];
+        if (index != NSNotFound)
+        {
+            identifier = _nextIdentifier++;
+            [self resizeLinks];
+        }
+        else
+        {
+            NSLog(@"Unable to grow segment catalog %@: %s", _catalog.path, strerror(errno));
+        }
+    });
+    return identifier;
+}
+
+- (void)finishSegmentWithIdentifier:(uint64_t)identifier
+                           duration:(NSTimeInterval)duration
+                               size:(unsigned long long)size
+                         frameCount:(NSUInteger)frameCount
+                             digest:(const FDSegmentDigest *)digest
+{
+    dispatch_sync(_queue, ^{
+        NSUInteger index = [_catalog indexOfRecordWithIdentifier:identifier];
+        FDSegmentRecord *record = [_catalog recordAtIndex:index];
+        if (record == NULL || (record->flags & (FDSegmentFlagFinished | FDSegmentFlagEvicted)))
+        {
+            return;
+        }
+
+        record->duration = (int64_t)(duration * USEC_PER_SEC);
+        record->size = size;
+        record->frameCount = (uint32_t)frameCount;
+        record->flags |= FDSegmentFlagFinished;
+        if (digest != NULL)
+        {
+            record->digest = *digest;
+            record->flags |= FDSegmentFlagDigest;
+        }
+        [_catalog synchronizeRecordAtIndex:index];
+
+        _usedBytes += size;
+        if (!(record->flags & FDSegmentFlagProtected))
+        {
+            [self appendLinkAtIndex:index];
+        }
+        [self evictLockedToFitAdditionalBytes:0];
+    });
+}
+
+- (void)setProtected:(BOOL)isProtected forSegmentWithIdentifier:(uint64_t)identifier
+{
+    dispatch_sync(_queue, ^{
+        NSUInteger index = [_catalog indexOfRecordWithIdentifier:identifier];
+        FDSegmentRecord *record = [_catalog recordAtIndex:index];
+        if (record == NULL || (record->flags & FDSegmentFlagEvicted) || isProtected == !!(record->flags & FDSegmentFlagProtected))
+        {
+            return;
+        }
+
+        if (isProtected)
+        {
+            record->flags |= FDSegmentFlagProtected;
+            if (record->flags & FDSegmentFlagFinished)
+            {
+                [self removeLinkAtIndex:index];
+            }
+        }
+        else
+        {
+            record->flags &= ~FDSegmentFlagProtected;
+            if (record->flags & FDSegmentFlagFinished)
+            {
+                [self insertLinkAtIndex:index];
+            }
+        }
+        [_catalog synchronizeRecordAtIndex:index];
+    });
+}
+
+- (void)removeSegmentWithIdentifier:(uint64_t)identifier
+{
+    dispatch_sync(_queue, ^{
+        NSUInteger index = [_catalog indexOfRecordWithIdentifier:identifier];
+        const FDSegmentRecord *record = [_catalog recordAtIndex:index];
+        if (record != NULL && (record->flags & FDSegmentFlagFinished) && !(record->flags & FDSegmentFlagEvicted))
+        {
+            [self evictRecordAtIndex:index];
+        }
+    });
+}
+
+- (BOOL)verifySegmentWithIdentifier:(uint64_t)identifier error:(NSError **)error
+{
+    __block FDSegmentDigest expected;
+    __block BOOL hasDigest = NO;
+    dispatch_sync(_queue, ^{
+        NSUInteger index = [_catalog indexOfRecordWithIdentifier:identifier];
+        const FDSegmentRecord *record = [_catalog recordAtIndex:index];
+        if (record != NULL && !(record->flags & FDSegmentFlagEvicted) && (record->flags & FDSegmentFlagDigest))
+        {
+            expected = record->digest;
+            hasDigest = YES;
+        }
+    });
+
+    NSString *path = [self pathForSegmentWithIdentifier:identifier];
+    if (!hasDigest)
+    {
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadNoSuchFileError userInfo:@{NSFilePathErrorKey : path}];
+        }
+        return NO;
+    }
+
+    FILE *file = fopen(path.fileSystemRepresentation, "rb");
+    if (file == NULL)
+    {
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey : path}];
+        }
+        return NO;
+    }
+
+    FDSegmentHasher *hasher = FDSegmentHasherCreate();
+    uint8_t *buffer = malloc(FDRecordingStoreVerificationChunkSize);
+    if (hasher == NULL || buffer == NULL)
+    {
+        fclose(file);
+        free(buffer);
+        FDSegmentHasherFree(hasher);
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:@{NSFilePathErrorKey : path}];
+        }
+        return NO;
+    }
+    size_t length;
+    while ((length = fread(buffer, 1, FDRecordingStoreVerificationChunkSize, file)) > 0)
+    {
+        FDSegmentHasherUpdate(hasher, buffer, length);
+    }
+    BOOL readFailed = ferror(file) != 0;
+    fclose(file);
+    free(buffer);
+
+    FDSegmentDigest actual;
+    FDSegmentHasherFinish(hasher, &actual);
+    FDSegmentHasherFree(hasher);
+
+    if (readFailed || !FDSegmentDigestEqual(&expected, &actual))
+    {
+        if (error != NULL)
+        {
+            NSInteger code = readFailed ? NSFileReadUnknownError : NSFileReadCorruptFileError;
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain code:code userInfo:@{NSFilePathErrorKey : path}];
+        }
+        return NO;
+    }
+    return YES;
+}
+
+- (NSUInteger)evictToFitAdditionalBytes:(unsigned long long)additionalBytes
+{
+    __block NSUInteger evicted = 0;
+    dispatch_sync(_queue, ^{
+        evicted = [self evictLockedToFitAdditionalBytes:additionalBytes];
+    });
+    return evicted;
+}
+
+#pragma mark - Private methods
+
+- (void)loadCatalog
+{
+    NSUInteger evictedCount = 0;
+    for (NSUInteger index = 0; index < _catalog.recordCount; index++)
+    {
+        evictedCount += ([_catalog recordAtIndex:index]->flags & FDSegmentFlagEvicted) ? 1 : 0;
+    }
+    if (evictedCount > FDRecordingStoreCompactionThreshold && evictedCount * 2 > _catalog.recordCount)
+    {
+        NSError *error = nil;
+        if (![_catalog compact:&error])
+        {
+            NSLog(@"Unable to compact segment catalog: %@", error);
+        }
+    }
+
+    [self resizeLinks];
+    for (NSUInteger index = 0; index < _catalog.recordCount; index++)
+    {
+        FDSegmentRecord *record = [_catalog recordAtIndex:index];
+        _nextIdentifier = MAX(_nextIdentifier, record->identifier + 1);
+        if (record->flags & FDSegmentFlagEvicted)
+        {
+            continue;
+        }
+
+        if (!(record->flags & FDSegmentFlagFinished))
+        {
+            // Interrupted while recording: the file size is all that can be recovered.
+            struct stat status;
+            NSString *path = [self pathForSegmentWithIdentifier:record->identifier];
+            record->size = stat(path.fileSystemRepresentation, &status) == 0 ? (uint64_t)status.st_size : 0;
+            record->flags |= FDSegmentFlagFinished;
+            [_catalog synchronizeRecordAtIndex:index];
+        }
+
+        _usedBytes += record->size;
+        if (!(record->flags & FDSegmentFlagProtected))
+        {
+            [self appendLinkAtIndex:index];
+        }
+    }
+}
+
+- (FDRecordingSegment *)segmentWithRecord:(const FDSegmentRecord *)record
+{
+    FDRecordingSegment *segment = [[FDRecordingSegment alloc] init];
+    segment.identifier = record->identifier;
+    segment.startDate = [NSDate dateWithTimeIntervalSince1970:(NSTimeInterval)record->startTime / USEC_PER_SEC];
+    segment.duration = (NSTimeInterval)record->duration / USEC_PER_SEC;
+    segment.size = record->size;
+    segment.frameCount = record->frameCount;
+    segment.finished = (record->flags & FDSegmentFlagFinished) != 0;
+    segment.protectedFromEviction = (record->flags & FDSegmentFlagProtected) != 0;
+    segment.path = [self pathForSegmentWithIdentifier:record->identifier];
+    if (record->flags & FDSegmentFlagDigest)
+    {
+        segment.sha256 = [NSData dataWithBytes:record->digest.sha256 length:sizeof(record->digest.sha256)];
+        segment.crc = record->digest.crc;
+    }
+    return segment;
+}
+
+- (unsigned long long)byteLimit
+{
+    unsigned long long limit = self.quota;
+    NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfFileSystemForPath:self.directory error:NULL];
+    NSNumber *freeSpace = attributes[NSFileSystemFreeSize];
+    if (freeSpace != nil)
+    {
+        unsigned long long available = _usedBytes + freeSpace.unsignedLongLongValue;
+        limit = MIN(limit, available > self.minimumFreeSpace ? available - self.minimumFreeSpace : 0);
+    }
+    return limit;
+}
+
+- (NSUInteger)evictLockedToFitAdditionalBytes:(unsigned long long)additionalBytes
+{
+    unsigned long long limit = [self byteLimit];
+    NSUInteger evicted = 0;
+    while (_head != NSNotFound && _usedBytes + additionalBytes > limit)
+    {
+        [self evictRecordAtIndex:_head];
+        evicted++;
+    }
+    return evicted;
+}
+
+- (void)evictRecordAtIndex:(NSUInteger)index
+{
+    FDSegmentRecord *record = [_catalog recordAtIndex:index];
+    // Its links are stale once evicted, unlinking again would corrupt the list.
+    if (record == NULL || (record->flags & FDSegmentFlagEvicted))
+    {
+        return;
+    }
+    if (!(record->flags & FDSegmentFlagProtected))
+    {
+        [self removeLinkAtIndex:index];
+    }
+
+    unlink([self pathForSegmentWithIdentifier:record->identifier].fileSystemRepresentation);
+    record->flags |= FDSegmentFlagEvicted;
+    [_catalog synchronizeRecordAtIndex:index];
+    _usedBytes -= MIN(_usedBytes, record->size);
+}
+
+#pragma mark - Eviction list
+
+- (void)resizeLinks
+{
+    NSUInteger length = _catalog.recordCount * sizeof(FDRecordingStoreLink);
+    if (_links.length < length)
+    {
+        _links.length = length;
+    }
+}
+
+- (void)appendLinkAtIndex:(NSUInteger)index
+{
+    FDRecordingStoreLink *links = _links.mutableBytes;
+    links[index].previous = _tail;
+    links[index].next = NSNotFound;
+    if (_tail != NSNotFound)
+    {
+        links[_tail].next = index;
+    }
+    else
+    {
+        _head = index;
+    }
+    _tail = index;
+}
+
+// Unprotecting is rare, so walking back from the tail to keep catalog order is fine.
+- (void)insertLinkAtIndex:(NSUInteger)index
+{
+    FDRecordingStoreLink *links = _links.mutableBytes;
+    NSUInteger previous = _tail;
+    while (previous != NSNotFound && previous > index)
+    {
+        previous = links[previous].previous;
+    }
+
+    NSUInteger next = previous != NSNotFound ? links[previous].next : _head;
+    links[index].previous = previous;
+    links[index].next = next;
+    if (previous != NSNotFound)
+    {
+        links[previous].next = index;
+    }
+    else
+    {
+        _head = index;
+    }
+    if (next != NSNotFound)
+    {
+        links[next].previous = index;
+    }
+    else
+    {
+        _tail = index;
+    }
+}
+
+- (void)removeLinkAtIndex:(NSUInteger)index
+{
+    FDRecordingStoreLink *links = _links.mutableBytes;
+    NSUInteger previous = links[index].previous;
+    NSUInteger next = links[index].next;
+    if (previous != NSNotFound)
+    {
+        links[previous].next = next;
+    }
+    else
+    {
+        _head = next;
+    }
+    if (next != NSNotFound)
+    {
+        links[next].previous = previous;
+    }
+    else
+    {
+        _tail = previous;
+    }
+}
+
+#pragma mark -
+
+@end
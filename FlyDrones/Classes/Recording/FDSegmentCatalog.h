@@ -0,0 +1,55 @@
+//
+//  FDSegmentCatalog.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDSegmentDigest.h"
+
+
+typedef NS_OPTIONS(uint32_t, FDSegmentFlags)
+{
+    FDSegmentFlagFinished = 1 << 0,
+    FDSegmentFlagProtected = 1 << 1,
+    FDSegmentFlagEvicted = 1 << 2,
+    // digest covers the whole segment file as written.
+    FDSegmentFlagDigest = 1 << 3
+};
+
+// One fixed-size catalog entry. Times are microseconds, startTime is since 1970.
+typedef struct FDSegmentRecord
+{
+    uint64_t identifier;
+    int64_t startTime;
+    int64_t duration;
+    uint64_t size;
+    uint32_t flags;
+    uint32_t frameCount;
+    FDSegmentDigest digest;
+    uint8_t reserved[52];
+} FDSegmentRecord;
+
+
+// Append-only, memory-mapped table of recording segments. Records are only ever
+// appended; existing ones are updated in place (flags, size), so reopening is a
+// single mmap. Record pointers stay valid until the next append.
+@interface FDSegmentCatalog : NSObject
+
+@property (nonatomic, copy, readonly) NSString *path;
+@property (nonatomic, assign, readonly) NSUInteger recordCount;
+
++ (instancetype)catalogWithPath:(NSString *)path error:(NSError **)error;
+
+- (FDSegmentRecord *)recordAtIndex:(NSUInteger)index;
+// Binary search, identifiers are appended in increasing order.
+- (NSUInteger)indexOfRecordWithIdentifier:(uint64_t)identifier;
+// Returns NSNotFound when the catalog could not grow; the existing records stay mapped.
+- (NSUInteger)appendRecord:(const FDSegmentRecord *)record;
+// Flushes a record changed in place to disk.
+- (void)synchronizeRecordAtIndex:(NSUInteger)index;
+
+// Rewrites the file without evicted records. Invalidates all indexes.
+- (BOOL)compact:(NSError **)error;
+
+@end
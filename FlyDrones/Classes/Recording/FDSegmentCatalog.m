@@ -0,0 +1,294 @@
+//
+//  FDSegmentCatalog.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDSegmentCatalog.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static uint32_t const FDSegmentCatalogMagic = 0x43534446; // "FDSC"
+static uint32_t const FDSegmentCatalogVersion = 1;
+static NSUInteger const FDSegmentCatalogGrowthRecords = 256;
+
+typedef struct FDSegmentCatalogHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved0;
+    uint64_t recordCount;
+    uint8_t reserved[40];
+} FDSegmentCatalogHeader;
+
+_Static_assert(sizeof(FDSegmentCatalogHeader) == 64, "catalog header layout changed");
+_Static_assert(sizeof(FDSegmentRecord) == 128, "catalog record layout changed");
+
+
+#pragma mark - Private functions
+
+static NSError *FDSegmentCatalogPOSIXError(NSString *path)
+{
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey : path}];
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDSegmentCatalog ()
+{
+    int _fileDescriptor;
+    FDSegmentCatalogHeader *_header;
+    size_t _mappedSize;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, copy, readwrite) NSString *path;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDSegmentCatalog
+
+#pragma mark - Class methods
+
++ (instancetype)catalogWithPath:(NSString *)path error:(NSError **)error
+{
+    FDSegmentCatalog *catalog = [[self alloc] init];
+    catalog.path = path;
+    return [catalog openWithError:error] ? catalog : nil;
+}
+
+#pragma mark - Lifecycle
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _fileDescriptor = -1;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self close];
+}
+
+#pragma mark - Instance methods
+
+- (NSUInteger)recordCount
+{
+    return _header != NULL ? (NSUInteger)_header->recordCount : 0;
+}
+
+- (FDSegmentRecord *)recordAtIndex:(NSUInteger)index
+{
+    if (index >= self.recordCount)
+    {
+        return NULL;
+    }
+    return (FDSegmentRecord *)(_header + 1) + index;
+}
+
+- (NSUInteger)indexOfRecordWithIdentifier:(uint64_t)identifier
+{
+    const FDSegmentRecord *records = (const FDSegmentRecord *)(_header + 1);
+    NSUInteger low = 0;
+    NSUInteger high = self.recordCount;
+    while (low < high)
+    {
+        NSUInteger middle = (low + high) / 2;
+        if (records[middle].identifier < identifier)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low < self.recordCount && records[low].identifier == identifier ? low : NSNotFound;
+}
+
+- (NSUInteger)appendRecord:(const FDSegmentRecord *)record
+{
+    NSUInteger index = self.recordCount;
+    size_t requiredSize = sizeof(FDSegmentCatalogHeader) + (index + 1) * sizeof(FDSegmentRecord);
+    if (requiredSize > _mappedSize && ![self mapWithSize:_mappedSize + FDSegmentCatalogGrowthRecords * sizeof(FDSegmentRecord)])
+    {
+        return NSNotFound;
+    }
+
+    FDSegmentRecord *slot = (FDSegmentRecord *)(_header + 1) + index;
+    memcpy(slot, record, sizeof(*slot));
+    // The record is visible only once the count covers it, so a crash never exposes half a record.
+    __sync_synchronize();
+    _header->recordCount = index + 1;
+
+    [self synchronizeRecordAtIndex:index];
+    msync(_header, sizeof(*_header), MS_ASYNC);
+    return index;
+}
+
+- (void)synchronizeRecordAtIndex:(NSUInteger)index
+{
+    FDSegmentRecord *record = [self recordAtIndex:index];
+    if (record == NULL)
+    {
+        return;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)record & ~(uintptr_t)(pageSize - 1);
+    uintptr_t end = (uintptr_t)(record + 1);
+    msync((void *)start, end - start, MS_ASYNC);
+}
+
+- (BOOL)compact:(NSError **)error
+{
+    NSString *temporaryPath = [self.path stringByAppendingPathExtension:@"tmp"];
+    int descriptor = open(temporaryPath.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (descriptor < 0)
+    {
+        if (error != NULL)
+        {
+            *error = FDSegmentCatalogPOSIXError(temporaryPath);
+        }
+        return NO;
+    }
+
+    NSMutableData *data = [NSMutableData dataWithLength:sizeof(FDSegmentCatalogHeader)];
+    uint64_t liveCount = 0;
+    for (NSUInteger i = 0; i < self.recordCount; i++)
+    {
+        const FDSegmentRecord *record = [self recordAtIndex:i];
+        if (!(record->flags & FDSegmentFlagEvicted))
+        {
+            [data appendBytes:record length:sizeof(*record)];
+            liveCount++;
+        }
+    }
+
+    FDSegmentCatalogHeader *header = data.mutableBytes;
+    header->magic = FDSegmentCatalogMagic;
+    header->version = FDSegmentCatalogVersion;
+    header->recordSize = sizeof(FDSegmentRecord);
+    header->recordCount = liveCount;
+
+    BOOL written = write(descriptor, data.bytes, data.length) == (ssize_t)data.length && fsync(descriptor) == 0;
+    close(descriptor);
+    if (!written || rename(temporaryPath.fileSystemRepresentation, self.path.fileSystemRepresentation) != 0)
+    {
+        if (error != NULL)
+        {
+            *error = FDSegmentCatalogPOSIXError(temporaryPath);
+        }
+        unlink(temporaryPath.fileSystemRepresentation);
+        return NO;
+    }
+
+    [self close];
+    return [self openWithError:error];
+}
+
+#pragma mark - Private methods
+
+- (BOOL)openWithError:(NSError **)error
+{
+    _fileDescriptor = open(self.path.fileSystemRepresentation, O_RDWR | O_CREAT, 0644);
+    struct stat status;
+    if (_fileDescriptor < 0 || fstat(_fileDescriptor, &status) != 0)
+    {
+        if (error != NULL)
+        {
+            *error = FDSegmentCatalogPOSIXError(self.path);
+        }
+        return NO;
+    }
+
+    BOOL created = status.st_size == 0;
+    size_t size = created ? sizeof(FDSegmentCatalogHeader) + FDSegmentCatalogGrowthRecords * sizeof(FDSegmentRecord) : (size_t)status.st_size;
+    if (![self mapWithSize:MAX(size, sizeof(FDSegmentCatalogHeader))])
+    {
+        if (error != NULL)
+        {
+            *error = FDSegmentCatalogPOSIXError(self.path);
+        }
+        return NO;
+    }
+
+    if (created)
+    {
+        _header->magic = FDSegmentCatalogMagic;
+        _header->version = FDSegmentCatalogVersion;
+        _header->recordSize = sizeof(FDSegmentRecord);
+        _header->recordCount = 0;
+    }
+
+    size_t capacity = (_mappedSize - sizeof(FDSegmentCatalogHeader)) / sizeof(FDSegmentRecord);
+    if (_header->magic != FDSegmentCatalogMagic || _header->version != FDSegmentCatalogVersion ||
+        _header->recordSize != sizeof(FDSegmentRecord) || _header->recordCount > capacity)
+    {
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:@{NSFilePathErrorKey : self.path}];
+        }
+        [self close];
+        return NO;
+    }
+    return YES;
+}
+
+// On failure the current mapping, if any, stays in place.
+- (BOOL)mapWithSize:(size_t)size
+{
+    struct stat status;
+    if (fstat(_fileDescriptor, &status) != 0 || ((size_t)status.st_size < size && ftruncate(_fileDescriptor, (off_t)size) != 0))
+    {
+        return NO;
+    }
+
+    void *address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fileDescriptor, 0);
+    if (address == MAP_FAILED)
+    {
+        return NO;
+    }
+
+    if (_header != NULL)
+    {
+        munmap(_header, _mappedSize);
+    }
+    _header = address;
+    _mappedSize = size;
+    return YES;
+}
+
+- (void)close
+{
+    if (_header != NULL)
+    {
+        msync(_header, _mappedSize, MS_SYNC);
+        munmap(_header, _mappedSize);
+        _header = NULL;
+        _mappedSize = 0;
+    }
+    if (_fileDescriptor >= 0)
+    {
+        close(_fileDescriptor);
+        _fileDescriptor = -1;
+    }
+}
+
+#pragma mark -
+
+@end
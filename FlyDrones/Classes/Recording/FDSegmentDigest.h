@@ -0,0 +1,33 @@
+//
+//  FDSegmentDigest.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+typedef struct FDSegmentDigest
+{
+    uint8_t sha256[32];
+    // CRC-32 (IEEE, as zlib), cheap enough to check on every open.
+    uint32_t crc;
+} FDSegmentDigest;
+
+typedef struct FDSegmentHasher FDSegmentHasher;
+
+// Incremental SHA-256 and CRC-32 over the bytes of one segment, fed as they are written.
+FDSegmentHasher *FDSegmentHasherCreate(void);
+void FDSegmentHasherFree(FDSegmentHasher *hasher);
+void FDSegmentHasherReset(FDSegmentHasher *hasher);
+void FDSegmentHasherUpdate(FDSegmentHasher *hasher, const void *bytes, size_t length);
+// Resets the hasher for the next segment.
+void FDSegmentHasherFinish(FDSegmentHasher *hasher, FDSegmentDigest *digest);
+
+BOOL FDSegmentDigestEqual(const FDSegmentDigest *digest1, const FDSegmentDigest *digest2);
+
+// Cache file name for the file at path: its base name plus the SHA-1 of the full
+// standardized path, so files of the same name in different folders never share it.
+NSString *FDDigestFileNameForPath(NSString *path, NSString *extension);
@@ -0,0 +1,97 @@
+//
+//  FDSegmentDigest.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDSegmentDigest.h"
+#include "libavutil/crc.h"
+#include "libavutil/mem.h"
+#include "libavutil/sha.h"
+#import <CommonCrypto/CommonDigest.h>
+
+
+struct FDSegmentHasher
+{
+    struct AVSHA *sha;
+    const AVCRC *crcTable;
+    uint32_t crc;
+};
+
+
+#pragma mark - Public functions
+
+FDSegmentHasher *FDSegmentHasherCreate(void)
+{
+    FDSegmentHasher *hasher = calloc(1, sizeof(FDSegmentHasher));
+    if (hasher == NULL)
+    {
+        return NULL;
+    }
+
+    hasher->sha = av_sha_alloc();
+    if (hasher->sha == NULL)
+    {
+        free(hasher);
+        return NULL;
+    }
+    hasher->crcTable = av_crc_get_table(AV_CRC_32_IEEE_LE);
+    FDSegmentHasherReset(hasher);
+    return hasher;
+}
+
+void FDSegmentHasherFree(FDSegmentHasher *hasher)
+{
+    if (hasher != NULL)
+    {
+        av_freep(&hasher->sha);
+        free(hasher);
+    }
+}
+
+void FDSegmentHasherReset(FDSegmentHasher *hasher)
+{
+    av_sha_init(hasher->sha, 256);
+    hasher->crc = UINT32_MAX;
+}
+
+void FDSegmentHasherUpdate(FDSegmentHasher *hasher, const void *bytes, size_t length)
+{
+    const uint8_t *data = bytes;
+    while (length > 0)
+    {
+        // av_sha_update takes an unsigned int length.
+        unsigned int chunk = (unsigned int)MIN(length, (size_t)UINT32_MAX);
+        av_sha_update(hasher->sha, data, chunk);
+        hasher->crc = av_crc(hasher->crcTable, hasher->crc, data, chunk);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+void FDSegmentHasherFinish(FDSegmentHasher *hasher, FDSegmentDigest *digest)
+{
+    av_sha_final(hasher->sha, digest->sha256);
+    digest->crc = hasher->crc ^ UINT32_MAX;
+    FDSegmentHasherReset(hasher);
+}
+
+BOOL FDSegmentDigestEqual(const FDSegmentDigest *digest1, const FDSegmentDigest *digest2)
+{
+    return digest1->crc == digest2->crc && memcmp(digest1->sha256, digest2->sha256, sizeof(digest1->sha256)) == 0;
+}
+
+NSString *FDDigestFileNameForPath(NSString *path, NSString *extension)
+{
+    const char *fileSystemPath = path.stringByStandardizingPath.fileSystemRepresentation;
+    uint8_t digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1(fileSystemPath, (CC_LONG)strlen(fileSystemPath), digest);
+
+    NSMutableString *name = [NSMutableString stringWithFormat:@"%@-", path.lastPathComponent.stringByDeletingPathExtension];
+    for (size_t i = 0; i < sizeof(digest); i++)
+    {
+        [name appendFormat:@"%02x", digest[i]];
+    }
+    return [name stringByAppendingPathExtension:extension];
+}
@@ -0,0 +1,29 @@
+//
+//  FDSegmentedRecorder.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDRecordingStore.h"
+
+
+// Writes an Annex B H.264 stream into fixed-duration segments of a recording
+// store. A new segment starts on the first keyframe after segmentDuration, so
+// every segment is decodable on its own. Writes happen on a private serial queue.
+@interface FDSegmentedRecorder : NSObject
+
+@property (nonatomic, strong, readonly) FDRecordingStore *store;
+@property (nonatomic, assign, readonly) NSTimeInterval segmentDuration;
+// Used to reserve quota when a segment begins, in bytes per second.
+@property (nonatomic, assign) unsigned long long expectedByteRate;
+@property (nonatomic, assign, readonly) uint64_t currentSegmentIdentifier;
+
+// Returns nil when the segment hasher cannot be allocated.
+- (instancetype)initWithStore:(FDRecordingStore *)store segmentDuration:(NSTimeInterval)segmentDuration;
+
+// timestamp is the stream time in seconds. The data is retained, not copied.
+- (void)appendAccessUnit:(NSData *)accessUnit timestamp:(NSTimeInterval)timestamp keyframe:(BOOL)keyframe;
+- (void)finishWithCompletion:(void (^)(void))completion;
+
+@end
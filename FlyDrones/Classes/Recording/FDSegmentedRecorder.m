@@ -0,0 +1,176 @@
+//
+//  FDSegmentedRecorder.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDSegmentedRecorder.h"
+
+
+static size_t const FDSegmentedRecorderBufferSize = 256 * 1024;
+static unsigned long long const FDSegmentedRecorderDefaultByteRate = 1024 * 1024;
+
+
+#pragma mark - Private interface methods
+
+@interface FDSegmentedRecorder ()
+{
+    dispatch_queue_t _queue;
+    FILE *_file;
+    char *_fileBuffer;
+    FDSegmentHasher *_hasher;
+    BOOL _segmentDamaged;
+    NSTimeInterval _segmentStartTimestamp;
+    NSTimeInterval _lastTimestamp;
+    unsigned long long _segmentSize;
+    NSUInteger _segmentFrameCount;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, strong, readwrite) FDRecordingStore *store;
+@property (nonatomic, assign, readwrite) NSTimeInterval segmentDuration;
+@property (atomic, assign, readwrite) uint64_t currentSegmentIdentifier;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDSegmentedRecorder
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithStore:(FDRecordingStore *)store segmentDuration:(NSTimeInterval)segmentDuration
+{
+    self = [super init];
+    if (self)
+    {
+        _store = store;
+        _segmentDuration = segmentDuration;
+        _expectedByteRate = FDSegmentedRecorderDefaultByteRate;
+        _queue = dispatch_queue_create("com.flydrones.segmented-recorder", DISPATCH_QUEUE_SERIAL);
+        _hasher = FDSegmentHasherCreate();
+        if (_hasher == NULL)
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self closeSegment];
+    free(_fileBuffer);
+    FDSegmentHasherFree(_hasher);
+}
+
+#pragma mark - Instance methods
+
+- (void)appendAccessUnit:(NSData *)accessUnit timestamp:(NSTimeInterval)timestamp keyframe:(BOOL)keyframe
+{
+    dispatch_async(_queue, ^{
+        BOOL segmentFull = _file != NULL && timestamp - _segmentStartTimestamp >= self.segmentDuration;
+        if (keyframe && (_file == NULL || segmentFull))
+        {
+            [self closeSegment];
+            [self openSegmentAtTimestamp:timestamp];
+        }
+        if (_file == NULL)
+        {
+            // Waiting for the first keyframe, or the store could not make room.
+            return;
+        }
+
+        if (fwrite(accessUnit.bytes, 1, accessUnit.length, _file) != accessUnit.length)
+        {
+            NSLog(@"Unable to write segment %llu: %s", self.currentSegmentIdentifier, strerror(errno));
+            _segmentDamaged = YES;
+            [self closeSegment];
+            return;
+        }
+        // Hashing the bytes already in cache is far cheaper than rereading the file later.
+        FDSegmentHasherUpdate(_hasher, accessUnit.bytes, accessUnit.length);
+        _segmentSize += accessUnit.length;
+        _segmentFrameCount++;
+        _lastTimestamp = timestamp;
+    });
+}
+
+- (void)finishWithCompletion:(void (^)(void))completion
+{
+    dispatch_async(_queue, ^{
+        [self closeSegment];
+        if (completion != nil)
+        {
+            dispatch_async(dispatch_get_main_queue(), completion);
+        }
+    });
+}
+
+#pragma mark - Private methods
+
+- (void)openSegmentAtTimestamp:(NSTimeInterval)timestamp
+{
+    unsigned long long expectedSize = (unsigned long long)(self.expectedByteRate * self.segmentDuration);
+    uint64_t identifier = [self.store beginSegmentWithStartDate:[NSDate date] expectedSize:expectedSize];
+    if (identifier == 0)
+    {
+        return;
+    }
+
+    NSString *path = [self.store pathForSegmentWithIdentifier:identifier];
+    _file = fopen(path.fileSystemRepresentation, "wb");
+    if (_file == NULL)
+    {
+        NSLog(@"Unable to create segment %@: %s", path, strerror(errno));
+        [self.store finishSegmentWithIdentifier:identifier duration:0 size:0 frameCount:0 digest:NULL];
+        return;
+    }
+
+    if (_fileBuffer == NULL)
+    {
+        _fileBuffer = malloc(FDSegmentedRecorderBufferSize);
+    }
+    setvbuf(_file, _fileBuffer, _IOFBF, FDSegmentedRecorderBufferSize);
+
+    self.currentSegmentIdentifier = identifier;
+    _segmentStartTimestamp = timestamp;
+    _lastTimestamp = timestamp;
+    _segmentSize = 0;
+    _segmentFrameCount = 0;
+    _segmentDamaged = NO;
+    FDSegmentHasherReset(_hasher);
+}
+
+- (void)closeSegment
+{
+    if (_file != NULL)
+    {
+        // A segment whose bytes did not all reach the disk gets no digest.
+        BOOL written = fclose(_file) == 0 && !_segmentDamaged;
+        _file = NULL;
+
+        FDSegmentDigest digest;
+        FDSegmentHasherFinish(_hasher, &digest);
+
+        NSTimeInterval duration = _lastTimestamp - _segmentStartTimestamp;
+        if (_segmentFrameCount > 1)
+        {
+            // Account for the display time of the last frame.
+            duration += duration / (_segmentFrameCount - 1);
+        }
+        [self.store finishSegmentWithIdentifier:self.currentSegmentIdentifier
+                                       duration:duration
+                                           size:_segmentSize
+                                     frameCount:_segmentFrameCount
+                                         digest:written ? &digest : NULL];
+        self.currentSegmentIdentifier = 0;
+    }
+}
+
+#pragma mark -
+
+@end
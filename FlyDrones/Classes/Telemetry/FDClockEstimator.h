@@ -0,0 +1,50 @@
+//
+//  FDClockEstimator.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stdint.h>
+
+
+// Tracks hostTime ~= offset + skew * (sourceTime - origin) for a remote clock seen
+// through a link with variable delay. Samples are fit by exponentially weighted
+// least squares; late arrivals get little weight so the fit follows the lower
+// delay envelope rather than the mean. Every update is O(1).
+typedef struct FDClockEstimator
+{
+    double forgetting;
+    double origin;
+    double hostOrigin;
+    double weight;
+    double sumX;
+    double sumY;
+    double sumXX;
+    double sumXY;
+    double offset;
+    double skew;
+    // Running mean absolute residual, in seconds.
+    double jitter;
+    double lastSourceTime;
+    unsigned long sampleCount;
+} FDClockEstimator;
+
+// forgetting is per sample; 0.999 at 50 Hz averages over roughly 20 seconds.
+void FDClockEstimatorInit(FDClockEstimator *estimator, double forgetting);
+void FDClockEstimatorReset(FDClockEstimator *estimator);
+void FDClockEstimatorAddSample(FDClockEstimator *estimator, double sourceTime, double hostTime);
+
+static inline double FDClockEstimatorHostTime(const FDClockEstimator *estimator, double sourceTime)
+{
+    return estimator->offset + estimator->skew * (sourceTime - estimator->origin);
+}
+
+static inline double FDClockEstimatorSourceTime(const FDClockEstimator *estimator, double hostTime)
+{
+    return estimator->origin + (hostTime - estimator->offset) / estimator->skew;
+}
+
+// Extends a wrapping 32-bit counter (RTP timestamps, time_boot_ms) to 64 bits.
+// last holds the previous extended value and is updated; start it at -1.
+int64_t FDClockUnwrapTimestamp(uint32_t timestamp, int64_t *last);
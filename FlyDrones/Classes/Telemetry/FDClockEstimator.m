@@ -0,0 +1,99 @@
+//
+//  FDClockEstimator.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDClockEstimator.h"
+
+
+// Crystal drift is tens of ppm; anything beyond this is noise during warm-up.
+static double const FDClockEstimatorMaximumSkewError = 1e-3;
+// Samples later than the fit by this many jitters are treated as delayed.
+static double const FDClockEstimatorDelayedThreshold = 2.0;
+static double const FDClockEstimatorDelayedWeight = 0.05;
+// A source clock that jumps back this far has restarted.
+static double const FDClockEstimatorRestartThreshold = 1.0;
+
+
+#pragma mark - Public functions
+
+void FDClockEstimatorInit(FDClockEstimator *estimator, double forgetting)
+{
+    estimator->forgetting = forgetting;
+    FDClockEstimatorReset(estimator);
+}
+
+void FDClockEstimatorReset(FDClockEstimator *estimator)
+{
+    double forgetting = estimator->forgetting;
+    memset(estimator, 0, sizeof(*estimator));
+    estimator->forgetting = forgetting;
+    estimator->skew = 1.0;
+}
+
+void FDClockEstimatorAddSample(FDClockEstimator *estimator, double sourceTime, double hostTime)
+{
+    if (estimator->sampleCount > 0 && sourceTime < estimator->lastSourceTime - FDClockEstimatorRestartThreshold)
+    {
+        FDClockEstimatorReset(estimator);
+    }
+    if (estimator->sampleCount == 0)
+    {
+        estimator->origin = sourceTime;
+        estimator->hostOrigin = hostTime;
+        estimator->offset = hostTime;
+    }
+    estimator->lastSourceTime = sourceTime;
+    estimator->sampleCount++;
+
+    // Both axes relative to the first sample keep the sums well conditioned.
+    double x = sourceTime - estimator->origin;
+    double y = hostTime - estimator->hostOrigin;
+    double residual = hostTime - FDClockEstimatorHostTime(estimator, sourceTime);
+    double weight = 1.0;
+    if (estimator->sampleCount > 10 && residual > FDClockEstimatorDelayedThreshold * estimator->jitter)
+    {
+        weight = FDClockEstimatorDelayedWeight;
+    }
+    else if (residual < 0)
+    {
+        // Earlier than predicted: the fit is above the delay floor, pull it down harder.
+        weight = 2.0;
+    }
+    estimator->jitter += (fabs(residual) - estimator->jitter) * 0.05;
+
+    double forgetting = estimator->forgetting;
+    estimator->weight = estimator->weight * forgetting + weight;
+    estimator->sumX = estimator->sumX * forgetting + weight * x;
+    estimator->sumY = estimator->sumY * forgetting + weight * y;
+    estimator->sumXX = estimator->sumXX * forgetting + weight * x * x;
+    estimator->sumXY = estimator->sumXY * forgetting + weight * x * y;
+
+    double meanX = estimator->sumX / estimator->weight;
+    double meanY = estimator->sumY / estimator->weight;
+    double varianceX = estimator->sumXX / estimator->weight - meanX * meanX;
+    double skew = 1.0;
+    // Skew is only observable once the samples span a meaningful interval.
+    if (varianceX > 1.0)
+    {
+        skew = (estimator->sumXY / estimator->weight - meanX * meanY) / varianceX;
+        skew = fmax(1.0 - FDClockEstimatorMaximumSkewError, fmin(1.0 + FDClockEstimatorMaximumSkewError, skew));
+    }
+    estimator->skew = skew;
+    estimator->offset = estimator->hostOrigin + meanY - skew * meanX;
+}
+
+int64_t FDClockUnwrapTimestamp(uint32_t timestamp, int64_t *last)
+{
+    if (*last < 0)
+    {
+        *last = timestamp;
+        return *last;
+    }
+    // The signed 32-bit difference handles wrap in either direction.
+    int32_t delta = (int32_t)(timestamp - (uint32_t)*last);
+    *last += delta;
+    return *last;
+}
@@ -0,0 +1,150 @@
+//
+//  FDMAVLinkParser.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+typedef NS_ENUM(uint32_t, FDMAVLinkMessageID)
+{
+    FDMAVLinkMessageIDHeartbeat = 0,
+    FDMAVLinkMessageIDSysStatus = 1,
+    FDMAVLinkMessageIDSystemTime = 2,
+    FDMAVLinkMessageIDPing = 4,
+    FDMAVLinkMessageIDParamValue = 22,
+    FDMAVLinkMessageIDGPSRawInt = 24,
+    FDMAVLinkMessageIDRawIMU = 27,
+    FDMAVLinkMessageIDScaledPressure = 29,
+    FDMAVLinkMessageIDAttitude = 30,
+    FDMAVLinkMessageIDAttitudeQuaternion = 31,
+    FDMAVLinkMessageIDLocalPositionNED = 32,
+    FDMAVLinkMessageIDGlobalPositionInt = 33,
+    FDMAVLinkMessageIDRCChannelsRaw = 35,
+    FDMAVLinkMessageIDServoOutputRaw = 36,
+    FDMAVLinkMessageIDMissionCurrent = 42,
+    FDMAVLinkMessageIDNavControllerOutput = 62,
+    FDMAVLinkMessageIDRCChannels = 65,
+    FDMAVLinkMessageIDVFRHUD = 74,
+    FDMAVLinkMessageIDCommandLong = 76,
+    FDMAVLinkMessageIDCommandAck = 77,
+    FDMAVLinkMessageIDHighresIMU = 105,
+    FDMAVLinkMessageIDTimesync = 111,
+    FDMAVLinkMessageIDBatteryStatus = 147,
+    FDMAVLinkMessageIDHomePosition = 242,
+    FDMAVLinkMessageIDExtendedSysState = 245,
+    FDMAVLinkMessageIDStatustext = 253
+};
+
+// Largest MAVLink v2 frame: header, payload, checksum and signature.
+#define FDMAVLinkMaximumFrameLength 280
+#define FDMAVLinkMaximumPayloadLength 255
+
+// A validated frame. payload points into the parser's receive ring (or, for a
+// truncated v2 payload, a zero-extended scratch copy) and is only valid for the
+// duration of the handler call.
+typedef struct FDMAVLinkMessage
+{
+    const uint8_t *payload;
+    uint32_t messageID;
+    uint8_t payloadLength;
+    uint8_t version;
+    uint8_t sequence;
+    uint8_t systemID;
+    uint8_t componentID;
+} FDMAVLinkMessage;
+
+// Payload fields are little-endian at fixed offsets, like the host byte order on iOS.
+static inline uint16_t FDMAVLinkReadUInt16(const FDMAVLinkMessage *message, size_t offset)
+{
+    uint16_t value;
+    memcpy(&value, message->payload + offset, sizeof(value));
+    return value;
+}
+
+static inline int16_t FDMAVLinkReadInt16(const FDMAVLinkMessage *message, size_t offset)
+{
+    return (int16_t)FDMAVLinkReadUInt16(message, offset);
+}
+
+static inline uint32_t FDMAVLinkReadUInt32(const FDMAVLinkMessage *message, size_t offset)
+{
+    uint32_t value;
+    memcpy(&value, message->payload + offset, sizeof(value));
+    return value;
+}
+
+static inline int32_t FDMAVLinkReadInt32(const FDMAVLinkMessage *message, size_t offset)
+{
+    return (int32_t)FDMAVLinkReadUInt32(message, offset);
+}
+
+static inline float FDMAVLinkReadFloat(const FDMAVLinkMessage *message, size_t offset)
+{
+    float value;
+    memcpy(&value, message->payload + offset, sizeof(value));
+    return value;
+}
+
+typedef void (*FDMAVLinkHandler)(const FDMAVLinkMessage *message, void *context);
+
+typedef NS_ENUM(NSInteger, FDMAVLinkFrameStatus)
+{
+    FDMAVLinkFrameStatusValid,
+    FDMAVLinkFrameStatusIncomplete,
+    // Bad magic, CRC, length or incompatible flags.
+    FDMAVLinkFrameStatusInvalid,
+    // Framed, but the message ID has no CRC_EXTRA so the frame is unverified.
+    FDMAVLinkFrameStatusUnknown
+};
+
+typedef struct FDMAVLinkParserStatistics
+{
+    uint64_t messageCount;
+    uint64_t crcErrorCount;
+    // Candidate frames with a message ID missing from the dispatch table. Their CRC
+    // cannot be checked, so they are skipped like noise.
+    uint64_t unknownMessageCount;
+    // Bytes skipped while resynchronizing, e.g. .tlog timestamps or line noise.
+    uint64_t droppedByteCount;
+    uint64_t byteCount;
+} FDMAVLinkParserStatistics;
+
+typedef struct FDMAVLinkParser FDMAVLinkParser;
+
+// Frames MAVLink v1 and v2 messages in place over a receive ring of ringCapacity
+// bytes (rounded up to a power of two). Not thread safe; feed from one queue.
+FDMAVLinkParser *FDMAVLinkParserCreate(size_t ringCapacity);
+void FDMAVLinkParserFree(FDMAVLinkParser *parser);
+
+// Returns NO for message IDs without CRC_EXTRA in the dispatch table.
+BOOL FDMAVLinkParserSetHandler(FDMAVLinkParser *parser, uint32_t messageID, FDMAVLinkHandler handler, void *context);
+
+// Contiguous free space in the ring, for reading a socket straight into it.
+uint8_t *FDMAVLinkParserWritePointer(FDMAVLinkParser *parser, size_t *available);
+// Makes length bytes written through the write pointer visible and dispatches every complete frame.
+void FDMAVLinkParserCommit(FDMAVLinkParser *parser, size_t length);
+// Copies bytes into the ring and parses them. Returns the number of bytes consumed.
+size_t FDMAVLinkParserFeed(FDMAVLinkParser *parser, const uint8_t *bytes, size_t length);
+
+FDMAVLinkParserStatistics FDMAVLinkParserGetStatistics(const FDMAVLinkParser *parser);
+
+// Validates one frame in a contiguous buffer. frameLength is set for valid and
+// unknown frames; scratch (FDMAVLinkMaximumPayloadLength bytes) receives
+// zero-extended truncated v2 payloads and may be NULL to keep them as sent.
+FDMAVLinkFrameStatus FDMAVLinkDecodeFrame(const uint8_t *frame,
+                                          size_t available,
+                                          FDMAVLinkMessage *message,
+                                          size_t *frameLength,
+                                          uint8_t *scratch);
+
+// CRC-16/MCRF4XX as used by MAVLink (X.25 polynomial, no final xor). Start with 0xFFFF.
+uint16_t FDMAVLinkCRCAccumulate(uint16_t crc, const uint8_t *bytes, size_t length);
+
+// Replays a capture (raw stream or .tlog) through a parser with every known
+// message handled and logs throughput. Returns messages per second.
+double FDMAVLinkParserBenchmark(const uint8_t *bytes, size_t length);
@@ -0,0 +1,20 @@
+//
+//  FDTelemetryBlockCodec.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Upper bound of an encoded block of count samples.
+#define FDTelemetryBlockMaximumSize(count) (16 + (count) * 14)
+
+// Packs one column block into a bit stream: timestamps as delta-of-delta with
+// variable-width buckets (a regular rate costs one bit per sample), values as
+// the XOR with their predecessor storing only the meaningful bits. Returns the
+// number of bytes written.
+size_t FDTelemetryBlockEncode(const int64_t *times, const float *values, size_t count, uint8_t *output);
+void FDTelemetryBlockDecode(const uint8_t *input, size_t count, int64_t *times, float *values);
@@ -0,0 +1,217 @@
+//
+//  FDTelemetryBlockCodec.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDTelemetryBlockCodec.h"
+
+
+typedef struct FDBitWriter
+{
+    uint8_t *output;
+    size_t position;
+    uint64_t accumulator;
+    int bitCount;
+} FDBitWriter;
+
+typedef struct FDBitReader
+{
+    const uint8_t *input;
+    uint64_t accumulator;
+    int bitCount;
+} FDBitReader;
+
+// Delta-of-delta buckets: prefix bits, prefix length, payload bits.
+static const struct
+{
+    uint32_t prefix;
+    int prefixLength;
+    int bits;
+} FDTelemetryTimeBuckets[] =
+{
+    {0x2, 2, 7},
+    {0x6, 3, 9},
+    {0xE, 4, 12},
+    {0xF, 4, 64}
+};
+
+
+#pragma mark - Private functions
+
+static inline void FDBitWriterWrite(FDBitWriter *writer, uint64_t value, int bits)
+{
+    if (bits > 32)
+    {
+        FDBitWriterWrite(writer, value >> 32, bits - 32);
+        value &= 0xFFFFFFFF;
+        bits = 32;
+    }
+    writer->accumulator = (writer->accumulator << bits) | (value & ((1ULL << bits) - 1));
+    writer->bitCount += bits;
+    while (writer->bitCount >= 8)
+    {
+        writer->bitCount -= 8;
+        writer->output[writer->position++] = (uint8_t)(writer->accumulator >> writer->bitCount);
+    }
+}
+
+static inline void FDBitWriterFlush(FDBitWriter *writer)
+{
+    if (writer->bitCount > 0)
+    {
+        writer->output[writer->position++] = (uint8_t)(writer->accumulator << (8 - writer->bitCount));
+        writer->bitCount = 0;
+    }
+}
+
+static inline uint64_t FDBitReaderRead(FDBitReader *reader, int bits)
+{
+    if (bits > 32)
+    {
+        uint64_t high = FDBitReaderRead(reader, bits - 32);
+        return (high << 32) | FDBitReaderRead(reader, 32);
+    }
+    while (reader->bitCount < bits)
+    {
+        reader->accumulator = (reader->accumulator << 8) | *reader->input++;
+        reader->bitCount += 8;
+    }
+    reader->bitCount -= bits;
+    return (reader->accumulator >> reader->bitCount) & ((1ULL << bits) - 1);
+}
+
+static inline uint32_t FDFloatBits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+
+#pragma mark - Public functions
+
+size_t FDTelemetryBlockEncode(const int64_t *times, const float *values, size_t count, uint8_t *output)
+{
+    FDBitWriter writer = {output, 0, 0, 0};
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    FDBitWriterWrite(&writer, (uint64_t)times[0], 64);
+    FDBitWriterWrite(&writer, FDFloatBits(values[0]), 32);
+
+    int64_t previousDelta = 0;
+    uint32_t previousBits = FDFloatBits(values[0]);
+    int previousLeading = 33;
+    int previousTrailing = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        int64_t delta = times[i] - times[i - 1];
+        int64_t deltaOfDelta = delta - previousDelta;
+        previousDelta = delta;
+        if (deltaOfDelta == 0)
+        {
+            FDBitWriterWrite(&writer, 0, 1);
+        }
+        else
+        {
+            for (size_t bucket = 0; bucket < sizeof(FDTelemetryTimeBuckets) / sizeof(FDTelemetryTimeBuckets[0]); bucket++)
+            {
+                int bits = FDTelemetryTimeBuckets[bucket].bits;
+                int64_t limit = bits < 64 ? (1LL << (bits - 1)) : INT64_MAX;
+                if (bits == 64 || (deltaOfDelta >= -limit && deltaOfDelta < limit))
+                {
+                    FDBitWriterWrite(&writer, FDTelemetryTimeBuckets[bucket].prefix, FDTelemetryTimeBuckets[bucket].prefixLength);
+                    FDBitWriterWrite(&writer, (uint64_t)deltaOfDelta, bits);
+                    break;
+                }
+            }
+        }
+
+        uint32_t bits = FDFloatBits(values[i]);
+        uint32_t xor = bits ^ previousBits;
+        previousBits = bits;
+        if (xor == 0)
+        {
+            FDBitWriterWrite(&writer, 0, 1);
+            continue;
+        }
+
+        int leading = __builtin_clz(xor);
+        int trailing = __builtin_ctz(xor);
+        if (leading >= previousLeading && trailing >= previousTrailing)
+        {
+            // Fits the previous window, which slowly varying telemetry usually does.
+            FDBitWriterWrite(&writer, 0x2, 2);
+            FDBitWriterWrite(&writer, xor >> previousTrailing, 32 - previousLeading - previousTrailing);
+        }
+        else
+        {
+            int length = 32 - leading - trailing;
+            FDBitWriterWrite(&writer, 0x3, 2);
+            FDBitWriterWrite(&writer, (uint64_t)leading, 5);
+            FDBitWriterWrite(&writer, (uint64_t)(length - 1), 5);
+            FDBitWriterWrite(&writer, xor >> trailing, length);
+            previousLeading = leading;
+            previousTrailing = trailing;
+        }
+    }
+
+    FDBitWriterFlush(&writer);
+    return writer.position;
+}
+
+void FDTelemetryBlockDecode(const uint8_t *input, size_t count, int64_t *times, float *values)
+{
+    FDBitReader reader = {input, 0, 0};
+    if (count == 0)
+    {
+        return;
+    }
+
+    times[0] = (int64_t)FDBitReaderRead(&reader, 64);
+    uint32_t previousBits = (uint32_t)FDBitReaderRead(&reader, 32);
+    memcpy(&values[0], &previousBits, sizeof(float));
+
+    int64_t previousDelta = 0;
+    int previousLeading = 33;
+    int previousTrailing = 0;
+    for (size_t i = 1; i < count; i++)
+    {
+        if (FDBitReaderRead(&reader, 1) != 0)
+        {
+            // Prefixes 10, 110, 1110 and 1111 select the bucket.
+            size_t bucket = 0;
+            while (bucket < 3 && FDBitReaderRead(&reader, 1) != 0)
+            {
+                bucket++;
+            }
+            int bits = FDTelemetryTimeBuckets[bucket].bits;
+            uint64_t raw = FDBitReaderRead(&reader, bits);
+            // Sign-extend the two's complement payload.
+            previousDelta += bits < 64 ? (int64_t)(raw << (64 - bits)) >> (64 - bits) : (int64_t)raw;
+        }
+        times[i] = times[i - 1] + previousDelta;
+
+        if (FDBitReaderRead(&reader, 1) != 0)
+        {
+            uint32_t xor;
+            if (FDBitReaderRead(&reader, 1) == 0)
+            {
+                xor = (uint32_t)FDBitReaderRead(&reader, 32 - previousLeading - previousTrailing) << previousTrailing;
+            }
+            else
+            {
+                previousLeading = (int)FDBitReaderRead(&reader, 5);
+                int length = (int)FDBitReaderRead(&reader, 5) + 1;
+                previousTrailing = 32 - previousLeading - length;
+                xor = (uint32_t)FDBitReaderRead(&reader, length) << previousTrailing;
+            }
+            previousBits ^= xor;
+        }
+        memcpy(&values[i], &previousBits, sizeof(float));
+    }
+}
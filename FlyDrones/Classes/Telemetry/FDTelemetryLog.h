@@ -0,0 +1,48 @@
+//
+//  FDTelemetryLog.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDMAVLinkParser.h"
+
+
+// Pass as messageID to enumerate every message.
+#define FDTelemetryLogAnyMessage UINT32_MAX
+
+typedef void (^FDTelemetryLogBlock)(int64_t time, const FDMAVLinkMessage *message, BOOL *stop);
+// frame is the raw MAVLink frame without the timestamp, pointing into the mapping.
+typedef void (^FDTelemetryLogRecordBlock)(int64_t time, const uint8_t *frame, size_t length, BOOL *stop);
+
+
+// Random access to a memory-mapped MAVLink .tlog, where every frame follows an
+// 8-byte big-endian timestamp in microseconds since 1970. A sparse index holds
+// one entry per 64 KB of log with the message IDs seen in that span; it is built
+// by scanning chunks of the file concurrently and cached next to other indexes,
+// so reopening a log costs one read. Seeking is a binary search plus at most one span.
+@interface FDTelemetryLog : NSObject
+
+@property (nonatomic, copy, readonly) NSString *path;
+@property (nonatomic, assign, readonly) NSUInteger recordCount;
+// Microseconds since 1970.
+@property (nonatomic, assign, readonly) int64_t startTime;
+@property (nonatomic, assign, readonly) int64_t endTime;
+
+// Caches/TelemetryIndex by default.
++ (NSString *)defaultIndexDirectory;
++ (instancetype)logWithContentsOfFile:(NSString *)path indexDirectory:(NSString *)indexDirectory error:(NSError **)error;
+
+- (NSUInteger)countOfMessagesWithID:(uint32_t)messageID;
+// File offset of the first record at or after time.
+- (unsigned long long)offsetOfRecordAtTime:(int64_t)time;
+// Spans without the requested message ID are skipped using the index.
+- (void)enumerateMessagesWithID:(uint32_t)messageID
+                       fromTime:(int64_t)fromTime
+                         toTime:(int64_t)toTime
+                     usingBlock:(FDTelemetryLogBlock)block;
+- (void)enumerateRecordsFromTime:(int64_t)fromTime
+                          toTime:(int64_t)toTime
+                      usingBlock:(FDTelemetryLogRecordBlock)block;
+
+@end
@@ -0,0 +1,482 @@
+//
+//  FDTelemetryLog.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDTelemetryLog.h"
+#import "FDSegmentDigest.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define FDTelemetryLogTimestampLength 8
+
+static uint32_t const FDTelemetryLogIndexMagic = 0x49544446; // 'FDTI'
+static uint32_t const FDTelemetryLogIndexVersion = 1;
+static size_t const FDTelemetryLogSpanSize = 64 * 1024;
+static size_t const FDTelemetryLogMinimumChunkSize = 4 * 1024 * 1024;
+static NSUInteger const FDTelemetryLogChunksPerCore = 4;
+// Timestamps outside 2010...2100 cannot start a record, which makes resyncing reliable.
+static int64_t const FDTelemetryLogEarliestTime = 1262304000000000LL;
+static int64_t const FDTelemetryLogLatestTime = 4102444800000000LL;
+
+// One index entry per span; messageMask has bit (ID & 255) set for every message in the span.
+typedef struct FDTelemetryLogEntry
+{
+    int64_t time;
+    uint64_t offset;
+    uint64_t messageMask[4];
+} FDTelemetryLogEntry;
+
+typedef struct FDTelemetryLogIndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t entryCount;
+    uint64_t recordCount;
+    int64_t sourceSize;
+    double sourceModificationDate;
+    int64_t startTime;
+    int64_t endTime;
+    uint32_t messageCounts[256];
+} FDTelemetryLogIndexHeader;
+
+typedef struct FDTelemetryLogChunk
+{
+    size_t start;
+    size_t end;
+    FDTelemetryLogEntry *entries;
+    size_t entryCount;
+    size_t entryCapacity;
+    uint64_t recordCount;
+    int64_t startTime;
+    int64_t endTime;
+    uint32_t messageCounts[256];
+} FDTelemetryLogChunk;
+
+
+#pragma mark - Private functions
+
+static inline int64_t FDTelemetryLogReadTimestamp(const uint8_t *bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < FDTelemetryLogTimestampLength; i++)
+    {
+        value = (value << 8) | bytes[i];
+    }
+    return (int64_t)value;
+}
+
+// Advances offset to the first record at or after it. Once in sync, frames with
+// unknown message IDs are trusted since the record chain frames them. Returns
+// FDMAVLinkFrameStatusIncomplete at the end of the log.
+static FDMAVLinkFrameStatus FDTelemetryLogFindRecord(const uint8_t *base,
+                                     size_t size,
+                                     size_t *offset,
+                                     BOOL synced,
+                                     int64_t *time,
+                                     FDMAVLinkMessage *message,
+                                     size_t *recordLength,
+                                     uint8_t *scratch)
+{
+    while (*offset + FDTelemetryLogTimestampLength < size)
+    {
+        const uint8_t *record = base + *offset;
+        int64_t timestamp = FDTelemetryLogReadTimestamp(record);
+        if (timestamp >= FDTelemetryLogEarliestTime && timestamp <= FDTelemetryLogLatestTime)
+        {
+            size_t frameLength;
+            FDMAVLinkFrameStatus status = FDMAVLinkDecodeFrame(record + FDTelemetryLogTimestampLength,
+                                                               size - *offset - FDTelemetryLogTimestampLength,
+                                                               message, &frameLength, scratch);
+            if (status == FDMAVLinkFrameStatusValid || (synced && status == FDMAVLinkFrameStatusUnknown))
+            {
+                *time = timestamp;
+                *recordLength = FDTelemetryLogTimestampLength + frameLength;
+                return status;
+            }
+            if (status == FDMAVLinkFrameStatusIncomplete)
+            {
+                // Truncated last record of a log that was still being written.
+                return status;
+            }
+        }
+        synced = NO;
+        (*offset)++;
+    }
+    return FDMAVLinkFrameStatusIncomplete;
+}
+
+static void FDTelemetryLogScanChunk(FDTelemetryLogChunk *chunk, const uint8_t *base, size_t size)
+{
+    size_t offset = chunk->start;
+    size_t nextSpan = offset;
+    BOOL synced = NO;
+    int64_t time;
+    FDMAVLinkMessage message;
+    size_t recordLength;
+    FDMAVLinkFrameStatus status;
+    chunk->startTime = INT64_MAX;
+    chunk->endTime = INT64_MIN;
+
+    while ((status = FDTelemetryLogFindRecord(base, size, &offset, synced, &time, &message, &recordLength, NULL)) != FDMAVLinkFrameStatusIncomplete)
+    {
+        // A record straddling the end belongs to this chunk, and so do unverifiable
+        // ones after it: the next chunk can only resync on a verified record.
+        if (offset >= chunk->end && status == FDMAVLinkFrameStatusValid)
+        {
+            break;
+        }
+        synced = YES;
+        if (offset >= nextSpan)
+        {
+            if (chunk->entryCount == chunk->entryCapacity)
+            {
+                chunk->entryCapacity = MAX(chunk->entryCapacity * 2, (size_t)64);
+                chunk->entries = realloc(chunk->entries, chunk->entryCapacity * sizeof(FDTelemetryLogEntry));
+            }
+            FDTelemetryLogEntry *entry = &chunk->entries[chunk->entryCount++];
+            memset(entry, 0, sizeof(*entry));
+            // Entries carry the running maximum so they stay sorted for binary search.
+            entry->time = MAX(time, chunk->endTime);
+            entry->offset = offset;
+            nextSpan = offset + FDTelemetryLogSpanSize;
+        }
+
+        uint8_t bucket = (uint8_t)message.messageID;
+        chunk->entries[chunk->entryCount - 1].messageMask[bucket >> 6] |= 1ULL << (bucket & 63);
+        chunk->messageCounts[bucket]++;
+        chunk->recordCount++;
+        chunk->startTime = MIN(chunk->startTime, time);
+        chunk->endTime = MAX(chunk->endTime, time);
+        offset += recordLength;
+    }
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDTelemetryLog ()
+{
+    const uint8_t *_base;
+    size_t _size;
+    FDTelemetryLogIndexHeader _header;
+    NSData *_entryData;
+    const FDTelemetryLogEntry *_entries;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, copy, readwrite) NSString *path;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDTelemetryLog
+
+#pragma mark - Lifecycle
+
++ (NSString *)defaultIndexDirectory
+{
+    NSString *caches = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject;
+    return [caches stringByAppendingPathComponent:@"TelemetryIndex"];
+}
+
++ (instancetype)logWithContentsOfFile:(NSString *)path indexDirectory:(NSString *)indexDirectory error:(NSError **)error
+{
+    FDTelemetryLog *log = [[self alloc] init];
+    log.path = path;
+    return [log openWithIndexDirectory:indexDirectory error:error] ? log : nil;
+}
+
+- (void)dealloc
+{
+    if (_base != NULL)
+    {
+        munmap((void *)_base, _size);
+    }
+}
+
+#pragma mark - Properties
+
+- (NSUInteger)recordCount
+{
+    return (NSUInteger)_header.recordCount;
+}
+
+- (int64_t)startTime
+{
+    return _header.startTime;
+}
+
+- (int64_t)endTime
+{
+    return _header.endTime;
+}
+
+#pragma mark - Instance methods
+
+- (NSUInteger)countOfMessagesWithID:(uint32_t)messageID
+{
+    // Counts are kept per low byte of the ID, exact for every v1 message.
+    return _header.messageCounts[messageID & 0xFF];
+}
+
+- (unsigned long long)offsetOfRecordAtTime:(int64_t)time
+{
+    if (_header.entryCount == 0)
+    {
+        return _size;
+    }
+
+    size_t offset = (size_t)_entries[[self entryIndexForTime:time]].offset;
+    BOOL synced = YES;
+    int64_t recordTime;
+    FDMAVLinkMessage message;
+    size_t recordLength;
+    while (FDTelemetryLogFindRecord(_base, _size, &offset, synced, &recordTime, &message, &recordLength, NULL) != FDMAVLinkFrameStatusIncomplete &&
+           recordTime < time)
+    {
+        offset += recordLength;
+    }
+    return MIN(offset, _size);
+}
+
+- (void)enumerateMessagesWithID:(uint32_t)messageID
+                       fromTime:(int64_t)fromTime
+                         toTime:(int64_t)toTime
+                     usingBlock:(FDTelemetryLogBlock)block
+{
+    [self enumerateRecordsWithID:messageID fromTime:fromTime toTime:toTime messageBlock:block recordBlock:nil];
+}
+
+- (void)enumerateRecordsFromTime:(int64_t)fromTime
+                          toTime:(int64_t)toTime
+                      usingBlock:(FDTelemetryLogRecordBlock)block
+{
+    [self enumerateRecordsWithID:FDTelemetryLogAnyMessage fromTime:fromTime toTime:toTime messageBlock:nil recordBlock:block];
+}
+
+#pragma mark - Private methods
+
+- (void)enumerateRecordsWithID:(uint32_t)messageID
+                      fromTime:(int64_t)fromTime
+                        toTime:(int64_t)toTime
+                  messageBlock:(FDTelemetryLogBlock)messageBlock
+                   recordBlock:(FDTelemetryLogRecordBlock)recordBlock
+{
+    uint8_t scratch[FDMAVLinkMaximumPayloadLength];
+    uint8_t bucket = (uint8_t)messageID;
+    BOOL stop = NO;
+
+    for (size_t index = [self entryIndexForTime:fromTime]; index < _header.entryCount && !stop; index++)
+    {
+        const FDTelemetryLogEntry *entry = &_entries[index];
+        if (entry->time > toTime)
+        {
+            break;
+        }
+        if (messageID != FDTelemetryLogAnyMessage && !(entry->messageMask[bucket >> 6] & (1ULL << (bucket & 63))))
+        {
+            continue;
+        }
+
+        size_t spanEnd = index + 1 < _header.entryCount ? _entries[index + 1].offset : _size;
+        size_t offset = entry->offset;
+        int64_t time;
+        FDMAVLinkMessage message;
+        size_t recordLength;
+        while (!stop && offset < spanEnd &&
+               FDTelemetryLogFindRecord(_base, _size, &offset, YES, &time, &message, &recordLength, scratch) != FDMAVLinkFrameStatusIncomplete &&
+               offset < spanEnd)
+        {
+            if (time > toTime)
+            {
+                stop = YES;
+                break;
+            }
+            if (time >= fromTime && (messageID == FDTelemetryLogAnyMessage || message.messageID == messageID))
+            {
+                if (messageBlock != nil)
+                {
+                    messageBlock(time, &message, &stop);
+                }
+                else
+                {
+                    recordBlock(time, _base + offset + FDTelemetryLogTimestampLength, recordLength - FDTelemetryLogTimestampLength, &stop);
+                }
+            }
+            offset += recordLength;
+        }
+    }
+}
+
+// Last entry starting at or before time, or the first entry.
+- (size_t)entryIndexForTime:(int64_t)time
+{
+    size_t low = 0;
+    size_t high = (size_t)_header.entryCount;
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        if (_entries[middle].time <= time)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low > 0 ? low - 1 : 0;
+}
+
+- (BOOL)openWithIndexDirectory:(NSString *)indexDirectory error:(NSError **)error
+{
+    int descriptor = open(self.path.fileSystemRepresentation, O_RDONLY);
+    struct stat status;
+    if (descriptor < 0 || fstat(descriptor, &status) != 0)
+    {
+        if (error != NULL)
+        {
+            *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey : self.path}];
+        }
+        if (descriptor >= 0)
+        {
+            close(descriptor);
+        }
+        return NO;
+    }
+
+    _size = (size_t)status.st_size;
+    if (_size > 0)
+    {
+        void *mapping = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (mapping == MAP_FAILED)
+        {
+            if (error != NULL)
+            {
+                *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:@{NSFilePathErrorKey : self.path}];
+            }
+            close(descriptor);
+            return NO;
+        }
+        _base = mapping;
+    }
+    close(descriptor);
+
+    double modificationDate = status.st_mtimespec.tv_sec + status.st_mtimespec.tv_nsec * 1e-9;
+    // The header check below covers the size and modification date.
+    NSString *indexPath = [indexDirectory stringByAppendingPathComponent:FDDigestFileNameForPath(self.path, @"tlogidx")];
+    if ([self loadIndexAtPath:indexPath sourceSize:status.st_size modificationDate:modificationDate])
+    {
+        return YES;
+    }
+
+    [self buildIndex];
+    _header.sourceSize = status.st_size;
+    _header.sourceModificationDate = modificationDate;
+
+    NSMutableData *data = [NSMutableData dataWithBytes:&_header length:sizeof(_header)];
+    [data appendData:_entryData];
+    [[NSFileManager defaultManager] createDirectoryAtPath:indexDirectory withIntermediateDirectories:YES attributes:nil error:NULL];
+    if (![data writeToFile:indexPath atomically:YES])
+    {
+        NSLog(@"Unable to write telemetry index %@", indexPath);
+    }
+    return YES;
+}
+
+- (BOOL)loadIndexAtPath:(NSString *)path sourceSize:(int64_t)sourceSize modificationDate:(double)modificationDate
+{
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+    if (data.length < sizeof(FDTelemetryLogIndexHeader))
+    {
+        return NO;
+    }
+
+    const FDTelemetryLogIndexHeader *header = data.bytes;
+    if (header->magic != FDTelemetryLogIndexMagic || header->version != FDTelemetryLogIndexVersion ||
+        header->sourceSize != sourceSize || header->sourceModificationDate != modificationDate ||
+        data.length != sizeof(*header) + header->entryCount * sizeof(FDTelemetryLogEntry))
+    {
+        return NO;
+    }
+
+    _header = *header;
+    _entryData = [data subdataWithRange:NSMakeRange(sizeof(*header), data.length - sizeof(*header))];
+    _entries = _entryData.bytes;
+    return YES;
+}
+
+- (void)buildIndex
+{
+    NSUInteger coreCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    size_t chunkSize = MAX(FDTelemetryLogMinimumChunkSize, _size / (coreCount * FDTelemetryLogChunksPerCore) + 1);
+    size_t chunkCount = MAX((_size + chunkSize - 1) / chunkSize, (size_t)1);
+
+    FDTelemetryLogChunk *chunks = calloc(chunkCount, sizeof(FDTelemetryLogChunk));
+    for (size_t i = 0; i < chunkCount; i++)
+    {
+        chunks[i].start = i * chunkSize;
+        chunks[i].end = MIN((i + 1) * chunkSize, _size);
+    }
+
+    const uint8_t *base = _base;
+    size_t size = _size;
+    if (base != NULL)
+    {
+        madvise((void *)base, size, MADV_SEQUENTIAL);
+        dispatch_apply(chunkCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+            FDTelemetryLogScanChunk(&chunks[index], base, size);
+        });
+        // Seeks and span reads from here on.
+        madvise((void *)base, size, MADV_RANDOM);
+    }
+
+    memset(&_header, 0, sizeof(_header));
+    _header.magic = FDTelemetryLogIndexMagic;
+    _header.version = FDTelemetryLogIndexVersion;
+    _header.startTime = INT64_MAX;
+    _header.endTime = INT64_MIN;
+
+    NSMutableData *entryData = [NSMutableData data];
+    for (size_t i = 0; i < chunkCount; i++)
+    {
+        FDTelemetryLogChunk *chunk = &chunks[i];
+        for (size_t entry = 0; entry < chunk->entryCount; entry++)
+        {
+            // Keep the running maximum across chunk boundaries too.
+            chunk->entries[entry].time = MAX(chunk->entries[entry].time, _header.endTime);
+        }
+        [entryData appendBytes:chunk->entries length:chunk->entryCount * sizeof(FDTelemetryLogEntry)];
+        for (int bucket = 0; bucket < 256; bucket++)
+        {
+            _header.messageCounts[bucket] += chunk->messageCounts[bucket];
+        }
+        _header.recordCount += chunk->recordCount;
+        _header.startTime = MIN(_header.startTime, chunk->startTime);
+        _header.endTime = MAX(_header.endTime, chunk->endTime);
+        free(chunk->entries);
+    }
+    free(chunks);
+
+    if (_header.recordCount == 0)
+    {
+        _header.startTime = 0;
+        _header.endTime = 0;
+    }
+    _header.entryCount = entryData.length / sizeof(FDTelemetryLogEntry);
+    _entryData = entryData;
+    _entries = _entryData.bytes;
+}
+
+#pragma mark -
+
+@end
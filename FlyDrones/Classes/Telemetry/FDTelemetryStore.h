@@ -0,0 +1,76 @@
+//
+//  FDTelemetryStore.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDMAVLinkParser.h"
+
+
+typedef NS_ENUM(NSUInteger, FDTelemetryField)
+{
+    FDTelemetryFieldAltitude,           // m above home
+    FDTelemetryFieldAirspeed,           // m/s
+    FDTelemetryFieldGroundSpeed,        // m/s
+    FDTelemetryFieldClimbRate,          // m/s
+    FDTelemetryFieldHeading,            // degrees
+    FDTelemetryFieldThrottle,           // percent
+    FDTelemetryFieldRoll,               // radians
+    FDTelemetryFieldPitch,              // radians
+    FDTelemetryFieldYaw,                // radians
+    FDTelemetryFieldBatteryVoltage,     // V
+    FDTelemetryFieldBatteryCurrent,     // A
+    FDTelemetryFieldBatteryRemaining,   // percent
+    FDTelemetryFieldCount
+};
+
+
+typedef void (^FDTelemetryMessageObserver)(const FDMAVLinkMessage *message);
+
+
+// Columnar in-memory telemetry history. Every field is its own column of
+// (time, value) samples, sealed every 256 samples into a compressed block that
+// carries its time span and min/max, so chart queries mostly read block headers.
+// Times are milliseconds of the autopilot's boot clock; after a reboot the new boot
+// clock continues from the last time stored, starting a new epoch. Thread safe.
+@interface FDTelemetryStore : NSObject
+
+@property (nonatomic, assign, readonly) unsigned long long memoryUsage;
+// Autopilot boots seen by appendMessage:.
+@property (nonatomic, assign, readonly) NSUInteger epochCount;
+// Sees every message passed to appendMessage: before it is decoded, on the parser
+// queue. Lets per-recording consumers such as FDGeotagger share the store's
+// parser handlers; set it to nil to detach them.
+@property (atomic, copy) FDTelemetryMessageObserver messageObserver;
+
+// Decodes the fields carried by ATTITUDE, GLOBAL_POSITION_INT, VFR_HUD and SYS_STATUS.
+// Call from the parser queue only.
+- (void)appendMessage:(const FDMAVLinkMessage *)message;
+// Installs handlers for the messages above. The store must outlive the parser.
+- (void)registerWithParser:(FDMAVLinkParser *)parser;
+
+// Samples older than the newest one in the column are dropped.
+- (void)appendValue:(float)value forField:(FDTelemetryField)field time:(int64_t)time;
+
+- (NSUInteger)sampleCountForField:(FDTelemetryField)field;
+// Copies samples with fromTime <= time <= toTime; returns how many were copied.
+- (NSUInteger)getSamplesForField:(FDTelemetryField)field
+                        fromTime:(int64_t)fromTime
+                          toTime:(int64_t)toTime
+                           times:(int64_t *)times
+                          values:(float *)values
+                    maximumCount:(NSUInteger)maximumCount;
+// Min/max per bucket across [fromTime, toTime) for level-of-detail charts. Blocks
+// within one bucket are never decompressed. Empty buckets are NAN.
+- (void)getEnvelopeForField:(FDTelemetryField)field
+                   fromTime:(int64_t)fromTime
+                     toTime:(int64_t)toTime
+                bucketCount:(NSUInteger)bucketCount
+                   minimums:(float *)minimums
+                   maximums:(float *)maximums;
+
+// Per-field sizes and the projected memory for an hour of 50 Hz telemetry.
+- (NSString *)memoryReport;
+
+@end
@@ -0,0 +1,432 @@
+//
+//  FDTelemetryStore.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDTelemetryStore.h"
+#import "FDTelemetryBlockCodec.h"
+#include <pthread.h>
+
+
+#define FDTelemetryBlockSampleCount 256
+
+static NSUInteger const FDTelemetryStoreInitialBlockCapacity = 16;
+// time_boot_ms jumping back this far means the autopilot rebooted.
+static int64_t const FDTelemetryStoreRebootThreshold = 1000;
+static NSString * const FDTelemetryFieldNames[FDTelemetryFieldCount] =
+{
+    @"altitude", @"airspeed", @"ground speed", @"climb rate", @"heading", @"throttle",
+    @"roll", @"pitch", @"yaw", @"battery voltage", @"battery current", @"battery remaining"
+};
+
+typedef struct FDTelemetryBlock
+{
+    int64_t startTime;
+    int64_t endTime;
+    float minimum;
+    float maximum;
+    uint32_t count;
+    uint32_t offset;
+} FDTelemetryBlock;
+
+typedef struct FDTelemetryColumn
+{
+    FDTelemetryBlock *blocks;
+    NSUInteger blockCount;
+    NSUInteger blockCapacity;
+    uint8_t *data;
+    size_t dataSize;
+    size_t dataCapacity;
+    // Samples not sealed into a block yet.
+    int64_t openTimes[FDTelemetryBlockSampleCount];
+    float openValues[FDTelemetryBlockSampleCount];
+    NSUInteger openCount;
+    NSUInteger sampleCount;
+} FDTelemetryColumn;
+
+
+#pragma mark - Private functions
+
+static void FDTelemetryColumnSeal(FDTelemetryColumn *column)
+{
+    if (column->blockCount == column->blockCapacity)
+    {
+        column->blockCapacity = MAX(column->blockCapacity * 2, FDTelemetryStoreInitialBlockCapacity);
+        column->blocks = realloc(column->blocks, column->blockCapacity * sizeof(FDTelemetryBlock));
+    }
+    size_t maximumSize = FDTelemetryBlockMaximumSize(column->openCount);
+    if (column->dataSize + maximumSize > column->dataCapacity)
+    {
+        // Grow by half so the slack stays proportional to the compressed size.
+        column->dataCapacity = MAX(column->dataCapacity + column->dataCapacity / 2, column->dataSize + maximumSize);
+        column->data = realloc(column->data, column->dataCapacity);
+    }
+
+    FDTelemetryBlock *block = &column->blocks[column->blockCount++];
+    block->startTime = column->openTimes[0];
+    block->endTime = column->openTimes[column->openCount - 1];
+    block->minimum = NAN;
+    block->maximum = NAN;
+    for (NSUInteger i = 0; i < column->openCount; i++)
+    {
+        block->minimum = fminf(block->minimum, column->openValues[i]);
+        block->maximum = fmaxf(block->maximum, column->openValues[i]);
+    }
+    block->count = (uint32_t)column->openCount;
+    block->offset = (uint32_t)column->dataSize;
+    column->dataSize += FDTelemetryBlockEncode(column->openTimes, column->openValues, column->openCount, column->data + column->dataSize);
+    column->openCount = 0;
+}
+
+// Index of the first block that ends at or after time.
+static NSUInteger FDTelemetryColumnFirstBlock(const FDTelemetryColumn *column, int64_t time)
+{
+    NSUInteger low = 0;
+    NSUInteger high = column->blockCount;
+    while (low < high)
+    {
+        NSUInteger middle = (low + high) / 2;
+        if (column->blocks[middle].endTime < time)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static inline void FDTelemetryEnvelopeAdd(float *minimums, float *maximums, NSUInteger bucket, float minimum, float maximum)
+{
+    minimums[bucket] = fminf(minimums[bucket], minimum);
+    maximums[bucket] = fmaxf(maximums[bucket], maximum);
+}
+
+static void FDTelemetryStoreHandleMessage(const FDMAVLinkMessage *message, void *context)
+{
+    [(__bridge FDTelemetryStore *)context appendMessage:message];
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDTelemetryStore ()
+{
+    pthread_mutex_t _lock;
+    FDTelemetryColumn _columns[FDTelemetryFieldCount];
+    // Store time of the latest timestamped message, and what maps the current boot epoch onto it.
+    int64_t _lastBootTime;
+    int64_t _latestStoreTime;
+    int64_t _lastRawBootTime;
+    int64_t _epochOffset;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) NSUInteger epochCount;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDTelemetryStore
+
+#pragma mark - Lifecycle
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        pthread_mutex_init(&_lock, NULL);
+        _lastBootTime = -1;
+        _lastRawBootTime = -1;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger field = 0; field < FDTelemetryFieldCount; field++)
+    {
+        free(_columns[field].blocks);
+        free(_columns[field].data);
+    }
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Properties
+
+- (unsigned long long)memoryUsage
+{
+    unsigned long long usage = sizeof(_columns);
+    pthread_mutex_lock(&_lock);
+    for (NSUInteger field = 0; field < FDTelemetryFieldCount; field++)
+    {
+        usage += _columns[field].blockCapacity * sizeof(FDTelemetryBlock) + _columns[field].dataCapacity;
+    }
+    pthread_mutex_unlock(&_lock);
+    return usage;
+}
+
+#pragma mark - Instance methods
+
+- (void)appendMessage:(const FDMAVLinkMessage *)message
+{
+    FDTelemetryMessageObserver observer = self.messageObserver;
+    if (observer != nil)
+    {
+        observer(message);
+    }
+
+    switch (message->messageID)
+    {
+        case FDMAVLinkMessageIDAttitude:
+        {
+            _lastBootTime = [self storeTimeForBootTime:FDMAVLinkReadUInt32(message, 0)];
+            [self appendValue:FDMAVLinkReadFloat(message, 4) forField:FDTelemetryFieldRoll time:_lastBootTime];
+            [self appendValue:FDMAVLinkReadFloat(message, 8) forField:FDTelemetryFieldPitch time:_lastBootTime];
+            [self appendValue:FDMAVLinkReadFloat(message, 12) forField:FDTelemetryFieldYaw time:_lastBootTime];
+            break;
+        }
+        case FDMAVLinkMessageIDGlobalPositionInt:
+        {
+            _lastBootTime = [self storeTimeForBootTime:FDMAVLinkReadUInt32(message, 0)];
+            [self appendValue:FDMAVLinkReadInt32(message, 16) / 1000.0f forField:FDTelemetryFieldAltitude time:_lastBootTime];
+            break;
+        }
+        // The messages below carry no timestamp; they are stamped with the latest boot time seen.
+        case FDMAVLinkMessageIDVFRHUD:
+        {
+            if (_lastBootTime >= 0)
+            {
+                [self appendValue:FDMAVLinkReadFloat(message, 0) forField:FDTelemetryFieldAirspeed time:_lastBootTime];
+                [self appendValue:FDMAVLinkReadFloat(message, 4) forField:FDTelemetryFieldGroundSpeed time:_lastBootTime];
+                [self appendValue:FDMAVLinkReadFloat(message, 12) forField:FDTelemetryFieldClimbRate time:_lastBootTime];
+                [self appendValue:FDMAVLinkReadInt16(message, 16) forField:FDTelemetryFieldHeading time:_lastBootTime];
+                [self appendValue:FDMAVLinkReadUInt16(message, 18) forField:FDTelemetryFieldThrottle time:_lastBootTime];
+            }
+            break;
+        }
+        case FDMAVLinkMessageIDSysStatus:
+        {
+            if (_lastBootTime >= 0)
+            {
+                uint16_t voltage = FDMAVLinkReadUInt16(message, 14);
+                int16_t current = FDMAVLinkReadInt16(message, 16);
+                int8_t remaining = (int8_t)message->payload[30];
+                // MAVLink marks unknown values with UINT16_MAX and -1.
+                [self appendValue:voltage != UINT16_MAX ? voltage / 1000.0f : NAN forField:FDTelemetryFieldBatteryVoltage time:_lastBootTime];
+                [self appendValue:current >= 0 ? current / 100.0f : NAN forField:FDTelemetryFieldBatteryCurrent time:_lastBootTime];
+                [self appendValue:remaining >= 0 ? remaining : NAN forField:FDTelemetryFieldBatteryRemaining time:_lastBootTime];
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+- (void)registerWithParser:(FDMAVLinkParser *)parser
+{
+    void *context = (__bridge void *)self;
+    FDMAVLinkParserSetHandler(parser, FDMAVLinkMessageIDAttitude, FDTelemetryStoreHandleMessage, context);
+    FDMAVLinkParserSetHandler(parser, FDMAVLinkMessageIDGlobalPositionInt, FDTelemetryStoreHandleMessage, context);
+    FDMAVLinkParserSetHandler(parser, FDMAVLinkMessageIDVFRHUD, FDTelemetryStoreHandleMessage, context);
+    FDMAVLinkParserSetHandler(parser, FDMAVLinkMessageIDSysStatus, FDTelemetryStoreHandleMessage, context);
+}
+
+- (void)appendValue:(float)value forField:(FDTelemetryField)field time:(int64_t)time
+{
+    pthread_mutex_lock(&_lock);
+    FDTelemetryColumn *column = &_columns[field];
+    BOOL ordered = YES;
+    if (column->openCount > 0)
+    {
+        ordered = time >= column->openTimes[column->openCount - 1];
+    }
+    else if (column->blockCount > 0)
+    {
+        ordered = time >= column->blocks[column->blockCount - 1].endTime;
+    }
+
+    if (ordered)
+    {
+        column->openTimes[column->openCount] = time;
+        column->openValues[column->openCount] = value;
+        column->sampleCount++;
+        if (++column->openCount == FDTelemetryBlockSampleCount)
+        {
+            FDTelemetryColumnSeal(column);
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (NSUInteger)sampleCountForField:(FDTelemetryField)field
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger count = _columns[field].sampleCount;
+    pthread_mutex_unlock(&_lock);
+    return count;
+}
+
+- (NSUInteger)getSamplesForField:(FDTelemetryField)field
+                        fromTime:(int64_t)fromTime
+                          toTime:(int64_t)toTime
+                           times:(int64_t *)times
+                          values:(float *)values
+                    maximumCount:(NSUInteger)maximumCount
+{
+    int64_t blockTimes[FDTelemetryBlockSampleCount];
+    float blockValues[FDTelemetryBlockSampleCount];
+    NSUInteger count = 0;
+
+    pthread_mutex_lock(&_lock);
+    const FDTelemetryColumn *column = &_columns[field];
+    for (NSUInteger index = FDTelemetryColumnFirstBlock(column, fromTime); index < column->blockCount && count < maximumCount; index++)
+    {
+        const FDTelemetryBlock *block = &column->blocks[index];
+        if (block->startTime > toTime)
+        {
+            break;
+        }
+        FDTelemetryBlockDecode(column->data + block->offset, block->count, blockTimes, blockValues);
+        for (NSUInteger i = 0; i < block->count && count < maximumCount; i++)
+        {
+            if (blockTimes[i] >= fromTime && blockTimes[i] <= toTime)
+            {
+                times[count] = blockTimes[i];
+                values[count] = blockValues[i];
+                count++;
+            }
+        }
+    }
+    for (NSUInteger i = 0; i < column->openCount && count < maximumCount; i++)
+    {
+        if (column->openTimes[i] >= fromTime && column->openTimes[i] <= toTime)
+        {
+            times[count] = column->openTimes[i];
+            values[count] = column->openValues[i];
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+    return count;
+}
+
+- (void)getEnvelopeForField:(FDTelemetryField)field
+                   fromTime:(int64_t)fromTime
+                     toTime:(int64_t)toTime
+                bucketCount:(NSUInteger)bucketCount
+                   minimums:(float *)minimums
+                   maximums:(float *)maximums
+{
+    for (NSUInteger bucket = 0; bucket < bucketCount; bucket++)
+    {
+        minimums[bucket] = NAN;
+        maximums[bucket] = NAN;
+    }
+    if (bucketCount == 0 || toTime <= fromTime)
+    {
+        return;
+    }
+
+    double bucketsPerTime = (double)bucketCount / (toTime - fromTime);
+    int64_t blockTimes[FDTelemetryBlockSampleCount];
+    float blockValues[FDTelemetryBlockSampleCount];
+
+    pthread_mutex_lock(&_lock);
+    const FDTelemetryColumn *column = &_columns[field];
+    for (NSUInteger index = FDTelemetryColumnFirstBlock(column, fromTime); index < column->blockCount; index++)
+    {
+        const FDTelemetryBlock *block = &column->blocks[index];
+        if (block->startTime >= toTime)
+        {
+            break;
+        }
+
+        if (block->startTime >= fromTime && block->endTime < toTime)
+        {
+            NSUInteger first = (NSUInteger)((block->startTime - fromTime) * bucketsPerTime);
+            NSUInteger last = (NSUInteger)((block->endTime - fromTime) * bucketsPerTime);
+            if (first == last)
+            {
+                FDTelemetryEnvelopeAdd(minimums, maximums, first, block->minimum, block->maximum);
+                continue;
+            }
+        }
+
+        // Zoomed in far enough that the block spans buckets: look at its samples.
+        FDTelemetryBlockDecode(column->data + block->offset, block->count, blockTimes, blockValues);
+        for (NSUInteger i = 0; i < block->count; i++)
+        {
+            if (blockTimes[i] >= fromTime && blockTimes[i] < toTime)
+            {
+                NSUInteger bucket = (NSUInteger)((blockTimes[i] - fromTime) * bucketsPerTime);
+                FDTelemetryEnvelopeAdd(minimums, maximums, MIN(bucket, bucketCount - 1), blockValues[i], blockValues[i]);
+            }
+        }
+    }
+    for (NSUInteger i = 0; i < column->openCount; i++)
+    {
+        if (column->openTimes[i] >= fromTime && column->openTimes[i] < toTime)
+        {
+            NSUInteger bucket = (NSUInteger)((column->openTimes[i] - fromTime) * bucketsPerTime);
+            FDTelemetryEnvelopeAdd(minimums, maximums, MIN(bucket, bucketCount - 1), column->openValues[i], column->openValues[i]);
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (NSString *)memoryReport
+{
+    NSMutableString *report = [NSMutableString stringWithString:@"Telemetry store memory:"];
+    double totalBytesPerSample = 0;
+
+    pthread_mutex_lock(&_lock);
+    for (NSUInteger field = 0; field < FDTelemetryFieldCount; field++)
+    {
+        const FDTelemetryColumn *column = &_columns[field];
+        NSUInteger sealedCount = column->sampleCount - column->openCount;
+        double bytesPerSample = sealedCount > 0 ? (double)(column->dataSize + column->blockCount * sizeof(FDTelemetryBlock)) / sealedCount : 0;
+        totalBytesPerSample += bytesPerSample;
+        [report appendFormat:@"\n  %@: %lu samples, %lu bytes, %.2f bytes/sample",
+         FDTelemetryFieldNames[field], (unsigned long)column->sampleCount, (unsigned long)column->dataSize, bytesPerSample];
+    }
+    pthread_mutex_unlock(&_lock);
+
+    // Raw storage would be 12 bytes per sample (int64 time, float value).
+    [report appendFormat:@"\n  one hour of 50 Hz telemetry: %.1f MB (%.1f MB uncompressed)",
+     totalBytesPerSample * 50 * 3600 / (1024 * 1024), 12.0 * FDTelemetryFieldCount * 50 * 3600 / (1024 * 1024)];
+    return report;
+}
+
+#pragma mark - Private methods
+
+// After a reboot time_boot_ms restarts near 0; the new epoch is appended right after
+// the last time seen so the columns stay ordered instead of dropping the new flight.
+- (int64_t)storeTimeForBootTime:(uint32_t)bootTime
+{
+    if (_lastRawBootTime >= 0 && bootTime + FDTelemetryStoreRebootThreshold < _lastRawBootTime)
+    {
+        _epochOffset = _latestStoreTime + 1 - (int64_t)bootTime;
+        self.epochCount++;
+    }
+    else if (_lastRawBootTime < 0)
+    {
+        self.epochCount = 1;
+    }
+    _lastRawBootTime = bootTime;
+    _latestStoreTime = MAX(_latestStoreTime, (int64_t)bootTime + _epochOffset);
+    return (int64_t)bootTime + _epochOffset;
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,46 @@
+//
+//  FDTelemetrySynchronizer.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDClockEstimator.h"
+
+
+// Maps MAVLink time_boot_ms and video stream time (AVFrame.pts or unwrapped RTP
+// time, in seconds) onto the host clock, continuously estimating offset and skew
+// of both. Telemetry samples are kept in a ring so the values at any decoded
+// frame are a linear interpolation between two neighbours. All methods are
+// thread safe; telemetry and video are usually fed from different queues.
+@interface FDTelemetrySynchronizer : NSObject
+
+@property (nonatomic, assign, readonly) NSUInteger fieldCount;
+@property (nonatomic, assign, readonly) NSUInteger capacity;
+// Bit i set: field i is an angle in radians, interpolated along the shorter arc.
+@property (nonatomic, assign) uint64_t angularFieldMask;
+// Known extra delay of the video link over the telemetry link, in seconds.
+@property (nonatomic, assign) NSTimeInterval videoLatency;
+// Samples older than this many seconds at the newest end are not held for later frames.
+@property (nonatomic, assign) NSTimeInterval maximumHoldInterval;
+
+@property (nonatomic, assign, readonly) FDClockEstimator telemetryClock;
+@property (nonatomic, assign, readonly) FDClockEstimator videoClock;
+
+- (instancetype)initWithFieldCount:(NSUInteger)fieldCount capacity:(NSUInteger)capacity;
+
+// receiveTime is CACurrentMediaTime() when the message or packet arrived.
+- (void)addTelemetryValues:(const float *)values bootTime:(uint32_t)bootTime receiveTime:(CFTimeInterval)receiveTime;
+- (void)addVideoFrameWithStreamTime:(NSTimeInterval)streamTime receiveTime:(CFTimeInterval)receiveTime;
+
+// Fills fieldCount values. Returns NO when no telemetry covers the frame.
+- (BOOL)getTelemetryValues:(float *)values forVideoStreamTime:(NSTimeInterval)streamTime;
+// The same lookup for a time already on the telemetry clock, e.g. from a recording.
+- (BOOL)getTelemetryValues:(float *)values atBootTime:(NSTimeInterval)bootTime;
+
+// Feeds synthetic 50 Hz telemetry and 30 fps video with known offsets, drift and
+// link jitter, and logs the recovered skews and the per-frame alignment error.
+// Returns NO when a scenario is outside the tolerances.
++ (BOOL)runSyntheticDriftCheck;
+
+@end
@@ -0,0 +1,335 @@
+//
+//  FDTelemetrySynchronizer.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDTelemetrySynchronizer.h"
+#include <pthread.h>
+
+
+// Around 20 s of 50 Hz telemetry and 30 s of 30 fps video.
+static double const FDTelemetrySynchronizerTelemetryForgetting = 0.999;
+static double const FDTelemetrySynchronizerVideoForgetting = 0.999;
+static NSTimeInterval const FDTelemetrySynchronizerDefaultHoldInterval = 0.5;
+
+// Synthetic drift check: the links, the warm-up excluded from the statistics and the tolerances.
+static NSTimeInterval const FDTelemetrySynchronizerCheckDuration = 120.0;
+static NSTimeInterval const FDTelemetrySynchronizerCheckWarmUp = 20.0;
+static NSTimeInterval const FDTelemetrySynchronizerCheckTelemetryDelay = 0.005;
+static NSTimeInterval const FDTelemetrySynchronizerCheckTelemetryJitter = 0.004;
+static NSTimeInterval const FDTelemetrySynchronizerCheckVideoLatency = 0.120;
+static NSTimeInterval const FDTelemetrySynchronizerCheckVideoJitter = 0.008;
+static double const FDTelemetrySynchronizerCheckSkewTolerance = 10e-6;
+static NSTimeInterval const FDTelemetrySynchronizerCheckMeanTolerance = 0.005;
+static NSTimeInterval const FDTelemetrySynchronizerCheckMaximumTolerance = 0.010;
+
+
+#pragma mark - Private functions
+
+// Exponentially distributed link delay with the given mean.
+static double FDTelemetrySynchronizerRandomDelay(double mean)
+{
+    return -log((random() + 1.0) / ((double)RAND_MAX + 2.0)) * mean;
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDTelemetrySynchronizer ()
+{
+    pthread_mutex_t _lock;
+    FDClockEstimator _telemetryClock;
+    FDClockEstimator _videoClock;
+    int64_t _lastBootTime;
+    double *_times;
+    float *_values;
+    NSUInteger _head;
+    NSUInteger _count;
+    // Logical index (0 = oldest) of the last bracket found; queries move forward with playback.
+    NSUInteger _cursor;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) NSUInteger fieldCount;
+@property (nonatomic, assign, readwrite) NSUInteger capacity;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDTelemetrySynchronizer
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithFieldCount:(NSUInteger)fieldCount capacity:(NSUInteger)capacity
+{
+    self = [super init];
+    if (self)
+    {
+        _fieldCount = fieldCount;
+        _capacity = MAX(capacity, (NSUInteger)2);
+        _maximumHoldInterval = FDTelemetrySynchronizerDefaultHoldInterval;
+        _lastBootTime = -1;
+        _times = malloc(_capacity * sizeof(double));
+        _values = malloc(_capacity * fieldCount * sizeof(float));
+        pthread_mutex_init(&_lock, NULL);
+        FDClockEstimatorInit(&_telemetryClock, FDTelemetrySynchronizerTelemetryForgetting);
+        FDClockEstimatorInit(&_videoClock, FDTelemetrySynchronizerVideoForgetting);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(_times);
+    free(_values);
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Properties
+
+- (FDClockEstimator)telemetryClock
+{
+    pthread_mutex_lock(&_lock);
+    FDClockEstimator clock = _telemetryClock;
+    pthread_mutex_unlock(&_lock);
+    return clock;
+}
+
+- (FDClockEstimator)videoClock
+{
+    pthread_mutex_lock(&_lock);
+    FDClockEstimator clock = _videoClock;
+    pthread_mutex_unlock(&_lock);
+    return clock;
+}
+
+#pragma mark - Instance methods
+
+- (void)addTelemetryValues:(const float *)values bootTime:(uint32_t)bootTime receiveTime:(CFTimeInterval)receiveTime
+{
+    pthread_mutex_lock(&_lock);
+    double time = FDClockUnwrapTimestamp(bootTime, &_lastBootTime) / 1000.0;
+    if (_count > 0 && time <= [self timeAtIndex:_count - 1])
+    {
+        if (time < [self timeAtIndex:_count - 1] - 1.0)
+        {
+            // The autopilot rebooted; older samples are on a different clock.
+            _count = 0;
+            _cursor = 0;
+        }
+        else
+        {
+            // Duplicate or reordered sample, the series must stay sorted.
+            pthread_mutex_unlock(&_lock);
+            return;
+        }
+    }
+
+    FDClockEstimatorAddSample(&_telemetryClock, time, receiveTime);
+
+    NSUInteger slot = (_head + _count) % self.capacity;
+    if (_count == self.capacity)
+    {
+        _head = (_head + 1) % self.capacity;
+        _cursor = _cursor > 0 ? _cursor - 1 : 0;
+    }
+    else
+    {
+        _count++;
+    }
+    _times[slot] = time;
+    memcpy(_values + slot * self.fieldCount, values, self.fieldCount * sizeof(float));
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)addVideoFrameWithStreamTime:(NSTimeInterval)streamTime receiveTime:(CFTimeInterval)receiveTime
+{
+    pthread_mutex_lock(&_lock);
+    FDClockEstimatorAddSample(&_videoClock, streamTime, receiveTime);
+    pthread_mutex_unlock(&_lock);
+}
+
+- (BOOL)getTelemetryValues:(float *)values forVideoStreamTime:(NSTimeInterval)streamTime
+{
+    pthread_mutex_lock(&_lock);
+    BOOL found = NO;
+    if (_videoClock.sampleCount > 0 && _telemetryClock.sampleCount > 0)
+    {
+        double hostTime = FDClockEstimatorHostTime(&_videoClock, streamTime) - self.videoLatency;
+        found = [self lockedGetValues:values atTime:FDClockEstimatorSourceTime(&_telemetryClock, hostTime)];
+    }
+    pthread_mutex_unlock(&_lock);
+    return found;
+}
+
+- (BOOL)getTelemetryValues:(float *)values atBootTime:(NSTimeInterval)bootTime
+{
+    pthread_mutex_lock(&_lock);
+    BOOL found = [self lockedGetValues:values atTime:bootTime];
+    pthread_mutex_unlock(&_lock);
+    return found;
+}
+
+#pragma mark - Private methods
+
+- (double)timeAtIndex:(NSUInteger)index
+{
+    return _times[(_head + index) % self.capacity];
+}
+
+- (BOOL)lockedGetValues:(float *)values atTime:(double)time
+{
+    if (_count == 0 || time < [self timeAtIndex:0])
+    {
+        return NO;
+    }
+
+    NSUInteger last = _count - 1;
+    if (time >= [self timeAtIndex:last])
+    {
+        if (time - [self timeAtIndex:last] > self.maximumHoldInterval)
+        {
+            return NO;
+        }
+        memcpy(values, _values + ((_head + last) % self.capacity) * self.fieldCount, self.fieldCount * sizeof(float));
+        return YES;
+    }
+
+    // Samples arrive at a near constant rate, so a proportional guess lands within a
+    // few samples when the cursor is far away; the walk is O(1) for playback.
+    NSUInteger index = MIN(_cursor, last - 1);
+    double interval = ([self timeAtIndex:last] - [self timeAtIndex:0]) / last;
+    if (fabs(time - [self timeAtIndex:index]) > 8 * interval)
+    {
+        index = MIN((NSUInteger)((time - [self timeAtIndex:0]) / interval), last - 1);
+    }
+    while (index > 0 && [self timeAtIndex:index] > time)
+    {
+        index--;
+    }
+    while (index + 1 < last && [self timeAtIndex:index + 1] <= time)
+    {
+        index++;
+    }
+    _cursor = index;
+
+    NSUInteger slot0 = (_head + index) % self.capacity;
+    NSUInteger slot1 = (_head + index + 1) % self.capacity;
+    double t0 = _times[slot0];
+    double t1 = _times[slot1];
+    float fraction = t1 > t0 ? (float)((time - t0) / (t1 - t0)) : 0.0f;
+    const float *values0 = _values + slot0 * self.fieldCount;
+    const float *values1 = _values + slot1 * self.fieldCount;
+    for (NSUInteger field = 0; field < self.fieldCount; field++)
+    {
+        float delta = values1[field] - values0[field];
+        if (field < 64 && (self.angularFieldMask & (1ULL << field)))
+        {
+            delta = remainderf(delta, 2.0f * (float)M_PI);
+        }
+        values[field] = values0[field] + fraction * delta;
+    }
+    return YES;
+}
+
+#pragma mark - Benchmark
+
++ (BOOL)runSyntheticDriftCheck
+{
+    // Drift of the autopilot and camera clocks against the host, in ppm, and the
+    // autopilot clock at the start, the first one just before time_boot_ms wraps.
+    static const double scenarios[][3] = {{50.0, -30.0, 4294960.0}, {-80.0, 40.0, 1.0}, {20.0, 20.0, 600.0}};
+    BOOL passed = YES;
+    for (size_t scenario = 0; scenario < sizeof(scenarios) / sizeof(scenarios[0]); scenario++)
+    {
+        srandom(7);
+        double telemetryDrift = scenarios[scenario][0] * 1e-6;
+        double videoDrift = scenarios[scenario][1] * 1e-6;
+        double bootStart = scenarios[scenario][2];
+        CFTimeInterval hostStart = 5000.0;
+
+        // The only field is the true host capture time of the sample, so the value
+        // interpolated at a frame is directly comparable with the frame's capture time.
+        FDTelemetrySynchronizer *synchronizer = [[FDTelemetrySynchronizer alloc] initWithFieldCount:1 capacity:512];
+        synchronizer.videoLatency = FDTelemetrySynchronizerCheckVideoLatency;
+
+        NSUInteger telemetryIndex = 0;
+        NSUInteger frameIndex = 0;
+        CFTimeInterval telemetryCapture = hostStart;
+        CFTimeInterval frameCapture = hostStart;
+        CFTimeInterval telemetryReceive = telemetryCapture + FDTelemetrySynchronizerCheckTelemetryDelay +
+                                          FDTelemetrySynchronizerRandomDelay(FDTelemetrySynchronizerCheckTelemetryJitter);
+        CFTimeInterval frameReceive = frameCapture + FDTelemetrySynchronizerCheckTelemetryDelay + FDTelemetrySynchronizerCheckVideoLatency +
+                                      FDTelemetrySynchronizerRandomDelay(FDTelemetrySynchronizerCheckVideoJitter);
+        double totalError = 0;
+        double maximumError = 0;
+        NSUInteger measuredFrames = 0;
+        NSUInteger missedFrames = 0;
+
+        // Events in arrival order, the way the two links would deliver them.
+        while (telemetryCapture < hostStart + FDTelemetrySynchronizerCheckDuration || frameCapture < hostStart + FDTelemetrySynchronizerCheckDuration)
+        {
+            if (telemetryReceive <= frameReceive)
+            {
+                float value = (float)(telemetryCapture - hostStart);
+                uint32_t bootTime = (uint32_t)llround(bootStart * 1000.0 + telemetryIndex * 20.0);
+                [synchronizer addTelemetryValues:&value bootTime:bootTime receiveTime:telemetryReceive];
+
+                telemetryIndex++;
+                telemetryCapture = hostStart + telemetryIndex * 0.02 / (1.0 + telemetryDrift);
+                telemetryReceive = telemetryCapture + FDTelemetrySynchronizerCheckTelemetryDelay +
+                                   FDTelemetrySynchronizerRandomDelay(FDTelemetrySynchronizerCheckTelemetryJitter);
+            }
+            else
+            {
+                NSTimeInterval streamTime = frameIndex / 30.0;
+                [synchronizer addVideoFrameWithStreamTime:streamTime receiveTime:frameReceive];
+                if (frameCapture - hostStart > FDTelemetrySynchronizerCheckWarmUp)
+                {
+                    float value;
+                    if ([synchronizer getTelemetryValues:&value forVideoStreamTime:streamTime])
+                    {
+                        double error = fabs(value - (frameCapture - hostStart));
+                        totalError += error;
+                        maximumError = MAX(maximumError, error);
+                        measuredFrames++;
+                    }
+                    else
+                    {
+                        missedFrames++;
+                    }
+                }
+
+                frameIndex++;
+                frameCapture = hostStart + frameIndex / 30.0 / (1.0 + videoDrift);
+                frameReceive = frameCapture + FDTelemetrySynchronizerCheckTelemetryDelay + FDTelemetrySynchronizerCheckVideoLatency +
+                               FDTelemetrySynchronizerRandomDelay(FDTelemetrySynchronizerCheckVideoJitter);
+            }
+        }
+
+        FDClockEstimator telemetryClock = synchronizer.telemetryClock;
+        FDClockEstimator videoClock = synchronizer.videoClock;
+        double telemetrySkewError = telemetryClock.skew - 1.0 / (1.0 + telemetryDrift);
+        double videoSkewError = videoClock.skew - 1.0 / (1.0 + videoDrift);
+        double meanError = measuredFrames > 0 ? totalError / measuredFrames : INFINITY;
+        BOOL scenarioPassed = fabs(telemetrySkewError) <= FDTelemetrySynchronizerCheckSkewTolerance &&
+                              fabs(videoSkewError) <= FDTelemetrySynchronizerCheckSkewTolerance &&
+                              meanError <= FDTelemetrySynchronizerCheckMeanTolerance &&
+                              maximumError <= FDTelemetrySynchronizerCheckMaximumTolerance && missedFrames == 0;
+        passed = passed && scenarioPassed;
+        NSLog(@"Sync check, drift %+.0f/%+.0f ppm: skew error %+.1f/%+.1f ppm, alignment %.2f ms mean %.2f ms max, %lu frames, %lu missed: %@",
+              scenarios[scenario][0], scenarios[scenario][1], telemetrySkewError * 1e6, videoSkewError * 1e6,
+              meanError * 1000.0, maximumError * 1000.0, (unsigned long)measuredFrames, (unsigned long)missedFrames,
+              scenarioPassed ? @"passed" : @"FAILED");
+    }
+    return passed;
+}
+
+#pragma mark -
+
+@end
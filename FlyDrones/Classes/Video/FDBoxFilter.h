@@ -0,0 +1,14 @@
+//
+//  FDBoxFilter.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stdint.h>
+
+
+// Downscales one 8-bit plane by averaging the source rectangle that maps onto
+// each destination pixel. Works for any ratio, destination must not be larger.
+void FDBoxFilterDownscalePlane(const uint8_t *source, int sourceStride, int sourceWidth, int sourceHeight,
+                               uint8_t *destination, int destinationStride, int destinationWidth, int destinationHeight);
@@ -0,0 +1,92 @@
+//
+//  FDBoxFilter.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDBoxFilter.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+#pragma mark - Private functions
+
+// Adds one source row into the 32-bit column accumulators.
+static inline void FDBoxFilterAccumulateRow(const uint8_t *row, uint32_t *accumulator, int width)
+{
+    int x = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t pixels = vld1q_u8(row + x);
+        uint16x8_t low = vmovl_u8(vget_low_u8(pixels));
+        uint16x8_t high = vmovl_u8(vget_high_u8(pixels));
+        vst1q_u32(accumulator + x, vaddw_u16(vld1q_u32(accumulator + x), vget_low_u16(low)));
+        vst1q_u32(accumulator + x + 4, vaddw_u16(vld1q_u32(accumulator + x + 4), vget_high_u16(low)));
+        vst1q_u32(accumulator + x + 8, vaddw_u16(vld1q_u32(accumulator + x + 8), vget_low_u16(high)));
+        vst1q_u32(accumulator + x + 12, vaddw_u16(vld1q_u32(accumulator + x + 12), vget_high_u16(high)));
+    }
+#endif
+    for (; x < width; x++)
+    {
+        accumulator[x] += row[x];
+    }
+}
+
+
+#pragma mark - Public functions
+
+void FDBoxFilterDownscalePlane(const uint8_t *source, int sourceStride, int sourceWidth, int sourceHeight,
+                               uint8_t *destination, int destinationStride, int destinationWidth, int destinationHeight)
+{
+    if (destinationWidth <= 0 || destinationHeight <= 0 || sourceWidth < destinationWidth || sourceHeight < destinationHeight)
+    {
+        return;
+    }
+
+    uint32_t *accumulator = malloc(sizeof(uint32_t) * sourceWidth);
+    int *columnStarts = malloc(sizeof(int) * (destinationWidth + 1));
+    if (accumulator == NULL || columnStarts == NULL)
+    {
+        free(accumulator);
+        free(columnStarts);
+        return;
+    }
+
+    for (int x = 0; x <= destinationWidth; x++)
+    {
+        columnStarts[x] = (int)((int64_t)x * sourceWidth / destinationWidth);
+    }
+
+    for (int y = 0; y < destinationHeight; y++)
+    {
+        int rowStart = (int)((int64_t)y * sourceHeight / destinationHeight);
+        int rowEnd = (int)((int64_t)(y + 1) * sourceHeight / destinationHeight);
+
+        memset(accumulator, 0, sizeof(uint32_t) * sourceWidth);
+        for (int row = rowStart; row < rowEnd; row++)
+        {
+            FDBoxFilterAccumulateRow(source + (size_t)row * sourceStride, accumulator, sourceWidth);
+        }
+
+        uint8_t *output = destination + (size_t)y * destinationStride;
+        uint32_t rows = (uint32_t)(rowEnd - rowStart);
+        for (int x = 0; x < destinationWidth; x++)
+        {
+            uint32_t sum = 0;
+            for (int column = columnStarts[x]; column < columnStarts[x + 1]; column++)
+            {
+                sum += accumulator[column];
+            }
+            uint32_t area = rows * (uint32_t)(columnStarts[x + 1] - columnStarts[x]);
+            output[x] = (uint8_t)((sum + area / 2) / area);
+        }
+    }
+
+    free(columnStarts);
+    free(accumulator);
+}
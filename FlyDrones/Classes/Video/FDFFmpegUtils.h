@@ -0,0 +1,28 @@
+//
+//  FDFFmpegUtils.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include "libavformat/avformat.h"
+#include "libavcodec/avcodec.h"
+
+
+extern NSString * const FDFFmpegErrorDomain;
+
+// Registers codecs, formats, filters and network protocols exactly once per process.
+void FDFFmpegInitialize(void);
+
+// Wraps an AVERROR code into an NSError of FDFFmpegErrorDomain.
+NSError *FDFFmpegError(int code, NSString *description);
+
+// Opens a decoder for the given stream with threadCount threads, 0 lets FFmpeg
+// pick. Returns NULL on failure.
+AVCodecContext *FDFFmpegOpenDecoder(AVStream *stream, int threadCount, int *errorCode);
+// Same, passing codec private and generic options such as "flags2" to avcodec_open2.
+AVCodecContext *FDFFmpegOpenDecoderWithOptions(AVStream *stream, int threadCount, AVDictionary **options, int *errorCode);
+
+// Downscales a decoded frame into a packed I420 buffer of width x height (even sizes).
+// 4:2:0 frames go through the box filter, anything else through swscale.
+void FDFFmpegDownscaleFrame(const AVFrame *frame, uint8_t *output, int width, int height);
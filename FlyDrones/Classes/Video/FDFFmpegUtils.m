@@ -0,0 +1,105 @@
+//
+//  FDFFmpegUtils.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+#import "FDBoxFilter.h"
+#include "libavfilter/avfilter.h"
+#include "libswscale/swscale.h"
+
+
+NSString * const FDFFmpegErrorDomain = @"FDFFmpegErrorDomain";
+
+
+#pragma mark - Public functions
+
+void FDFFmpegInitialize(void)
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        av_register_all();
+        avfilter_register_all();
+        avformat_network_init();
+    });
+}
+
+NSError *FDFFmpegError(int code, NSString *description)
+{
+    char buffer[AV_ERROR_MAX_STRING_SIZE] = {0};
+    av_strerror(code, buffer, sizeof(buffer));
+
+    NSString *reason = [NSString stringWithUTF8String:buffer];
+    NSString *message = description.length > 0 ? [NSString stringWithFormat:@"%@: %@", description, reason] : reason;
+    return [NSError errorWithDomain:FDFFmpegErrorDomain code:code userInfo:@{NSLocalizedDescriptionKey : message}];
+}
+
+AVCodecContext *FDFFmpegOpenDecoder(AVStream *stream, int threadCount, int *errorCode)
+{
+    return FDFFmpegOpenDecoderWithOptions(stream, threadCount, NULL, errorCode);
+}
+
+AVCodecContext *FDFFmpegOpenDecoderWithOptions(AVStream *stream, int threadCount, AVDictionary **options, int *errorCode)
+{
+    AVCodec *codec = avcodec_find_decoder(stream->codec->codec_id);
+    if (codec == NULL)
+    {
+        if (errorCode != NULL)
+        {
+            *errorCode = AVERROR_DECODER_NOT_FOUND;
+        }
+        return NULL;
+    }
+
+    AVCodecContext *context = avcodec_alloc_context3(codec);
+    int result = context != NULL ? avcodec_copy_context(context, stream->codec) : AVERROR(ENOMEM);
+    if (result >= 0)
+    {
+        context->thread_count = threadCount;
+        context->refcounted_frames = 1;
+        result = avcodec_open2(context, codec, options);
+    }
+
+    if (result < 0)
+    {
+        avcodec_free_context(&context);
+        if (errorCode != NULL)
+        {
+            *errorCode = result;
+        }
+        return NULL;
+    }
+    return context;
+}
+
+void FDFFmpegDownscaleFrame(const AVFrame *frame, uint8_t *output, int width, int height)
+{
+    uint8_t *outputPlanes[3] = {output, output + width * height, output + width * height * 5 / 4};
+
+    if (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P)
+    {
+        int chromaWidth = (frame->width + 1) / 2;
+        int chromaHeight = (frame->height + 1) / 2;
+        FDBoxFilterDownscalePlane(frame->data[0], frame->linesize[0], frame->width, frame->height,
+                                  outputPlanes[0], width, width, height);
+        FDBoxFilterDownscalePlane(frame->data[1], frame->linesize[1], chromaWidth, chromaHeight,
+                                  outputPlanes[1], width / 2, width / 2, height / 2);
+        FDBoxFilterDownscalePlane(frame->data[2], frame->linesize[2], chromaWidth, chromaHeight,
+                                  outputPlanes[2], width / 2, width / 2, height / 2);
+        return;
+    }
+
+    struct SwsContext *converter = sws_getContext(frame->width, frame->height, frame->format,
+                                                  width, height, AV_PIX_FMT_YUV420P,
+                                                  SWS_AREA, NULL, NULL, NULL);
+    if (converter == NULL)
+    {
+        return;
+    }
+
+    int outputStrides[3] = {width, width / 2, width / 2};
+    sws_scale(converter, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, outputPlanes, outputStrides);
+    sws_freeContext(converter);
+}
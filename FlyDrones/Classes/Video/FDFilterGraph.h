@@ -0,0 +1,48 @@
+//
+//  FDFilterGraph.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+// Called for every filtered frame. The frame is unreferenced after the block returns,
+// take a reference (av_frame_ref) to keep it.
+typedef void (^FDFilterGraphOutputBlock)(AVFrame *frame);
+
+
+// A libavfilter chain such as "crop=iw-64:ih-36,scale=960:-2" or "unsharp=5:5:0.8",
+// parsed and configured once for a fixed input format. Input frames are referenced,
+// not copied (AV_BUFFERSRC_FLAG_KEEP_REF), and outputs are handed out as the
+// graph's own references, so a chain like crop copies nothing. Filters that write
+// in place get a copy, the decoder's frame stays shared.
+@interface FDFilterGraph : NSObject
+
+@property (nonatomic, copy, readonly) NSString *filterDescription;
+@property (nonatomic, assign, readonly) int threadCount;
+@property (nonatomic, assign, readonly) int outputWidth;
+@property (nonatomic, assign, readonly) int outputHeight;
+@property (nonatomic, assign, readonly) enum AVPixelFormat outputPixelFormat;
+@property (nonatomic, assign, readonly) NSTimeInterval averageFilterTime;
+
+// threadCount is the graph's slice thread count, 0 means one per active core and 1 disables threading.
+// outputPixelFormat restricts the sink, AV_PIX_FMT_NONE accepts whatever the chain produces.
+- (instancetype)initWithDescription:(NSString *)description
+                              width:(int)width
+                             height:(int)height
+                        pixelFormat:(enum AVPixelFormat)pixelFormat
+                           timeBase:(AVRational)timeBase
+                  outputPixelFormat:(enum AVPixelFormat)outputPixelFormat
+                        threadCount:(int)threadCount
+                              error:(NSError **)error;
+
+// Feeds one frame, or NULL at the end of the stream to flush, and passes every frame
+// the graph can produce to block. The caller keeps its reference to frame. Not thread safe.
+- (BOOL)filterFrame:(AVFrame *)frame usingBlock:(FDFilterGraphOutputBlock)block error:(NSError **)error;
+
+// Logs the per frame cost of a few typical chains single threaded and with slice threads.
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount;
+
+@end
@@ -0,0 +1,276 @@
+//
+//  FDFilterGraph.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFilterGraph.h"
+#include "libavfilter/avfilter.h"
+#include "libavfilter/buffersink.h"
+#include "libavfilter/buffersrc.h"
+#include "libavutil/opt.h"
+
+
+#pragma mark - Private interface methods
+
+@interface FDFilterGraph ()
+{
+    AVFilterGraph *_graph;
+    AVFilterContext *_source;
+    AVFilterContext *_sink;
+    AVFrame *_output;
+    NSUInteger _frameCount;
+    CFTimeInterval _totalFilterTime;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, copy, readwrite) NSString *filterDescription;
+@property (nonatomic, assign, readwrite) int threadCount;
+@property (nonatomic, assign, readwrite) int outputWidth;
+@property (nonatomic, assign, readwrite) int outputHeight;
+@property (nonatomic, assign, readwrite) enum AVPixelFormat outputPixelFormat;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDFilterGraph
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithDescription:(NSString *)description
+                              width:(int)width
+                             height:(int)height
+                        pixelFormat:(enum AVPixelFormat)pixelFormat
+                           timeBase:(AVRational)timeBase
+                  outputPixelFormat:(enum AVPixelFormat)outputPixelFormat
+                        threadCount:(int)threadCount
+                              error:(NSError **)error
+{
+    self = [super init];
+    if (self)
+    {
+        FDFFmpegInitialize();
+        _filterDescription = [description copy];
+        _threadCount = threadCount;
+
+        int result = [self configureWithWidth:width height:height pixelFormat:pixelFormat timeBase:timeBase outputPixelFormat:outputPixelFormat];
+        if (result < 0)
+        {
+            if (error != NULL)
+            {
+                *error = FDFFmpegError(result, [NSString stringWithFormat:@"Unable to configure filter graph \"%@\"", description]);
+            }
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    av_frame_free(&_output);
+    avfilter_graph_free(&_graph);
+}
+
+#pragma mark - Properties
+
+- (NSTimeInterval)averageFilterTime
+{
+    return _frameCount > 0 ? _totalFilterTime / _frameCount : 0.0;
+}
+
+#pragma mark - Instance methods
+
+- (BOOL)filterFrame:(AVFrame *)frame usingBlock:(FDFilterGraphOutputBlock)block error:(NSError **)error
+{
+    CFTimeInterval start = CACurrentMediaTime();
+    CFTimeInterval blockTime = 0;
+    // The source takes its own reference, the caller's frame is left untouched.
+    int result = av_buffersrc_add_frame_flags(_source, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+    while (result >= 0)
+    {
+        result = av_buffersink_get_frame_flags(_sink, _output, 0);
+        if (result == AVERROR(EAGAIN) || result == AVERROR_EOF)
+        {
+            result = 0;
+            break;
+        }
+        if (result < 0)
+        {
+            break;
+        }
+
+        CFTimeInterval blockStart = CACurrentMediaTime();
+        if (block != nil)
+        {
+            block(_output);
+        }
+        av_frame_unref(_output);
+        blockTime += CACurrentMediaTime() - blockStart;
+    }
+
+    if (frame != NULL)
+    {
+        _totalFilterTime += CACurrentMediaTime() - start - blockTime;
+        _frameCount++;
+    }
+    if (result < 0)
+    {
+        if (error != NULL)
+        {
+            *error = FDFFmpegError(result, @"Unable to filter frame");
+        }
+        return NO;
+    }
+    return YES;
+}
+
+#pragma mark - Private methods
+
+- (int)configureWithWidth:(int)width
+                   height:(int)height
+              pixelFormat:(enum AVPixelFormat)pixelFormat
+                 timeBase:(AVRational)timeBase
+        outputPixelFormat:(enum AVPixelFormat)outputPixelFormat
+{
+    _output = av_frame_alloc();
+    _graph = avfilter_graph_alloc();
+    if (_output == NULL || _graph == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+    // Must be set before the first filter is created, that is when the graph starts its workers.
+    _graph->nb_threads = _threadCount;
+    _graph->thread_type = _threadCount == 1 ? 0 : AVFILTER_THREAD_SLICE;
+
+    char arguments[256];
+    snprintf(arguments, sizeof(arguments), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=1/1",
+             width, height, pixelFormat, timeBase.num, MAX(timeBase.den, 1));
+    int result = avfilter_graph_create_filter(&_source, avfilter_get_by_name("buffer"), "in", arguments, NULL, _graph);
+    if (result >= 0)
+    {
+        result = avfilter_graph_create_filter(&_sink, avfilter_get_by_name("buffersink"), "out", NULL, NULL, _graph);
+    }
+    if (result >= 0 && outputPixelFormat != AV_PIX_FMT_NONE)
+    {
+        enum AVPixelFormat formats[] = {outputPixelFormat, AV_PIX_FMT_NONE};
+        result = av_opt_set_int_list(_sink, "pix_fmts", formats, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+    }
+    if (result < 0)
+    {
+        return result;
+    }
+
+    // Named the way the chain sees them: its input is our source's output and vice versa.
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    if (outputs == NULL || inputs == NULL)
+    {
+        avfilter_inout_free(&outputs);
+        avfilter_inout_free(&inputs);
+        return AVERROR(ENOMEM);
+    }
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = _source;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = _sink;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    result = avfilter_graph_parse_ptr(_graph, _filterDescription.UTF8String, &inputs, &outputs, NULL);
+    avfilter_inout_free(&outputs);
+    avfilter_inout_free(&inputs);
+    if (result >= 0)
+    {
+        result = avfilter_graph_config(_graph, NULL);
+    }
+    if (result >= 0)
+    {
+        AVFilterLink *link = _sink->inputs[0];
+        _outputWidth = link->w;
+        _outputHeight = link->h;
+        _outputPixelFormat = link->format;
+    }
+    return result;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount
+{
+    FDFFmpegInitialize();
+    AVFrame *frame = av_frame_alloc();
+    if (frame == NULL)
+    {
+        return;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 32) < 0)
+    {
+        av_frame_free(&frame);
+        return;
+    }
+    for (int plane = 0; plane < 3; plane++)
+    {
+        int planeHeight = plane == 0 ? height : (height + 1) / 2;
+        for (int y = 0; y < planeHeight; y++)
+        {
+            for (int x = 0; x < frame->linesize[plane]; x++)
+            {
+                frame->data[plane][(size_t)y * frame->linesize[plane] + x] = (uint8_t)((x ^ y) + plane * 64);
+            }
+        }
+    }
+
+    NSArray *chains = @[@"null",
+                        @"crop=iw*9/10:ih*9/10,scale=960:-2",
+                        @"scale=1280:720",
+                        @"unsharp=5:5:0.8",
+                        @"lutyuv=y=negval",
+                        @"hqdn3d"];
+    int threadCounts[2] = {1, 0};
+    for (NSString *chain in chains)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            NSError *error = nil;
+            FDFilterGraph *graph = [[FDFilterGraph alloc] initWithDescription:chain width:width height:height
+                                                                  pixelFormat:AV_PIX_FMT_YUV420P timeBase:(AVRational){1, 30}
+                                                            outputPixelFormat:AV_PIX_FMT_YUV420P threadCount:threadCounts[i] error:&error];
+            if (graph == nil)
+            {
+                NSLog(@"Filter chain %@: %@", chain, error);
+                break;
+            }
+
+            __block NSUInteger outputs = 0;
+            for (NSUInteger j = 0; j < frameCount; j++)
+            {
+                frame->pts = (int64_t)j;
+                if (![graph filterFrame:frame usingBlock:^(AVFrame *output) { outputs++; } error:&error])
+                {
+                    NSLog(@"Filter chain %@: %@", chain, error);
+                    break;
+                }
+            }
+            [graph filterFrame:NULL usingBlock:^(AVFrame *output) { outputs++; } error:NULL];
+            NSLog(@"Filter chain \"%@\" at %dx%d -> %dx%d, %@: %.3f ms/frame, %lu frames out",
+                  chain, width, height, graph.outputWidth, graph.outputHeight,
+                  threadCounts[i] == 1 ? @"1 thread" : @"slice threads", graph.averageFilterTime * 1000.0, (unsigned long)outputs);
+        }
+    }
+
+    av_frame_free(&frame);
+}
+
+#pragma mark -
+
+@end
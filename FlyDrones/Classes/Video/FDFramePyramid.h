@@ -0,0 +1,39 @@
+//
+//  FDFramePyramid.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+// Levels below the source: 1/2, 1/4 and 1/8.
+#define FDFramePyramidLevelCount 3
+
+
+// Builds the half, quarter and eighth resolution YUV 4:2:0 levels of a decoded
+// frame in one pass, so the full screen view, the mini-map tile and the thumbnails
+// each pick a level instead of scaling the frame separately. Rows stream through
+// all levels while the rows they come from are still in cache. Level planes come
+// from AVBufferPools and are recycled once every consumer released its reference.
+@interface FDFramePyramid : NSObject
+
+@property (nonatomic, assign, readonly) int width;
+@property (nonatomic, assign, readonly) int height;
+@property (nonatomic, assign, readonly) NSTimeInterval averageBuildTime;
+
+- (instancetype)initWithWidth:(int)width height:(int)height;
+
+// levels receives FDFramePyramidLevelCount new frame references, level i is
+// (roughly) 1 / 2^(i + 1) of the source. Release them with av_frame_free.
+// The source must be YUV 4:2:0 of the pyramid's size. Not thread safe.
+- (BOOL)buildLevelsFromFrame:(const AVFrame *)frame levels:(AVFrame **)levels;
+
+// Smallest level at least targetWidth wide, 0 for the source itself, i + 1 for levels[i].
++ (int)levelForTargetWidth:(int)targetWidth sourceWidth:(int)sourceWidth;
+
+// Logs the pyramid build time against three separate sws_scale calls.
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount;
+
+@end
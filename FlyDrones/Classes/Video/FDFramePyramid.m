@@ -0,0 +1,302 @@
+//
+//  FDFramePyramid.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFramePyramid.h"
+#include "libavutil/buffer.h"
+#include "libswscale/swscale.h"
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static int const FDFramePyramidAlignment = 32;
+
+
+#pragma mark - Private functions
+
+// Averages 2x2 blocks of two source rows. An odd last column is averaged with itself.
+static void FDFramePyramidDownscaleRow(const uint8_t *top, const uint8_t *bottom, int sourceWidth, uint8_t *output, int outputWidth)
+{
+    int pairs = sourceWidth / 2;
+    int x = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; x + 16 <= pairs; x += 16)
+    {
+        uint16x8_t low = vaddq_u16(vpaddlq_u8(vld1q_u8(top + 2 * x)), vpaddlq_u8(vld1q_u8(bottom + 2 * x)));
+        uint16x8_t high = vaddq_u16(vpaddlq_u8(vld1q_u8(top + 2 * x + 16)), vpaddlq_u8(vld1q_u8(bottom + 2 * x + 16)));
+        vst1q_u8(output + x, vcombine_u8(vrshrn_n_u16(low, 2), vrshrn_n_u16(high, 2)));
+    }
+#endif
+    for (; x < pairs; x++)
+    {
+        output[x] = (uint8_t)((top[2 * x] + top[2 * x + 1] + bottom[2 * x] + bottom[2 * x + 1] + 2) >> 2);
+    }
+    if (x < outputWidth)
+    {
+        output[x] = (uint8_t)((top[2 * x] + bottom[2 * x] + 1) >> 1);
+    }
+}
+
+// Streams the rows of one plane through every level: a level row is produced as soon
+// as the two rows above it exist, while they are still in cache.
+static void FDFramePyramidBuildPlane(const uint8_t *source, int sourceStride, int sourceWidth, int sourceHeight,
+                                     uint8_t * const *planes, const int *strides, const int *widths, const int *heights)
+{
+    int done[FDFramePyramidLevelCount] = {0};
+    for (int y = 0; y < heights[0]; y++)
+    {
+        const uint8_t *top = source + (size_t)(2 * y) * sourceStride;
+        const uint8_t *bottom = source + (size_t)MIN(2 * y + 1, sourceHeight - 1) * sourceStride;
+        FDFramePyramidDownscaleRow(top, bottom, sourceWidth, planes[0] + (size_t)y * strides[0], widths[0]);
+        done[0] = y + 1;
+
+        for (int level = 1; level < FDFramePyramidLevelCount; level++)
+        {
+            while (done[level] < heights[level] && MIN(2 * done[level] + 1, heights[level - 1] - 1) < done[level - 1])
+            {
+                int row = done[level];
+                const uint8_t *above = planes[level - 1] + (size_t)(2 * row) * strides[level - 1];
+                const uint8_t *below = planes[level - 1] + (size_t)MIN(2 * row + 1, heights[level - 1] - 1) * strides[level - 1];
+                FDFramePyramidDownscaleRow(above, below, widths[level - 1], planes[level] + (size_t)row * strides[level], widths[level]);
+                done[level]++;
+            }
+        }
+    }
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDFramePyramid ()
+{
+    // Indexed by level, then plane.
+    AVBufferPool *_pools[FDFramePyramidLevelCount][3];
+    int _widths[3][FDFramePyramidLevelCount];
+    int _heights[3][FDFramePyramidLevelCount];
+    int _strides[3][FDFramePyramidLevelCount];
+    NSUInteger _buildCount;
+    CFTimeInterval _totalBuildTime;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) int width;
+@property (nonatomic, assign, readwrite) int height;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDFramePyramid
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithWidth:(int)width height:(int)height
+{
+    self = [super init];
+    if (self)
+    {
+        _width = width;
+        _height = height;
+        for (int plane = 0; plane < 3; plane++)
+        {
+            // Every dimension rounds up, so the chroma of a level is also the half of the previous level's chroma.
+            int planeWidth = plane == 0 ? width : (width + 1) / 2;
+            int planeHeight = plane == 0 ? height : (height + 1) / 2;
+            for (int level = 0; level < FDFramePyramidLevelCount; level++)
+            {
+                planeWidth = (planeWidth + 1) / 2;
+                planeHeight = (planeHeight + 1) / 2;
+                _widths[plane][level] = planeWidth;
+                _heights[plane][level] = planeHeight;
+                _strides[plane][level] = FFALIGN(planeWidth, FDFramePyramidAlignment);
+                _pools[level][plane] = av_buffer_pool_init(_strides[plane][level] * planeHeight, NULL);
+                if (_pools[level][plane] == NULL)
+                {
+                    return nil;
+                }
+            }
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // Pools with buffers still referenced are freed when the last one is released.
+    for (int level = 0; level < FDFramePyramidLevelCount; level++)
+    {
+        for (int plane = 0; plane < 3; plane++)
+        {
+            av_buffer_pool_uninit(&_pools[level][plane]);
+        }
+    }
+}
+
+#pragma mark - Properties
+
+- (NSTimeInterval)averageBuildTime
+{
+    return _buildCount > 0 ? _totalBuildTime / _buildCount : 0.0;
+}
+
+#pragma mark - Instance methods
+
+- (BOOL)buildLevelsFromFrame:(const AVFrame *)frame levels:(AVFrame **)levels
+{
+    if ((frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) ||
+        frame->width != self.width || frame->height != self.height || self.width < 2 || self.height < 2)
+    {
+        return NO;
+    }
+
+    CFTimeInterval start = CACurrentMediaTime();
+    BOOL allocated = YES;
+    for (int level = 0; level < FDFramePyramidLevelCount; level++)
+    {
+        levels[level] = av_frame_alloc();
+        if (levels[level] == NULL)
+        {
+            allocated = NO;
+            continue;
+        }
+        levels[level]->format = frame->format;
+        levels[level]->width = _widths[0][level];
+        levels[level]->height = _heights[0][level];
+        av_frame_copy_props(levels[level], frame);
+        for (int plane = 0; plane < 3; plane++)
+        {
+            levels[level]->buf[plane] = av_buffer_pool_get(_pools[level][plane]);
+            if (levels[level]->buf[plane] == NULL)
+            {
+                allocated = NO;
+                break;
+            }
+            levels[level]->data[plane] = levels[level]->buf[plane]->data;
+            levels[level]->linesize[plane] = _strides[plane][level];
+        }
+    }
+    if (!allocated)
+    {
+        for (int level = 0; level < FDFramePyramidLevelCount; level++)
+        {
+            av_frame_free(&levels[level]);
+        }
+        return NO;
+    }
+
+    for (int plane = 0; plane < 3; plane++)
+    {
+        uint8_t *planes[FDFramePyramidLevelCount];
+        for (int level = 0; level < FDFramePyramidLevelCount; level++)
+        {
+            planes[level] = levels[level]->data[plane];
+        }
+        int sourceWidth = plane == 0 ? self.width : (self.width + 1) / 2;
+        int sourceHeight = plane == 0 ? self.height : (self.height + 1) / 2;
+        FDFramePyramidBuildPlane(frame->data[plane], frame->linesize[plane], sourceWidth, sourceHeight,
+                                 planes, _strides[plane], _widths[plane], _heights[plane]);
+    }
+
+    _totalBuildTime += CACurrentMediaTime() - start;
+    _buildCount++;
+    return YES;
+}
+
++ (int)levelForTargetWidth:(int)targetWidth sourceWidth:(int)sourceWidth
+{
+    int level = 0;
+    int width = sourceWidth;
+    while (level < FDFramePyramidLevelCount && (width + 1) / 2 >= targetWidth)
+    {
+        width = (width + 1) / 2;
+        level++;
+    }
+    return level;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount
+{
+    FDFramePyramid *pyramid = [[FDFramePyramid alloc] initWithWidth:width height:height];
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *scaled[FDFramePyramidLevelCount] = {NULL};
+    struct SwsContext *converters[FDFramePyramidLevelCount] = {NULL};
+    BOOL ready = pyramid != nil && frame != NULL;
+    if (ready)
+    {
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = width;
+        frame->height = height;
+        ready = av_frame_get_buffer(frame, FDFramePyramidAlignment) >= 0;
+    }
+    for (int level = 0; ready && level < FDFramePyramidLevelCount; level++)
+    {
+        scaled[level] = av_frame_alloc();
+        ready = scaled[level] != NULL;
+        if (ready)
+        {
+            scaled[level]->format = AV_PIX_FMT_YUV420P;
+            scaled[level]->width = pyramid->_widths[0][level];
+            scaled[level]->height = pyramid->_heights[0][level];
+            converters[level] = sws_getContext(width, height, AV_PIX_FMT_YUV420P, scaled[level]->width, scaled[level]->height,
+                                               AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+            ready = converters[level] != NULL && av_frame_get_buffer(scaled[level], FDFramePyramidAlignment) >= 0;
+        }
+    }
+
+    if (ready)
+    {
+        for (int plane = 0; plane < 3; plane++)
+        {
+            int planeHeight = plane == 0 ? height : (height + 1) / 2;
+            for (int y = 0; y < planeHeight; y++)
+            {
+                memset(frame->data[plane] + (size_t)y * frame->linesize[plane], (y * 3 + plane * 40) & 0xFF, frame->linesize[plane]);
+            }
+        }
+
+        AVFrame *levels[FDFramePyramidLevelCount];
+        for (NSUInteger i = 0; i < frameCount; i++)
+        {
+            if ([pyramid buildLevelsFromFrame:frame levels:levels])
+            {
+                for (int level = 0; level < FDFramePyramidLevelCount; level++)
+                {
+                    av_frame_free(&levels[level]);
+                }
+            }
+        }
+
+        CFTimeInterval start = CACurrentMediaTime();
+        for (NSUInteger i = 0; i < frameCount; i++)
+        {
+            for (int level = 0; level < FDFramePyramidLevelCount; level++)
+            {
+                sws_scale(converters[level], (const uint8_t * const *)frame->data, frame->linesize, 0, height,
+                          scaled[level]->data, scaled[level]->linesize);
+            }
+        }
+        CFTimeInterval scaleTime = (CACurrentMediaTime() - start) / MAX(frameCount, (NSUInteger)1);
+        NSLog(@"Pyramid at %dx%d: %.3f ms/frame, separate sws_scale %.3f ms/frame (%.1fx)",
+              width, height, pyramid.averageBuildTime * 1000.0, scaleTime * 1000.0,
+              scaleTime / MAX(pyramid.averageBuildTime, 1e-9));
+    }
+
+    for (int level = 0; level < FDFramePyramidLevelCount; level++)
+    {
+        sws_freeContext(converters[level]);
+        av_frame_free(&scaled[level]);
+    }
+    av_frame_free(&frame);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,43 @@
+//
+//  FDH264Utils.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stdint.h>
+
+
+typedef NS_ENUM(uint8_t, FDH264NALType)
+{
+    FDH264NALTypeSlice = 1,
+    FDH264NALTypeIDRSlice = 5,
+    FDH264NALTypeSEI = 6,
+    FDH264NALTypeSPS = 7,
+    FDH264NALTypePPS = 8,
+    FDH264NALTypeAccessUnitDelimiter = 9
+};
+
+// Walks the NAL units of a packet without copying. A zero nalLengthSize means
+// Annex B start codes, otherwise NALs are prefixed with a big-endian length (avcC).
+typedef struct FDH264NALIterator
+{
+    const uint8_t *position;
+    const uint8_t *end;
+    int nalLengthSize;
+} FDH264NALIterator;
+
+void FDH264NALIteratorInit(FDH264NALIterator *iterator, const uint8_t *data, int size, int nalLengthSize);
+
+// Returns NO when there are no more NAL units. nal points at the NAL header byte.
+BOOL FDH264NALIteratorNext(FDH264NALIterator *iterator, const uint8_t **nal, int *nalSize);
+
+// Returns 0 for Annex B extradata, or the avcC NAL length prefix size.
+int FDH264NALLengthSize(const uint8_t *extradata, int extradataSize);
+
+BOOL FDH264PacketContainsIDR(const uint8_t *data, int size, int nalLengthSize);
+
+static inline FDH264NALType FDH264NALUnitType(const uint8_t *nal)
+{
+    return (FDH264NALType)(nal[0] & 0x1F);
+}
@@ -0,0 +1,119 @@
+//
+//  FDH264Utils.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDH264Utils.h"
+
+
+#pragma mark - Private functions
+
+static const uint8_t *FDH264FindStartCode(const uint8_t *position, const uint8_t *end)
+{
+    for (; position + 3 <= end; position++)
+    {
+        if (position[0] == 0 && position[1] == 0 && position[2] == 1)
+        {
+            return position;
+        }
+    }
+    return end;
+}
+
+
+#pragma mark - Public functions
+
+void FDH264NALIteratorInit(FDH264NALIterator *iterator, const uint8_t *data, int size, int nalLengthSize)
+{
+    iterator->position = data;
+    iterator->end = data + size;
+    iterator->nalLengthSize = nalLengthSize;
+
+    if (nalLengthSize == 0)
+    {
+        const uint8_t *startCode = FDH264FindStartCode(data, iterator->end);
+        iterator->position = startCode < iterator->end ? startCode + 3 : iterator->end;
+    }
+}
+
+BOOL FDH264NALIteratorNext(FDH264NALIterator *iterator, const uint8_t **nal, int *nalSize)
+{
+    const uint8_t *position = iterator->position;
+    const uint8_t *end = iterator->end;
+
+    if (iterator->nalLengthSize > 0)
+    {
+        if (end - position < iterator->nalLengthSize)
+        {
+            return NO;
+        }
+
+        uint32_t length = 0;
+        for (int i = 0; i < iterator->nalLengthSize; i++)
+        {
+            length = (length << 8) | position[i];
+        }
+        position += iterator->nalLengthSize;
+        if (length == 0 || length > (uint32_t)(end - position))
+        {
+            iterator->position = end;
+            return NO;
+        }
+
+        *nal = position;
+        *nalSize = (int)length;
+        iterator->position = position + length;
+        return YES;
+    }
+
+    if (position >= end)
+    {
+        return NO;
+    }
+
+    const uint8_t *next = FDH264FindStartCode(position, end);
+    const uint8_t *nalEnd = next;
+    // Trailing zero belongs to a four byte start code of the next NAL.
+    while (nalEnd > position && nalEnd < end && nalEnd[-1] == 0)
+    {
+        nalEnd--;
+    }
+
+    *nal = position;
+    *nalSize = (int)(nalEnd - position);
+    iterator->position = next < end ? next + 3 : end;
+    return *nalSize > 0 ? YES : FDH264NALIteratorNext(iterator, nal, nalSize);
+}
+
+int FDH264NALLengthSize(const uint8_t *extradata, int extradataSize)
+{
+    if (extradata == NULL || extradataSize < 7 || extradata[0] != 1)
+    {
+        return 0;
+    }
+    return (extradata[4] & 0x03) + 1;
+}
+
+BOOL FDH264PacketContainsIDR(const uint8_t *data, int size, int nalLengthSize)
+{
+    FDH264NALIterator iterator;
+    FDH264NALIteratorInit(&iterator, data, size, nalLengthSize);
+
+    const uint8_t *nal = NULL;
+    int nalSize = 0;
+    while (FDH264NALIteratorNext(&iterator, &nal, &nalSize))
+    {
+        FDH264NALType type = FDH264NALUnitType(nal);
+        if (type == FDH264NALTypeIDRSlice)
+        {
+            return YES;
+        }
+        if (type == FDH264NALTypeSlice)
+        {
+            return NO;
+        }
+    }
+    return NO;
+}
@@ -0,0 +1,57 @@
+//
+//  FDLensCorrector.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+// Pinhole intrinsics in pixels and Brown-Conrady distortion, as produced by the
+// usual checkerboard calibration (radial k1, k2, k3 and tangential p1, p2).
+typedef struct FDLensCalibration
+{
+    int width;
+    int height;
+    double focalLengthX;
+    double focalLengthY;
+    double principalPointX;
+    double principalPointY;
+    double k1;
+    double k2;
+    double k3;
+    double p1;
+    double p2;
+} FDLensCalibration;
+
+
+// Removes lens distortion from YUV 4:2:0 frames with a remap table computed once per
+// calibration. The table already includes the crop and the scale to the output
+// size, so dewarping, cropping and scaling are a single pass. Entries are fixed
+// point and stored tile by tile, so a tile reads its table sequentially and its
+// source pixels from a small neighbourhood. Row bands of tiles run concurrently.
+@interface FDLensCorrector : NSObject
+
+@property (nonatomic, assign, readonly) FDLensCalibration calibration;
+@property (nonatomic, assign, readonly) int outputWidth;
+@property (nonatomic, assign, readonly) int outputHeight;
+// Region of the undistorted image, in calibration pixels, that fills the output.
+@property (nonatomic, assign, readonly) CGRect cropRect;
+// Splits the frame into row bands processed concurrently, YES by default.
+@property (nonatomic, assign, getter=isConcurrent) BOOL concurrent;
+@property (nonatomic, assign, readonly) NSTimeInterval averageCorrectionTime;
+
+// cropRect CGRectNull keeps the whole calibration frame. Output sizes are rounded down to even.
+- (instancetype)initWithCalibration:(FDLensCalibration)calibration
+                        outputWidth:(int)outputWidth
+                       outputHeight:(int)outputHeight
+                           cropRect:(CGRect)cropRect;
+
+// frame must match the calibration size, output must be allocated at the output size.
+- (BOOL)correctFrame:(const AVFrame *)frame toFrame:(AVFrame *)output;
+
+// Logs the correction time of a synthetic wide angle calibration, single and multi-threaded.
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount;
+
+@end
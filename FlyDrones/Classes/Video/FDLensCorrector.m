@@ -0,0 +1,403 @@
+//
+//  FDLensCorrector.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDLensCorrector.h"
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+// Luma tile size; chroma tiles are half of it in both directions, so tile row i
+// of every plane covers the same band of the picture.
+#define FDLensTileWidth 64
+#define FDLensTileHeight 16
+
+// Remap table of one plane. Entries are grouped by tile, row-major inside a tile:
+// integer source column and row, and both 7-bit fractions (0...128, x low byte).
+typedef struct FDLensTable
+{
+    int width;
+    int height;
+    int tileWidth;
+    int tileHeight;
+    int tilesPerRow;
+    int tileRows;
+    uint16_t *columns;
+    uint16_t *rows;
+    uint16_t *fractions;
+} FDLensTable;
+
+
+#pragma mark - Private functions
+
+static BOOL FDLensTableAllocate(FDLensTable *table, int width, int height, int tileWidth, int tileHeight)
+{
+    table->width = width;
+    table->height = height;
+    table->tileWidth = tileWidth;
+    table->tileHeight = tileHeight;
+    table->tilesPerRow = (width + tileWidth - 1) / tileWidth;
+    table->tileRows = (height + tileHeight - 1) / tileHeight;
+    // Partial tiles at the right and bottom edges are padded, padding entries stay 0.
+    size_t count = (size_t)table->tilesPerRow * table->tileRows * tileWidth * tileHeight;
+    table->columns = calloc(count, sizeof(uint16_t));
+    table->rows = calloc(count, sizeof(uint16_t));
+    table->fractions = calloc(count, sizeof(uint16_t));
+    return table->columns != NULL && table->rows != NULL && table->fractions != NULL;
+}
+
+static void FDLensTableFree(FDLensTable *table)
+{
+    free(table->columns);
+    free(table->rows);
+    free(table->fractions);
+    memset(table, 0, sizeof(FDLensTable));
+}
+
+static inline size_t FDLensTableIndex(const FDLensTable *table, int x, int y)
+{
+    int tileColumn = x / table->tileWidth;
+    int tileRow = y / table->tileHeight;
+    size_t tile = (size_t)tileRow * table->tilesPerRow + tileColumn;
+    return (tile * table->tileHeight + y % table->tileHeight) * table->tileWidth + x % table->tileWidth;
+}
+
+// Clamps to the source plane so that both bilinear taps exist.
+static inline void FDLensTableSet(FDLensTable *table, int x, int y, double sourceX, double sourceY, int sourceWidth, int sourceHeight)
+{
+    sourceX = MIN(MAX(sourceX, 0.0), sourceWidth - 1.0);
+    sourceY = MIN(MAX(sourceY, 0.0), sourceHeight - 1.0);
+    int column = MIN((int)sourceX, sourceWidth - 2);
+    int row = MIN((int)sourceY, sourceHeight - 2);
+    int fractionX = (int)lrint((sourceX - column) * 128.0);
+    int fractionY = (int)lrint((sourceY - row) * 128.0);
+    size_t index = FDLensTableIndex(table, x, y);
+    table->columns[index] = (uint16_t)column;
+    table->rows[index] = (uint16_t)row;
+    table->fractions[index] = (uint16_t)(fractionX | (fractionY << 8));
+}
+
+// Undistorted (ideal) pixel to the distorted pixel the lens actually recorded.
+static void FDLensDistort(const FDLensCalibration *calibration, double x, double y, double *sourceX, double *sourceY)
+{
+    double u = (x - calibration->principalPointX) / calibration->focalLengthX;
+    double v = (y - calibration->principalPointY) / calibration->focalLengthY;
+    double r2 = u * u + v * v;
+    double radial = 1.0 + r2 * (calibration->k1 + r2 * (calibration->k2 + r2 * calibration->k3));
+    double distortedU = u * radial + 2.0 * calibration->p1 * u * v + calibration->p2 * (r2 + 2.0 * u * u);
+    double distortedV = v * radial + calibration->p1 * (r2 + 2.0 * v * v) + 2.0 * calibration->p2 * u * v;
+    *sourceX = distortedU * calibration->focalLengthX + calibration->principalPointX;
+    *sourceY = distortedV * calibration->focalLengthY + calibration->principalPointY;
+}
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+static inline uint8x8_t FDLensBlend(uint8x8_t topLeft, uint8x8_t topRight, uint8x8_t bottomLeft, uint8x8_t bottomRight,
+                                    uint16x8_t fractionX, uint16x8_t fractionY)
+{
+    uint16x8_t one = vdupq_n_u16(128);
+    uint16x8_t inverseX = vsubq_u16(one, fractionX);
+    uint16x8_t inverseY = vsubq_u16(one, fractionY);
+    uint16x8_t top = vmlaq_u16(vmulq_u16(vmovl_u8(topLeft), inverseX), vmovl_u8(topRight), fractionX);
+    uint16x8_t bottom = vmlaq_u16(vmulq_u16(vmovl_u8(bottomLeft), inverseX), vmovl_u8(bottomRight), fractionX);
+    uint32x4_t low = vmlal_u16(vmull_u16(vget_low_u16(top), vget_low_u16(inverseY)), vget_low_u16(bottom), vget_low_u16(fractionY));
+    uint32x4_t high = vmlal_u16(vmull_u16(vget_high_u16(top), vget_high_u16(inverseY)), vget_high_u16(bottom), vget_high_u16(fractionY));
+    return vmovn_u16(vcombine_u16(vrshrn_n_u32(low, 14), vrshrn_n_u32(high, 14)));
+}
+#endif
+
+static void FDLensRemapTileRow(const FDLensTable *table, int tileRow, const uint8_t *source, int sourceStride,
+                               uint8_t *destination, int destinationStride)
+{
+    for (int tileColumn = 0; tileColumn < table->tilesPerRow; tileColumn++)
+    {
+        int left = tileColumn * table->tileWidth;
+        int width = MIN(table->tileWidth, table->width - left);
+        size_t tileStart = ((size_t)tileRow * table->tilesPerRow + tileColumn) * table->tileHeight * table->tileWidth;
+        for (int row = 0; row < table->tileHeight; row++)
+        {
+            int y = tileRow * table->tileHeight + row;
+            if (y >= table->height)
+            {
+                break;
+            }
+            const uint16_t *columns = table->columns + tileStart + (size_t)row * table->tileWidth;
+            const uint16_t *rows = table->rows + tileStart + (size_t)row * table->tileWidth;
+            const uint16_t *fractions = table->fractions + tileStart + (size_t)row * table->tileWidth;
+            uint8_t *output = destination + (size_t)y * destinationStride + left;
+            int x = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+            for (; x + 8 <= width; x += 8)
+            {
+                uint16x8_t packed = vld1q_u16(fractions + x);
+                uint16x8_t fractionX = vandq_u16(packed, vdupq_n_u16(0xFF));
+                uint16x8_t fractionY = vshrq_n_u16(packed, 8);
+                uint16x8_t columnVector = vld1q_u16(columns + x);
+                uint16x8_t rowVector = vld1q_u16(rows + x);
+                uint16_t firstColumn = columns[x];
+                uint16_t firstRow = rows[x];
+
+                // Near the center the 8 taps usually share a row pair and span fewer than 16 columns:
+                // load 16 bytes per row and pick the taps with table lookups instead of 32 scalar loads.
+                uint16x8_t offsets = vsubq_u16(columnVector, vdupq_n_u16(firstColumn));
+                uint16x8_t outside = vorrq_u16(vmvnq_u16(vceqq_u16(rowVector, vdupq_n_u16(firstRow))), vcgtq_u16(offsets, vdupq_n_u16(14)));
+                uint64x2_t outsideBits = vreinterpretq_u64_u16(outside);
+                uint8x8_t topLeft;
+                uint8x8_t topRight;
+                uint8x8_t bottomLeft;
+                uint8x8_t bottomRight;
+                if ((vgetq_lane_u64(outsideBits, 0) | vgetq_lane_u64(outsideBits, 1)) == 0 && firstColumn + 16 <= sourceStride)
+                {
+                    const uint8_t *top = source + (size_t)firstRow * sourceStride + firstColumn;
+                    uint8x16_t topRow = vld1q_u8(top);
+                    uint8x16_t bottomRow = vld1q_u8(top + sourceStride);
+                    uint8x8x2_t topTable = {{vget_low_u8(topRow), vget_high_u8(topRow)}};
+                    uint8x8x2_t bottomTable = {{vget_low_u8(bottomRow), vget_high_u8(bottomRow)}};
+                    uint8x8_t leftIndex = vmovn_u16(offsets);
+                    uint8x8_t rightIndex = vadd_u8(leftIndex, vdup_n_u8(1));
+                    topLeft = vtbl2_u8(topTable, leftIndex);
+                    topRight = vtbl2_u8(topTable, rightIndex);
+                    bottomLeft = vtbl2_u8(bottomTable, leftIndex);
+                    bottomRight = vtbl2_u8(bottomTable, rightIndex);
+                }
+                else
+                {
+                    uint8_t taps[4][8];
+                    for (int i = 0; i < 8; i++)
+                    {
+                        const uint8_t *pixel = source + (size_t)rows[x + i] * sourceStride + columns[x + i];
+                        taps[0][i] = pixel[0];
+                        taps[1][i] = pixel[1];
+                        taps[2][i] = pixel[sourceStride];
+                        taps[3][i] = pixel[sourceStride + 1];
+                    }
+                    topLeft = vld1_u8(taps[0]);
+                    topRight = vld1_u8(taps[1]);
+                    bottomLeft = vld1_u8(taps[2]);
+                    bottomRight = vld1_u8(taps[3]);
+                }
+                vst1_u8(output + x, FDLensBlend(topLeft, topRight, bottomLeft, bottomRight, fractionX, fractionY));
+            }
+#endif
+            for (; x < width; x++)
+            {
+                const uint8_t *pixel = source + (size_t)rows[x] * sourceStride + columns[x];
+                uint32_t fractionX = fractions[x] & 0xFF;
+                uint32_t fractionY = fractions[x] >> 8;
+                uint32_t top = pixel[0] * (128 - fractionX) + pixel[1] * fractionX;
+                uint32_t bottom = pixel[sourceStride] * (128 - fractionX) + pixel[sourceStride + 1] * fractionX;
+                output[x] = (uint8_t)((top * (128 - fractionY) + bottom * fractionY + 8192) >> 14);
+            }
+        }
+    }
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDLensCorrector ()
+{
+    FDLensTable _luma;
+    FDLensTable _chroma;
+    NSUInteger _correctionCount;
+    CFTimeInterval _totalCorrectionTime;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) FDLensCalibration calibration;
+@property (nonatomic, assign, readwrite) int outputWidth;
+@property (nonatomic, assign, readwrite) int outputHeight;
+@property (nonatomic, assign, readwrite) CGRect cropRect;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDLensCorrector
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithCalibration:(FDLensCalibration)calibration
+                        outputWidth:(int)outputWidth
+                       outputHeight:(int)outputHeight
+                           cropRect:(CGRect)cropRect
+{
+    self = [super init];
+    if (self)
+    {
+        _calibration = calibration;
+        _outputWidth = outputWidth & ~1;
+        _outputHeight = outputHeight & ~1;
+        _cropRect = CGRectIsNull(cropRect) ? CGRectMake(0, 0, calibration.width, calibration.height) : cropRect;
+        _concurrent = YES;
+
+        if (_outputWidth < 2 || _outputHeight < 2 || calibration.width < 4 || calibration.height < 4 ||
+            calibration.focalLengthX <= 0 || calibration.focalLengthY <= 0 ||
+            !FDLensTableAllocate(&_luma, _outputWidth, _outputHeight, FDLensTileWidth, FDLensTileHeight) ||
+            !FDLensTableAllocate(&_chroma, _outputWidth / 2, _outputHeight / 2, FDLensTileWidth / 2, FDLensTileHeight / 2))
+        {
+            return nil;
+        }
+        [self buildTables];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    FDLensTableFree(&_luma);
+    FDLensTableFree(&_chroma);
+}
+
+#pragma mark - Properties
+
+- (NSTimeInterval)averageCorrectionTime
+{
+    return _correctionCount > 0 ? _totalCorrectionTime / _correctionCount : 0.0;
+}
+
+#pragma mark - Instance methods
+
+- (BOOL)correctFrame:(const AVFrame *)frame toFrame:(AVFrame *)output
+{
+    BOOL supported = (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) &&
+                     (output->format == AV_PIX_FMT_YUV420P || output->format == AV_PIX_FMT_YUVJ420P);
+    if (!supported || frame->width != self.calibration.width || frame->height != self.calibration.height ||
+        output->width != self.outputWidth || output->height != self.outputHeight)
+    {
+        return NO;
+    }
+
+    CFTimeInterval start = CACurrentMediaTime();
+    const FDLensTable *luma = &_luma;
+    const FDLensTable *chroma = &_chroma;
+    void (^band)(size_t) = ^(size_t tileRow) {
+        FDLensRemapTileRow(luma, (int)tileRow, frame->data[0], frame->linesize[0], output->data[0], output->linesize[0]);
+        if ((int)tileRow < chroma->tileRows)
+        {
+            FDLensRemapTileRow(chroma, (int)tileRow, frame->data[1], frame->linesize[1], output->data[1], output->linesize[1]);
+            FDLensRemapTileRow(chroma, (int)tileRow, frame->data[2], frame->linesize[2], output->data[2], output->linesize[2]);
+        }
+    };
+    if (self.concurrent)
+    {
+        dispatch_apply((size_t)luma->tileRows, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), band);
+    }
+    else
+    {
+        for (int tileRow = 0; tileRow < luma->tileRows; tileRow++)
+        {
+            band((size_t)tileRow);
+        }
+    }
+    av_frame_copy_props(output, frame);
+
+    _totalCorrectionTime += CACurrentMediaTime() - start;
+    _correctionCount++;
+    return YES;
+}
+
+#pragma mark - Private methods
+
+- (void)buildTables
+{
+    FDLensCalibration calibration = self.calibration;
+    CGRect crop = self.cropRect;
+    double scaleX = crop.size.width / self.outputWidth;
+    double scaleY = crop.size.height / self.outputHeight;
+    FDLensTable *luma = &_luma;
+    FDLensTable *chroma = &_chroma;
+    int chromaWidth = (calibration.width + 1) / 2;
+    int chromaHeight = (calibration.height + 1) / 2;
+
+    dispatch_apply((size_t)luma->tileRows, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t tileRow) {
+        double sourceX;
+        double sourceY;
+        int firstRow = (int)tileRow * luma->tileHeight;
+        for (int y = firstRow; y < MIN(firstRow + luma->tileHeight, luma->height); y++)
+        {
+            for (int x = 0; x < luma->width; x++)
+            {
+                FDLensDistort(&calibration, crop.origin.x + (x + 0.5) * scaleX - 0.5, crop.origin.y + (y + 0.5) * scaleY - 0.5, &sourceX, &sourceY);
+                FDLensTableSet(luma, x, y, sourceX, sourceY, calibration.width, calibration.height);
+            }
+        }
+
+        // Chroma samples sit at the center of their 2x2 luma block.
+        firstRow = (int)tileRow * chroma->tileHeight;
+        for (int y = firstRow; y < MIN(firstRow + chroma->tileHeight, chroma->height); y++)
+        {
+            for (int x = 0; x < chroma->width; x++)
+            {
+                FDLensDistort(&calibration, crop.origin.x + (2 * x + 1.0) * scaleX - 0.5, crop.origin.y + (2 * y + 1.0) * scaleY - 0.5, &sourceX, &sourceY);
+                FDLensTableSet(chroma, x, y, (sourceX + 0.5) / 2.0 - 0.5, (sourceY + 0.5) / 2.0 - 0.5, chromaWidth, chromaHeight);
+            }
+        }
+    });
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithWidth:(int)width height:(int)height frameCount:(NSUInteger)frameCount
+{
+    // A typical action camera: about 120 degrees horizontally with strong barrel distortion.
+    FDLensCalibration calibration = {width, height, width * 0.3, width * 0.3, width / 2.0, height / 2.0, -0.28, 0.08, -0.01, 0.0, 0.0};
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *output = av_frame_alloc();
+    if (frame == NULL || output == NULL)
+    {
+        av_frame_free(&frame);
+        av_frame_free(&output);
+        return;
+    }
+    frame->format = output->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    output->width = width & ~1;
+    output->height = height & ~1;
+    if (av_frame_get_buffer(frame, 32) < 0 || av_frame_get_buffer(output, 32) < 0)
+    {
+        av_frame_free(&frame);
+        av_frame_free(&output);
+        return;
+    }
+    for (int plane = 0; plane < 3; plane++)
+    {
+        int planeHeight = plane == 0 ? height : (height + 1) / 2;
+        for (int y = 0; y < planeHeight; y++)
+        {
+            for (int x = 0; x < frame->linesize[plane]; x++)
+            {
+                frame->data[plane][(size_t)y * frame->linesize[plane] + x] = (uint8_t)(((x >> 4) ^ (y >> 4)) & 1 ? 235 : 16);
+            }
+        }
+    }
+
+    CFTimeInterval start = CACurrentMediaTime();
+    FDLensCorrector *corrector = [[FDLensCorrector alloc] initWithCalibration:calibration outputWidth:width outputHeight:height cropRect:CGRectNull];
+    CFTimeInterval buildTime = CACurrentMediaTime() - start;
+    for (int concurrent = 0; corrector != nil && concurrent < 2; concurrent++)
+    {
+        FDLensCorrector *pass = concurrent == 0 ? corrector : [[FDLensCorrector alloc] initWithCalibration:calibration outputWidth:width
+                                                                                               outputHeight:height cropRect:CGRectNull];
+        pass.concurrent = concurrent == 1;
+        for (NSUInteger i = 0; i < frameCount; i++)
+        {
+            [pass correctFrame:frame toFrame:output];
+        }
+        NSLog(@"Lens correction at %dx%d, %@: %.2f ms/frame (tables built in %.1f ms)",
+              width, height, pass.concurrent ? @"row bands" : @"single thread", pass.averageCorrectionTime * 1000.0, buildTime * 1000.0);
+    }
+
+    av_frame_free(&frame);
+    av_frame_free(&output);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,48 @@
+//
+//  FDPostprocessor.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDFFmpegUtils.h"
+
+
+// Quality level meaning post-processing is off.
+#define FDPostprocessorQualityOff (-1)
+
+
+// Optional deblocking and deringing of the live view through libpostproc ("hb:a,vb:a,dr:a",
+// the automatic filters enabled by quality 0...6). Macroblock quantizers come from the
+// frame's QP table when the decoder exports one, otherwise from fallbackQuantizer.
+// The quality level follows the time left in the frame budget: it drops as soon as
+// its measured cost does not fit anymore and climbs back one level at a time after
+// a run of frames with headroom.
+@interface FDPostprocessor : NSObject
+
+@property (nonatomic, assign, readonly) int width;
+@property (nonatomic, assign, readonly) int height;
+// Upper bound of the adaptive level, PP_QUALITY_MAX (6) by default.
+@property (nonatomic, assign) int maximumQuality;
+// Quality used for the next frame.
+@property (nonatomic, assign, readonly) int quality;
+// MPEG scale quantizer (1...31) assumed when the frame has no QP table, 8 by default.
+@property (nonatomic, assign) int fallbackQuantizer;
+// Fraction of the remaining frame time post-processing may use, 0.5 by default.
+@property (nonatomic, assign) double budgetShare;
+
+- (instancetype)initWithWidth:(int)width height:(int)height;
+
+// Processes a YUV 4:2:0 frame into output (allocated, same size) at the current quality,
+// then adapts the quality. remainingTime is what is left of the frame interval after
+// decoding this frame. Returns NO when post-processing is off, output is then untouched
+// and the caller shows frame. Not thread safe.
+- (BOOL)processFrame:(AVFrame *)frame toFrame:(AVFrame *)output remainingTime:(NSTimeInterval)remainingTime;
+
+// Running average cost of one frame at a quality level, 0 when it has not run yet.
+- (NSTimeInterval)averageCostForQuality:(int)quality;
+
+// Decodes a recording, post-processes every frame at each quality and logs the cost per level.
++ (void)logCostForFileAtPath:(NSString *)path;
+
+@end
@@ -0,0 +1,347 @@
+//
+//  FDPostprocessor.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDPostprocessor.h"
+#include "libpostproc/postprocess.h"
+
+
+static char const * const FDPostprocessorFilters = "hb:a,vb:a,dr:a";
+static int const FDPostprocessorDefaultFallbackQuantizer = 8;
+static double const FDPostprocessorDefaultBudgetShare = 0.5;
+// Frames in a row with room for the next level before climbing to it.
+static NSUInteger const FDPostprocessorHeadroomFrames = 30;
+// Assumed cost of an unmeasured level relative to the current one.
+static double const FDPostprocessorLevelGrowth = 1.5;
+static double const FDPostprocessorCostSmoothing = 0.1;
+
+#define FDPostprocessorLevelCount (PP_QUALITY_MAX + 1)
+
+
+#pragma mark - Private functions
+
+// libpostproc expects MPEG-1 scale quantizers, the same conversion the pp filters apply.
+static inline int8_t FDPostprocessorNormalizeQuantizer(int8_t quantizer, int type)
+{
+    switch (type)
+    {
+        case FF_QSCALE_TYPE_MPEG2:
+            return quantizer >> 1;
+        case FF_QSCALE_TYPE_H264:
+            return quantizer >> 2;
+        case FF_QSCALE_TYPE_VP56:
+            return (63 - quantizer + 2) >> 2;
+        default:
+            return quantizer;
+    }
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDPostprocessor ()
+{
+    pp_context *_context;
+    pp_mode *_modes[FDPostprocessorLevelCount];
+    int8_t *_quantizers;
+    int _quantizerStride;
+    int _quantizerRows;
+    int _filledQuantizer;
+    NSTimeInterval _costs[FDPostprocessorLevelCount];
+    NSUInteger _headroomFrames;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) int width;
+@property (nonatomic, assign, readwrite) int height;
+@property (nonatomic, assign, readwrite) int quality;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDPostprocessor
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithWidth:(int)width height:(int)height
+{
+    self = [super init];
+    if (self)
+    {
+        _width = width;
+        _height = height;
+        _maximumQuality = PP_QUALITY_MAX;
+        _quality = PP_QUALITY_MAX;
+        _fallbackQuantizer = FDPostprocessorDefaultFallbackQuantizer;
+        _budgetShare = FDPostprocessorDefaultBudgetShare;
+
+        // One quantizer per 16x16 macroblock.
+        _quantizerStride = (width + 15) / 16;
+        _quantizerRows = (height + 15) / 16;
+        _quantizers = malloc((size_t)_quantizerStride * _quantizerRows);
+        _context = pp_get_context(width, height, PP_FORMAT_420 | PP_CPU_CAPS_AUTO);
+        for (int level = 0; level < FDPostprocessorLevelCount; level++)
+        {
+            _modes[level] = pp_get_mode_by_name_and_quality(FDPostprocessorFilters, level);
+            if (_modes[level] == NULL)
+            {
+                return nil;
+            }
+        }
+        if (_quantizers == NULL || _context == NULL)
+        {
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (int level = 0; level < FDPostprocessorLevelCount; level++)
+    {
+        if (_modes[level] != NULL)
+        {
+            pp_free_mode(_modes[level]);
+        }
+    }
+    if (_context != NULL)
+    {
+        pp_free_context(_context);
+    }
+    free(_quantizers);
+}
+
+#pragma mark - Properties
+
+- (void)setMaximumQuality:(int)maximumQuality
+{
+    _maximumQuality = MIN(MAX(maximumQuality, FDPostprocessorQualityOff), PP_QUALITY_MAX);
+    self.quality = MIN(self.quality, _maximumQuality);
+}
+
+#pragma mark - Instance methods
+
+- (BOOL)processFrame:(AVFrame *)frame toFrame:(AVFrame *)output remainingTime:(NSTimeInterval)remainingTime
+{
+    int quality = self.quality;
+    if (quality == FDPostprocessorQualityOff || frame->width != self.width || frame->height != self.height ||
+        (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P))
+    {
+        [self adaptToRemainingTime:remainingTime];
+        return NO;
+    }
+
+    CFTimeInterval start = CACurrentMediaTime();
+    int stride = 0;
+    int type = FF_QSCALE_TYPE_MPEG1;
+    const int8_t *quantizers = [self quantizersForFrame:frame stride:&stride type:&type];
+    pp_postprocess((const uint8_t **)frame->data, frame->linesize, output->data, output->linesize,
+                   self.width, self.height, quantizers, stride, _modes[quality], _context, frame->pict_type);
+    av_frame_copy_props(output, frame);
+
+    NSTimeInterval cost = CACurrentMediaTime() - start;
+    _costs[quality] = _costs[quality] > 0 ? _costs[quality] + FDPostprocessorCostSmoothing * (cost - _costs[quality]) : cost;
+    [self adaptToRemainingTime:remainingTime];
+    return YES;
+}
+
+- (NSTimeInterval)averageCostForQuality:(int)quality
+{
+    return quality >= 0 && quality < FDPostprocessorLevelCount ? _costs[quality] : 0.0;
+}
+
+#pragma mark - Private methods
+
+- (const int8_t *)quantizersForFrame:(AVFrame *)frame stride:(int *)stride type:(int *)type
+{
+    int8_t *table = av_frame_get_qp_table(frame, stride, type);
+    if (table != NULL && *type == FF_QSCALE_TYPE_MPEG1)
+    {
+        return table;
+    }
+
+    if (table != NULL)
+    {
+        for (int row = 0; row < _quantizerRows; row++)
+        {
+            for (int column = 0; column < _quantizerStride; column++)
+            {
+                _quantizers[row * _quantizerStride + column] = FDPostprocessorNormalizeQuantizer(table[row * *stride + column], *type);
+            }
+        }
+        // The table now holds values of our own, do not reuse it as the fallback.
+        _filledQuantizer = 0;
+    }
+    else if (_filledQuantizer != self.fallbackQuantizer)
+    {
+        // The H.264 decoder does not export QP tables, which is the usual case here.
+        memset(_quantizers, MIN(MAX(self.fallbackQuantizer, 1), 31), (size_t)_quantizerStride * _quantizerRows);
+        _filledQuantizer = self.fallbackQuantizer;
+    }
+    *stride = _quantizerStride;
+    *type = FF_QSCALE_TYPE_MPEG1;
+    return _quantizers;
+}
+
+- (void)adaptToRemainingTime:(NSTimeInterval)remainingTime
+{
+    NSTimeInterval budget = self.budgetShare * MAX(remainingTime, 0.0);
+    int quality = self.quality;
+
+    // Turn down at once while the measured cost does not fit, unmeasured lower levels are assumed to.
+    while (quality > FDPostprocessorQualityOff && _costs[quality] > budget)
+    {
+        quality--;
+    }
+    if (quality < self.quality)
+    {
+        self.quality = quality;
+        _headroomFrames = 0;
+        return;
+    }
+
+    int next = quality + 1;
+    if (next > self.maximumQuality)
+    {
+        _headroomFrames = 0;
+        return;
+    }
+    NSTimeInterval nextCost = _costs[next];
+    if (nextCost == 0)
+    {
+        nextCost = quality >= 0 ? _costs[quality] * FDPostprocessorLevelGrowth : 0.0;
+    }
+    if (nextCost <= budget && budget > 0)
+    {
+        _headroomFrames++;
+        if (_headroomFrames >= FDPostprocessorHeadroomFrames)
+        {
+            self.quality = next;
+            _headroomFrames = 0;
+        }
+    }
+    else
+    {
+        _headroomFrames = 0;
+    }
+}
+
+#pragma mark - Benchmark
+
++ (void)logCostForFileAtPath:(NSString *)path
+{
+    FDFFmpegInitialize();
+    AVFormatContext *format = NULL;
+    AVCodecContext *decoder = NULL;
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *output = av_frame_alloc();
+    int result = frame != NULL && output != NULL ? avformat_open_input(&format, path.fileSystemRepresentation, NULL, NULL) : AVERROR(ENOMEM);
+    if (result >= 0)
+    {
+        result = avformat_find_stream_info(format, NULL);
+    }
+    int streamIndex = result >= 0 ? av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0) : result;
+    if (streamIndex >= 0)
+    {
+        decoder = FDFFmpegOpenDecoder(format->streams[streamIndex], 0, &result);
+    }
+    if (streamIndex < 0 || decoder == NULL)
+    {
+        NSLog(@"Unable to open %@: %@", path, FDFFmpegError(streamIndex < 0 ? streamIndex : result, @"Unable to open recording"));
+        av_frame_free(&frame);
+        av_frame_free(&output);
+        avformat_close_input(&format);
+        return;
+    }
+
+    FDPostprocessor *postprocessor = nil;
+    CFTimeInterval totals[FDPostprocessorLevelCount] = {0};
+    NSUInteger frameCount = 0;
+    NSUInteger tableCount = 0;
+    AVPacket packet;
+    av_init_packet(&packet);
+    BOOL draining = NO;
+    while (YES)
+    {
+        if (!draining && av_read_frame(format, &packet) < 0)
+        {
+            draining = YES;
+        }
+        if (draining)
+        {
+            av_init_packet(&packet);
+            packet.data = NULL;
+            packet.size = 0;
+        }
+        else if (packet.stream_index != streamIndex)
+        {
+            av_free_packet(&packet);
+            continue;
+        }
+
+        int gotFrame = 0;
+        int decoded = avcodec_decode_video2(decoder, frame, &gotFrame, &packet);
+        if (!draining)
+        {
+            av_free_packet(&packet);
+        }
+        if (gotFrame)
+        {
+            if (postprocessor == nil)
+            {
+                postprocessor = [[FDPostprocessor alloc] initWithWidth:frame->width height:frame->height];
+                output->format = frame->format;
+                output->width = frame->width;
+                output->height = frame->height;
+                if (postprocessor == nil || av_frame_get_buffer(output, 32) < 0)
+                {
+                    av_frame_unref(frame);
+                    break;
+                }
+            }
+
+            int stride;
+            int type;
+            tableCount += av_frame_get_qp_table(frame, &stride, &type) != NULL ? 1 : 0;
+            for (int level = 0; level < FDPostprocessorLevelCount; level++)
+            {
+                // Fixed level, a huge budget keeps the adaptation from moving it.
+                postprocessor.maximumQuality = level;
+                postprocessor.quality = level;
+                CFTimeInterval start = CACurrentMediaTime();
+                [postprocessor processFrame:frame toFrame:output remainingTime:DBL_MAX];
+                totals[level] += CACurrentMediaTime() - start;
+            }
+            frameCount++;
+            av_frame_unref(frame);
+        }
+        if (draining && (decoded < 0 || !gotFrame))
+        {
+            break;
+        }
+    }
+
+    NSMutableString *report = [NSMutableString string];
+    for (int level = 0; level < FDPostprocessorLevelCount; level++)
+    {
+        [report appendFormat:@" q%d %.2f ms", level, totals[level] * 1000.0 / MAX(frameCount, (NSUInteger)1)];
+    }
+    NSLog(@"Postprocessing %@: %lu frames (%lu with QP tables),%@ per frame",
+          path.lastPathComponent, (unsigned long)frameCount, (unsigned long)tableCount, report);
+
+    avcodec_free_context(&decoder);
+    av_frame_free(&frame);
+    av_frame_free(&output);
+    avformat_close_input(&format);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,63 @@
+//
+//  FDScrubEngine.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+@class FDScrubEngine;
+
+
+@interface FDScrubFrame : NSObject
+
+@property (nonatomic, assign, readonly) NSTimeInterval timestamp;
+@property (nonatomic, assign, readonly) int width;
+@property (nonatomic, assign, readonly) int height;
+// Packed I420 planes of width x height.
+@property (nonatomic, strong, readonly) NSData *planes;
+// Decoded without loop filter while dragging.
+@property (nonatomic, assign, readonly, getter=isLowQuality) BOOL lowQuality;
+// Time from the scrub request to this frame being ready.
+@property (nonatomic, assign, readonly) NSTimeInterval latency;
+
+@end
+
+
+@protocol FDScrubEngineDelegate <NSObject>
+
+// Called on the main queue, only for the most recent request.
+- (void)scrubEngine:(FDScrubEngine *)engine didDecodeFrame:(FDScrubFrame *)frame;
+
+@end
+
+
+// Serves timeline drags from a bounded LRU of low resolution frames. Misses are
+// decoded on a background decoder that continues forward from its current
+// position when the target lies in the same GOP and seeks otherwise; once idle
+// it prefetches in the drag direction.
+@interface FDScrubEngine : NSObject
+
+@property (nonatomic, weak) id<FDScrubEngineDelegate> delegate;
+@property (nonatomic, assign, readonly) NSTimeInterval duration;
+@property (nonatomic, assign, readonly) CGSize outputSize;
+@property (nonatomic, assign, readonly) NSUInteger cacheCapacity;
+// How far ahead of the playhead to decode while the finger rests, in seconds.
+@property (nonatomic, assign) NSTimeInterval prefetchDuration;
+
+@property (nonatomic, assign, readonly) NSTimeInterval averageLatency;
+@property (nonatomic, assign, readonly) NSTimeInterval maximumLatency;
+@property (nonatomic, assign, readonly) NSUInteger requestCount;
+@property (nonatomic, assign, readonly) NSUInteger cacheHitCount;
+
+- (instancetype)initWithPath:(NSString *)path
+                  outputSize:(CGSize)outputSize
+               cacheCapacity:(NSUInteger)cacheCapacity
+                       error:(NSError **)error;
+
+// Switches the decoder to reduced quality until endScrubbing.
+- (void)beginScrubbing;
+- (void)scrubToTime:(NSTimeInterval)time;
+// Redecodes the final position at full quality.
+- (void)endScrubbing;
+
+@end
@@ -0,0 +1,591 @@
+//
+//  FDScrubEngine.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDScrubEngine.h"
+#import "FDFFmpegUtils.h"
+#include <pthread.h>
+
+
+static NSTimeInterval const FDScrubEngineDefaultPrefetchDuration = 1.0;
+// Without a keyframe index, decoding forward beats seeking up to this distance.
+static NSTimeInterval const FDScrubEngineForwardDecodeLimit = 2.0;
+
+typedef struct FDScrubCacheEntry
+{
+    int64_t pts;
+    uint64_t lastUse;
+    BOOL lowQuality;
+    BOOL valid;
+} FDScrubCacheEntry;
+
+typedef NS_ENUM(NSInteger, FDScrubDecodeResult)
+{
+    FDScrubDecodeResultDecoded,
+    FDScrubDecodeResultAborted,
+    FDScrubDecodeResultFailed
+};
+
+
+#pragma mark - FDScrubFrame
+
+@interface FDScrubFrame ()
+
+@property (nonatomic, assign, readwrite) NSTimeInterval timestamp;
+@property (nonatomic, assign, readwrite) int width;
+@property (nonatomic, assign, readwrite) int height;
+@property (nonatomic, strong, readwrite) NSData *planes;
+@property (nonatomic, assign, readwrite, getter=isLowQuality) BOOL lowQuality;
+@property (nonatomic, assign, readwrite) NSTimeInterval latency;
+
+@end
+
+@implementation FDScrubFrame
+
+@end
+
+
+#pragma mark - Private interface methods
+
+@interface FDScrubEngine ()
+{
+    dispatch_queue_t _decoderQueue;
+    pthread_mutex_t _lock;
+
+    // Decoder state, only touched on _decoderQueue.
+    AVFormatContext *_format;
+    AVCodecContext *_decoder;
+    AVFrame *_frame;
+    int _streamIndex;
+    AVRational _timeBase;
+    int64_t _startPts;
+    int64_t _frameDuration;
+    int64_t _decoderPts;
+    BOOL _decoderLowQuality;
+    BOOL _forceSeek;
+    uint8_t *_scratch;
+    // Prefetch progress around _prefetchOriginPts; slots up to _prefetchedPts were attempted.
+    int64_t _prefetchOriginPts;
+    int64_t _prefetchedPts;
+    NSInteger _prefetchStep;
+    BOOL _prefetchLowQuality;
+
+    // Cache and request state, guarded by _lock.
+    FDScrubCacheEntry *_entries;
+    uint8_t *_pixels;
+    size_t _planesSize;
+    uint64_t _useClock;
+    int64_t _requestedPts;
+    uint64_t _requestSerial;
+    uint64_t _servedSerial;
+    CFTimeInterval _requestTime;
+    NSInteger _direction;
+    BOOL _scrubbing;
+    BOOL _serviceScheduled;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) NSTimeInterval duration;
+@property (nonatomic, assign, readwrite) CGSize outputSize;
+@property (nonatomic, assign, readwrite) NSUInteger cacheCapacity;
+@property (nonatomic, assign, readwrite) NSTimeInterval averageLatency;
+@property (nonatomic, assign, readwrite) NSTimeInterval maximumLatency;
+@property (nonatomic, assign, readwrite) NSUInteger requestCount;
+@property (nonatomic, assign, readwrite) NSUInteger cacheHitCount;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDScrubEngine
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithPath:(NSString *)path
+                  outputSize:(CGSize)outputSize
+               cacheCapacity:(NSUInteger)cacheCapacity
+                       error:(NSError **)error
+{
+    self = [super init];
+    if (self)
+    {
+        FDFFmpegInitialize();
+        pthread_mutex_init(&_lock, NULL);
+        _decoderQueue = dispatch_queue_create("com.flydrones.scrub-decoder", DISPATCH_QUEUE_SERIAL);
+        _outputSize = CGSizeMake(((int)outputSize.width) & ~1, ((int)outputSize.height) & ~1);
+        _cacheCapacity = MAX(cacheCapacity, (NSUInteger)1);
+        _prefetchDuration = FDScrubEngineDefaultPrefetchDuration;
+        _decoderPts = AV_NOPTS_VALUE;
+        _prefetchOriginPts = AV_NOPTS_VALUE;
+        _requestedPts = AV_NOPTS_VALUE;
+
+        int result = avformat_open_input(&_format, path.fileSystemRepresentation, NULL, NULL);
+        if (result >= 0)
+        {
+            result = avformat_find_stream_info(_format, NULL);
+        }
+        if (result >= 0)
+        {
+            result = av_find_best_stream(_format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        }
+        if (result >= 0)
+        {
+            _streamIndex = result;
+            // One frame thread keeps the latency of a single frame low.
+            _decoder = FDFFmpegOpenDecoder(_format->streams[_streamIndex], 1, &result);
+        }
+        if (result < 0)
+        {
+            if (error != NULL)
+            {
+                *error = FDFFmpegError(result, @"Unable to open recording for scrubbing");
+            }
+            return nil;
+        }
+
+        AVStream *stream = _format->streams[_streamIndex];
+        AVRational frameRate = av_guess_frame_rate(_format, stream, NULL);
+        _timeBase = stream->time_base;
+        _startPts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        _frameDuration = frameRate.num > 0 ? MAX(av_rescale_q(1, av_inv_q(frameRate), _timeBase), 1) : 1;
+        _duration = _format->duration != AV_NOPTS_VALUE ? (NSTimeInterval)_format->duration / AV_TIME_BASE : 0;
+
+        _frame = av_frame_alloc();
+        _planesSize = (size_t)_outputSize.width * (size_t)_outputSize.height * 3 / 2;
+        _scratch = malloc(_planesSize);
+        _pixels = malloc(_planesSize * _cacheCapacity);
+        _entries = calloc(_cacheCapacity, sizeof(FDScrubCacheEntry));
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    av_frame_free(&_frame);
+    avcodec_free_context(&_decoder);
+    avformat_close_input(&_format);
+    free(_scratch);
+    free(_pixels);
+    free(_entries);
+    pthread_mutex_destroy(&_lock);
+}
+
+#pragma mark - Instance methods
+
+- (void)beginScrubbing
+{
+    pthread_mutex_lock(&_lock);
+    _scrubbing = YES;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)endScrubbing
+{
+    pthread_mutex_lock(&_lock);
+    _scrubbing = NO;
+    int64_t pts = _requestedPts;
+    pthread_mutex_unlock(&_lock);
+
+    if (pts != AV_NOPTS_VALUE)
+    {
+        [self requestPts:pts];
+    }
+}
+
+- (void)scrubToTime:(NSTimeInterval)time
+{
+    time = MAX(0, self.duration > 0 ? MIN(time, self.duration) : time);
+    int64_t pts = _startPts + (int64_t)(time / av_q2d(_timeBase));
+    // Snap to the frame grid so nearby finger positions share cache entries.
+    pts = _startPts + (pts - _startPts + _frameDuration / 2) / _frameDuration * _frameDuration;
+    [self requestPts:pts];
+}
+
+#pragma mark - Requests
+
+- (void)requestPts:(int64_t)pts
+{
+    CFTimeInterval now = CACurrentMediaTime();
+
+    pthread_mutex_lock(&_lock);
+    if (_requestedPts != AV_NOPTS_VALUE && pts != _requestedPts)
+    {
+        _direction = pts > _requestedPts ? 1 : -1;
+    }
+    _requestedPts = pts;
+    _requestSerial++;
+    _requestTime = now;
+
+    FDScrubFrame *frame = [self lockedCachedFrameForPts:pts allowLowQuality:_scrubbing];
+    if (frame != nil)
+    {
+        _servedSerial = _requestSerial;
+    }
+
+    BOOL schedule = !_serviceScheduled;
+    _serviceScheduled = YES;
+    pthread_mutex_unlock(&_lock);
+
+    if (frame != nil)
+    {
+        self.cacheHitCount++;
+        [self deliverFrame:frame];
+    }
+    if (schedule)
+    {
+        dispatch_async(_decoderQueue, ^{
+            [self serviceRequests];
+        });
+    }
+}
+
+- (void)deliverFrame:(FDScrubFrame *)frame
+{
+    NSUInteger count = self.requestCount + 1;
+    self.averageLatency += (frame.latency - self.averageLatency) / count;
+    self.maximumLatency = MAX(self.maximumLatency, frame.latency);
+    self.requestCount = count;
+    [self.delegate scrubEngine:self didDecodeFrame:frame];
+}
+
+// Runs on the decoder queue until there is neither a request nor prefetch work left.
+- (void)serviceRequests
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&_lock);
+        uint64_t serial = _requestSerial;
+        int64_t target = _requestedPts;
+        BOOL pending = _servedSerial != serial;
+        BOOL lowQuality = _scrubbing;
+        NSInteger direction = _direction;
+        CFTimeInterval requestTime = _requestTime;
+        pthread_mutex_unlock(&_lock);
+
+        if (pending)
+        {
+            FDScrubDecodeResult result = [self decodeToPts:target serial:serial lowQuality:lowQuality];
+            if (result == FDScrubDecodeResultAborted)
+            {
+                continue;
+            }
+
+            pthread_mutex_lock(&_lock);
+            FDScrubFrame *frame = nil;
+            if (_requestSerial == serial)
+            {
+                // VFR streams and dropped frames can leave the target's grid slot empty.
+                frame = [self lockedCachedFrameForPts:target allowLowQuality:YES];
+                if (frame == nil)
+                {
+                    NSUInteger nearest = [self lockedIndexOfNearestEntryForPts:target];
+                    frame = nearest != NSNotFound ? [self lockedFrameForEntryAtIndex:nearest] : nil;
+                }
+                frame.latency = CACurrentMediaTime() - requestTime;
+                // Served once a frame goes out; after a failure another attempt would only spin.
+                if (frame != nil || result == FDScrubDecodeResultFailed)
+                {
+                    _servedSerial = serial;
+                }
+            }
+            pthread_mutex_unlock(&_lock);
+
+            if (frame != nil)
+            {
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    [self deliverFrame:frame];
+                });
+            }
+            continue;
+        }
+
+        int64_t gap = target != AV_NOPTS_VALUE ? [self prefetchGapFromPts:target direction:direction lowQuality:lowQuality] : AV_NOPTS_VALUE;
+        FDScrubDecodeResult result = gap != AV_NOPTS_VALUE ? [self decodeToPts:gap serial:serial lowQuality:lowQuality] : FDScrubDecodeResultFailed;
+        if (result == FDScrubDecodeResultDecoded)
+        {
+            // The decode may step over the gap's slot without filling it; never retry it.
+            _prefetchedPts = gap;
+        }
+        if (result == FDScrubDecodeResultFailed)
+        {
+            pthread_mutex_lock(&_lock);
+            BOOL idle = _requestSerial == serial;
+            if (idle)
+            {
+                _serviceScheduled = NO;
+            }
+            pthread_mutex_unlock(&_lock);
+            if (idle)
+            {
+                return;
+            }
+        }
+    }
+}
+
+// First frame within the prefetch window that is neither cached nor already attempted.
+- (int64_t)prefetchGapFromPts:(int64_t)pts direction:(NSInteger)direction lowQuality:(BOOL)lowQuality
+{
+    NSInteger step = direction < 0 ? -1 : 1;
+    if (pts != _prefetchOriginPts || step != _prefetchStep || lowQuality != _prefetchLowQuality)
+    {
+        _prefetchOriginPts = pts;
+        _prefetchedPts = pts;
+        _prefetchStep = step;
+        _prefetchLowQuality = lowQuality;
+    }
+    int64_t window = (int64_t)(self.prefetchDuration / av_q2d(_timeBase));
+    NSUInteger maximumFrames = MIN((NSUInteger)(window / _frameDuration), self.cacheCapacity / 2);
+    int64_t endPts = self.duration > 0 ? _startPts + (int64_t)(self.duration / av_q2d(_timeBase)) : INT64_MAX;
+
+    int64_t gap = AV_NOPTS_VALUE;
+    pthread_mutex_lock(&_lock);
+    for (NSUInteger i = 1; i <= maximumFrames; i++)
+    {
+        int64_t candidate = pts + step * (int64_t)i * _frameDuration;
+        if (candidate < _startPts || candidate > endPts)
+        {
+            break;
+        }
+        if ((candidate - _prefetchedPts) * step <= 0)
+        {
+            continue;
+        }
+        if ([self lockedIndexOfEntryForPts:candidate allowLowQuality:lowQuality] == NSNotFound)
+        {
+            gap = candidate;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+    return gap;
+}
+
+#pragma mark - Decoding
+
+- (FDScrubDecodeResult)decodeToPts:(int64_t)target serial:(uint64_t)serial lowQuality:(BOOL)lowQuality
+{
+    if (lowQuality != _decoderLowQuality)
+    {
+        // References decoded without the loop filter would leak artifacts into full quality frames.
+        _forceSeek = _forceSeek || !lowQuality;
+        _decoderLowQuality = lowQuality;
+        _decoder->skip_loop_filter = lowQuality ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+        _decoder->flags2 = lowQuality ? (_decoder->flags2 | CODEC_FLAG2_FAST) : (_decoder->flags2 & ~CODEC_FLAG2_FAST);
+    }
+
+    if (_forceSeek || ![self canDecodeForwardToPts:target])
+    {
+        _forceSeek = NO;
+        _decoderPts = AV_NOPTS_VALUE;
+        if (av_seek_frame(_format, _streamIndex, target, AVSEEK_FLAG_BACKWARD) < 0)
+        {
+            return FDScrubDecodeResultFailed;
+        }
+        avcodec_flush_buffers(_decoder);
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    BOOL endOfFile = NO;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&_lock);
+        BOOL superseded = _requestSerial != serial;
+        pthread_mutex_unlock(&_lock);
+        if (superseded)
+        {
+            return FDScrubDecodeResultAborted;
+        }
+
+        int gotFrame = 0;
+        if (!endOfFile)
+        {
+            if (av_read_frame(_format, &packet) < 0)
+            {
+                endOfFile = YES;
+                continue;
+            }
+            if (packet.stream_index == _streamIndex)
+            {
+                avcodec_decode_video2(_decoder, _frame, &gotFrame, &packet);
+            }
+            av_free_packet(&packet);
+        }
+        else
+        {
+            packet.data = NULL;
+            packet.size = 0;
+            avcodec_decode_video2(_decoder, _frame, &gotFrame, &packet);
+            if (!gotFrame)
+            {
+                // Past the last frame: serve the closest one we have.
+                _forceSeek = YES;
+                return [self cacheLastFrameAsPts:target] ? FDScrubDecodeResultDecoded : FDScrubDecodeResultFailed;
+            }
+        }
+
+        if (!gotFrame)
+        {
+            continue;
+        }
+
+        int64_t pts = av_frame_get_best_effort_timestamp(_frame);
+        _decoderPts = pts;
+        if (pts == AV_NOPTS_VALUE)
+        {
+            av_frame_unref(_frame);
+            continue;
+        }
+
+        FDFFmpegDownscaleFrame(_frame, _scratch, (int)self.outputSize.width, (int)self.outputSize.height);
+        av_frame_unref(_frame);
+
+        // Cache under the grid position so lookups by requested pts hit.
+        int64_t gridPts = _startPts + (pts - _startPts + _frameDuration / 2) / _frameDuration * _frameDuration;
+        pthread_mutex_lock(&_lock);
+        [self lockedInsertScratchForPts:gridPts lowQuality:lowQuality];
+        pthread_mutex_unlock(&_lock);
+
+        if (gridPts >= target)
+        {
+            return FDScrubDecodeResultDecoded;
+        }
+    }
+}
+
+- (BOOL)canDecodeForwardToPts:(int64_t)target
+{
+    if (_decoderPts == AV_NOPTS_VALUE || target <= _decoderPts)
+    {
+        return NO;
+    }
+
+    AVStream *stream = _format->streams[_streamIndex];
+    int index = av_index_search_timestamp(stream, target, AVSEEK_FLAG_BACKWARD);
+    if (index >= 0)
+    {
+        // Seeking would land on this keyframe anyway; continuing is never slower.
+        return stream->index_entries[index].timestamp <= _decoderPts;
+    }
+    return (target - _decoderPts) * av_q2d(_timeBase) <= FDScrubEngineForwardDecodeLimit;
+}
+
+- (BOOL)cacheLastFrameAsPts:(int64_t)target
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger best = NSNotFound;
+    for (NSUInteger i = 0; i < self.cacheCapacity; i++)
+    {
+        if (_entries[i].valid && _entries[i].pts < target && (best == NSNotFound || _entries[i].pts > _entries[best].pts))
+        {
+            best = i;
+        }
+    }
+    if (best != NSNotFound)
+    {
+        memcpy(_scratch, _pixels + best * _planesSize, _planesSize);
+        [self lockedInsertScratchForPts:target lowQuality:_entries[best].lowQuality];
+    }
+    pthread_mutex_unlock(&_lock);
+    return best != NSNotFound;
+}
+
+#pragma mark - Cache
+
+// A linear scan over a few dozen entries beats any hashing at this size.
+- (NSUInteger)lockedIndexOfEntryForPts:(int64_t)pts allowLowQuality:(BOOL)allowLowQuality
+{
+    for (NSUInteger i = 0; i < self.cacheCapacity; i++)
+    {
+        if (_entries[i].valid && _entries[i].pts == pts && (allowLowQuality || !_entries[i].lowQuality))
+        {
+            return i;
+        }
+    }
+    return NSNotFound;
+}
+
+// The closest entry at or before pts, or failing that the closest one after it.
+- (NSUInteger)lockedIndexOfNearestEntryForPts:(int64_t)pts
+{
+    NSUInteger before = NSNotFound;
+    NSUInteger after = NSNotFound;
+    for (NSUInteger i = 0; i < self.cacheCapacity; i++)
+    {
+        if (!_entries[i].valid)
+        {
+            continue;
+        }
+        if (_entries[i].pts <= pts)
+        {
+            before = before == NSNotFound || _entries[i].pts > _entries[before].pts ? i : before;
+        }
+        else
+        {
+            after = after == NSNotFound || _entries[i].pts < _entries[after].pts ? i : after;
+        }
+    }
+    return before != NSNotFound ? before : after;
+}
+
+- (FDScrubFrame *)lockedCachedFrameForPts:(int64_t)pts allowLowQuality:(BOOL)allowLowQuality
+{
+    NSUInteger index = [self lockedIndexOfEntryForPts:pts allowLowQuality:allowLowQuality];
+    return index != NSNotFound ? [self lockedFrameForEntryAtIndex:index] : nil;
+}
+
+- (FDScrubFrame *)lockedFrameForEntryAtIndex:(NSUInteger)index
+{
+    _entries[index].lastUse = ++_useClock;
+    FDScrubFrame *frame = [[FDScrubFrame alloc] init];
+    frame.timestamp = (_entries[index].pts - _startPts) * av_q2d(_timeBase);
+    frame.width = (int)self.outputSize.width;
+    frame.height = (int)self.outputSize.height;
+    frame.planes = [NSData dataWithBytes:_pixels + index * _planesSize length:_planesSize];
+    frame.lowQuality = _entries[index].lowQuality;
+    return frame;
+}
+
+- (void)lockedInsertScratchForPts:(int64_t)pts lowQuality:(BOOL)lowQuality
+{
+    NSUInteger slot = [self lockedIndexOfEntryForPts:pts allowLowQuality:YES];
+    if (slot == NSNotFound)
+    {
+        slot = 0;
+        for (NSUInteger i = 0; i < self.cacheCapacity; i++)
+        {
+            if (!_entries[i].valid)
+            {
+                slot = i;
+                break;
+            }
+            if (_entries[i].lastUse < _entries[slot].lastUse)
+            {
+                slot = i;
+            }
+        }
+    }
+    else if (lowQuality && !_entries[slot].lowQuality)
+    {
+        // Never replace a full quality frame with a degraded one.
+        _entries[slot].lastUse = ++_useClock;
+        return;
+    }
+
+    memcpy(_pixels + slot * _planesSize, _scratch, _planesSize);
+    _entries[slot].pts = pts;
+    _entries[slot].lowQuality = lowQuality;
+    _entries[slot].valid = YES;
+    _entries[slot].lastUse = ++_useClock;
+}
+
+#pragma mark -
+
+@end
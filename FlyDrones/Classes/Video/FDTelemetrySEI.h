@@ -0,0 +1,44 @@
+//
+//  FDTelemetrySEI.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#include <stdint.h>
+#include "x264.h"
+
+
+// Telemetry carried by every encoded frame as an H.264 user_data_unregistered SEI.
+typedef struct FDTelemetrySEISample
+{
+    uint32_t bootTime;          // ms, MAVLink time_boot_ms
+    int32_t latitude;           // degrees * 1e7
+    int32_t longitude;          // degrees * 1e7
+    int32_t altitude;           // mm above home
+    float roll;                 // radians
+    float pitch;                // radians
+    float yaw;                  // radians
+    float groundSpeed;          // m/s
+    uint16_t batteryVoltage;    // mV
+} FDTelemetrySEISample;
+
+// UUID plus the packed sample.
+#define FDTelemetrySEIPayloadSize 43
+
+// Writes the SEI payload (not NAL encapsulated, not escaped) and returns its size.
+int FDTelemetrySEIEncodePayload(const FDTelemetrySEISample *sample, uint8_t *payload);
+// Returns NO unless payload is a FlyDrones telemetry user_data_unregistered payload.
+BOOL FDTelemetrySEIDecodePayload(const uint8_t *payload, int size, FDTelemetrySEISample *sample);
+
+// Attaches the sample to a picture before x264_encoder_encode; x264 frees it once written.
+BOOL FDTelemetrySEIAttach(x264_picture_t *picture, const FDTelemetrySEISample *sample);
+
+// Finds the telemetry SEI in a packet straight from the demuxer or av_parser_parse2,
+// without touching any slice data. nalLengthSize as for FDH264NALIteratorInit.
+BOOL FDTelemetrySEIExtract(const uint8_t *data, int size, int nalLengthSize, FDTelemetrySEISample *sample);
+// Same, also returns the bytes of the SEI NAL unit carrying the sample, prefix included.
+BOOL FDTelemetrySEIExtractMeasuringSize(const uint8_t *data, int size, int nalLengthSize, FDTelemetrySEISample *sample, int *seiSize);
+
+// Logs the bitrate share of the telemetry SEIs in a recording and the extraction time per frame.
+void FDTelemetrySEILogStatistics(NSString *path);
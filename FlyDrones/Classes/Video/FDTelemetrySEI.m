@@ -0,0 +1,289 @@
+//
+//  FDTelemetrySEI.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDTelemetrySEI.h"
+#import "FDFFmpegUtils.h"
+#import "FDH264Utils.h"
+
+
+#define FDTelemetrySEIVersion 1
+#define FDTelemetrySEIUserDataUnregistered 5
+#define FDTelemetrySEIUUIDSize 16
+
+static const uint8_t FDTelemetrySEIUUID[FDTelemetrySEIUUIDSize] =
+{
+    0x46, 0x44, 0x54, 0x4C, 0x4D, 0x2D, 0x4A, 0x8B, 0x9E, 0x31, 0x5C, 0x0F, 0x72, 0xD6, 0x11, 0xA4
+};
+
+// Reads RBSP bytes of a NAL unit, dropping emulation prevention bytes.
+typedef struct FDRBSPReader
+{
+    const uint8_t *position;
+    const uint8_t *end;
+    int zeroCount;
+} FDRBSPReader;
+
+
+#pragma mark - Private functions
+
+static inline BOOL FDRBSPReaderRead(FDRBSPReader *reader, uint8_t *byte)
+{
+    if (reader->position < reader->end && reader->zeroCount >= 2 && *reader->position == 0x03)
+    {
+        reader->position++;
+        reader->zeroCount = 0;
+    }
+    if (reader->position >= reader->end)
+    {
+        return NO;
+    }
+    *byte = *reader->position++;
+    reader->zeroCount = *byte == 0 ? reader->zeroCount + 1 : 0;
+    return YES;
+}
+
+// SEI payload type and size are coded as runs of 0xFF plus a final byte.
+static BOOL FDRBSPReaderReadSEIValue(FDRBSPReader *reader, int *value)
+{
+    uint8_t byte;
+    *value = 0;
+    do
+    {
+        if (!FDRBSPReaderRead(reader, &byte))
+        {
+            return NO;
+        }
+        *value += byte;
+    }
+    while (byte == 0xFF);
+    return YES;
+}
+
+static inline void FDWriteUInt16(uint8_t *output, uint16_t value)
+{
+    output[0] = (uint8_t)value;
+    output[1] = (uint8_t)(value >> 8);
+}
+
+static inline void FDWriteUInt32(uint8_t *output, uint32_t value)
+{
+    FDWriteUInt16(output, (uint16_t)value);
+    FDWriteUInt16(output + 2, (uint16_t)(value >> 16));
+}
+
+static inline uint16_t FDReadUInt16(const uint8_t *input)
+{
+    return (uint16_t)(input[0] | (input[1] << 8));
+}
+
+static inline uint32_t FDReadUInt32(const uint8_t *input)
+{
+    return FDReadUInt16(input) | ((uint32_t)FDReadUInt16(input + 2) << 16);
+}
+
+static inline int16_t FDTelemetrySEIPackAngle(float angle)
+{
+    // Radians * 1e4 in [-pi, pi]; some autopilots report yaw in [0, 2pi).
+    return (int16_t)lrintf(remainderf(angle, 2.0f * (float)M_PI) * 10000.0f);
+}
+
+
+#pragma mark - Public functions
+
+int FDTelemetrySEIEncodePayload(const FDTelemetrySEISample *sample, uint8_t *payload)
+{
+    memcpy(payload, FDTelemetrySEIUUID, FDTelemetrySEIUUIDSize);
+    uint8_t *data = payload + FDTelemetrySEIUUIDSize;
+    data[0] = FDTelemetrySEIVersion;
+    FDWriteUInt32(data + 1, sample->bootTime);
+    FDWriteUInt32(data + 5, (uint32_t)sample->latitude);
+    FDWriteUInt32(data + 9, (uint32_t)sample->longitude);
+    FDWriteUInt32(data + 13, (uint32_t)sample->altitude);
+    FDWriteUInt16(data + 17, (uint16_t)FDTelemetrySEIPackAngle(sample->roll));
+    FDWriteUInt16(data + 19, (uint16_t)FDTelemetrySEIPackAngle(sample->pitch));
+    FDWriteUInt16(data + 21, (uint16_t)FDTelemetrySEIPackAngle(sample->yaw));
+    FDWriteUInt16(data + 23, (uint16_t)MIN(MAX(lrintf(sample->groundSpeed * 100.0f), 0L), (long)UINT16_MAX));
+    FDWriteUInt16(data + 25, sample->batteryVoltage);
+    return FDTelemetrySEIPayloadSize;
+}
+
+BOOL FDTelemetrySEIDecodePayload(const uint8_t *payload, int size, FDTelemetrySEISample *sample)
+{
+    if (size < FDTelemetrySEIPayloadSize || memcmp(payload, FDTelemetrySEIUUID, FDTelemetrySEIUUIDSize) != 0)
+    {
+        return NO;
+    }
+    const uint8_t *data = payload + FDTelemetrySEIUUIDSize;
+    if (data[0] != FDTelemetrySEIVersion)
+    {
+        return NO;
+    }
+
+    sample->bootTime = FDReadUInt32(data + 1);
+    sample->latitude = (int32_t)FDReadUInt32(data + 5);
+    sample->longitude = (int32_t)FDReadUInt32(data + 9);
+    sample->altitude = (int32_t)FDReadUInt32(data + 13);
+    sample->roll = (int16_t)FDReadUInt16(data + 17) / 10000.0f;
+    sample->pitch = (int16_t)FDReadUInt16(data + 19) / 10000.0f;
+    sample->yaw = (int16_t)FDReadUInt16(data + 21) / 10000.0f;
+    sample->groundSpeed = FDReadUInt16(data + 23) / 100.0f;
+    sample->batteryVoltage = FDReadUInt16(data + 25);
+    return YES;
+}
+
+BOOL FDTelemetrySEIAttach(x264_picture_t *picture, const FDTelemetrySEISample *sample)
+{
+    // x264 keeps the payload until the frame leaves the lookahead and then passes
+    // both the payload and the array to sei_free.
+    x264_sei_payload_t *payloads = malloc(sizeof(x264_sei_payload_t));
+    uint8_t *payload = malloc(FDTelemetrySEIPayloadSize);
+    if (payloads == NULL || payload == NULL)
+    {
+        free(payloads);
+        free(payload);
+        // x264 calls sei_free whenever it is set, even without payloads.
+        picture->extra_sei.num_payloads = 0;
+        picture->extra_sei.payloads = NULL;
+        picture->extra_sei.sei_free = NULL;
+        return NO;
+    }
+
+    payloads->payload_type = FDTelemetrySEIUserDataUnregistered;
+    payloads->payload_size = FDTelemetrySEIEncodePayload(sample, payload);
+    payloads->payload = payload;
+    picture->extra_sei.num_payloads = 1;
+    picture->extra_sei.payloads = payloads;
+    picture->extra_sei.sei_free = free;
+    return YES;
+}
+
+// Looks for the telemetry payload in the messages of one SEI NAL unit.
+static BOOL FDTelemetrySEIExtractFromNAL(const uint8_t *nal, int nalSize, FDTelemetrySEISample *sample)
+{
+    FDRBSPReader reader = {nal + 1, nal + nalSize, 0};
+    int payloadType;
+    int payloadSize;
+    while (reader.end - reader.position > 1 &&
+           FDRBSPReaderReadSEIValue(&reader, &payloadType) &&
+           FDRBSPReaderReadSEIValue(&reader, &payloadSize))
+    {
+        uint8_t payload[FDTelemetrySEIPayloadSize];
+        int copied = 0;
+        BOOL candidate = payloadType == FDTelemetrySEIUserDataUnregistered && payloadSize >= FDTelemetrySEIPayloadSize;
+        for (int i = 0; i < payloadSize; i++)
+        {
+            uint8_t byte;
+            if (!FDRBSPReaderRead(&reader, &byte))
+            {
+                return NO;
+            }
+            if (candidate && copied < FDTelemetrySEIPayloadSize)
+            {
+                payload[copied++] = byte;
+                // Give up on foreign user data (e.g. the x264 version string) after the UUID.
+                if (copied == FDTelemetrySEIUUIDSize && memcmp(payload, FDTelemetrySEIUUID, FDTelemetrySEIUUIDSize) != 0)
+                {
+                    candidate = NO;
+                }
+            }
+        }
+        if (candidate && FDTelemetrySEIDecodePayload(payload, copied, sample))
+        {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+BOOL FDTelemetrySEIExtract(const uint8_t *data, int size, int nalLengthSize, FDTelemetrySEISample *sample)
+{
+    return FDTelemetrySEIExtractMeasuringSize(data, size, nalLengthSize, sample, NULL);
+}
+
+BOOL FDTelemetrySEIExtractMeasuringSize(const uint8_t *data, int size, int nalLengthSize, FDTelemetrySEISample *sample, int *seiSize)
+{
+    FDH264NALIterator iterator;
+    FDH264NALIteratorInit(&iterator, data, size, nalLengthSize);
+    const uint8_t *nal;
+    int nalSize;
+    while (FDH264NALIteratorNext(&iterator, &nal, &nalSize))
+    {
+        FDH264NALType type = FDH264NALUnitType(nal);
+        if (type == FDH264NALTypeSlice || type == FDH264NALTypeIDRSlice)
+        {
+            // SEI precedes the first slice of an access unit.
+            break;
+        }
+        if (type == FDH264NALTypeSEI && FDTelemetrySEIExtractFromNAL(nal, nalSize, sample))
+        {
+            if (seiSize != NULL)
+            {
+                // The whole NAL unit with its length prefix or start code, as stored in the stream.
+                int prefixSize = nalLengthSize > 0 ? nalLengthSize : (nal - data >= 4 && nal[-4] == 0 ? 4 : 3);
+                *seiSize = nalSize + prefixSize;
+            }
+            return YES;
+        }
+    }
+    return NO;
+}
+
+void FDTelemetrySEILogStatistics(NSString *path)
+{
+    FDFFmpegInitialize();
+    AVFormatContext *format = NULL;
+    int result = avformat_open_input(&format, path.fileSystemRepresentation, NULL, NULL);
+    if (result >= 0)
+    {
+        result = avformat_find_stream_info(format, NULL);
+    }
+    if (result >= 0)
+    {
+        result = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    }
+    if (result < 0)
+    {
+        NSLog(@"Unable to open %@: %@", path, FDFFmpegError(result, @"Unable to open recording"));
+        avformat_close_input(&format);
+        return;
+    }
+
+    AVStream *stream = format->streams[result];
+    int nalLengthSize = FDH264NALLengthSize(stream->codec->extradata, stream->codec->extradata_size);
+    unsigned long long totalBytes = 0;
+    unsigned long long seiBytes = 0;
+    NSUInteger frameCount = 0;
+    NSUInteger tagged = 0;
+    CFTimeInterval extractionTime = 0;
+    FDTelemetrySEISample sample;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+    while (av_read_frame(format, &packet) >= 0)
+    {
+        if (packet.stream_index == stream->index)
+        {
+            CFTimeInterval start = CACurrentMediaTime();
+            int seiSize = 0;
+            BOOL found = FDTelemetrySEIExtractMeasuringSize(packet.data, packet.size, nalLengthSize, &sample, &seiSize);
+            extractionTime += CACurrentMediaTime() - start;
+
+            frameCount++;
+            tagged += found ? 1 : 0;
+            totalBytes += packet.size;
+            seiBytes += found ? seiSize : 0;
+        }
+        av_free_packet(&packet);
+    }
+
+    double duration = frameCount / MAX(av_q2d(av_guess_frame_rate(format, stream, NULL)), 1.0);
+    NSLog(@"Telemetry SEI in %@: %lu of %lu frames, %.1f kbit/s (%.2f%% of %.0f kbit/s), extraction %.2f us/frame",
+          path.lastPathComponent, (unsigned long)tagged, (unsigned long)frameCount,
+          seiBytes * 8 / 1000.0 / MAX(duration, 1e-3), 100.0 * seiBytes / MAX(totalBytes, 1ULL),
+          totalBytes * 8 / 1000.0 / MAX(duration, 1e-3), extractionTime * 1e6 / MAX(frameCount, (NSUInteger)1));
+    avformat_close_input(&format);
+}
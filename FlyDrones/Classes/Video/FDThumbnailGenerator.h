@@ -0,0 +1,28 @@
+//
+//  FDThumbnailGenerator.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDThumbnailStrip.h"
+
+
+// Builds the review thumbnails of a recording from its keyframes only. Keyframes
+// are split between several decoder instances running in parallel and the result
+// is cached on disk as one packed file per recording.
+@interface FDThumbnailGenerator : NSObject
+
+// Bounding box the thumbnails are fitted into at the recording's display aspect
+// ratio, rounded down to even dimensions. 160x90 by default.
+@property (nonatomic, assign) CGSize thumbnailSize;
+@property (nonatomic, assign) NSUInteger maximumThumbnailCount;
+// 0 means one decoder per active core.
+@property (nonatomic, assign) NSUInteger decoderCount;
+@property (nonatomic, copy) NSString *cacheDirectory;
+
+// Returns the cached strip when it is still valid, otherwise generates it. Synchronous.
+- (FDThumbnailStrip *)thumbnailStripForFileAtPath:(NSString *)path error:(NSError **)error;
+- (NSString *)cachePathForFileAtPath:(NSString *)path;
+
+@end
@@ -0,0 +1,331 @@
+//
+//  FDThumbnailGenerator.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDThumbnailGenerator.h"
+#import "FDFFmpegUtils.h"
+#import "FDSegmentDigest.h"
+
+
+static NSUInteger const FDThumbnailDefaultMaximumCount = 200;
+// Safety net when a seek lands far away from the wanted keyframe.
+static NSUInteger const FDThumbnailMaximumPacketsPerSeek = 256;
+
+
+typedef struct FDThumbnailKeyframe
+{
+    int64_t position;
+    int64_t timestamp;
+} FDThumbnailKeyframe;
+
+
+#pragma mark - Private functions
+
+static int FDThumbnailCollectKeyframes(AVFormatContext *format, int streamIndex, NSMutableData *keyframes)
+{
+    AVStream *stream = format->streams[streamIndex];
+
+    // Containers with a sample table already know their keyframes.
+    for (int i = 0; i < stream->nb_index_entries; i++)
+    {
+        AVIndexEntry *entry = &stream->index_entries[i];
+        if (entry->flags & AVINDEX_KEYFRAME)
+        {
+            FDThumbnailKeyframe keyframe = {entry->pos, entry->timestamp};
+            [keyframes appendBytes:&keyframe length:sizeof(keyframe)];
+        }
+    }
+    if (keyframes.length > 0)
+    {
+        return 0;
+    }
+
+    // Raw elementary streams need one pass over the packet headers.
+    AVPacket packet;
+    av_init_packet(&packet);
+    int result;
+    while ((result = av_read_frame(format, &packet)) >= 0)
+    {
+        if (packet.stream_index == streamIndex && (packet.flags & AV_PKT_FLAG_KEY))
+        {
+            FDThumbnailKeyframe keyframe = {packet.pos, packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts};
+            [keyframes appendBytes:&keyframe length:sizeof(keyframe)];
+        }
+        av_free_packet(&packet);
+    }
+    return result == AVERROR_EOF ? 0 : result;
+}
+
+// Decodes one contiguous run of keyframes with a private demuxer and decoder.
+static void FDThumbnailDecodeKeyframes(const char *path,
+                                       int streamIndex,
+                                       const FDThumbnailKeyframe *keyframes,
+                                       NSUInteger count,
+                                       int width,
+                                       int height,
+                                       uint8_t *output,
+                                       BOOL *decoded)
+{
+    AVFormatContext *format = NULL;
+    AVCodecContext *decoder = NULL;
+    AVFrame *frame = av_frame_alloc();
+    int result = frame != NULL ? avformat_open_input(&format, path, NULL, NULL) : AVERROR(ENOMEM);
+    if (result >= 0)
+    {
+        decoder = FDFFmpegOpenDecoder(format->streams[streamIndex], 1, &result);
+    }
+    if (result < 0)
+    {
+        av_frame_free(&frame);
+        avformat_close_input(&format);
+        return;
+    }
+
+    decoder->skip_frame = AVDISCARD_NONKEY;
+    decoder->skip_loop_filter = AVDISCARD_ALL;
+    decoder->flags2 |= CODEC_FLAG2_FAST;
+
+    BOOL byteSeek = (format->iformat->flags & AVFMT_GENERIC_INDEX) && !(format->iformat->flags & AVFMT_NO_BYTE_SEEK);
+    size_t planesSize = (size_t)width * height * 3 / 2;
+
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        const FDThumbnailKeyframe *keyframe = &keyframes[i];
+        result = byteSeek ? av_seek_frame(format, -1, keyframe->position, AVSEEK_FLAG_BYTE)
+                          : av_seek_frame(format, streamIndex, keyframe->timestamp, AVSEEK_FLAG_BACKWARD);
+        if (result < 0)
+        {
+            continue;
+        }
+        avcodec_flush_buffers(decoder);
+
+        AVPacket packet;
+        av_init_packet(&packet);
+        int gotFrame = 0;
+        for (NSUInteger attempt = 0; attempt < FDThumbnailMaximumPacketsPerSeek; attempt++)
+        {
+            if (av_read_frame(format, &packet) < 0)
+            {
+                break;
+            }
+            BOOL isKeyframe = packet.stream_index == streamIndex && (packet.flags & AV_PKT_FLAG_KEY);
+            if (isKeyframe)
+            {
+                avcodec_decode_video2(decoder, frame, &gotFrame, &packet);
+                if (!gotFrame)
+                {
+                    // The keyframe is held back by the reorder delay, drain it.
+                    AVPacket flushPacket;
+                    av_init_packet(&flushPacket);
+                    flushPacket.data = NULL;
+                    flushPacket.size = 0;
+                    avcodec_decode_video2(decoder, frame, &gotFrame, &flushPacket);
+                }
+            }
+            av_free_packet(&packet);
+            if (isKeyframe)
+            {
+                break;
+            }
+        }
+
+        if (gotFrame)
+        {
+            FDFFmpegDownscaleFrame(frame, output + i * planesSize, width, height);
+            decoded[i] = YES;
+            av_frame_unref(frame);
+        }
+    }
+
+    av_frame_free(&frame);
+    avcodec_free_context(&decoder);
+    avformat_close_input(&format);
+}
+
+
+#pragma mark - Public interface methods
+
+@implementation FDThumbnailGenerator
+
+#pragma mark - Lifecycle
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        FDFFmpegInitialize();
+        _thumbnailSize = CGSizeMake(160, 90);
+        _maximumThumbnailCount = FDThumbnailDefaultMaximumCount;
+        NSString *caches = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject;
+        _cacheDirectory = [caches stringByAppendingPathComponent:@"Thumbnails"];
+    }
+    return self;
+}
+
+#pragma mark - Instance methods
+
+- (NSString *)cachePathForFileAtPath:(NSString *)path
+{
+    return [self.cacheDirectory stringByAppendingPathComponent:FDDigestFileNameForPath(path, @"thumbs")];
+}
+
+- (FDThumbnailStrip *)thumbnailStripForFileAtPath:(NSString *)path error:(NSError **)error
+{
+    NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:error];
+    if (attributes == nil)
+    {
+        return nil;
+    }
+
+    NSString *cachePath = [self cachePathForFileAtPath:path];
+    CGSize boundingSize = self.thumbnailSize;
+    NSUInteger maximumCount = MAX(self.maximumThumbnailCount, (NSUInteger)1);
+    FDThumbnailStrip *strip = [FDThumbnailStrip stripWithContentsOfFile:cachePath
+                                                       sourceAttributes:attributes
+                                                           boundingSize:boundingSize
+                                                           maximumCount:maximumCount];
+    if (strip != nil)
+    {
+        return strip;
+    }
+
+    int width = 0;
+    int height = 0;
+
+    AVFormatContext *format = NULL;
+    int result = avformat_open_input(&format, path.fileSystemRepresentation, NULL, NULL);
+    if (result >= 0)
+    {
+        result = avformat_find_stream_info(format, NULL);
+    }
+    if (result >= 0)
+    {
+        result = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    }
+
+    int streamIndex = result;
+    NSMutableData *allKeyframes = [NSMutableData data];
+    if (result >= 0)
+    {
+        result = FDThumbnailCollectKeyframes(format, streamIndex, allKeyframes);
+    }
+
+    AVRational timeBase = {1, 1};
+    int64_t startTime = 0;
+    if (result >= 0)
+    {
+        AVStream *stream = format->streams[streamIndex];
+        timeBase = stream->time_base;
+        startTime = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+        // Fit the display aspect ratio, non-square pixels included, inside thumbnailSize.
+        AVRational sampleAspectRatio = av_guess_sample_aspect_ratio(format, stream, NULL);
+        double displayWidth = stream->codec->width;
+        double displayHeight = stream->codec->height;
+        if (sampleAspectRatio.num > 0 && sampleAspectRatio.den > 0)
+        {
+            displayWidth *= av_q2d(sampleAspectRatio);
+        }
+        if (displayWidth > 0 && displayHeight > 0)
+        {
+            double scale = MIN(boundingSize.width / displayWidth, boundingSize.height / displayHeight);
+            width = ((int)lround(displayWidth * scale)) & ~1;
+            height = ((int)lround(displayHeight * scale)) & ~1;
+        }
+        if (stream->codec->width < width || stream->codec->height < height || width <= 0 || height <= 0)
+        {
+            result = AVERROR(EINVAL);
+        }
+    }
+    avformat_close_input(&format);
+
+    NSUInteger keyframeCount = allKeyframes.length / sizeof(FDThumbnailKeyframe);
+    if (result >= 0 && keyframeCount == 0)
+    {
+        result = AVERROR_INVALIDDATA;
+    }
+    if (result < 0)
+    {
+        if (error != NULL)
+        {
+            *error = FDFFmpegError(result, @"Unable to index keyframes");
+        }
+        return nil;
+    }
+
+    // Evenly spread the thumbnails when there are more keyframes than wanted.
+    NSUInteger count = MIN(keyframeCount, maximumCount);
+    NSMutableData *selection = [NSMutableData dataWithLength:count * sizeof(FDThumbnailKeyframe)];
+    FDThumbnailKeyframe *keyframes = selection.mutableBytes;
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        keyframes[i] = ((const FDThumbnailKeyframe *)allKeyframes.bytes)[i * keyframeCount / count];
+    }
+
+    size_t planesSize = (size_t)width * height * 3 / 2;
+    NSMutableData *planes = [NSMutableData dataWithLength:count * planesSize];
+    NSMutableData *decodedFlags = [NSMutableData dataWithLength:count * sizeof(BOOL)];
+    uint8_t *output = planes.mutableBytes;
+    BOOL *decoded = decodedFlags.mutableBytes;
+    const char *fileSystemPath = path.fileSystemRepresentation;
+
+    NSUInteger decoderCount = self.decoderCount > 0 ? self.decoderCount : [[NSProcessInfo processInfo] activeProcessorCount];
+    decoderCount = MIN(decoderCount, count);
+    dispatch_apply(decoderCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t worker) {
+        // Contiguous runs keep each decoder seeking forward through the file.
+        NSUInteger first = worker * count / decoderCount;
+        NSUInteger last = (worker + 1) * count / decoderCount;
+        FDThumbnailDecodeKeyframes(fileSystemPath, streamIndex, keyframes + first, last - first,
+                                   width, height, output + first * planesSize, decoded + first);
+    });
+
+    // Compact away keyframes that failed to decode.
+    NSMutableData *timestamps = [NSMutableData dataWithCapacity:count * sizeof(double)];
+    NSUInteger kept = 0;
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        if (!decoded[i])
+        {
+            continue;
+        }
+        if (kept != i)
+        {
+            memmove(output + kept * planesSize, output + i * planesSize, planesSize);
+        }
+        double timestamp = keyframes[i].timestamp != AV_NOPTS_VALUE ? (keyframes[i].timestamp - startTime) * av_q2d(timeBase) : 0;
+        [timestamps appendBytes:&timestamp length:sizeof(timestamp)];
+        kept++;
+    }
+    [planes setLength:kept * planesSize];
+
+    [[NSFileManager defaultManager] createDirectoryAtPath:self.cacheDirectory withIntermediateDirectories:YES attributes:nil error:NULL];
+    CGSize size = CGSizeMake(width, height);
+    if (![FDThumbnailStrip writeThumbnailPlanes:planes
+                                     timestamps:timestamps
+                                           size:size
+                                   boundingSize:boundingSize
+                                   maximumCount:maximumCount
+                               sourceAttributes:attributes
+                                         toFile:cachePath])
+    {
+        NSLog(@"Unable to write thumbnail cache %@", cachePath);
+    }
+
+    strip = [FDThumbnailStrip stripWithContentsOfFile:cachePath
+                                     sourceAttributes:attributes
+                                         boundingSize:boundingSize
+                                         maximumCount:maximumCount];
+    if (strip == nil && error != NULL)
+    {
+        *error = FDFFmpegError(AVERROR(EIO), @"Unable to load thumbnail cache");
+    }
+    return strip;
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,41 @@
+//
+//  FDThumbnailStrip.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+
+// Read-only view over the packed thumbnail cache of one recording. The file is
+// memory mapped and thumbnails stay in I420 until an image is requested.
+@interface FDThumbnailStrip : NSObject
+
+@property (nonatomic, assign, readonly) NSUInteger count;
+@property (nonatomic, assign, readonly) CGSize thumbnailSize;
+
+// Returns nil when the cache is missing, corrupt, older than the recording or was
+// generated with another bounding size or maximum count.
++ (instancetype)stripWithContentsOfFile:(NSString *)path
+                       sourceAttributes:(NSDictionary *)sourceAttributes
+                           boundingSize:(CGSize)boundingSize
+                           maximumCount:(NSUInteger)maximumCount;
+
+// timestamps holds count doubles (seconds), planes holds count I420 thumbnails back to back.
+// boundingSize and maximumCount are the generator settings the strip was made with.
++ (BOOL)writeThumbnailPlanes:(NSData *)planes
+                  timestamps:(NSData *)timestamps
+                        size:(CGSize)size
+                boundingSize:(CGSize)boundingSize
+                maximumCount:(NSUInteger)maximumCount
+            sourceAttributes:(NSDictionary *)sourceAttributes
+                      toFile:(NSString *)path;
+
+- (NSTimeInterval)timestampAtIndex:(NSUInteger)index;
+- (NSUInteger)indexNearestToTimestamp:(NSTimeInterval)timestamp;
+- (const uint8_t *)planesAtIndex:(NSUInteger)index;
+
+- (UIImage *)thumbnailAtIndex:(NSUInteger)index;
+// Thumbnails of the range laid side by side in one image.
+- (UIImage *)stripImageWithRange:(NSRange)range;
+
+@end
@@ -0,0 +1,211 @@
+//
+//  FDThumbnailStrip.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDThumbnailStrip.h"
+#include "libswscale/swscale.h"
+
+
+static uint32_t const FDThumbnailStripMagic = 0x53544446; // "FDTS"
+static uint32_t const FDThumbnailStripVersion = 2;
+
+typedef struct FDThumbnailStripHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint16_t width;
+    uint16_t height;
+    uint16_t boundingWidth;
+    uint16_t boundingHeight;
+    uint32_t maximumCount;
+    int64_t sourceSize;
+    double sourceModificationDate;
+} FDThumbnailStripHeader;
+
+
+#pragma mark - Private interface methods
+
+@interface FDThumbnailStrip ()
+
+#pragma mark - Properties
+
+@property (nonatomic, strong) NSData *data;
+@property (nonatomic, assign, readwrite) NSUInteger count;
+@property (nonatomic, assign, readwrite) CGSize thumbnailSize;
+@property (nonatomic, assign) const double *timestamps;
+@property (nonatomic, assign) const uint8_t *planes;
+@property (nonatomic, assign) size_t planesSize;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDThumbnailStrip
+
+#pragma mark - Class methods
+
++ (instancetype)stripWithContentsOfFile:(NSString *)path
+                       sourceAttributes:(NSDictionary *)sourceAttributes
+                           boundingSize:(CGSize)boundingSize
+                           maximumCount:(NSUInteger)maximumCount
+{
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+    if (data.length < sizeof(FDThumbnailStripHeader))
+    {
+        return nil;
+    }
+
+    const FDThumbnailStripHeader *header = data.bytes;
+    size_t planesSize = (size_t)header->width * header->height * 3 / 2;
+    size_t expectedLength = sizeof(*header) + header->count * (sizeof(double) + planesSize);
+    if (header->magic != FDThumbnailStripMagic || header->version != FDThumbnailStripVersion || data.length != expectedLength)
+    {
+        return nil;
+    }
+    if (header->boundingWidth != (uint16_t)boundingSize.width || header->boundingHeight != (uint16_t)boundingSize.height ||
+        header->maximumCount != (uint32_t)MIN(maximumCount, (NSUInteger)UINT32_MAX))
+    {
+        return nil;
+    }
+    if (header->sourceSize != (int64_t)[sourceAttributes fileSize] ||
+        header->sourceModificationDate != [[sourceAttributes fileModificationDate] timeIntervalSinceReferenceDate])
+    {
+        return nil;
+    }
+
+    FDThumbnailStrip *strip = [[self alloc] init];
+    strip.data = data;
+    strip.count = header->count;
+    strip.thumbnailSize = CGSizeMake(header->width, header->height);
+    strip.planesSize = planesSize;
+    strip.timestamps = (const double *)(header + 1);
+    strip.planes = (const uint8_t *)(strip.timestamps + header->count);
+    return strip;
+}
+
++ (BOOL)writeThumbnailPlanes:(NSData *)planes
+                  timestamps:(NSData *)timestamps
+                        size:(CGSize)size
+                boundingSize:(CGSize)boundingSize
+                maximumCount:(NSUInteger)maximumCount
+            sourceAttributes:(NSDictionary *)sourceAttributes
+                      toFile:(NSString *)path
+{
+    FDThumbnailStripHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FDThumbnailStripMagic;
+    header.version = FDThumbnailStripVersion;
+    header.count = (uint32_t)(timestamps.length / sizeof(double));
+    header.width = (uint16_t)size.width;
+    header.height = (uint16_t)size.height;
+    header.boundingWidth = (uint16_t)boundingSize.width;
+    header.boundingHeight = (uint16_t)boundingSize.height;
+    header.maximumCount = (uint32_t)MIN(maximumCount, (NSUInteger)UINT32_MAX);
+    header.sourceSize = (int64_t)[sourceAttributes fileSize];
+    header.sourceModificationDate = [[sourceAttributes fileModificationDate] timeIntervalSinceReferenceDate];
+
+    NSMutableData *data = [NSMutableData dataWithCapacity:sizeof(header) + timestamps.length + planes.length];
+    [data appendBytes:&header length:sizeof(header)];
+    [data appendData:timestamps];
+    [data appendData:planes];
+    return [data writeToFile:path atomically:YES];
+}
+
+#pragma mark - Instance methods
+
+- (NSTimeInterval)timestampAtIndex:(NSUInteger)index
+{
+    return index < self.count ? self.timestamps[index] : 0;
+}
+
+- (NSUInteger)indexNearestToTimestamp:(NSTimeInterval)timestamp
+{
+    if (self.count == 0)
+    {
+        return NSNotFound;
+    }
+
+    NSUInteger low = 0;
+    NSUInteger high = self.count - 1;
+    while (low < high)
+    {
+        NSUInteger middle = (low + high) / 2;
+        if (self.timestamps[middle] < timestamp)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if (low > 0 && timestamp - self.timestamps[low - 1] < self.timestamps[low] - timestamp)
+    {
+        return low - 1;
+    }
+    return low;
+}
+
+- (const uint8_t *)planesAtIndex:(NSUInteger)index
+{
+    return index < self.count ? self.planes + index * self.planesSize : NULL;
+}
+
+- (UIImage *)thumbnailAtIndex:(NSUInteger)index
+{
+    return [self stripImageWithRange:NSMakeRange(index, 1)];
+}
+
+- (UIImage *)stripImageWithRange:(NSRange)range
+{
+    if (range.length == 0 || NSMaxRange(range) > self.count)
+    {
+        return nil;
+    }
+
+    int width = (int)self.thumbnailSize.width;
+    int height = (int)self.thumbnailSize.height;
+    size_t bytesPerRow = (size_t)width * range.length * 4;
+    NSMutableData *pixels = [NSMutableData dataWithLength:bytesPerRow * height];
+
+    struct SwsContext *converter = sws_getContext(width, height, AV_PIX_FMT_YUV420P,
+                                                  width, height, AV_PIX_FMT_RGBA,
+                                                  SWS_POINT, NULL, NULL, NULL);
+    if (converter == NULL)
+    {
+        return nil;
+    }
+
+    for (NSUInteger i = 0; i < range.length; i++)
+    {
+        const uint8_t *luma = [self planesAtIndex:range.location + i];
+        const uint8_t *source[3] = {luma, luma + width * height, luma + width * height * 5 / 4};
+        int sourceStrides[3] = {width, width / 2, width / 2};
+        uint8_t *destination[1] = {(uint8_t *)pixels.mutableBytes + i * width * 4};
+        int destinationStrides[1] = {(int)bytesPerRow};
+        sws_scale(converter, source, sourceStrides, 0, height, destination, destinationStrides);
+    }
+    sws_freeContext(converter);
+
+    CGDataProviderRef provider = CGDataProviderCreateWithCFData((__bridge CFDataRef)pixels);
+    CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceRGB();
+    CGImageRef image = CGImageCreate(width * range.length, height, 8, 32, bytesPerRow, colorSpace,
+                                     kCGBitmapByteOrderDefault | kCGImageAlphaNoneSkipLast,
+                                     provider, NULL, NO, kCGRenderingIntentDefault);
+    UIImage *result = [UIImage imageWithCGImage:image];
+
+    CGImageRelease(image);
+    CGColorSpaceRelease(colorSpace);
+    CGDataProviderRelease(provider);
+    return result;
+}
+
+#pragma mark -
+
+@end
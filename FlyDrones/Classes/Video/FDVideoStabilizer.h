@@ -0,0 +1,72 @@
+//
+//  FDVideoStabilizer.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDMotionEstimator.h"
+
+
+typedef NS_ENUM(NSUInteger, FDStabilizationInterpolation)
+{
+    // NEON, the one that fits the live budget.
+    FDStabilizationInterpolationBilinear,
+    // Sharper and several times slower, meant for the offline pass.
+    FDStabilizationInterpolationBicubic
+};
+
+// Similarity applied to a frame about its center to move it onto the smoothed path.
+typedef struct FDStabilizationCorrection
+{
+    double translationX;
+    double translationY;
+    double rotation;
+    double scale;
+} FDStabilizationCorrection;
+
+// Image motion caused by an attitude change (radians) for a forward looking camera
+// with the given focal length in pixels, for when telemetry is available but vectors are not.
+FDCameraMotion FDCameraMotionFromAttitudeChange(double deltaRoll, double deltaPitch, double deltaYaw,
+                                                double focalLength, int width, int height);
+
+
+// Smooths the camera path accumulated from per frame motion and warps YUV 4:2:0
+// frames onto it. The output is zoomed by cropMargin on every side so corrections
+// up to the margin never show the frame border.
+//
+// Live mode follows the path with a one-sided exponential filter and needs no
+// lookahead. The offline mode takes the motion of a whole recording (first pass)
+// and smooths it with a centered Gaussian window; the corrections are then applied
+// while re-encoding (second pass).
+@interface FDVideoStabilizer : NSObject
+
+@property (nonatomic, assign, readonly) int width;
+@property (nonatomic, assign, readonly) int height;
+// Fraction of width and height cropped on each side, 0.08 by default.
+@property (nonatomic, assign) double cropMargin;
+@property (nonatomic, assign) FDStabilizationInterpolation interpolation;
+// Weight of the previous smoothed position in live mode, 0.9 by default. Higher is smoother and lags more.
+@property (nonatomic, assign) double liveSmoothing;
+// Half width in frames of the offline smoothing window, 30 by default.
+@property (nonatomic, assign) NSUInteger smoothingRadius;
+@property (nonatomic, assign, readonly) NSTimeInterval averageWarpTime;
+
+- (instancetype)initWithWidth:(int)width height:(int)height;
+
+// Live mode. Frames without valid motion are assumed static.
+- (FDStabilizationCorrection)correctionForMotion:(const FDCameraMotion *)motion;
+- (void)reset;
+
+// Offline mode, returns count FDStabilizationCorrection.
+- (NSData *)correctionsForMotions:(const FDCameraMotion *)motions count:(NSUInteger)count;
+// First pass: one FDCameraMotion per decoded frame, in presentation order.
++ (NSData *)motionsForFileAtPath:(NSString *)path error:(NSError **)error;
+
+// Both frames must be YUV 4:2:0 of the stabilizer's size, output already allocated. Single threaded.
+- (BOOL)warpFrame:(const AVFrame *)frame correction:(FDStabilizationCorrection)correction toFrame:(AVFrame *)output;
+
+// Logs the warp time of a 1080p frame (or any size) for both interpolations.
++ (void)runBenchmarkWithWidth:(int)width height:(int)height;
+
+@end
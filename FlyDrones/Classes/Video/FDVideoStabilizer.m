@@ -0,0 +1,597 @@
+//
+//  FDVideoStabilizer.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDVideoStabilizer.h"
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+static double const FDVideoStabilizerDefaultCropMargin = 0.08;
+static double const FDVideoStabilizerDefaultLiveSmoothing = 0.9;
+static NSUInteger const FDVideoStabilizerDefaultSmoothingRadius = 30;
+// Rotation and zoom corrections are limited to this fraction of the crop margin (radians, log scale).
+static double const FDVideoStabilizerAngularLimit = 0.5;
+
+// Path components: translation x, y in pixels, rotation and log scale.
+#define FDVideoStabilizerComponents 4
+#define FDVideoStabilizerCubicPhases 64
+
+// Output to source pixel mapping in 16.16 fixed point: u = a * x + b * y + c, v = d * x + e * y + f.
+typedef struct FDStabilizerMap
+{
+    int32_t a;
+    int32_t b;
+    int32_t c;
+    int32_t d;
+    int32_t e;
+    int32_t f;
+} FDStabilizerMap;
+
+// Catmull-Rom taps per 1/64 pixel phase, summing to 128.
+static int16_t FDVideoStabilizerCubicWeights[FDVideoStabilizerCubicPhases][4];
+
+
+#pragma mark - Private functions
+
+static void FDVideoStabilizerBuildCubicWeights(void)
+{
+    for (int phase = 0; phase < FDVideoStabilizerCubicPhases; phase++)
+    {
+        double t = (double)phase / FDVideoStabilizerCubicPhases;
+        double weights[4] =
+        {
+            ((-0.5 * t + 1.0) * t - 0.5) * t,
+            (1.5 * t - 2.5) * t * t + 1.0,
+            ((-1.5 * t + 2.0) * t + 0.5) * t,
+            (0.5 * t - 0.5) * t * t
+        };
+        int16_t *taps = FDVideoStabilizerCubicWeights[phase];
+        taps[0] = (int16_t)lrint(weights[0] * 128.0);
+        taps[2] = (int16_t)lrint(weights[2] * 128.0);
+        taps[3] = (int16_t)lrint(weights[3] * 128.0);
+        taps[1] = (int16_t)(128 - taps[0] - taps[2] - taps[3]);
+    }
+}
+
+static inline int32_t FDVideoStabilizerClamp(int32_t value, int32_t minimum, int32_t maximum)
+{
+    return value < minimum ? minimum : (value > maximum ? maximum : value);
+}
+
+// scale is 1 for luma and 0.5 for the 4:2:0 chroma planes.
+static FDStabilizerMap FDVideoStabilizerMapMake(FDStabilizationCorrection correction, double zoom, int width, int height, double scale)
+{
+    // Inverse of p -> center + s * R(rotation) * (p - center) + t, preceded by the crop zoom.
+    double centerX = (width - 1) / 2.0;
+    double centerY = (height - 1) / 2.0;
+    double cosine = cos(correction.rotation);
+    double sine = sin(correction.rotation);
+    double factor = 1.0 / (correction.scale * zoom);
+    double a = cosine * factor;
+    double b = sine * factor;
+    double d = -sine * factor;
+    double e = cosine * factor;
+    double translationX = correction.translationX * scale;
+    double translationY = correction.translationY * scale;
+    double c = centerX - (a * centerX + b * centerY) - (cosine * translationX + sine * translationY) / correction.scale;
+    double f = centerY - (d * centerX + e * centerY) - (-sine * translationX + cosine * translationY) / correction.scale;
+
+    FDStabilizerMap map =
+    {
+        (int32_t)lrint(a * 65536.0), (int32_t)lrint(b * 65536.0), (int32_t)lrint(c * 65536.0),
+        (int32_t)lrint(d * 65536.0), (int32_t)lrint(e * 65536.0), (int32_t)lrint(f * 65536.0)
+    };
+    return map;
+}
+
+// Bilinear with 7-bit weights. Source coordinates are clamped so both taps stay inside the plane.
+static void FDVideoStabilizerWarpBilinear(const uint8_t *source, int sourceStride, uint8_t *destination, int destinationStride,
+                                          int width, int height, const FDStabilizerMap *map)
+{
+    int32_t maximumU = ((width - 1) << 16) - 1;
+    int32_t maximumV = ((height - 1) << 16) - 1;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    int32_t rampA[4] = {0, map->a, 2 * map->a, 3 * map->a};
+    int32_t rampD[4] = {0, map->d, 2 * map->d, 3 * map->d};
+    int32x4_t stepU = vld1q_s32(rampA);
+    int32x4_t stepV = vld1q_s32(rampD);
+    int32x4_t quarterU = vdupq_n_s32(4 * map->a);
+    int32x4_t quarterV = vdupq_n_s32(4 * map->d);
+    int32x4_t zero = vdupq_n_s32(0);
+    int32x4_t limitU = vdupq_n_s32(maximumU);
+    int32x4_t limitV = vdupq_n_s32(maximumV);
+    int32x4_t fractionMask = vdupq_n_s32(0xFFFF);
+    uint16x8_t one = vdupq_n_u16(128);
+#endif
+
+    for (int y = 0; y < height; y++)
+    {
+        int32_t rowU = map->b * y + map->c;
+        int32_t rowV = map->e * y + map->f;
+        uint8_t *output = destination + (size_t)y * destinationStride;
+        int x = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+        for (; x + 8 <= width; x += 8)
+        {
+            int32x4_t u0 = vaddq_s32(vdupq_n_s32(rowU + map->a * x), stepU);
+            int32x4_t v0 = vaddq_s32(vdupq_n_s32(rowV + map->d * x), stepV);
+            int32x4_t u1 = vmaxq_s32(vminq_s32(vaddq_s32(u0, quarterU), limitU), zero);
+            int32x4_t v1 = vmaxq_s32(vminq_s32(vaddq_s32(v0, quarterV), limitV), zero);
+            u0 = vmaxq_s32(vminq_s32(u0, limitU), zero);
+            v0 = vmaxq_s32(vminq_s32(v0, limitV), zero);
+
+            uint16x8_t fractionX = vcombine_u16(vmovn_u32(vreinterpretq_u32_s32(vshrq_n_s32(vandq_s32(u0, fractionMask), 9))),
+                                                vmovn_u32(vreinterpretq_u32_s32(vshrq_n_s32(vandq_s32(u1, fractionMask), 9))));
+            uint16x8_t fractionY = vcombine_u16(vmovn_u32(vreinterpretq_u32_s32(vshrq_n_s32(vandq_s32(v0, fractionMask), 9))),
+                                                vmovn_u32(vreinterpretq_u32_s32(vshrq_n_s32(vandq_s32(v1, fractionMask), 9))));
+            int32x4_t columns0 = vshrq_n_s32(u0, 16);
+            int32x4_t columns1 = vshrq_n_s32(u1, 16);
+            int32x4_t rows0 = vshrq_n_s32(v0, 16);
+            int32x4_t rows1 = vshrq_n_s32(v1, 16);
+            int32_t firstColumn = vgetq_lane_s32(columns0, 0);
+            int32_t firstRow = vgetq_lane_s32(rows0, 0);
+
+            uint8x8_t topLeft;
+            uint8x8_t topRight;
+            uint8x8_t bottomLeft;
+            uint8x8_t bottomRight;
+            if (map->a >= 0 && firstRow == vgetq_lane_s32(rows1, 3) &&
+                vgetq_lane_s32(columns1, 3) - firstColumn <= 14 && firstColumn + 16 <= sourceStride)
+            {
+                // Small rotations keep 8 outputs on one source row pair: two loads and table lookups.
+                const uint8_t *top = source + (size_t)firstRow * sourceStride + firstColumn;
+                uint8x16_t topRow = vld1q_u8(top);
+                uint8x16_t bottomRow = vld1q_u8(top + sourceStride);
+                uint8x8x2_t topTable = {{vget_low_u8(topRow), vget_high_u8(topRow)}};
+                uint8x8x2_t bottomTable = {{vget_low_u8(bottomRow), vget_high_u8(bottomRow)}};
+                uint16x8_t offsets = vcombine_u16(vmovn_u32(vreinterpretq_u32_s32(vsubq_s32(columns0, vdupq_n_s32(firstColumn)))),
+                                                  vmovn_u32(vreinterpretq_u32_s32(vsubq_s32(columns1, vdupq_n_s32(firstColumn)))));
+                uint8x8_t left = vmovn_u16(offsets);
+                uint8x8_t right = vadd_u8(left, vdup_n_u8(1));
+                topLeft = vtbl2_u8(topTable, left);
+                topRight = vtbl2_u8(topTable, right);
+                bottomLeft = vtbl2_u8(bottomTable, left);
+                bottomRight = vtbl2_u8(bottomTable, right);
+            }
+            else
+            {
+                int32_t columns[8];
+                int32_t rows[8];
+                uint8_t taps[4][8];
+                vst1q_s32(columns, columns0);
+                vst1q_s32(columns + 4, columns1);
+                vst1q_s32(rows, rows0);
+                vst1q_s32(rows + 4, rows1);
+                for (int i = 0; i < 8; i++)
+                {
+                    const uint8_t *pixel = source + (size_t)rows[i] * sourceStride + columns[i];
+                    taps[0][i] = pixel[0];
+                    taps[1][i] = pixel[1];
+                    taps[2][i] = pixel[sourceStride];
+                    taps[3][i] = pixel[sourceStride + 1];
+                }
+                topLeft = vld1_u8(taps[0]);
+                topRight = vld1_u8(taps[1]);
+                bottomLeft = vld1_u8(taps[2]);
+                bottomRight = vld1_u8(taps[3]);
+            }
+
+            uint16x8_t inverseX = vsubq_u16(one, fractionX);
+            uint16x8_t inverseY = vsubq_u16(one, fractionY);
+            uint16x8_t top = vmlaq_u16(vmulq_u16(vmovl_u8(topLeft), inverseX), vmovl_u8(topRight), fractionX);
+            uint16x8_t bottom = vmlaq_u16(vmulq_u16(vmovl_u8(bottomLeft), inverseX), vmovl_u8(bottomRight), fractionX);
+            uint32x4_t low = vmlal_u16(vmull_u16(vget_low_u16(top), vget_low_u16(inverseY)), vget_low_u16(bottom), vget_low_u16(fractionY));
+            uint32x4_t high = vmlal_u16(vmull_u16(vget_high_u16(top), vget_high_u16(inverseY)), vget_high_u16(bottom), vget_high_u16(fractionY));
+            vst1_u8(output + x, vmovn_u16(vcombine_u16(vrshrn_n_u32(low, 14), vrshrn_n_u32(high, 14))));
+        }
+#endif
+        for (; x < width; x++)
+        {
+            int32_t u = FDVideoStabilizerClamp(rowU + map->a * x, 0, maximumU);
+            int32_t v = FDVideoStabilizerClamp(rowV + map->d * x, 0, maximumV);
+            uint32_t fractionX = (uint32_t)(u & 0xFFFF) >> 9;
+            uint32_t fractionY = (uint32_t)(v & 0xFFFF) >> 9;
+            const uint8_t *pixel = source + (size_t)(v >> 16) * sourceStride + (u >> 16);
+            uint32_t top = pixel[0] * (128 - fractionX) + pixel[1] * fractionX;
+            uint32_t bottom = pixel[sourceStride] * (128 - fractionX) + pixel[sourceStride + 1] * fractionX;
+            output[x] = (uint8_t)((top * (128 - fractionY) + bottom * fractionY + 8192) >> 14);
+        }
+    }
+}
+
+// Separable 4x4 Catmull-Rom, scalar.
+static void FDVideoStabilizerWarpBicubic(const uint8_t *source, int sourceStride, uint8_t *destination, int destinationStride,
+                                         int width, int height, const FDStabilizerMap *map)
+{
+    int32_t maximumU = ((width - 2) << 16) - 1;
+    int32_t maximumV = ((height - 2) << 16) - 1;
+    for (int y = 0; y < height; y++)
+    {
+        int32_t rowU = map->b * y + map->c;
+        int32_t rowV = map->e * y + map->f;
+        uint8_t *output = destination + (size_t)y * destinationStride;
+        for (int x = 0; x < width; x++)
+        {
+            int32_t u = FDVideoStabilizerClamp(rowU + map->a * x, 1 << 16, maximumU);
+            int32_t v = FDVideoStabilizerClamp(rowV + map->d * x, 1 << 16, maximumV);
+            const int16_t *weightsX = FDVideoStabilizerCubicWeights[(u & 0xFFFF) >> 10];
+            const int16_t *weightsY = FDVideoStabilizerCubicWeights[(v & 0xFFFF) >> 10];
+            const uint8_t *pixel = source + (size_t)((v >> 16) - 1) * sourceStride + (u >> 16) - 1;
+            int32_t sum = 0;
+            for (int row = 0; row < 4; row++)
+            {
+                const uint8_t *line = pixel + (size_t)row * sourceStride;
+                int32_t horizontal = weightsX[0] * line[0] + weightsX[1] * line[1] + weightsX[2] * line[2] + weightsX[3] * line[3];
+                sum += weightsY[row] * horizontal;
+            }
+            output[x] = (uint8_t)FDVideoStabilizerClamp((sum + 8192) >> 14, 0, 255);
+        }
+    }
+}
+
+
+#pragma mark - Public functions
+
+FDCameraMotion FDCameraMotionFromAttitudeChange(double deltaRoll, double deltaPitch, double deltaYaw,
+                                                double focalLength, int width, int height)
+{
+    // Small angle pinhole model: yaw and pitch pan the image, roll rotates it the other way.
+    FDCameraMotion motion;
+    memset(&motion, 0, sizeof(motion));
+    motion.valid = YES;
+    motion.translationX = -focalLength * deltaYaw;
+    motion.translationY = focalLength * deltaPitch;
+    motion.rotation = -deltaRoll;
+    motion.scale = 1.0;
+
+    double centerX = width / 2.0;
+    double centerY = height / 2.0;
+    double cosine = cos(motion.rotation);
+    double sine = sin(motion.rotation);
+    double matrix[9] =
+    {
+        cosine, -sine, centerX - cosine * centerX + sine * centerY + motion.translationX,
+        sine, cosine, centerY - sine * centerX - cosine * centerY + motion.translationY,
+        0.0, 0.0, 1.0
+    };
+    memcpy(motion.matrix, matrix, sizeof(matrix));
+    return motion;
+}
+
+
+#pragma mark - Private interface methods
+
+@interface FDVideoStabilizer ()
+{
+    double _path[FDVideoStabilizerComponents];
+    double _smoothed[FDVideoStabilizerComponents];
+    BOOL _started;
+    NSUInteger _warpCount;
+    CFTimeInterval _totalWarpTime;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readwrite) int width;
+@property (nonatomic, assign, readwrite) int height;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDVideoStabilizer
+
+#pragma mark - Lifecycle
+
+- (instancetype)initWithWidth:(int)width height:(int)height
+{
+    self = [super init];
+    if (self)
+    {
+        static dispatch_once_t onceToken;
+        dispatch_once(&onceToken, ^{
+            FDVideoStabilizerBuildCubicWeights();
+        });
+        _width = width;
+        _height = height;
+        _cropMargin = FDVideoStabilizerDefaultCropMargin;
+        _liveSmoothing = FDVideoStabilizerDefaultLiveSmoothing;
+        _smoothingRadius = FDVideoStabilizerDefaultSmoothingRadius;
+    }
+    return self;
+}
+
+#pragma mark - Properties
+
+- (NSTimeInterval)averageWarpTime
+{
+    return _warpCount > 0 ? _totalWarpTime / _warpCount : 0.0;
+}
+
+#pragma mark - Instance methods
+
+- (FDStabilizationCorrection)correctionForMotion:(const FDCameraMotion *)motion
+{
+    if (motion->valid)
+    {
+        _path[0] += motion->translationX;
+        _path[1] += motion->translationY;
+        _path[2] += motion->rotation;
+        _path[3] += log(MAX(motion->scale, 1e-3));
+    }
+    if (!_started)
+    {
+        memcpy(_smoothed, _path, sizeof(_path));
+        _started = YES;
+    }
+
+    double limits[FDVideoStabilizerComponents];
+    [self getLimits:limits];
+    double offsets[FDVideoStabilizerComponents];
+    for (int i = 0; i < FDVideoStabilizerComponents; i++)
+    {
+        double smoothed = self.liveSmoothing * _smoothed[i] + (1.0 - self.liveSmoothing) * _path[i];
+        // Pulling the filter back inside the margin keeps it from winding up on long pans.
+        offsets[i] = MIN(MAX(smoothed - _path[i], -limits[i]), limits[i]);
+        _smoothed[i] = _path[i] + offsets[i];
+    }
+    return [self correctionWithOffsets:offsets];
+}
+
+- (void)reset
+{
+    memset(_path, 0, sizeof(_path));
+    memset(_smoothed, 0, sizeof(_smoothed));
+    _started = NO;
+}
+
+- (NSData *)correctionsForMotions:(const FDCameraMotion *)motions count:(NSUInteger)count
+{
+    NSMutableData *corrections = [NSMutableData dataWithLength:count * sizeof(FDStabilizationCorrection)];
+    double *path = malloc(sizeof(double) * FDVideoStabilizerComponents * MAX(count, (NSUInteger)1));
+    NSInteger radius = (NSInteger)self.smoothingRadius;
+    double *weights = malloc(sizeof(double) * (2 * radius + 1));
+    if (corrections == nil || path == NULL || weights == NULL)
+    {
+        free(path);
+        free(weights);
+        return nil;
+    }
+
+    double position[FDVideoStabilizerComponents] = {0};
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        if (motions[i].valid)
+        {
+            position[0] += motions[i].translationX;
+            position[1] += motions[i].translationY;
+            position[2] += motions[i].rotation;
+            position[3] += log(MAX(motions[i].scale, 1e-3));
+        }
+        memcpy(path + i * FDVideoStabilizerComponents, position, sizeof(position));
+    }
+
+    double sigma = MAX(radius / 2.0, 1.0);
+    for (NSInteger k = -radius; k <= radius; k++)
+    {
+        weights[k + radius] = exp(-0.5 * (k / sigma) * (k / sigma));
+    }
+
+    double limits[FDVideoStabilizerComponents];
+    [self getLimits:limits];
+    FDStabilizationCorrection *output = corrections.mutableBytes;
+    for (NSInteger i = 0; i < (NSInteger)count; i++)
+    {
+        // The window is clipped at both ends of the recording and renormalized.
+        double smoothed[FDVideoStabilizerComponents] = {0};
+        double total = 0;
+        for (NSInteger k = MAX(-radius, -i); k <= MIN(radius, (NSInteger)count - 1 - i); k++)
+        {
+            double weight = weights[k + radius];
+            const double *sample = path + (i + k) * FDVideoStabilizerComponents;
+            for (int j = 0; j < FDVideoStabilizerComponents; j++)
+            {
+                smoothed[j] += weight * sample[j];
+            }
+            total += weight;
+        }
+        double offsets[FDVideoStabilizerComponents];
+        for (int j = 0; j < FDVideoStabilizerComponents; j++)
+        {
+            offsets[j] = MIN(MAX(smoothed[j] / total - path[i * FDVideoStabilizerComponents + j], -limits[j]), limits[j]);
+        }
+        output[i] = [self correctionWithOffsets:offsets];
+    }
+
+    free(path);
+    free(weights);
+    return corrections;
+}
+
++ (NSData *)motionsForFileAtPath:(NSString *)path error:(NSError **)error
+{
+    FDFFmpegInitialize();
+    AVFormatContext *format = NULL;
+    AVCodecContext *decoder = NULL;
+    AVDictionary *options = NULL;
+    AVFrame *frame = av_frame_alloc();
+    int result = frame != NULL ? avformat_open_input(&format, path.fileSystemRepresentation, NULL, NULL) : AVERROR(ENOMEM);
+    if (result >= 0)
+    {
+        result = avformat_find_stream_info(format, NULL);
+    }
+    int streamIndex = result >= 0 ? av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0) : result;
+    if (streamIndex >= 0)
+    {
+        [FDMotionEstimator addDecoderOptions:&options];
+        decoder = FDFFmpegOpenDecoderWithOptions(format->streams[streamIndex], 0, &options, &result);
+    }
+    av_dict_free(&options);
+    result = streamIndex < 0 ? streamIndex : result;
+
+    FDMotionEstimator *estimator = [[FDMotionEstimator alloc] init];
+    NSMutableData *motions = [NSMutableData data];
+    AVPacket packet;
+    av_init_packet(&packet);
+    BOOL draining = NO;
+    while (decoder != NULL && result >= 0)
+    {
+        if (!draining && av_read_frame(format, &packet) < 0)
+        {
+            draining = YES;
+        }
+        if (draining)
+        {
+            av_init_packet(&packet);
+            packet.data = NULL;
+            packet.size = 0;
+        }
+        else if (packet.stream_index != streamIndex)
+        {
+            av_free_packet(&packet);
+            continue;
+        }
+
+        int gotFrame = 0;
+        int decoded = avcodec_decode_video2(decoder, frame, &gotFrame, &packet);
+        if (!draining)
+        {
+            av_free_packet(&packet);
+        }
+        if (gotFrame)
+        {
+            FDCameraMotion motion;
+            [estimator estimateMotionForFrame:frame motion:&motion];
+            [motions appendBytes:&motion length:sizeof(motion)];
+            av_frame_unref(frame);
+        }
+        if (draining && (decoded < 0 || !gotFrame))
+        {
+            break;
+        }
+    }
+
+    avcodec_free_context(&decoder);
+    av_frame_free(&frame);
+    avformat_close_input(&format);
+    if (result < 0)
+    {
+        if (error != NULL)
+        {
+            *error = FDFFmpegError(result, @"Unable to analyze recording");
+        }
+        return nil;
+    }
+    return motions;
+}
+
+- (BOOL)warpFrame:(const AVFrame *)frame correction:(FDStabilizationCorrection)correction toFrame:(AVFrame *)output
+{
+    BOOL supported = (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P) &&
+                     (output->format == AV_PIX_FMT_YUV420P || output->format == AV_PIX_FMT_YUVJ420P);
+    if (!supported || frame->width != self.width || frame->height != self.height ||
+        output->width != self.width || output->height != self.height || self.width < 8 || self.height < 8)
+    {
+        return NO;
+    }
+
+    CFTimeInterval start = CACurrentMediaTime();
+    double zoom = 1.0 / (1.0 - 2.0 * self.cropMargin);
+    for (int plane = 0; plane < 3; plane++)
+    {
+        int width = plane == 0 ? self.width : (self.width + 1) / 2;
+        int height = plane == 0 ? self.height : (self.height + 1) / 2;
+        FDStabilizerMap map = FDVideoStabilizerMapMake(correction, zoom, width, height, plane == 0 ? 1.0 : 0.5);
+        if (self.interpolation == FDStabilizationInterpolationBicubic)
+        {
+            FDVideoStabilizerWarpBicubic(frame->data[plane], frame->linesize[plane], output->data[plane], output->linesize[plane], width, height, &map);
+        }
+        else
+        {
+            FDVideoStabilizerWarpBilinear(frame->data[plane], frame->linesize[plane], output->data[plane], output->linesize[plane], width, height, &map);
+        }
+    }
+    av_frame_copy_props(output, frame);
+    _totalWarpTime += CACurrentMediaTime() - start;
+    _warpCount++;
+    return YES;
+}
+
+#pragma mark - Private methods
+
+- (void)getLimits:(double *)limits
+{
+    limits[0] = self.cropMargin * self.width;
+    limits[1] = self.cropMargin * self.height;
+    limits[2] = self.cropMargin * FDVideoStabilizerAngularLimit;
+    limits[3] = self.cropMargin * FDVideoStabilizerAngularLimit;
+}
+
+- (FDStabilizationCorrection)correctionWithOffsets:(const double *)offsets
+{
+    FDStabilizationCorrection correction = {offsets[0], offsets[1], offsets[2], exp(offsets[3])};
+    return correction;
+}
+
+#pragma mark - Benchmark
+
++ (void)runBenchmarkWithWidth:(int)width height:(int)height
+{
+    AVFrame *source = av_frame_alloc();
+    AVFrame *output = av_frame_alloc();
+    if (source == NULL || output == NULL)
+    {
+        av_frame_free(&source);
+        av_frame_free(&output);
+        return;
+    }
+    source->format = output->format = AV_PIX_FMT_YUV420P;
+    source->width = output->width = width;
+    source->height = output->height = height;
+    if (av_frame_get_buffer(source, 32) < 0 || av_frame_get_buffer(output, 32) < 0)
+    {
+        av_frame_free(&source);
+        av_frame_free(&output);
+        return;
+    }
+    for (int plane = 0; plane < 3; plane++)
+    {
+        int planeHeight = plane == 0 ? height : (height + 1) / 2;
+        for (int y = 0; y < planeHeight; y++)
+        {
+            for (int x = 0; x < source->linesize[plane]; x++)
+            {
+                source->data[plane][(size_t)y * source->linesize[plane] + x] = (uint8_t)(x * 7 + y * 13 + ((x * y) >> 3));
+            }
+        }
+    }
+
+    // A typical hover correction: a few pixels of shake and a fraction of a degree.
+    FDStabilizationCorrection correction = {12.3, -7.7, 0.006, 1.01};
+    NSUInteger const iterations = 60;
+    for (int interpolation = 0; interpolation < 2; interpolation++)
+    {
+        FDVideoStabilizer *stabilizer = [[FDVideoStabilizer alloc] initWithWidth:width height:height];
+        stabilizer.interpolation = interpolation;
+        for (NSUInteger i = 0; i < iterations; i++)
+        {
+            [stabilizer warpFrame:source correction:correction toFrame:output];
+        }
+        NSLog(@"Stabilizer %@ warp at %dx%d: %.2f ms/frame",
+              interpolation == FDStabilizationInterpolationBicubic ? @"bicubic" : @"bilinear",
+              width, height, stabilizer.averageWarpTime * 1000.0);
+    }
+
+    av_frame_free(&source);
+    av_frame_free(&output);
+}
+
+#pragma mark -
+
+@end
@@ -0,0 +1,63 @@
+//
+//  FDVideoTranscoder.h
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDTelemetrySEI.h"
+
+
+// time is seconds from the start of the source. Return NO for frames without telemetry.
+typedef BOOL (^FDTranscodeTelemetryProvider)(NSTimeInterval time, FDTelemetrySEISample *sample);
+
+
+@interface FDTranscodeOptions : NSObject
+
+// Target average bitrate in kbit/s.
+@property (nonatomic, assign) NSUInteger bitrate;
+// x264 preset name, "veryfast" by default.
+@property (nonatomic, copy) NSString *preset;
+// Segments are whole GOPs of at least this many frames.
+@property (nonatomic, assign) NSUInteger minimumFramesPerSegment;
+// Number of segments encoded concurrently, 0 means one per active core.
+@property (nonatomic, assign) NSUInteger maximumConcurrentSegments;
+// Embeds per-frame telemetry as SEI. Called concurrently from the segment workers.
+@property (nonatomic, copy) FDTranscodeTelemetryProvider telemetryProvider;
+
+@end
+
+
+@interface FDTranscodeReport : NSObject
+
+@property (nonatomic, assign, readonly) NSUInteger frameCount;
+@property (nonatomic, assign, readonly) NSUInteger segmentCount;
+@property (nonatomic, assign, readonly) NSUInteger coreCount;
+// Wall clock time of the whole transcode, including the scan and concatenation.
+@property (nonatomic, assign, readonly) NSTimeInterval wallTime;
+// Sum of the per segment decode + encode times, i.e. what one core would need.
+@property (nonatomic, assign, readonly) NSTimeInterval serialTime;
+@property (nonatomic, assign, readonly) double speedup;
+// Speedup divided by the core count, 1.0 is perfect scaling.
+@property (nonatomic, assign, readonly) double efficiency;
+
+@end
+
+
+// Splits an H.264 recording at IDR boundaries, decodes and re-encodes the segments
+// concurrently with independent libavcodec/x264 instances and concatenates them
+// into the destination container keeping the source timestamps.
+@interface FDVideoTranscoder : NSObject
+
+@property (nonatomic, strong, readonly) FDTranscodeOptions *options;
+@property (atomic, assign, readonly, getter=isCancelled) BOOL cancelled;
+
+- (instancetype)initWithOptions:(FDTranscodeOptions *)options;
+
+// Synchronous, call it from a background queue.
+- (FDTranscodeReport *)transcodeFileAtPath:(NSString *)sourcePath
+                                    toPath:(NSString *)destinationPath
+                                     error:(NSError **)error;
+- (void)cancel;
+
+@end
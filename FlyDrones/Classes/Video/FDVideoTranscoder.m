@@ -0,0 +1,759 @@
+//
+//  FDVideoTranscoder.m
+//  FlyDrones
+//
+//  Copyright (c) 2015 Sergey Galagan. All rights reserved.
+//
+
+#import "FDVideoTranscoder.h"
+#import "FDFFmpegUtils.h"
+#import "FDH264Utils.h"
+#include "libswscale/swscale.h"
+#include "x264.h"
+
+
+static NSUInteger const FDTranscodeDefaultBitrate = 4000;
+static NSUInteger const FDTranscodeDefaultMinimumFramesPerSegment = 120;
+// More segments than cores so a slow GOP does not leave the other cores idle at the end.
+static NSUInteger const FDTranscodeSegmentsPerCore = 4;
+
+
+typedef struct FDTranscodeSegment
+{
+    int64_t startPosition;
+    int64_t startTimestamp;
+    NSUInteger firstFrame;
+    NSUInteger packetCount;
+} FDTranscodeSegment;
+
+typedef struct FDTranscodeParameters
+{
+    int streamIndex;
+    int width;
+    int height;
+    AVRational timeBase;
+    AVRational frameRate;
+    int64_t startPts;
+    int64_t frameDuration;
+    int nalLengthSize;
+    BOOL byteSeek;
+    int bitrate;
+    const char *preset;
+    // Retained by the options for the duration of the transcode.
+    __unsafe_unretained FDTranscodeTelemetryProvider telemetryProvider;
+} FDTranscodeParameters;
+
+// Per frame record of the intermediate segment files.
+typedef struct FDTranscodedFrameHeader
+{
+    int64_t pts;
+    int64_t dts;
+    int32_t size;
+    int32_t keyframe;
+} FDTranscodedFrameHeader;
+
+
+#pragma mark - Segment worker
+
+static int FDTranscodeWriteNALs(FILE *output, x264_nal_t *nals, int nalCount, int size, x264_picture_t *picture)
+{
+    if (size <= 0)
+    {
+        return 0;
+    }
+
+    FDTranscodedFrameHeader header = {picture->i_pts, picture->i_dts, size, picture->b_keyframe};
+    // x264 keeps the payloads of one encode call contiguous.
+    if (fwrite(&header, sizeof(header), 1, output) != 1 || fwrite(nals[0].p_payload, 1, size, output) != (size_t)size)
+    {
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+// The first access unit of segment 0 carries SPS/PPS, muxers want them as extradata.
+static int FDTranscodeSetExtradata(AVCodecContext *codec, const uint8_t *data, int size)
+{
+    static const uint8_t startCode[] = {0, 0, 0, 1};
+    uint8_t *extradata = av_mallocz(size + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (extradata == NULL)
+    {
+        return AVERROR(ENOMEM);
+    }
+
+    int extradataSize = 0;
+    FDH264NALIterator iterator;
+    FDH264NALIteratorInit(&iterator, data, size, 0);
+    const uint8_t *nal = NULL;
+    int nalSize = 0;
+    while (FDH264NALIteratorNext(&iterator, &nal, &nalSize))
+    {
+        FDH264NALType type = FDH264NALUnitType(nal);
+        if (type == FDH264NALTypeSPS || type == FDH264NALTypePPS)
+        {
+            memcpy(extradata + extradataSize, startCode, sizeof(startCode));
+            memcpy(extradata + extradataSize + sizeof(startCode), nal, nalSize);
+            extradataSize += sizeof(startCode) + nalSize;
+        }
+    }
+
+    codec->extradata = extradata;
+    codec->extradata_size = extradataSize;
+    return extradataSize > 0 ? 0 : AVERROR_INVALIDDATA;
+}
+
+static x264_t *FDTranscodeOpenEncoder(const FDTranscodeParameters *parameters)
+{
+    x264_param_t param;
+    if (x264_param_default_preset(&param, parameters->preset, NULL) < 0)
+    {
+        return NULL;
+    }
+
+    // Parallelism comes from running segments side by side.
+    param.i_threads = 1;
+    param.b_sliced_threads = 0;
+    param.i_width = parameters->width;
+    param.i_height = parameters->height;
+    param.i_csp = X264_CSP_I420;
+    param.b_vfr_input = 1;
+    param.i_timebase_num = parameters->timeBase.num;
+    param.i_timebase_den = parameters->timeBase.den;
+    param.i_fps_num = parameters->frameRate.num;
+    param.i_fps_den = parameters->frameRate.den;
+    param.b_repeat_headers = 1;
+    param.b_annexb = 1;
+    param.rc.i_rc_method = X264_RC_ABR;
+    param.rc.i_bitrate = parameters->bitrate;
+    param.rc.i_vbv_max_bitrate = parameters->bitrate;
+    param.rc.i_vbv_buffer_size = parameters->bitrate;
+
+    if (x264_param_apply_profile(&param, "high") < 0)
+    {
+        return NULL;
+    }
+    return x264_encoder_open(&param);
+}
+
+static int FDTranscodeSegmentRun(const char *path,
+                                 const FDTranscodeSegment *segment,
+                                 const FDTranscodeParameters *parameters,
+                                 BOOL seek,
+                                 FILE *output,
+                                 volatile BOOL *cancelled)
+{
+    AVFormatContext *format = NULL;
+    AVCodecContext *decoder = NULL;
+    x264_t *encoder = NULL;
+    struct SwsContext *converter = NULL;
+    AVFrame *frame = av_frame_alloc();
+    AVFrame *converted = NULL;
+    AVPacket packet;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+
+    int result = frame != NULL ? avformat_open_input(&format, path, NULL, NULL) : AVERROR(ENOMEM);
+    if (result >= 0)
+    {
+        decoder = FDFFmpegOpenDecoder(format->streams[parameters->streamIndex], 1, &result);
+    }
+    if (result >= 0 && seek)
+    {
+        if (parameters->byteSeek)
+        {
+            result = av_seek_frame(format, -1, segment->startPosition, AVSEEK_FLAG_BYTE);
+        }
+        else
+        {
+            result = av_seek_frame(format, parameters->streamIndex, segment->startTimestamp, AVSEEK_FLAG_BACKWARD);
+        }
+    }
+    if (result >= 0)
+    {
+        encoder = FDTranscodeOpenEncoder(parameters);
+        result = encoder != NULL ? 0 : AVERROR_EXTERNAL;
+    }
+
+    x264_picture_t input;
+    x264_picture_t encoded;
+    x264_nal_t *nals = NULL;
+    int nalCount = 0;
+    x264_picture_init(&input);
+    input.img.i_csp = X264_CSP_I420;
+    input.img.i_plane = 3;
+
+    // Segment 0 is read from the top without a seek, which may also start before its IDR.
+    BOOL started = NO;
+    NSUInteger packetsLeft = segment->packetCount;
+    NSUInteger decodedFrames = 0;
+    BOOL draining = NO;
+
+    while (result >= 0 && !*cancelled)
+    {
+        if (!draining)
+        {
+            if (packetsLeft == 0)
+            {
+                draining = YES;
+                continue;
+            }
+
+            result = av_read_frame(format, &packet);
+            if (result == AVERROR_EOF)
+            {
+                result = 0;
+                draining = YES;
+                continue;
+            }
+            if (result < 0)
+            {
+                break;
+            }
+            if (packet.stream_index != parameters->streamIndex)
+            {
+                av_free_packet(&packet);
+                continue;
+            }
+
+            if (!started)
+            {
+                // Reading starts on or before the segment start, skip up to its IDR so only its own packets count.
+                // Same key as the scan recorded for the segment.
+                int64_t timestamp = packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts;
+                BOOL isStart = parameters->byteSeek ? packet.pos == segment->startPosition : timestamp == segment->startTimestamp;
+                started = isStart && FDH264PacketContainsIDR(packet.data, packet.size, parameters->nalLengthSize);
+                if (!started)
+                {
+                    av_free_packet(&packet);
+                    continue;
+                }
+            }
+            packetsLeft--;
+        }
+
+        int gotFrame = 0;
+        AVPacket flushPacket;
+        av_init_packet(&flushPacket);
+        flushPacket.data = NULL;
+        flushPacket.size = 0;
+
+        result = avcodec_decode_video2(decoder, frame, &gotFrame, draining ? &flushPacket : &packet);
+        if (!draining)
+        {
+            av_free_packet(&packet);
+        }
+        if (result < 0)
+        {
+            break;
+        }
+        result = 0;
+
+        if (!gotFrame)
+        {
+            if (draining)
+            {
+                break;
+            }
+            continue;
+        }
+
+        AVFrame *source = frame;
+        if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P)
+        {
+            if (converted == NULL)
+            {
+                converted = av_frame_alloc();
+                converted->format = AV_PIX_FMT_YUV420P;
+                converted->width = parameters->width;
+                converted->height = parameters->height;
+                result = av_frame_get_buffer(converted, 32);
+            }
+            converter = sws_getCachedContext(converter, frame->width, frame->height, frame->format,
+                                             parameters->width, parameters->height, AV_PIX_FMT_YUV420P,
+                                             SWS_BILINEAR, NULL, NULL, NULL);
+            if (result < 0 || converter == NULL)
+            {
+                result = result < 0 ? result : AVERROR(ENOMEM);
+                break;
+            }
+            sws_scale(converter, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height,
+                      converted->data, converted->linesize);
+            source = converted;
+        }
+
+        int64_t pts = av_frame_get_best_effort_timestamp(frame);
+        if (parameters->byteSeek || pts == AV_NOPTS_VALUE)
+        {
+            // Raw streams carry no usable timestamps after a byte seek.
+            pts = parameters->startPts + (int64_t)(segment->firstFrame + decodedFrames) * parameters->frameDuration;
+        }
+        decodedFrames++;
+
+        for (int plane = 0; plane < 3; plane++)
+        {
+            input.img.plane[plane] = source->data[plane];
+            input.img.i_stride[plane] = source->linesize[plane];
+        }
+        input.i_pts = pts;
+        input.i_type = decodedFrames == 1 ? X264_TYPE_IDR : X264_TYPE_AUTO;
+        // The previous frame's payloads now belong to x264, which frees them through sei_free.
+        input.extra_sei.num_payloads = 0;
+        input.extra_sei.payloads = NULL;
+        input.extra_sei.sei_free = NULL;
+        FDTelemetrySEISample sample;
+        if (parameters->telemetryProvider != nil && parameters->telemetryProvider((pts - parameters->startPts) * av_q2d(parameters->timeBase), &sample))
+        {
+            FDTelemetrySEIAttach(&input, &sample);
+        }
+
+        int size = x264_encoder_encode(encoder, &nals, &nalCount, &input, &encoded);
+        result = size < 0 ? AVERROR_EXTERNAL : FDTranscodeWriteNALs(output, nals, nalCount, size, &encoded);
+        av_frame_unref(frame);
+    }
+
+    while (result >= 0 && encoder != NULL && !*cancelled && x264_encoder_delayed_frames(encoder) > 0)
+    {
+        int size = x264_encoder_encode(encoder, &nals, &nalCount, NULL, &encoded);
+        result = size < 0 ? AVERROR_EXTERNAL : FDTranscodeWriteNALs(output, nals, nalCount, size, &encoded);
+    }
+
+    if (result >= 0 && *cancelled)
+    {
+        result = AVERROR_EXIT;
+    }
+
+    if (encoder != NULL)
+    {
+        x264_encoder_close(encoder);
+    }
+    sws_freeContext(converter);
+    av_frame_free(&converted);
+    av_frame_free(&frame);
+    avcodec_free_context(&decoder);
+    avformat_close_input(&format);
+    return result;
+}
+
+
+#pragma mark - FDTranscodeOptions
+
+@implementation FDTranscodeOptions
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _bitrate = FDTranscodeDefaultBitrate;
+        _preset = @"veryfast";
+        _minimumFramesPerSegment = FDTranscodeDefaultMinimumFramesPerSegment;
+    }
+    return self;
+}
+
+@end
+
+
+#pragma mark - FDTranscodeReport
+
+@interface FDTranscodeReport ()
+
+@property (nonatomic, assign, readwrite) NSUInteger frameCount;
+@property (nonatomic, assign, readwrite) NSUInteger segmentCount;
+@property (nonatomic, assign, readwrite) NSUInteger coreCount;
+@property (nonatomic, assign, readwrite) NSTimeInterval wallTime;
+@property (nonatomic, assign, readwrite) NSTimeInterval serialTime;
+
+@end
+
+@implementation FDTranscodeReport
+
+- (double)speedup
+{
+    return self.wallTime > 0 ? self.serialTime / self.wallTime : 0;
+}
+
+- (double)efficiency
+{
+    return self.coreCount > 0 ? self.speedup / self.coreCount : 0;
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"%lu frames in %lu segments, wall %.2fs, serial %.2fs, speedup %.2fx on %lu cores (%.0f%% efficiency)",
+            (unsigned long)self.frameCount, (unsigned long)self.segmentCount, self.wallTime, self.serialTime,
+            self.speedup, (unsigned long)self.coreCount, self.efficiency * 100.0];
+}
+
+@end
+
+
+#pragma mark - Private interface methods
+
+@interface FDVideoTranscoder ()
+{
+    volatile BOOL _cancelFlag;
+}
+
+#pragma mark - Properties
+
+@property (nonatomic, strong, readwrite) FDTranscodeOptions *options;
+
+@end
+
+
+#pragma mark - Public interface methods
+
+@implementation FDVideoTranscoder
+
+#pragma mark - Lifecycle
+
+- (instancetype)init
+{
+    return [self initWithOptions:[[FDTranscodeOptions alloc] init]];
+}
+
+- (instancetype)initWithOptions:(FDTranscodeOptions *)options
+{
+    self = [super init];
+    if (self)
+    {
+        FDFFmpegInitialize();
+        _options = options;
+    }
+    return self;
+}
+
+#pragma mark - Instance methods
+
+- (BOOL)isCancelled
+{
+    return _cancelFlag;
+}
+
+- (void)cancel
+{
+    _cancelFlag = YES;
+}
+
+- (FDTranscodeReport *)transcodeFileAtPath:(NSString *)sourcePath
+                                    toPath:(NSString *)destinationPath
+                                     error:(NSError **)error
+{
+    CFTimeInterval startTime = CACurrentMediaTime();
+    _cancelFlag = NO;
+
+    FDTranscodeParameters parameters;
+    memset(&parameters, 0, sizeof(parameters));
+    NSMutableData *segments = [NSMutableData data];
+    NSUInteger frameCount = 0;
+
+    int result = [self scanSourceAtPath:sourcePath parameters:&parameters segments:segments frameCount:&frameCount];
+    if (result < 0)
+    {
+        if (error != NULL)
+        {
+            *error = FDFFmpegError(result, @"Unable to scan source");
+        }
+        return nil;
+    }
+
+    NSUInteger segmentCount = segments.length / sizeof(FDTranscodeSegment);
+    const FDTranscodeSegment *segmentList = segments.bytes;
+    NSString *temporaryDirectory = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+    [[NSFileManager defaultManager] createDirectoryAtPath:temporaryDirectory withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    NSMutableData *durations = [NSMutableData dataWithLength:segmentCount * sizeof(NSTimeInterval)];
+    NSMutableData *results = [NSMutableData dataWithLength:segmentCount * sizeof(int)];
+    NSTimeInterval *segmentDurations = durations.mutableBytes;
+    int *segmentResults = results.mutableBytes;
+    const char *path = sourcePath.fileSystemRepresentation;
+    volatile BOOL *cancelled = &_cancelFlag;
+
+    NSUInteger coreCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    NSUInteger concurrency = self.options.maximumConcurrentSegments > 0 ? self.options.maximumConcurrentSegments : coreCount;
+    concurrency = MIN(concurrency, segmentCount);
+    __block long nextSegment = 0;
+
+    // One iteration per worker, each pulling the next segment when it is done, which
+    // balances uneven GOPs and bounds the concurrency without parking pool threads.
+    dispatch_apply(concurrency, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t worker) {
+        for (;;)
+        {
+            size_t index = (size_t)__sync_fetch_and_add(&nextSegment, 1);
+            if (index >= segmentCount)
+            {
+                break;
+            }
+            CFTimeInterval segmentStart = CACurrentMediaTime();
+
+            NSString *segmentPath = [temporaryDirectory stringByAppendingPathComponent:[NSString stringWithFormat:@"%06zu.seg", index]];
+            FILE *output = fopen(segmentPath.fileSystemRepresentation, "wb");
+            segmentResults[index] = output != NULL ? FDTranscodeSegmentRun(path, &segmentList[index], &parameters, index > 0, output, cancelled) : AVERROR(errno);
+            if (output != NULL)
+            {
+                fclose(output);
+            }
+            if (segmentResults[index] < 0)
+            {
+                *cancelled = YES;
+            }
+
+            segmentDurations[index] = CACurrentMediaTime() - segmentStart;
+        }
+    });
+
+    NSTimeInterval serialTime = 0;
+    for (NSUInteger i = 0; i < segmentCount; i++)
+    {
+        serialTime += segmentDurations[i];
+        // Siblings of a failed segment stop with AVERROR_EXIT, report the failure that stopped them.
+        if (segmentResults[i] < 0 && (result >= 0 || (result == AVERROR_EXIT && segmentResults[i] != AVERROR_EXIT)))
+        {
+            result = segmentResults[i];
+        }
+    }
+
+    if (result >= 0)
+    {
+        result = [self concatenateSegmentsInDirectory:temporaryDirectory count:segmentCount parameters:&parameters toPath:destinationPath];
+    }
+    [[NSFileManager defaultManager] removeItemAtPath:temporaryDirectory error:NULL];
+
+    if (result < 0)
+    {
+        if (error != NULL)
+        {
+            *error = FDFFmpegError(result, @"Unable to transcode");
+        }
+        return nil;
+    }
+
+    FDTranscodeReport *report = [[FDTranscodeReport alloc] init];
+    report.frameCount = frameCount;
+    report.segmentCount = segmentCount;
+    report.coreCount = MIN(concurrency, coreCount);
+    report.serialTime = serialTime;
+    report.wallTime = CACurrentMediaTime() - startTime;
+    return report;
+}
+
+#pragma mark - Private methods
+
+// Reads packet headers only (no decoding) and groups whole GOPs into segments.
+- (int)scanSourceAtPath:(NSString *)sourcePath
+             parameters:(FDTranscodeParameters *)parameters
+               segments:(NSMutableData *)segments
+             frameCount:(NSUInteger *)frameCount
+{
+    AVFormatContext *format = NULL;
+    int result = avformat_open_input(&format, sourcePath.fileSystemRepresentation, NULL, NULL);
+    if (result >= 0)
+    {
+        result = avformat_find_stream_info(format, NULL);
+    }
+    if (result >= 0)
+    {
+        result = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    }
+    if (result < 0)
+    {
+        avformat_close_input(&format);
+        return result;
+    }
+
+    AVStream *stream = format->streams[result];
+    AVRational frameRate = av_guess_frame_rate(format, stream, NULL);
+    if (frameRate.num <= 0 || frameRate.den <= 0)
+    {
+        frameRate = (AVRational){30, 1};
+    }
+
+    parameters->streamIndex = result;
+    parameters->width = stream->codec->width;
+    parameters->height = stream->codec->height;
+    parameters->timeBase = stream->time_base;
+    parameters->frameRate = frameRate;
+    parameters->frameDuration = MAX(av_rescale_q(1, av_inv_q(frameRate), stream->time_base), 1);
+    parameters->startPts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    parameters->nalLengthSize = FDH264NALLengthSize(stream->codec->extradata, stream->codec->extradata_size);
+    parameters->byteSeek = (format->iformat->flags & AVFMT_GENERIC_INDEX) && !(format->iformat->flags & AVFMT_NO_BYTE_SEEK);
+    parameters->bitrate = (int)self.options.bitrate;
+    parameters->preset = self.options.preset.UTF8String;
+    parameters->telemetryProvider = self.options.telemetryProvider;
+
+    NSMutableData *gops = [NSMutableData data];
+    NSUInteger frames = 0;
+    AVPacket packet;
+    av_init_packet(&packet);
+
+    while (!_cancelFlag && (result = av_read_frame(format, &packet)) >= 0)
+    {
+        if (packet.stream_index == parameters->streamIndex)
+        {
+            if ((packet.flags & AV_PKT_FLAG_KEY) && FDH264PacketContainsIDR(packet.data, packet.size, parameters->nalLengthSize))
+            {
+                FDTranscodeSegment gop = {packet.pos, packet.dts != AV_NOPTS_VALUE ? packet.dts : packet.pts, frames, 0};
+                [gops appendBytes:&gop length:sizeof(gop)];
+            }
+            if (gops.length > 0)
+            {
+                // Frames before the first IDR cannot be decoded on their own.
+                ((FDTranscodeSegment *)gops.mutableBytes)[gops.length / sizeof(FDTranscodeSegment) - 1].packetCount++;
+                frames++;
+            }
+        }
+        av_free_packet(&packet);
+    }
+    avformat_close_input(&format);
+
+    if (_cancelFlag)
+    {
+        return AVERROR_EXIT;
+    }
+    if (result != AVERROR_EOF)
+    {
+        return result;
+    }
+    if (gops.length == 0 || parameters->width <= 0 || parameters->height <= 0)
+    {
+        return AVERROR_INVALIDDATA;
+    }
+
+    NSUInteger coreCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    NSUInteger framesPerSegment = MAX(self.options.minimumFramesPerSegment, frames / (coreCount * FDTranscodeSegmentsPerCore));
+    const FDTranscodeSegment *gopList = gops.bytes;
+    NSUInteger gopCount = gops.length / sizeof(FDTranscodeSegment);
+
+    FDTranscodeSegment current = gopList[0];
+    for (NSUInteger i = 1; i < gopCount; i++)
+    {
+        if (current.packetCount >= framesPerSegment)
+        {
+            [segments appendBytes:&current length:sizeof(current)];
+            current = gopList[i];
+        }
+        else
+        {
+            current.packetCount += gopList[i].packetCount;
+        }
+    }
+    [segments appendBytes:&current length:sizeof(current)];
+
+    *frameCount = frames;
+    return 0;
+}
+
+- (int)concatenateSegmentsInDirectory:(NSString *)directory
+                                count:(NSUInteger)segmentCount
+                           parameters:(const FDTranscodeParameters *)parameters
+                               toPath:(NSString *)destinationPath
+{
+    AVFormatContext *format = NULL;
+    int result = avformat_alloc_output_context2(&format, NULL, NULL, destinationPath.fileSystemRepresentation);
+    if (result < 0)
+    {
+        return result;
+    }
+
+    AVStream *stream = avformat_new_stream(format, NULL);
+    if (stream == NULL)
+    {
+        avformat_free_context(format);
+        return AVERROR(ENOMEM);
+    }
+
+    stream->time_base = parameters->timeBase;
+    stream->codec->codec_type = AVMEDIA_TYPE_VIDEO;
+    stream->codec->codec_id = AV_CODEC_ID_H264;
+    stream->codec->width = parameters->width;
+    stream->codec->height = parameters->height;
+    stream->codec->pix_fmt = AV_PIX_FMT_YUV420P;
+    stream->codec->time_base = parameters->timeBase;
+    if (format->oformat->flags & AVFMT_GLOBALHEADER)
+    {
+        stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    NSMutableData *buffer = [NSMutableData data];
+    FILE *input = NULL;
+    BOOL headerWritten = NO;
+    int64_t lastDts = AV_NOPTS_VALUE;
+
+    for (NSUInteger index = 0; index < segmentCount && result >= 0; index++)
+    {
+        NSString *segmentPath = [directory stringByAppendingPathComponent:[NSString stringWithFormat:@"%06lu.seg", (unsigned long)index]];
+        input = fopen(segmentPath.fileSystemRepresentation, "rb");
+        if (input == NULL)
+        {
+            result = AVERROR(errno);
+            break;
+        }
+
+        FDTranscodedFrameHeader header;
+        while (result >= 0 && fread(&header, sizeof(header), 1, input) == 1)
+        {
+            [buffer setLength:header.size];
+            if (fread(buffer.mutableBytes, 1, header.size, input) != (size_t)header.size)
+            {
+                result = AVERROR_INVALIDDATA;
+                break;
+            }
+
+            if (!headerWritten)
+            {
+                result = FDTranscodeSetExtradata(stream->codec, buffer.bytes, header.size);
+
+                if (result >= 0 && !(format->oformat->flags & AVFMT_NOFILE))
+                {
+                    result = avio_open(&format->pb, destinationPath.fileSystemRepresentation, AVIO_FLAG_WRITE);
+                }
+                if (result >= 0)
+                {
+                    result = avformat_write_header(format, NULL);
+                }
+                headerWritten = result >= 0;
+                if (!headerWritten)
+                {
+                    break;
+                }
+            }
+
+            // Reordering delay is identical in every segment, so dts only needs a nudge on VFR input.
+            int64_t dts = header.dts;
+            if (lastDts != AV_NOPTS_VALUE && dts <= lastDts)
+            {
+                dts = lastDts + 1;
+            }
+            lastDts = dts;
+
+            AVPacket packet;
+            av_init_packet(&packet);
+            packet.data = buffer.mutableBytes;
+            packet.size = header.size;
+            packet.stream_index = stream->index;
+            packet.pts = av_rescale_q(header.pts, parameters->timeBase, stream->time_base);
+            packet.dts = av_rescale_q(dts, parameters->timeBase, stream->time_base);
+            packet.duration = (int)av_rescale_q(parameters->frameDuration, parameters->timeBase, stream->time_base);
+            packet.flags = header.keyframe ? AV_PKT_FLAG_KEY : 0;
+            result = av_write_frame(format, &packet);
+        }
+
+        fclose(input);
+    }
+
+    if (headerWritten)
+    {
+        int trailerResult = av_write_trailer(format);
+        result = result < 0 ? result : trailerResult;
+    }
+    if (format->pb != NULL && !(format->oformat->flags & AVFMT_NOFILE))
+    {
+        avio_closep(&format->pb);
+    }
+    avformat_free_context(format);
+    return result;
+}
+
+@end